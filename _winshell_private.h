@@ -22,8 +22,15 @@
 
 
 
+#include "platform.h"
 #include "job.h"
 #include "parsed_process.h"
+#include "out_stream.h"
+#include "dir_cache.h"
+#include "completion.h"
+#include "trace.h"
+#include "stats.h"
+#include "script.h"
 
 
 
@@ -33,8 +40,46 @@
 
 
 
-/* MAX_JOBS: The maximum number of jobs that can be active at the same time. */
-#define MAX_JOBS 4096
+/* CMDLINE_BATCH_CAP: Capacity in WCHARs of the cmdline batch that's handed
+                      from the reader thread to the job spawner thread. Always
+                      fits at least one MAX_CMDLINE line. */
+#define CMDLINE_BATCH_CAP (4 * (MAX_CMDLINE + 1))
+
+
+
+/* PROMPT: Printed when the shell is waiting for a command at the console. */
+#define PROMPT L"winshell> "
+
+/* HERE_DOC_PROMPT: Printed instead of PROMPT while a here-document body or
+                    an unfinished block (for, while, if, function) is being
+                    typed. */
+#define HERE_DOC_PROMPT L"> "
+
+
+
+/* JOBS_INIT_CAP: Initial capacity of the job table. It doubles whenever every
+                  jid is in use. Must be a multiple of 64. */
+#define JOBS_INIT_CAP 4096
+
+
+
+/* COMPLETIONS_CAP: Number of finished jobs kept in the completion history. */
+#define COMPLETIONS_CAP 64
+
+
+
+/* JOB_STR_MAX_PREFIX: Upper bound on the length of the "[jid] STATUS\t\t" 
+                       part of a job_to_str description. */
+#define JOB_STR_MAX_PREFIX 32
+
+/* JOB_STR_LEN: Upper bound on the length of the job_to_str description of 
+                job (not including the NULL terminator). */
+#define JOB_STR_LEN(job) (JOB_STR_MAX_PREFIX + (job)->len_cmdline)
+
+/* COMPLETION_STR_MAX_PREFIX: Upper bound on the length of the 
+                              "[jid] DONE (exit N, S.MMMs)\t\t" part of a 
+                              completion description. */
+#define COMPLETION_STR_MAX_PREFIX 80
 
 
 
@@ -58,6 +103,14 @@
 /* SPAWNJOB_EMPTY_JOB: The job only contained builtins. */
 #define SPAWNJOB_EMPTY_JOB -5
 
+/* SPAWNJOB_BAD_SUBSTITUTION: A $(...) substitution couldn't be expanded (the
+                              error has already been reported). */
+#define SPAWNJOB_BAD_SUBSTITUTION -6
+
+/* SPAWNJOB_CMDLINE_TOO_LONG: Glob expansion made a process command line 
+                              longer than MAX_CMDLINE. */
+#define SPAWNJOB_CMDLINE_TOO_LONG -7
+
 
 
 /* wait_handles: Points to heap-allocated array of handles. This is the array
@@ -74,9 +127,77 @@ extern int32_t n_wait_handles;
 extern int32_t cap_wait_handles;
 
 
-/* jobs: Static-duration array of jobs - the data needed to manage each job is 
-         contained somewhere in this array. */
-extern job_t jobs[];
+/* jobs: Points to heap-allocated array of job_t's, indexed by jid. Grows (and
+         may move) when every jid is in use - don't hold job_t pointers across
+         a find_open_jid call. */
+extern job_t *jobs;
+
+/* job_status: Points to heap-allocated array with the status of each job, 
+               indexed by jid. Kept apart from the job_t's so that scans only
+               touch this. */
+extern job_status_t *job_status;
+
+/* job_n_procs_alive: Points to heap-allocated array with the number of live
+                      processes of each job (the usage of its proc_hs array),
+                      indexed by jid. */
+extern int32_t *job_n_procs_alive;
+
+/* cap_jobs: Current capacity of jobs, job_status and job_n_procs_alive. */
+extern int32_t cap_jobs;
+
+/* live_jobs_head, live_jobs_tail: jids of the first (oldest) and last job in
+                                   the live job list, -1 if it's empty. */
+extern int32_t live_jobs_head;
+extern int32_t live_jobs_tail;
+
+/* free_jid_bits: Points to heap-allocated bitmap with a 1 bit for every jid 
+                  that isn't in use (cap_jobs / 64 words). */
+extern uint64_t *free_jid_bits;
+
+/* completions: Ring of the last COMPLETIONS_CAP finished jobs. Record i 
+                (counting from the first job that ever finished) is at 
+                i % COMPLETIONS_CAP. */
+extern completion_t completions[];
+
+/* n_completions: Number of jobs that have ever finished. */
+extern int64_t n_completions;
+
+#ifndef WINSHELL_NO_STATS
+/* stat_counters: Indexed by stat_counter_t. */
+extern volatile LONG64 stat_counters[];
+
+/* stat_hists: Indexed by stat_hist_t. */
+extern latency_hist_t stat_hists[];
+#endif
+
+
+
+/* redirected_out_encoding: Encoding builtins use when their output goes to a
+                            file or a pipe. Set by init_winshell from the
+                            WINSHELL_OUTPUT_ENCODING environment variable. */
+extern out_encoding_t redirected_out_encoding;
+
+/* spooled_out_h: Pipe a builtin run by spawn_job writes to. The stage that
+                  reads it isn't started until the builtin is done, so a
+                  stream writing to it is spooled rather than blocking once
+                  the pipe is full. NULL the rest of the time. */
+extern HANDLE spooled_out_h;
+
+
+
+/* THREAD_LOCAL: Storage class of a variable that each thread has its own
+                 copy of. */
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* print_err_jid: jid of the job this thread is spawning, printed with the 
+                  error. -1 when it isn't spawning one. Per thread: errors
+                  from the reader, capture, relay and stage threads must not
+                  pick up the shell thread's job. */
+extern THREAD_LOCAL int32_t print_err_jid;
 
 
 
@@ -85,9 +206,25 @@ extern HANDLE cmdline_reader_thread_h;
 
 
 
-/* cmdline: Contains a line read from stdin waiting to be read by the job 
-            spawner thread. */
-extern WCHAR cmdline[];
+/* stdin_is_console: TRUE if stdin is a console, FALSE if it's a pipe or a
+                     file. Set once by init_winshell. */
+extern BOOL stdin_is_console;
+
+/* cmdline_batch: Contains one or more NULL-terminated lines read from stdin,
+                  stored back to back, waiting to be read by the job spawner
+                  thread. */
+extern WCHAR cmdline_batch[];
+
+/* len_cmdline_batch: Number of WCHARs used in cmdline_batch (including the
+                      NULL terminators). */
+extern int32_t len_cmdline_batch;
+
+/* n_cmdline_batch: Number of lines in cmdline_batch. */
+extern int32_t n_cmdline_batch;
+
+/* cmdline_eof: Set by the reader thread once stdin has no more lines. The
+                batch it's set with may still contain lines. */
+extern BOOL cmdline_eof;
 
 /* cmdline_consumed_e: After reading and setting cmdline, the reader thread
                        will wait on this condition before reading another line.
@@ -119,6 +256,39 @@ extern HANDLE exited_e;
 
 
 
+/* here_doc_body: Body of the here-document whose command line was last
+                  returned by here_doc_feed, one '\n' after every line. The
+                  script compiler copies it into the command's IR node. */
+extern WCHAR *here_doc_body;
+
+/* len_here_doc_body: Number of WCHARs in here_doc_body. -1 if the command
+                      line last returned by here_doc_feed has no 
+                      here-document. */
+extern int32_t len_here_doc_body;
+
+/* here_doc_input: Body fed to a "<<TAG" of the job being spawned, 
+                   len_here_doc_input WCHARs. Set by the script VM from the
+                   command's IR node while it spawns it, NULL otherwise. */
+extern const WCHAR *here_doc_input;
+extern int32_t len_here_doc_input;
+
+
+
+/* pipe_relay_enabled: Are pipe edges of new jobs relayed? Set by pipestat. */
+extern BOOL pipe_relay_enabled;
+
+
+
+/* shell_cwd: The shell's working directory (absolute). */
+extern WCHAR shell_cwd[];
+
+/* spawn_lock: Held while the shell has inheritable handles meant for the 
+               children of one spawn, so that a process started by another
+               thread (xargs) can't inherit them and hold a pipe open. */
+extern CRITICAL_SECTION spawn_lock;
+
+
+
 /**
  * first_nonescaped_dquote
  * 
@@ -196,17 +366,152 @@ BOOL readjust_quotes(WCHAR *str);
 
 
 
+/**
+ * quote_arg
+ *
+ * Quotes an argument so that it reaches the child as it is (CreateProcessW
+ * and CommandLineToArgvW rules): if it's empty or has whitespace or quotes
+ * (or force_quotes is set), it's put in quotes, quotes in it are escaped, 
+ * and backslashes before a quote are doubled.
+ *
+ * out: Quoted argument is written here (not NULL-terminated). NULL to only
+ *      get its length.
+ *
+ * Return Value: Returns the length of the quoted argument.
+ */
+int32_t quote_arg(const WCHAR *arg, int32_t len_arg, BOOL force_quotes,
+                  WCHAR *out);
+
+
+
+/**
+ * quote_words
+ *
+ * Writes text into a command line so that it's only split into words (at
+ * whitespace): each word is quoted if it has quotes or shell metacharacters
+ * in it, so a ">" or "|" in it is an argument rather than a redirection or
+ * a pipe. Between double quotes, the text stays one argument instead: only 
+ * its quotes (and the backslashes before them) are escaped.
+ *
+ * is_in_quotes: Is the text going between double quotes?
+ * is_before_quote: Is it followed by one (so backslashes it ends with have
+ *                  to be doubled)?
+ *
+ * Return Value: Returns the number of WCHARs written to out, -1 if they 
+ *               don't fit in cap_out.
+ */
+int32_t quote_words(const WCHAR *text, int32_t len_text, BOOL is_in_quotes,
+                    BOOL is_before_quote, WCHAR *out, int32_t cap_out);
+
+
+
 /**
  * find_open_jid
  *
- * Finds the first jid that's open to be used for a new job.
+ * Finds the lowest jid that's open to be used for a new job. Grows the job 
+ * table if every jid is in use.
  *
  * Return Value: Returns the jid on success.
- *               Return -1 if the jobs array is full.
+ *               Return -1 if the job table couldn't be grown.
  */
 int32_t find_open_jid();
 
 
+
+/**
+ * grow_jobs
+ * 
+ * Doubles the capacity of the job table (or allocates it with JOBS_INIT_CAP
+ * jobs the first time). New jobs are GARBAGE.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure (realloc failed).
+ */
+BOOL grow_jobs();
+
+
+
+/**
+ * activate_job
+ * 
+ * Marks a GARBAGE job RUNNING, takes its jid out of the free set and appends
+ * it to the live job list.
+ * 
+ * jid: jid of the job.
+ */
+void activate_job(int32_t jid);
+
+
+
+/**
+ * release_job
+ * 
+ * Marks a job GARBAGE, unlinks it from the live job list and returns its jid
+ * to the free set. Does nothing if the job is already GARBAGE.
+ * Doesn't free the job's resources.
+ * 
+ * jid: jid of the job.
+ */
+void release_job(int32_t jid);
+
+
+
+/**
+ * job_arena_new
+ *
+ * Gets an arena with room for at least cap bytes, from a free list if one of
+ * the right size is available.
+ *
+ * cap: Number of bytes needed.
+ *
+ * Return Value: Returns the arena (with one reference) on success, NULL on
+ *               failure (malloc failed).
+ */
+job_arena_t *job_arena_new(size_t cap);
+
+
+
+/**
+ * job_arena_alloc
+ *
+ * Bumps n_bytes (aligned to JOB_ARENA_ALIGN) out of an arena.
+ *
+ * Return Value: Returns the memory, or NULL if the arena doesn't have room.
+ */
+void *job_arena_alloc(job_arena_t *arena, size_t n_bytes);
+
+
+
+/**
+ * job_arena_intern_cmdline
+ *
+ * Gives an arena's job its command line: if a live job has the same one, the
+ * arena shares it (and takes a reference to that job's arena). Otherwise it's
+ * copied into the arena and made available to later jobs.
+ *
+ * arena: Arena of the job. Must have room for len_cmdline + 1 WCHARs.
+ * cmdline: Command line (doesn't need to be NULL-terminated).
+ * len_cmdline: Length of cmdline.
+ *
+ * Return Value: Returns the NULL-terminated command line to use.
+ */
+const WCHAR *job_arena_intern_cmdline(job_arena_t *arena, 
+                                      const WCHAR *cmdline, 
+                                      int32_t len_cmdline);
+
+
+
+/**
+ * job_arena_release
+ *
+ * Drops a reference to an arena. Once the last one is gone, the arena stops
+ * being an intern source, drops its reference to the arena its cmdline came
+ * from and goes back on a free list (or is freed).
+ *
+ * arena: Arena to release. May be NULL.
+ */
+void job_arena_release(job_arena_t *arena);
+
+
 /**
  * init_winshell
  * 
@@ -238,8 +543,148 @@ BOOL append_to_wait_handles(HANDLE *handles, int32_t len_handles);
  * print_err
  * 
  * Prints err message to stderr based on GetLastError code.
+ * Each error is a single write: "[hh:mm:ss.mmm] [jid N] err_name: message".
+ * Messages are cached per error code, and an error identical to the previous
+ * one within ERR_REPEAT_WINDOW_MS is only counted. The count is printed when
+ * the window closes.
+ * 
+ * err_name: Describes where the error happened.
+ */
+void print_err(const WCHAR *err_name);
+
+
+
+/**
+ * print_err_summary
+ * 
+ * Prints the "repeated N times" summary for the last error if any repeats 
+ * were suppressed. Called before the shell exits.
+ */
+void print_err_summary();
+
+
+
+/* UTF8_MAX_PER_WCHAR: Most UTF-8 bytes one WCHAR turns into - 3 for a
+                      16-bit WCHAR (a surrogate pair is 2 WCHARs for 4
+                      bytes), 4 where WCHAR is 32 bits. */
+#if WCHAR_MAX > 0xFFFF
+#define UTF8_MAX_PER_WCHAR 4
+#else
+#define UTF8_MAX_PER_WCHAR 3
+#endif
+
+/**
+ * utf16_to_utf8
+ * 
+ * Transcodes UTF-16 text to UTF-8. Runs of ASCII are converted 8 WCHARs at a
+ * time (SSE2 when available). Unpaired surrogates become U+FFFD. Where WCHAR
+ * is 32 bits (Linux), WCHARs past U+FFFF are code points of their own.
+ * 
+ * src: UTF-16 text to convert (doesn't need to be NULL-terminated).
+ * len_src: Number of WCHARs in src.
+ * dst: Output buffer. Must have room for UTF8_MAX_PER_WCHAR * len_src bytes.
+ * 
+ * Return Value: Returns the number of bytes written to dst.
+ */
+int32_t utf16_to_utf8(const WCHAR *src, int32_t len_src, char *dst);
+
+
+
+/**
+ * utf16le_to_wchar
+ * 
+ * Copies UTF-16LE text into WCHARs. Where WCHAR is 16 bits that's a plain
+ * copy; where it's 32 bits (Linux) each surrogate pair becomes one WCHAR.
+ * 
+ * src: UTF-16LE text, 2 bytes per code unit (needn't be aligned).
+ * n_units: Number of code units in src.
+ * dst: Output buffer. Must have room for n_units WCHARs.
+ * 
+ * Return Value: Returns the number of WCHARs written to dst.
+ */
+int32_t utf16le_to_wchar(const BYTE *src, int32_t n_units, WCHAR *dst);
+
+
+
+/**
+ * out_stream_init
+ *
+ * Initializes an out_stream that writes to h. Doesn't allocate - the buffer
+ * is allocated on the first write.
+ *
+ * stream: out_stream_t to initialize.
+ * h: HANDLE to write to (console, file or pipe).
+ */
+void out_stream_init(out_stream_t *stream, HANDLE h);
+
+
+
+/**
+ * out_stream_reserve
+ *
+ * Makes sure there is room for n_wchars more WCHARs in the stream's buffer.
+ * Flushes first if OUT_STREAM_FLUSH_AT WCHARs are already pending.
+ *
+ * stream: out_stream_t to grow.
+ * n_wchars: Number of WCHARs about to be appended.
+ *
+ * Return Value: Returns a pointer to where the next WCHAR should be written.
+ *               Returns NULL on failure (realloc or flush failed).
+ */
+WCHAR *out_stream_reserve(out_stream_t *stream, int32_t n_wchars);
+
+
+
+/**
+ * out_stream_write
+ *
+ * Appends len_str WCHARs of str to the stream's buffer.
+ *
+ * stream: out_stream_t to append to.
+ * str: Text to append (doesn't need to be NULL-terminated).
+ * len_str: Number of WCHARs in str.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL out_stream_write(out_stream_t *stream, const WCHAR *str, int32_t len_str);
+
+
+
+/**
+ * out_stream_puts
+ *
+ * Appends a NULL-terminated string to the stream's buffer.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL out_stream_puts(out_stream_t *stream, const WCHAR *str);
+
+
+
+/**
+ * out_stream_flush
+ *
+ * Writes everything pending in the stream's buffer with a single write call.
+ * A spooled stream isn't written until it's closed.
+ *
+ * stream: out_stream_t to flush.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL out_stream_flush(out_stream_t *stream);
+
+
+
+/**
+ * out_stream_close
+ *
+ * Flushes the stream and frees its buffer. Doesn't close the HANDLE. A
+ * spooled stream's buffer goes to a writer thread instead, which writes it
+ * and closes a duplicate of the HANDLE when it's done.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the flush failed.
  */
-void print_err();
+BOOL out_stream_close(out_stream_t *stream);
 
 
 
@@ -276,6 +721,49 @@ BOOL reap_proc(HANDLE proc_h);
 
 
 
+/**
+ * record_completion
+ * 
+ * Moves a job whose processes have all exited into the completion history
+ * (overwriting the oldest record once it's full) and frees its slot. The
+ * record takes over the job's arena.
+ * 
+ * jid: jid of the job.
+ */
+void record_completion(int32_t jid);
+
+
+
+/**
+ * capture_stage_times
+ * 
+ * Captures the wall, user and system time of a timed job's process that just
+ * exited. Does nothing if the job isn't timed.
+ * 
+ * Note: Must be called after stage_query_exit and before proc_h is closed.
+ * 
+ * job: Job the process belongs to.
+ * proc_h: HANDLE of the process.
+ */
+void capture_stage_times(job_t *job, HANDLE proc_h);
+
+
+
+/**
+ * report_job_times
+ * 
+ * Writes the time report of a timed job whose last process was just reaped
+ * to stderr: one line per stage and a total. The total's real time is the 
+ * job's wall time, user and sys are summed over the stages.
+ * 
+ * job: Job to report on.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL report_job_times(const job_t *job);
+
+
+
 /**
  * parse_job_cmdline
  * 
@@ -283,18 +771,22 @@ BOOL reap_proc(HANDLE proc_h);
  * the processes.
  * 
  * job_cmdline: Job command line inputted by user.
+ * cwd: Working directory of the job (wildcards are matched in it).
  * out_n_procs: Number of processes to be spawned will be put here. This is 
  *              also the size of the returned array.
  * out_is_foreground: Whether this is a foreground job will be placed here.
  * 
- * Return Value: Returns a poitner to a heap-allocated array of parsed 
- *               processes.
+ * Return Value: Returns a pointer to an array of parsed processes. The array
+ *               is reused by the next call - don't free it.
  *               If an error occurs, NULL will be returned and one of these
  *               error codes will be placed in out_n_procs:
  *                - SPAWNJOB_EMPTY_PIPE
  *                - SPAWNJOB_EMPTY_CMDLINE
+ *                - SPAWNJOB_SYSCALL_FAILURE
+ *                - SPAWNJOB_CMDLINE_TOO_LONG
  */
 parsed_process_t *parse_job_cmdline(const WCHAR *job_cmdline,
+                                    const WCHAR *cwd,
                                     int32_t *out_n_procs,
                                     BOOL *out_is_foreground);
 
@@ -303,18 +795,50 @@ parsed_process_t *parse_job_cmdline(const WCHAR *job_cmdline,
 /**
  * job_to_str
  * 
- * Creates a string description for a given job.
+ * Writes the description of a job ("[jid] STATUS\t\tcmdline") to a 
+ * caller-supplied buffer. Doesn't allocate.
+ * 
+ * job: job_t object to describe.
+ * out: Buffer to write to. Must have room for JOB_STR_LEN(job) + 1 WCHARs.
+ * cap_out: Capacity of out in WCHARs.
+ * 
+ * Return Value: Returns the length of the description (not including the 
+ *               NULL terminator that is also written).
+ *               Returns -1 if out is too small - nothing is written.
+ */
+int32_t job_to_str(const job_t *job, WCHAR *out, int32_t cap_out);
+
+
+
+
+/**
+ * write_job_line
+ * 
+ * Formats a job's description followed by a newline directly into an 
+ * out_stream's buffer.
  * 
+ * stream: out_stream_t to append to.
  * job: job_t object to describe.
  * 
- * Return Value: Returns a pointer to a heap-allocated NULL-terminated string 
- *               containing the description for the job. Must be freed with 
- *               free().
- *               Returns NULL on error.
+ * Return Value: Returns TRUE on success, FALSE on failure.
  */
-WCHAR *job_to_str(const job_t *job);
+BOOL write_job_line(out_stream_t *stream, const job_t *job);
+
 
 
+/**
+ * write_completion_line
+ * 
+ * Formats a completion record ("[jid] DONE (exit N, S.MMMs)\t\tcmdline") 
+ * followed by a newline directly into an out_stream's buffer.
+ * 
+ * stream: out_stream_t to append to.
+ * record: completion_t to describe.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL write_completion_line(out_stream_t *stream, const completion_t *record);
+
 
 
 /**
@@ -337,13 +861,13 @@ BOOL terminate_job(job_t *job);
  * kill_builtin
  * 
  * parsed_proc: Parsed info about the command that called this builtin.
- * startup_info: Should be setup for I/O redirection. Will send output to
- *               the hStdOutput HANDLE.
+ * stdio: Standard streams after I/O redirection. Will send output to
+ *        std_out.
  * 
  * Return Value: Returns TRUE on success, FALSE on failure.
  */
 BOOL kill_builtin(parsed_process_t *parsed_proc, 
-                  STARTUPINFO *startup_info);
+                  stdio_handles_t *stdio);
 
 
 
@@ -352,12 +876,12 @@ BOOL kill_builtin(parsed_process_t *parsed_proc,
  * 
  * parsed_proc: Contains parsed information about command line that called
  *              this builtin to be called.
- * startup_info: Contains redirection info - will output to hStdOutput.
+ * stdio: Standard streams after redirection - will output to std_out.
  * 
  * Return Value: Returns TRUE on success, returns FALSE on failure.
  */
 BOOL jobs_builtin(parsed_process_t *parsed_proc, 
-                  STARTUPINFO *startup_info);
+                  stdio_handles_t *stdio);
 
 
 
@@ -369,10 +893,10 @@ BOOL jobs_builtin(parsed_process_t *parsed_proc,
  * 
  * parsed_proc: Parsed info from command that called this builtin, not
  *              used.
- * startup_info: Redirection info, not used.
+ * stdio: Standard streams after redirection, not used.
  */
 void exit_builtin(parsed_process_t *parsed_proc, 
-                  STARTUPINFO *startup_info);
+                  stdio_handles_t *stdio);
 
 
 
@@ -383,12 +907,12 @@ void exit_builtin(parsed_process_t *parsed_proc,
  * 
  * parsed_proc: Contains information parsed from the command that called this
  *              builtin. Not used.
- * startup_info: Contains redirection info. Output is written to hStdOutput.
+ * stdio: Standard streams after redirection. Output is written to std_out.
  *
  * Return Value: Returns TRUE on success. Returns FALSE on failure.
  */
 BOOL pwd_builtin(parsed_process_t *parsed_proc, 
-                 STARTUPINFO *startup_info);
+                 stdio_handles_t *stdio);
 
 
 
@@ -399,39 +923,761 @@ BOOL pwd_builtin(parsed_process_t *parsed_proc,
  * 
  * parsed_proc: Contains information about command line that called this 
  *              builtin. The directory to move to will be extracted from this.
- * startup_info: Contains I/O redirection information. Not used.
+ * stdio: Standard streams after I/O redirection. Not used.
  * 
  * Return Value: Returns TRUE on success. Returns FALSE on failure.
  */
 BOOL cd_builtin(parsed_process_t *parsed_proc, 
-                STARTUPINFO *startup_info);
+                stdio_handles_t *stdio);
 
 
 
 /**
- * spawn_job
- *
- * Does all the work for spawning the job from the given job_cmdline. 
- * Cleans/parses the cmdline, sets up the pipes and I/O redirection, 
- * spawns the processes, and adds the job struct to the jobs array.
+ * history_builtin
  * 
- * Note: This function will alter the buffer at job_cmdline.
- *
- * Return Value: Returns the jid of the new job on success. 
- *               Returns -1 on failure.
+ * Lists or searches the command history.
+ *  - history         lists the newest HISTORY_DEFAULT_SHOW entries
+ *  - history N       lists the newest N entries
+ *  - history -p text lists entries that start with text, newest first
+ *  - history -s text lists entries that contain text, newest first
+ * 
+ * parsed_proc: Contains parsed information about the command line that 
+ *              called this builtin.
+ * stdio: Standard streams after redirection - will output to std_out.
+ * 
+ * Return Value: Returns TRUE on success, returns FALSE on failure.
  */
-int32_t spawn_job(const WCHAR *job_cmdline);
+BOOL history_builtin(parsed_process_t *parsed_proc, 
+                     stdio_handles_t *stdio);
 
 
 
 /**
- * shell_loop
+ * trace_builtin
  * 
- * Called by main to run the shell loop.
- * Repeatedly reads commands from the console and spawns and manages jobs
- * accordingly.
+ * Controls lifecycle tracing.
+ *  - trace start           clears recorded events and starts recording
+ *  - trace stop            stops recording
+ *  - trace dump file.json  writes the recorded events to file.json in the
+ *                          Chrome trace event format
+ * 
+ * parsed_proc: Contains information about command line that called this 
+ *              builtin.
+ * stdio: Standard streams after I/O redirection. Not used.
+ * 
+ * Return Value: Returns TRUE on success. Returns FALSE on failure.
  */
-void shell_loop();
+BOOL trace_builtin(parsed_process_t *parsed_proc, 
+                   stdio_handles_t *stdio);
+
+
+
+/**
+ * trace_event
+ *
+ * Records an event on the calling thread's ring. Use the TRACE macro instead
+ * so that nothing is done while tracing is off.
+ *
+ * kind: What happened.
+ * arg: Kind-specific number shown in the dump.
+ */
+void trace_event(trace_event_kind_t kind, int64_t arg);
+
+
+
+/**
+ * trace_start
+ *
+ * Clears every ring and starts recording.
+ */
+void trace_start();
+
+
+
+/**
+ * trace_stop
+ *
+ * Stops recording. Recorded events are kept for trace_dump.
+ */
+void trace_stop();
+
+
+
+/**
+ * trace_dump
+ *
+ * Writes every recorded event to a file in the Chrome trace event format.
+ * Timestamps are microseconds since the earliest recorded event.
+ *
+ * Note: Events recorded while the dump runs may be cut off or torn - stop
+ *       tracing first for a clean dump.
+ *
+ * path: File to (over)write (relative to shell_cwd).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL trace_dump(const WCHAR *path);
+
+
+
+/**
+ * stats_builtin
+ * 
+ * Shows the shell's counters, gauges and latency histograms.
+ *  - stats          prints them as text
+ *  - stats --json   prints them as a JSON object
+ *  - stats --reset  zeroes them (after printing, if combined with --json)
+ * 
+ * parsed_proc: Contains parsed information about the command line that 
+ *              called this builtin.
+ * stdio: Standard streams after redirection - will output to std_out.
+ * 
+ * Return Value: Returns TRUE on success, returns FALSE on failure.
+ */
+BOOL stats_builtin(parsed_process_t *parsed_proc, 
+                   stdio_handles_t *stdio);
+
+
+
+#ifndef WINSHELL_NO_STATS
+
+/**
+ * stats_record_since
+ *
+ * Records the microseconds elapsed since start in a histogram.
+ *
+ * hist: Histogram to record in.
+ * start: QueryPerformanceCounter value when the timed work started.
+ */
+void stats_record_since(stat_hist_t hist, const LARGE_INTEGER *start);
+
+
+
+/**
+ * stats_reset
+ *
+ * Zeroes every counter and histogram.
+ */
+void stats_reset();
+
+
+
+/**
+ * stats_write
+ *
+ * Writes the counters, the gauges (wait set size and jid table occupancy)
+ * and a summary of each histogram to stream, as aligned text or as JSON.
+ * Write failures show up when the stream is flushed.
+ */
+void stats_write(out_stream_t *stream, BOOL as_json);
+
+
+
+/**
+ * stats_percentile
+ *
+ * Return Value: Returns the value (bucket upper bound, capped at the max)
+ *               below which pct percent of a histogram's values fall.
+ */
+int64_t stats_percentile(stat_hist_t hist, int32_t pct);
+
+// ifndef WINSHELL_NO_STATS
+#endif
+
+
+
+/**
+ * pipestat_builtin
+ *
+ * Per-edge throughput of pipelines.
+ *  - pipestat on     relays the pipe edges of jobs spawned from now on
+ *                    through the shell, so they can be measured
+ *  - pipestat off    spawns new jobs with direct pipes again
+ *  - pipestat %jid   shows bytes, rates and waits of each edge of job jid
+ *  - pipestat        shows them for every live job that has relays
+ * Off by default: a relayed edge costs a thread and an extra pipe hop (a 
+ * splice on Linux, a copy on Win32 - "winshell_bench relay" measures it).
+ *
+ * parsed_proc: Contains parsed information about the command line that
+ *              called this builtin.
+ * stdio: Standard streams after redirection - will output to std_out.
+ *
+ * Return Value: Returns TRUE on success, returns FALSE on failure.
+ */
+BOOL pipestat_builtin(parsed_process_t *parsed_proc,
+                      stdio_handles_t *stdio);
+
+
+
+/**
+ * start_pipe_relay
+ *
+ * Relays a pipe edge of a job through a new relay thread and adds the relay
+ * to job->relays.
+ *
+ * job: Job being spawned (job->relays has room for the edge).
+ * upstream_read_h: Private read end of the pipe the upstream stage writes
+ *                  to. Taken over by the relay on success.
+ * from, to: Application names of the upstream and downstream stages.
+ * out_downstream_read_h: Inheritable read end of the pipe for the downstream
+ *                        stage is placed here. Close it once the stage has
+ *                        been spawned.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (upstream_read_h
+ *               is left open).
+ */
+BOOL start_pipe_relay(job_t *job, HANDLE upstream_read_h, const WCHAR *from,
+                      const WCHAR *to, HANDLE *out_downstream_read_h);
+
+
+
+/**
+ * release_pipe_relays
+ *
+ * Drops the job's references to its relays. Relays that are still copying
+ * keep going until their pipes close.
+ *
+ * job: Job that's being done with.
+ */
+void release_pipe_relays(job_t *job);
+
+
+
+/**
+ * write_pipe_stats
+ *
+ * Writes a line per relayed pipe edge of a job: bytes relayed, the rate
+ * since the last call and overall, and the share of time the relay waited
+ * on the upstream stage (slow to write) and on the downstream stage (slow to
+ * read - backpressure).
+ *
+ * stream: Where the lines go.
+ * job: Job whose edges are written.
+ */
+void write_pipe_stats(out_stream_t *stream, job_t *job);
+
+
+
+/**
+ * history_open
+ *
+ * Opens (creating if needed) the history file - WINSHELL_HISTFILE, or
+ * %USERPROFILE%\.winshell_history - maps it and indexes its entries. Other
+ * shells can have it open at the same time.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure. The shell runs
+ *               without history if this fails.
+ */
+BOOL history_open();
+
+
+
+/**
+ * history_add
+ *
+ * Appends a line to the history file and indexes it. Empty lines and a line
+ * equal to the newest entry aren't added.
+ *
+ * line: Line to add (doesn't need to be NULL-terminated).
+ * len_line: Number of WCHARs in line.
+ */
+void history_add(const WCHAR *line, int32_t len_line);
+
+
+
+/**
+ * history_search
+ *
+ * Finds the newest entries that start with (or contain) pattern, through 
+ * the gram index.
+ *
+ * pattern: Text to search for (doesn't need to be NULL-terminated).
+ * len_pattern: Number of WCHARs in pattern.
+ * is_prefix: TRUE for a prefix search, FALSE for a substring search.
+ * out_ids: Matching entry ids are placed here, newest first.
+ * max_ids: Capacity of out_ids.
+ *
+ * Return Value: Returns the number of ids placed in out_ids.
+ */
+int32_t history_search(const WCHAR *pattern, int32_t len_pattern,
+                       BOOL is_prefix, int32_t *out_ids, int32_t max_ids);
+
+
+
+/**
+ * history_search_older
+ *
+ * One step of a reverse incremental search: finds the newest entry older 
+ * than before_id that contains pattern.
+ *
+ * pattern: Text to search for (doesn't need to be NULL-terminated).
+ * len_pattern: Number of WCHARs in pattern.
+ * before_id: Only entries older than this are looked at - history_count() 
+ *            for the first step, the last match for the next ones.
+ *
+ * Return Value: Returns the id of the entry, -1 if there's none.
+ */
+int32_t history_search_older(const WCHAR *pattern, int32_t len_pattern,
+                             int32_t before_id);
+
+
+
+/**
+ * history_entry
+ *
+ * Looks up an entry by id.
+ *
+ * id: Entry id (0 is the oldest).
+ * out_len_entry: Length of the entry is placed here.
+ *
+ * Return Value: Returns a pointer to the entry text (not NULL-terminated).
+ *               Only valid until the next history_add.
+ *               Returns NULL if there is no such entry.
+ */
+const WCHAR *history_entry(int32_t id, int32_t *out_len_entry);
+
+
+
+/**
+ * history_count
+ *
+ * Return Value: Returns the number of entries in the history.
+ */
+int32_t history_count();
+
+
+
+/**
+ * history_expand
+ *
+ * Expands a line that starts with '!': "!!" becomes the newest entry and
+ * "!text" becomes the newest entry that starts with text.
+ *
+ * line: NULL-terminated line, with room for MAX_CMDLINE + 1 WCHARs. Replaced
+ *       with the expansion.
+ *
+ * Return Value: Returns TRUE if line was expanded (or didn't need to be).
+ *               Returns FALSE if no entry matched - line is left as is.
+ */
+BOOL history_expand(WCHAR *line);
+
+
+
+/**
+ * dir_cache_get
+ *
+ * Gets the listing of a directory, reading it if it isn't cached or has
+ * changed since it was read.
+ *
+ * dir: Directory path (relative paths are taken from shell_cwd).
+ *
+ * Return Value: Returns the listing, valid until the next dir_cache_get.
+ *               Returns NULL if the directory can't be read.
+ */
+const dir_listing_t *dir_cache_get(const WCHAR *dir);
+
+
+
+/**
+ * dir_listing_find_prefix
+ *
+ * Finds the names in a listing that start with prefix (case-insensitive).
+ *
+ * listing: Listing to search.
+ * prefix: Prefix to look for (doesn't need to be NULL-terminated).
+ * len_prefix: Number of WCHARs in prefix.
+ * out_first: Index into listing->names of the first match is placed here.
+ *
+ * Return Value: Returns the number of matches (they are contiguous).
+ */
+int32_t dir_listing_find_prefix(const dir_listing_t *listing,
+                                const WCHAR *prefix,
+                                int32_t len_prefix,
+                                int32_t *out_first);
+
+
+
+/**
+ * dir_cache_warm
+ *
+ * Reads the current directory and every PATH directory into the cache (only
+ * the ones that aren't cached or have changed). Called by the cmdline reader
+ * thread while it's idle so that completion doesn't have to list them.
+ */
+void dir_cache_warm();
+
+
+
+/**
+ * complete_cmdline
+ *
+ * Completes the last word of a partially typed line in place:
+ *  - the first word of a pipeline stage completes to a builtin or an
+ *    executable in PATH (or a path if it contains a '\')
+ *  - the argument of kill completes to a live jid
+ *  - anything else completes to a file or directory path
+ * A unique match is completed fully. Otherwise the word is extended to the
+ * longest common prefix of the matches, and if that adds nothing the matches
+ * are listed.
+ *
+ * line: Line being typed, with room for MAX_CMDLINE + 1 WCHARs. Doesn't need
+ *       to be NULL-terminated.
+ * in_out_len_line: Length of line. Updated to the completed length.
+ * candidates_out: The listing of ambiguous matches is written here.
+ *
+ * Return Value: Returns TRUE if matches were listed to candidates_out.
+ */
+BOOL complete_cmdline(WCHAR *line, int32_t *in_out_len_line,
+                      out_stream_t *candidates_out);
+
+
+
+/**
+ * spawn_job
+ *
+ * Does all the work for spawning the job from the given job_cmdline. 
+ * Expands $(...) substitutions, cleans/parses the cmdline, sets up the pipes
+ * and I/O redirection, spawns the processes, and adds the job struct to the
+ * jobs array.
+ * 
+ * Note: This function will alter the buffer at job_cmdline.
+ *
+ * job_cmdline: Command line of the job.
+ * job_stdout_h: Where the job's output goes unless it's redirected (the 
+ *               shell's stdout, or a capture pipe for a substitution).
+ * cwd: Working directory of the job: shell_cwd, or the directory of a
+ *      "(cd DIR; cmd)" scope. The job keeps its own copy.
+ *
+ * Return Value: Returns the jid of the new job on success. 
+ *               Returns a negative number on failure:
+ *                - SPAWNJOB_EMPTY_PIPE 
+ *                - SPAWNJOB_EMPTY_CMDLINE
+ *                - SPAWNJOB_SYSCALL_FAILURE
+ *                - SPAWNJOB_EMPTY_JOB
+ *                - SPAWNJOB_BAD_SUBSTITUTION
+ *                - SPAWNJOB_CMDLINE_TOO_LONG
+ */
+int32_t spawn_job(const WCHAR *job_cmdline, HANDLE job_stdout_h,
+                  const WCHAR *cwd);
+
+
+
+/**
+ * expand_substitutions
+ * 
+ * Replaces every $(pipeline) in a command line with the trimmed output of 
+ * running pipeline (nested substitutions are expanded by the inner spawn).
+ * Errors are written to stderr.
+ * 
+ * cmdline: Command line to expand.
+ * cwd: Working directory the pipelines run in (the outer job's).
+ * is_quoted: Quote the output (see quote_words) so that it's only split 
+ *            into words, rather than paste it as it is (a variable's 
+ *            value).
+ * out: Expanded command line is written here (NULL-terminated).
+ * cap_out: Capacity of out in WCHARs.
+ * 
+ * Return Value: Returns the length of the expanded command line.
+ *               Returns -1 on failure.
+ */
+int32_t expand_substitutions(const WCHAR *cmdline, const WCHAR *cwd,
+                             BOOL is_quoted, WCHAR *out, int32_t cap_out);
+
+
+
+/**
+ * expand_globs
+ *
+ * Replaces every argument of a process command line (not the application
+ * name) that has an unquoted wildcard with the sorted paths it matches.
+ * Matches with spaces are quoted. Arguments with quotes are left alone.
+ *
+ * cmd_line: NULL-terminated process command line. Expanded in place.
+ * cap_cmd_line: Capacity of cmd_line in WCHARs.
+ * cwd: Working directory relative patterns are matched in.
+ *
+ * Return Value: Returns TRUE on success. Returns FALSE if the expanded
+ *               command line wouldn't fit (cmd_line is left unchanged).
+ */
+BOOL expand_globs(WCHAR *cmd_line, int32_t cap_cmd_line, const WCHAR *cwd);
+
+
+
+/**
+ * here_doc_feed
+ *
+ * Passes every line read through here-document collection. A line with a
+ * "<<TAG" is held back, and the lines after it become its body until a line
+ * that is just TAG. Other lines pass straight through.
+ *
+ * line: Line that was read, or NULL at the end of input (a here-document
+ *       still being collected is then cut short with a warning).
+ * out_cmdline: If a command line is ready to spawn, it's placed here. It's
+ *              valid until the next call.
+ *
+ * Return Value: Returns TRUE if *out_cmdline is ready to spawn, FALSE if the
+ *               line was taken as (part of) a here-document.
+ */
+BOOL here_doc_feed(const WCHAR *line, const WCHAR **out_cmdline);
+
+
+
+/**
+ * here_doc_pending
+ *
+ * Return Value: Returns TRUE while a here-document body is being collected.
+ */
+BOOL here_doc_pending();
+
+
+
+/**
+ * start_here_writer
+ *
+ * Creates a pipe for a child's stdin and starts a writer thread that feeds
+ * it data (as UTF-8). The data is copied, so it can be reused right away.
+ *
+ * data: Text to feed.
+ * len_data: Number of WCHARs in data.
+ * out_read_h: Inheritable read end of the pipe is placed here. Close it once
+ *             the child has been spawned.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL start_here_writer(const WCHAR *data, int32_t len_data,
+                       HANDLE *out_read_h);
+
+
+
+/**
+ * script_feed
+ *
+ * Compiles a line of input. Once the line completes a top-level statement
+ * (every block it opened is closed), the compiled chunk is run.
+ *
+ * line: Line of input.
+ *
+ * Return Value: Returns the jid of the foreground job the chunk started, -1
+ *               if it ran to the end (or the line didn't complete a
+ *               statement).
+ */
+int32_t script_feed(const WCHAR *line);
+
+
+
+/**
+ * script_resume
+ *
+ * Carries on with the script once the foreground job it was stopped on is
+ * done.
+ *
+ * exit_code: Exit code of the job.
+ *
+ * Return Value: Returns the jid of the next foreground job started, -1 if
+ *               the script ran to the end (or wasn't stopped on a job).
+ */
+int32_t script_resume(DWORD exit_code);
+
+
+
+/**
+ * script_pending
+ *
+ * Return Value: Returns TRUE while a block is open (more lines are needed
+ *               before anything runs).
+ */
+BOOL script_pending();
+
+
+
+/**
+ * script_end_input
+ *
+ * Called at the end of input: throws away a statement whose blocks were
+ * never closed.
+ */
+void script_end_input();
+
+
+
+/**
+ * resolve_app_path
+ *
+ * Finds the executable for an application name (".exe" is assumed if it
+ * has no extension). A name with a directory in it is only made absolute.
+ *
+ * name: Application name.
+ * cwd: Working directory of the job.
+ * out_path: Full path of the executable is placed here (MAX_PATH + 1
+ *           WCHARs).
+ *
+ * Return Value: Returns TRUE if out_path was filled in. Returns FALSE if no
+ *               executable was found - then the name should be used as is.
+ */
+BOOL resolve_app_path(const WCHAR *name, const WCHAR *cwd, WCHAR *out_path);
+
+
+
+/**
+ * forget_app_paths
+ *
+ * Forgets every remembered lookup. Called when the shell's directory
+ * changes, so that executables that appeared since are found.
+ */
+void forget_app_paths();
+
+
+
+/**
+ * make_abs_path
+ *
+ * Makes a path absolute against a directory other than the process's current
+ * one, and normalizes it ("." and ".." are resolved).
+ *
+ * base_dir: Absolute directory relative paths are taken from.
+ * path: Path to make absolute.
+ * out_path: Absolute path is placed here (MAX_PATH + 1 WCHARs).
+ *
+ * Return Value: Returns TRUE on success. Returns FALSE if the path is too
+ *               long.
+ */
+BOOL make_abs_path(const WCHAR *base_dir, const WCHAR *path,
+                   WCHAR *out_path);
+
+
+
+/**
+ * find_dir
+ *
+ * Resolves the directory a cd names against base_dir and checks that it
+ * exists. Errors are written to stderr.
+ *
+ * base_dir: Absolute directory the cd is made from.
+ * dir: Directory named by the user.
+ * out_dir: Absolute directory is placed here (MAX_PATH + 1 WCHARs).
+ *
+ * Return Value: Returns TRUE if out_dir is an existing directory.
+ */
+BOOL find_dir(const WCHAR *base_dir, const WCHAR *dir, WCHAR *out_dir);
+
+
+
+/**
+ * is_inproc_builtin
+ *
+ * Return Value: Returns TRUE if application_name is run in-process.
+ */
+BOOL is_inproc_builtin(const WCHAR *application_name);
+
+
+
+/**
+ * start_inproc_stage
+ *
+ * Starts an in-process builtin as a stage of a job.
+ *
+ * parsed_proc: The stage (is_inproc_builtin is TRUE for its name).
+ * in_h, out_h: The stage's stdin and stdout. Duplicated - close them once
+ *              this returns, as for a process.
+ * out_stage_h: HANDLE that's signaled once the stage is done is placed
+ *              here. Use it like a process HANDLE, with the stage_*
+ *              functions.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL start_inproc_stage(const parsed_process_t *parsed_proc, HANDLE in_h,
+                        HANDLE out_h, HANDLE *out_stage_h);
+
+
+
+/**
+ * stage_query_exit
+ *
+ * plat_query_exit for a process or an in-process stage.
+ */
+BOOL stage_query_exit(HANDLE h, DWORD *out_exit_code);
+
+
+
+/**
+ * stage_times
+ *
+ * plat_proc_times for a process or an in-process stage. A timer or event
+ * stage uses no CPU time; its wall time is from when it started until it
+ * was due (or stopped).
+ */
+BOOL stage_times(HANDLE h, uint64_t *out_wall, uint64_t *out_user,
+                 uint64_t *out_sys);
+
+
+
+/**
+ * stage_terminate
+ *
+ * plat_terminate for a process or an in-process stage. A thread stage is
+ * told to stop and its blocking I/O is cancelled; a sleep ends right away.
+ */
+BOOL stage_terminate(HANDLE h, DWORD exit_code);
+
+
+
+/**
+ * stage_close
+ *
+ * plat_close for a process or an in-process stage.
+ */
+void stage_close(HANDLE h);
+
+
+
+/**
+ * run_job_cmdline
+ * 
+ * Spawns a job command line, and reports why if it couldn't be spawned.
+ * 
+ * cmdline: Job command line.
+ * cwd: Working directory of the job (shell_cwd unless it's scoped).
+ * out_status: Unless a foreground job was started, the command's status is
+ *             placed here: 0 if it was spawned (or was only builtins), 1 if
+ *             it failed.
+ * 
+ * Return Value: Returns the jid of the foreground job that was started, or 
+ *               -1 if none was.
+ */
+int32_t run_job_cmdline(const WCHAR *cmdline, const WCHAR *cwd,
+                        DWORD *out_status);
+
+
+
+/**
+ * shell_loop
+ * 
+ * Called by main to run the shell loop.
+ * Repeatedly reads commands from the console and spawns and manages jobs
+ * accordingly.
+ */
+void shell_loop();
+
+
+
+/**
+ * fill_cmdline_batch
+ *
+ * Fills cmdline_batch with as many complete lines from non-console stdin as
+ * are available (at least one unless stdin is at EOF). Only blocks in
+ * ReadFile when no complete line is buffered yet.
+ * Sets cmdline_eof once the end of input has been reached and every line has
+ * been handed out.
+ *
+ * Note: The caller must hold cmdline_lock.
+ *
+ * stdin_h: HANDLE to stdin (a pipe or a file).
+ *
+ * Return Value: Returns TRUE on success.
+ *               Returns FALSE if ReadFile failed (GetLastError is
+ *               ERROR_OPERATION_ABORTED if the read was cancelled on exit).
+ */
+BOOL fill_cmdline_batch(HANDLE stdin_h);
 
 
 
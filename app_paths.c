@@ -0,0 +1,109 @@
+
+/**
+ * app_paths.c
+ *
+ * Finds the executable a command names (SearchPathW: the job's working
+ * directory first, like cmd.exe, then the shell's directory, the system
+ * directories and PATH) and remembers the answer, so a command run over and
+ * over in a loop is only looked up once.
+ */
+
+
+
+#include <windows.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* APP_PATHS_CAP: Number of remembered lookups (a power of 2). */
+#define APP_PATHS_CAP 64
+
+
+
+/**
+ * app_path_t struct
+ *
+ * A remembered lookup, made from working directory dir. name is empty if the
+ * slot is unused.
+ */
+typedef struct _app_path {
+    WCHAR name[MAX_PATH + 1];
+    WCHAR dir[MAX_PATH + 1];
+    WCHAR path[MAX_PATH + 1];
+    uint32_t gen;
+} app_path_t;
+
+
+
+/* app_paths: Remembered lookups, indexed by a hash of the name. */
+static app_path_t app_paths[APP_PATHS_CAP];
+
+/* app_paths_gen: Lookups remembered under an older generation are stale. */
+static uint32_t app_paths_gen = 1;
+
+
+
+/**
+ * resolve_app_path
+ *
+ * Finds the executable for an application name (".exe" is assumed if it
+ * has no extension). A name with a directory in it is only made absolute.
+ *
+ * name: Application name.
+ * cwd: Working directory of the job.
+ * out_path: Full path of the executable is placed here (MAX_PATH + 1
+ *           WCHARs).
+ *
+ * Return Value: Returns TRUE if out_path was filled in. Returns FALSE if no
+ *               executable was found - then the name should be used as is.
+ */
+BOOL resolve_app_path(const WCHAR *name, const WCHAR *cwd, WCHAR *out_path) {
+
+    size_t len_name = wcslen(name);
+    if (len_name == 0 or len_name > MAX_PATH)
+        return FALSE;
+    if (wcspbrk(name, L"\\/:"))
+        return make_abs_path(cwd, name, out_path);
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len_name; i++) {
+        hash ^= towlower(name[i]);
+        hash *= 16777619u;
+    }
+    app_path_t *entry = &app_paths[hash & (APP_PATHS_CAP - 1)];
+    if (entry->gen == app_paths_gen and _wcsicmp(entry->name, name) == 0
+         and _wcsicmp(entry->dir, cwd) == 0) {
+        wcscpy(out_path, entry->path);
+        return TRUE;
+    }
+
+    DWORD len_path = SearchPathW(cwd, name, L".exe", MAX_PATH + 1, out_path,
+                                 NULL);
+    if (len_path == 0 or len_path > MAX_PATH)
+        len_path = SearchPathW(NULL, name, L".exe", MAX_PATH + 1, out_path,
+                               NULL);
+    if (len_path == 0 or len_path > MAX_PATH)
+        return FALSE;
+
+    wcscpy(entry->name, name);
+    wcscpy(entry->dir, cwd);
+    wcscpy(entry->path, out_path);
+    entry->gen = app_paths_gen;
+    return TRUE;
+}
+
+
+
+/**
+ * forget_app_paths
+ *
+ * Forgets every remembered lookup. Called when the shell's directory
+ * changes, so that executables that appeared since are found.
+ */
+void forget_app_paths() {
+    app_paths_gen++;
+}
@@ -0,0 +1,348 @@
+
+/**
+ * bench.c
+ *
+ * Entry point of the benchmark harness (built instead of main.c). Runs the
+ * suites named on the command line, or all of them, and writes
+ *
+ *     {"benchmarks":[ {"suite":"...", ...}, ... ]}
+ *
+ * to stdout, one result object per line.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include "bench.h"
+
+
+
+/* suites: Every suite, in the order they run. */
+static const bench_suite_t suites[] = {
+    { L"spawn", spawn_bench },
+    { L"jobs", jobs_bench },
+    { L"jobs_pipe", jobs_pipe_bench },
+    { L"relay", relay_bench },
+    { L"script", script_bench },
+    { L"latency", latency_bench },
+    { L"redir", redir_bench }
+};
+
+/* N_SUITES: Number of suites. */
+#define N_SUITES ((int32_t)(sizeof(suites) / sizeof(*suites)))
+
+HANDLE bench_null_h;
+
+#ifdef _WIN32
+const WCHAR *bench_null_path = L"NUL";
+#else
+const WCHAR *bench_null_path = L"/dev/null";
+#endif
+
+/* n_results: Results written so far (the first one has no comma). */
+static int32_t n_results = 0;
+
+/* MAKE_FILE_CHUNK: Bytes written by each WriteFile of bench_make_file. */
+#define MAKE_FILE_CHUNK (1 << 20)
+
+
+
+/**
+ * bench_now_us
+ *
+ * Return Value: Returns a monotonic time in microseconds.
+ */
+int64_t bench_now_us() {
+
+    static LARGE_INTEGER freq = { 0 };
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart / freq.QuadPart * 1000000
+            + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+
+
+/**
+ * bench_spawn
+ *
+ * Spawns a job command line like the shell loop does: spawn_job, then its
+ * processes go into the wait set. Records STAT_HIST_SPAWN.
+ *
+ * out_h: Where the job's output goes unless it's redirected.
+ *
+ * Return Value: Returns the jid of the job, SPAWNJOB_EMPTY_JOB if the
+ *               cmdline only ran shell builtins, or another negative number
+ *               if spawn_job failed (reported on stderr).
+ */
+int32_t bench_spawn(const WCHAR *cmdline, HANDLE out_h) {
+
+    STAT_TIMER_START(spawn_timer);
+    int32_t jid = spawn_job(cmdline, out_h, shell_cwd);
+    STAT_TIMER_RECORD(STAT_HIST_SPAWN, spawn_timer);
+    print_err_jid = -1;
+    if (jid == SPAWNJOB_EMPTY_JOB)
+        return jid; // only shell builtins, which already ran
+    if (jid < 0) {
+        fwprintf(stderr, L"bench: spawn_job returned %d for: %ls\n",
+                 jid, cmdline);
+        return jid;
+    }
+    if (!append_to_wait_handles(jobs[jid].proc_hs, job_n_procs_alive[jid])) {
+        print_err(L"bench_spawn -> append_to_wait_handles");
+        return -1;
+    }
+    return jid;
+}
+
+
+
+/**
+ * bench_reap
+ *
+ * Waits for one process (or in-process stage) in the wait set to exit and
+ * reaps it like the shell loop does. Records STAT_HIST_REAP.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the wait set is empty or
+ *               the wait or reap failed.
+ */
+BOOL bench_reap() {
+
+    // wait_handles[0] is cmdline_available_e, which nothing signals here
+    if (n_wait_handles <= 1)
+        return FALSE;
+    int32_t signaled_i = plat_wait_any(
+        wait_handles + 1,
+        n_wait_handles - 1,
+        PLAT_INFINITE
+    );
+    if (signaled_i < 0) {
+        print_err(L"bench_reap -> plat_wait_any");
+        return FALSE;
+    }
+
+    STAT_TIMER_START(reap_timer);
+    BOOL bool_rc = reap_proc(wait_handles[signaled_i + 1]);
+    STAT_TIMER_RECORD(STAT_HIST_REAP, reap_timer);
+    if (!bool_rc)
+        fwprintf(stderr, L"bench: reap_proc failed (not found)\n");
+    return bool_rc;
+}
+
+
+
+/**
+ * bench_run_fg
+ *
+ * Spawns a job and reaps until it's done, like a foreground job.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL bench_run_fg(const WCHAR *cmdline, HANDLE out_h) {
+
+    int32_t jid = bench_spawn(cmdline, out_h);
+    if (jid == SPAWNJOB_EMPTY_JOB)
+        return TRUE; // only shell builtins, already done
+    if (jid < 0)
+        return FALSE;
+    while (job_status[jid] == RUNNING) {
+        if (!bench_reap())
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * bench_env_int
+ *
+ * Return Value: Returns the environment variable name as a number, or
+ *               default_value if it isn't set to a positive one.
+ */
+int64_t bench_env_int(const WCHAR *name, int64_t default_value) {
+
+    WCHAR value[32];
+
+    DWORD len_value = GetEnvironmentVariableW(name, value, 32);
+    if (len_value == 0 || len_value >= 32)
+        return default_value;
+    int64_t n = (int64_t)wcstoll(value, NULL, 10);
+    return n > 0 ? n : default_value;
+}
+
+
+
+/**
+ * bench_make_file
+ *
+ * Creates (or truncates) a file at path and fills it with n_bytes of
+ * newline-terminated lines of text.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL bench_make_file(const WCHAR *path, int64_t n_bytes) {
+
+    static char chunk[MAKE_FILE_CHUNK];
+    DWORD bytes_written;
+
+    // 64-byte lines, so the chunk is whole lines
+    for (int32_t i = 0; i < MAKE_FILE_CHUNK; i++)
+        chunk[i] = i % 64 == 63 ? '\n' : (char)('a' + i % 26);
+
+    HANDLE file_h = CreateFileW(
+        path,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (file_h == INVALID_HANDLE_VALUE) {
+        print_err(L"bench_make_file -> CreateFileW");
+        return FALSE;
+    }
+
+    BOOL ok = TRUE;
+    for (int64_t off = 0; off < n_bytes && ok; off += bytes_written) {
+        DWORD n_to_write = n_bytes - off < MAKE_FILE_CHUNK
+                            ? (DWORD)(n_bytes - off)
+                            : MAKE_FILE_CHUNK;
+        ok = WriteFile(file_h, chunk, n_to_write, &bytes_written, NULL);
+    }
+    if (!ok)
+        print_err(L"bench_make_file -> WriteFile");
+    CloseHandle(file_h);
+    return ok;
+}
+
+
+
+/**
+ * bench_emit
+ *
+ * Writes one benchmark's result, a JSON object, as the next element of the
+ * results array.
+ */
+void bench_emit(out_stream_t *out, const WCHAR *json_object) {
+
+    out_stream_puts(out, n_results > 0 ? L",\n" : L"\n");
+    out_stream_puts(out, json_object);
+    n_results++;
+
+    // Results come slowly; show each one as soon as it's in
+    out_stream_flush(out);
+}
+
+
+
+/**
+ * bench_hist_json
+ *
+ * Formats a histogram as a JSON object with its count, p50, p99 and max.
+ *
+ * Return Value: Returns the number of WCHARs written to buf.
+ */
+int bench_hist_json(WCHAR *buf, int cap_buf, stat_hist_t hist) {
+
+    int len = _snwprintf(
+        buf,
+        cap_buf,
+        L"{\"count\":%lld,\"p50\":%lld,\"p99\":%lld,\"max\":%lld}",
+        (long long)stat_hists[hist].count,
+        (long long)stats_percentile(hist, 50),
+        (long long)stats_percentile(hist, 99),
+        (long long)stat_hists[hist].max
+    );
+    return len > 0 ? len : 0;
+}
+
+
+
+/**
+ * is_selected
+ *
+ * Return Value: Returns TRUE if the command line names the suite, or names
+ *               no suites at all.
+ */
+static BOOL is_selected(const WCHAR *cmd_line, const WCHAR *name) {
+
+    const WCHAR *arg_p = skip_whitespace(cmd_line);
+    if (*arg_p == L'\0')
+        return TRUE;
+
+    size_t len_name = wcslen(name);
+    while (*arg_p != L'\0') {
+        const WCHAR *arg_end_p = arg_end(arg_p);
+        if ((size_t)(arg_end_p - arg_p) == len_name
+             && wcsncmp(arg_p, name, len_name) == 0)
+            return TRUE;
+        arg_p = skip_whitespace(arg_end_p);
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * wWinMain
+ *
+ * Execution starts here.
+ */
+int WINAPI wWinMain(HINSTANCE hInstance,
+                    HINSTANCE hPrevInstance,
+                    PWSTR cmdLine,
+                    int nCmdShow) {
+
+    BOOL ok = TRUE;
+
+    if (init_winshell() != 0)
+        ExitProcess(1);
+
+    SECURITY_ATTRIBUTES sa = {
+        .nLength = sizeof(SECURITY_ATTRIBUTES),
+        .lpSecurityDescriptor = NULL,
+        .bInheritHandle = TRUE
+    };
+    bench_null_h = CreateFileW(
+        bench_null_path,
+        GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        &sa,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (bench_null_h == INVALID_HANDLE_VALUE) {
+        print_err(L"bench -> CreateFileW null device");
+        ExitProcess(1);
+    }
+
+    out_stream_t out;
+    out_stream_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    out_stream_puts(&out, L"{\"benchmarks\":[");
+
+    for (int32_t i = 0; i < N_SUITES && ok; i++) {
+        if (!is_selected(cmdLine, suites[i].name))
+            continue;
+        ok = suites[i].run(&out);
+        if (!ok)
+            fwprintf(stderr, L"bench: suite %ls failed\n", suites[i].name);
+    }
+
+    out_stream_puts(&out, L"\n]}\n");
+    out_stream_close(&out);
+    ExitProcess(ok ? 0 : 1);
+}
@@ -0,0 +1,220 @@
+
+/**
+ * bench.h
+ *
+ * The benchmark harness. It runs the shell's own spawn_job and reap loop
+ * (without the prompt or the cmdline reader thread) and writes what it
+ * measures as JSON. Each suite is a bench_suite_t in bench.c's suites
+ * table.
+ */
+
+
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+#include "_winshell_private.h"
+
+
+
+// The suites report the shell's own stats (histograms and counters)
+#ifdef WINSHELL_NO_STATS
+#error "bench: the benchmarks need stats - build without WINSHELL_NO_STATS"
+#endif
+
+
+
+/**
+ * bench_suite_t struct
+ *
+ * A named group of benchmarks.
+ */
+typedef struct _bench_suite {
+
+    /* name: Selects the suite on the command line. */
+    const WCHAR *name;
+
+    /* run: Runs the suite, writing a result with bench_emit for every
+            benchmark. Returns TRUE on success, FALSE on failure. */
+    BOOL (*run)(out_stream_t *out);
+
+} bench_suite_t;
+
+
+
+/* bench_null_h: The null device, opened for writing. Jobs that would print
+                 something are pointed at it. */
+extern HANDLE bench_null_h;
+
+/* bench_null_path: Name of the null device, for redirections to it. */
+extern const WCHAR *bench_null_path;
+
+
+
+/**
+ * bench_now_us
+ *
+ * Return Value: Returns a monotonic time in microseconds.
+ */
+int64_t bench_now_us();
+
+
+
+/**
+ * bench_spawn
+ *
+ * Spawns a job command line like the shell loop does: spawn_job, then its
+ * processes go into the wait set. Records STAT_HIST_SPAWN.
+ *
+ * out_h: Where the job's output goes unless it's redirected.
+ *
+ * Return Value: Returns the jid of the job, SPAWNJOB_EMPTY_JOB if the
+ *               cmdline only ran shell builtins, or another negative number
+ *               if spawn_job failed (reported on stderr).
+ */
+int32_t bench_spawn(const WCHAR *cmdline, HANDLE out_h);
+
+
+
+/**
+ * bench_reap
+ *
+ * Waits for one process (or in-process stage) in the wait set to exit and
+ * reaps it like the shell loop does. Records STAT_HIST_REAP.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the wait set is empty or
+ *               the wait or reap failed.
+ */
+BOOL bench_reap();
+
+
+
+/**
+ * bench_run_fg
+ *
+ * Spawns a job and reaps until it's done, like a foreground job.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL bench_run_fg(const WCHAR *cmdline, HANDLE out_h);
+
+
+
+/**
+ * bench_env_int
+ *
+ * Return Value: Returns the environment variable name as a number, or
+ *               default_value if it isn't set to a positive one.
+ */
+int64_t bench_env_int(const WCHAR *name, int64_t default_value);
+
+
+
+/**
+ * bench_make_file
+ *
+ * Creates (or truncates) a file at path and fills it with n_bytes of
+ * newline-terminated lines of text.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL bench_make_file(const WCHAR *path, int64_t n_bytes);
+
+
+
+/**
+ * bench_emit
+ *
+ * Writes one benchmark's result, a JSON object, as the next element of the
+ * results array.
+ */
+void bench_emit(out_stream_t *out, const WCHAR *json_object);
+
+
+
+/**
+ * bench_hist_json
+ *
+ * Formats a histogram as a JSON object with its count, p50, p99 and max.
+ *
+ * Return Value: Returns the number of WCHARs written to buf.
+ */
+int bench_hist_json(WCHAR *buf, int cap_buf, stat_hist_t hist);
+
+
+
+/**
+ * spawn_bench
+ *
+ * Spawn and reap throughput: pipeline length and background concurrency
+ * sweeps, with in-process builtins and with external programs.
+ */
+BOOL spawn_bench(out_stream_t *out);
+
+
+
+/**
+ * jobs_bench
+ *
+ * Lists a full job table with the jobs builtin, to the null device and to
+ * a file.
+ */
+BOOL jobs_bench(out_stream_t *out);
+
+
+
+/**
+ * jobs_pipe_bench
+ *
+ * Pipes a full job table listing into an external program, in UTF-8 and
+ * in UTF-16.
+ */
+BOOL jobs_pipe_bench(out_stream_t *out);
+
+
+
+/**
+ * relay_bench
+ *
+ * Bulk data through pipelines of cat stages, with their pipe edges direct
+ * and relayed (pipestat on).
+ */
+BOOL relay_bench(out_stream_t *out);
+
+
+
+/**
+ * script_bench
+ *
+ * A 100k-iteration compiled loop against the equivalent generated script.
+ */
+BOOL script_bench(out_stream_t *out);
+
+
+
+/**
+ * latency_bench
+ *
+ * Latency of trivial foreground jobs, in-process builtins against the
+ * external programs.
+ */
+BOOL latency_bench(out_stream_t *out);
+
+
+
+/**
+ * redir_bench
+ *
+ * Redirection throughput with a multi-GB file: input redirection, and
+ * output redirection that truncates, clobbers and appends.
+ */
+BOOL redir_bench(out_stream_t *out);
+
+
+
+// ifndef _BENCH_H
+#endif
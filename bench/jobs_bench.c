@@ -0,0 +1,251 @@
+
+/**
+ * jobs_bench.c
+ *
+ * The "jobs" suite: how long the jobs builtin takes to list a full job
+ * table. JOBS_BENCH_LIVE background jobs (in-process sleeps, so they cost
+ * no processes) are started, then "jobs" is run over and over with its
+ * output going to the null device and to a file.
+ *
+ * The "jobs_pipe" suite pipes the same listing into an external program,
+ * once in each output encoding, so the bytes each encoding puts through a
+ * pipe and the rate it gets there can be compared.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include "bench.h"
+
+
+
+/* JOBS_BENCH_LIVE: Live jobs listed by every "jobs". */
+#define JOBS_BENCH_LIVE 4096
+
+/* JOBS_BENCH_RUNS: Times "jobs" is run per target. */
+#define JOBS_BENCH_RUNS 200
+
+/* JOBS_PIPE_RUNS: Times "jobs | sink" is run per encoding. */
+#define JOBS_PIPE_RUNS 50
+
+/* RESULT_CAP: Capacity in WCHARs of one result object. */
+#define RESULT_CAP 512
+
+
+
+/**
+ * fill_jobs
+ *
+ * Starts n_jobs background jobs that stay alive until clear_jobs.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL fill_jobs(int32_t n_jobs) {
+
+    for (int32_t i = 0; i < n_jobs; i++) {
+        if (bench_spawn(L"sleep 3600 &", bench_null_h) < 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * clear_jobs
+ *
+ * Terminates every live job.
+ */
+static void clear_jobs() {
+
+    int32_t jid, next_jid;
+
+    for (jid = live_jobs_head; jid >= 0; jid = next_jid) {
+        next_jid = jobs[jid].next_live; // terminate_job unlinks the job
+        terminate_job(&jobs[jid]);
+    }
+}
+
+
+
+/**
+ * run_jobs
+ *
+ * Runs "jobs" JOBS_BENCH_RUNS times with cmdline (which redirects it) and
+ * reports the spawn_us histogram (parse plus the builtin) and the bytes
+ * written.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_jobs(out_stream_t *out, const WCHAR *target,
+                     const WCHAR *cmdline) {
+
+    WCHAR result[RESULT_CAP];
+
+    stats_reset();
+    int64_t started_us = bench_now_us();
+    for (int32_t i = 0; i < JOBS_BENCH_RUNS; i++) {
+        if (!bench_run_fg(cmdline, bench_null_h))
+            return FALSE;
+    }
+    double seconds = (bench_now_us() - started_us) / 1e6;
+
+    int64_t n_bytes = stat_counters[STAT_OUT_BYTES];
+    int len = _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"jobs\",\"target\":\"%ls\",\"live_jobs\":%d,"
+        L"\"runs\":%d,\"bytes_per_run\":%lld,\"mb_per_sec\":%.1f,"
+        L"\"jobs_us\":",
+        target,
+        JOBS_BENCH_LIVE,
+        JOBS_BENCH_RUNS,
+        (long long)(n_bytes / JOBS_BENCH_RUNS),
+        n_bytes / seconds / 1e6
+    );
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_SPAWN);
+    _snwprintf(result + len, RESULT_CAP - len, L"}");
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * pipe_sink
+ *
+ * Return Value: Returns the external program that "jobs" is piped into:
+ *               WINSHELL_BENCH_SINK if it's set, else a platform default
+ *               that reads all of its input.
+ */
+static const WCHAR *pipe_sink() {
+
+    static WCHAR sink[MAX_PATH + 1];
+
+    DWORD len_sink = GetEnvironmentVariableW(
+        L"WINSHELL_BENCH_SINK",
+        sink,
+        MAX_PATH + 1
+    );
+    if (len_sink > 0 && len_sink <= MAX_PATH)
+        return sink;
+#ifdef _WIN32
+    return L"C:\\Windows\\System32\\sort.exe";
+#else
+    return L"/usr/bin/wc -c";
+#endif
+}
+
+
+
+/**
+ * run_jobs_pipe
+ *
+ * Runs "jobs | sink" JOBS_PIPE_RUNS times with builtins writing encoding,
+ * and reports the bytes "jobs" put into the pipe, the rate they got
+ * through it (spawning and reaping the sink included) and the spawn_us
+ * histogram.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_jobs_pipe(out_stream_t *out, out_encoding_t encoding) {
+
+    WCHAR cmdline[MAX_PATH + 16];
+    WCHAR result[RESULT_CAP];
+
+    _snwprintf(cmdline, MAX_PATH + 16, L"jobs | %ls", pipe_sink());
+
+    out_encoding_t saved_encoding = redirected_out_encoding;
+    redirected_out_encoding = encoding;
+
+    stats_reset();
+    BOOL ok = TRUE;
+    int64_t started_us = bench_now_us();
+    for (int32_t i = 0; i < JOBS_PIPE_RUNS && ok; i++)
+        ok = bench_run_fg(cmdline, bench_null_h);
+    double seconds = (bench_now_us() - started_us) / 1e6;
+
+    redirected_out_encoding = saved_encoding;
+    if (!ok)
+        return FALSE;
+
+    // Only the builtin counts toward STAT_OUT_BYTES, not the sink
+    int64_t n_bytes = stat_counters[STAT_OUT_BYTES];
+    int len = _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"jobs_pipe\",\"encoding\":\"%ls\","
+        L"\"live_jobs\":%d,\"runs\":%d,\"bytes_per_run\":%lld,"
+        L"\"mb_per_sec\":%.1f,\"runs_per_sec\":%.1f,\"spawn_us\":",
+        encoding == OUT_ENC_UTF8 ? L"utf-8" : L"utf-16",
+        JOBS_BENCH_LIVE,
+        JOBS_PIPE_RUNS,
+        (long long)(n_bytes / JOBS_PIPE_RUNS),
+        n_bytes / seconds / 1e6,
+        JOBS_PIPE_RUNS / seconds
+    );
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_SPAWN);
+    _snwprintf(result + len, RESULT_CAP - len, L"}");
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * jobs_bench
+ *
+ * Lists a full job table with the jobs builtin, to the null device and to
+ * a file.
+ */
+BOOL jobs_bench(out_stream_t *out) {
+
+    WCHAR cmdline[MAX_PATH + 32];
+
+    if (!fill_jobs(JOBS_BENCH_LIVE)) {
+        clear_jobs();
+        return FALSE;
+    }
+
+    _snwprintf(cmdline, MAX_PATH + 32, L"jobs > %ls", bench_null_path);
+    BOOL ok = run_jobs(out, L"null", cmdline);
+
+    // A file is truncated by every run, so it never grows
+    if (ok)
+        ok = run_jobs(out, L"file", L"jobs > bench_jobs.txt");
+    DeleteFileW(L"bench_jobs.txt");
+
+    clear_jobs();
+    return ok;
+}
+
+
+
+/**
+ * jobs_pipe_bench
+ *
+ * Pipes a full job table listing into an external program, in UTF-8 and
+ * in UTF-16.
+ */
+BOOL jobs_pipe_bench(out_stream_t *out) {
+
+    if (!fill_jobs(JOBS_BENCH_LIVE)) {
+        clear_jobs();
+        return FALSE;
+    }
+
+    BOOL ok = run_jobs_pipe(out, OUT_ENC_UTF8);
+    if (ok)
+        ok = run_jobs_pipe(out, OUT_ENC_UTF16);
+
+    clear_jobs();
+    return ok;
+}
@@ -0,0 +1,240 @@
+
+/**
+ * latency_bench.c
+ *
+ * The "latency" suite: how long a foreground job of one trivial command
+ * takes, from spawn_job until it's reaped, when the command is an
+ * in-process builtin and when it's the external program of the same name
+ * (run by its full path, so it isn't taken for the builtin). The external
+ * programs are looked for in WINSHELL_BENCH_BIN, else a platform default;
+ * a command whose program isn't there is only run in-process.
+ *
+ * Per command: the in-process and external latency_us percentiles, and how
+ * many times faster the in-process p50 is.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+
+
+
+/* LATENCY_BENCH_RUNS: Jobs run per command each way. */
+#define LATENCY_BENCH_RUNS 500
+
+/* LATENCY_BENCH_FILE: Small file cat is run on. */
+#define LATENCY_BENCH_FILE L"bench_latency.txt"
+
+/* LATENCY_BENCH_FILE_BYTES: Size of LATENCY_BENCH_FILE. */
+#define LATENCY_BENCH_FILE_BYTES 4096
+
+/* RESULT_CAP: Capacity in WCHARs of one result object. */
+#define RESULT_CAP 512
+
+/* CMDLINE_CAP: Capacity in WCHARs of one command line. */
+#define CMDLINE_CAP (MAX_PATH + 64)
+
+#ifdef _WIN32
+#define BIN_SEP L"\\"
+#define BIN_EXT L".exe"
+#else
+#define BIN_SEP L"/"
+#define BIN_EXT L""
+#endif
+
+
+
+/**
+ * latency_cmd_t struct
+ *
+ * A command that's timed, as a builtin name and its arguments.
+ */
+typedef struct _latency_cmd {
+    const WCHAR *name;
+    const WCHAR *args;
+} latency_cmd_t;
+
+/* latency_cmds: Every command that's timed. */
+static const latency_cmd_t latency_cmds[] = {
+    { L"true", L"" },
+    { L"false", L"" },
+    { L"echo", L" hello" },
+    { L"printf", L" hello" },
+    { L"cat", L" " LATENCY_BENCH_FILE },
+    { L"sleep", L" 0" },
+    { L"env", L"" }
+};
+
+/* samples: Latency of every run of the command being timed. */
+static int64_t samples[LATENCY_BENCH_RUNS];
+
+
+
+/**
+ * bin_dir
+ *
+ * Return Value: Returns the directory the external programs are in:
+ *               WINSHELL_BENCH_BIN if it's set, else a platform default.
+ */
+static const WCHAR *bin_dir() {
+
+    static WCHAR dir[MAX_PATH + 1];
+
+    DWORD len_dir = GetEnvironmentVariableW(
+        L"WINSHELL_BENCH_BIN",
+        dir,
+        MAX_PATH + 1
+    );
+    if (len_dir > 0 && len_dir <= MAX_PATH)
+        return dir;
+#ifdef _WIN32
+    return L"C:\\Program Files\\Git\\usr\\bin";
+#else
+    return L"/usr/bin";
+#endif
+}
+
+
+
+/**
+ * compare_samples
+ *
+ * qsort comparison of two int64_t samples.
+ */
+static int compare_samples(const void *a, const void *b) {
+
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+/**
+ * time_cmdline
+ *
+ * Runs cmdline as a foreground job LATENCY_BENCH_RUNS times and formats
+ * the latencies as a JSON object with their count, p50, p99 and max.
+ *
+ * out_p50: p50 latency is placed here.
+ *
+ * Return Value: Returns the number of WCHARs written to buf, or -1 on
+ *               failure.
+ */
+static int time_cmdline(const WCHAR *cmdline, WCHAR *buf, int cap_buf,
+                        int64_t *out_p50) {
+
+    for (int32_t i = 0; i < LATENCY_BENCH_RUNS; i++) {
+        int64_t started_us = bench_now_us();
+        if (!bench_run_fg(cmdline, bench_null_h))
+            return -1;
+        samples[i] = bench_now_us() - started_us;
+    }
+    qsort(samples, LATENCY_BENCH_RUNS, sizeof(int64_t), compare_samples);
+
+    *out_p50 = samples[LATENCY_BENCH_RUNS / 2];
+    int len = _snwprintf(
+        buf,
+        cap_buf,
+        L"{\"count\":%d,\"p50\":%lld,\"p99\":%lld,\"max\":%lld}",
+        LATENCY_BENCH_RUNS,
+        (long long)*out_p50,
+        (long long)samples[LATENCY_BENCH_RUNS * 99 / 100],
+        (long long)samples[LATENCY_BENCH_RUNS - 1]
+    );
+    return len > 0 ? len : 0;
+}
+
+
+
+/**
+ * run_latency
+ *
+ * Times and reports one command, in-process and external.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_latency(out_stream_t *out, const latency_cmd_t *cmd) {
+
+    WCHAR cmdline[CMDLINE_CAP];
+    WCHAR app_path[MAX_PATH + 1];
+    WCHAR result[RESULT_CAP];
+    int64_t inproc_p50, external_p50;
+
+    int len = _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"latency\",\"command\":\"%ls\",\"inproc_us\":",
+        cmd->name
+    );
+
+    _snwprintf(cmdline, CMDLINE_CAP, L"%ls%ls", cmd->name, cmd->args);
+    int len_hist = time_cmdline(cmdline, result + len, RESULT_CAP - len,
+                                &inproc_p50);
+    if (len_hist < 0)
+        return FALSE;
+    len += len_hist;
+
+    _snwprintf(app_path, MAX_PATH + 1, L"%ls" BIN_SEP L"%ls" BIN_EXT,
+               bin_dir(), cmd->name);
+    if (GetFileAttributesW(app_path) == INVALID_FILE_ATTRIBUTES) {
+        fwprintf(stderr, L"bench: no %ls, %ls only runs in-process\n",
+                 app_path, cmd->name);
+        _snwprintf(result + len, RESULT_CAP - len,
+                   L",\"external_us\":null}");
+        bench_emit(out, result);
+        return TRUE;
+    }
+
+    len += _snwprintf(result + len, RESULT_CAP - len, L",\"external_us\":");
+    _snwprintf(cmdline, CMDLINE_CAP, L"\"%ls\"%ls", app_path, cmd->args);
+    len_hist = time_cmdline(cmdline, result + len, RESULT_CAP - len,
+                            &external_p50);
+    if (len_hist < 0)
+        return FALSE;
+    len += len_hist;
+
+    _snwprintf(
+        result + len,
+        RESULT_CAP - len,
+        L",\"p50_speedup\":%.1f}",
+        (double)external_p50 / (inproc_p50 > 0 ? inproc_p50 : 1)
+    );
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * latency_bench
+ *
+ * Latency of trivial foreground jobs, in-process builtins against the
+ * external programs.
+ */
+BOOL latency_bench(out_stream_t *out) {
+
+    if (!bench_make_file(LATENCY_BENCH_FILE, LATENCY_BENCH_FILE_BYTES)) {
+        DeleteFileW(LATENCY_BENCH_FILE);
+        return FALSE;
+    }
+
+    BOOL ok = TRUE;
+    for (int32_t i = 0;
+          i < (int32_t)(sizeof(latency_cmds) / sizeof(*latency_cmds)) && ok;
+          i++) {
+        ok = run_latency(out, &latency_cmds[i]);
+    }
+
+    DeleteFileW(LATENCY_BENCH_FILE);
+    return ok;
+}
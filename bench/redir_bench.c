@@ -0,0 +1,191 @@
+
+/**
+ * redir_bench.c
+ *
+ * The "redir" suite: file redirection throughput with multi-GB files. A
+ * REDIR_BENCH_MB (WINSHELL_BENCH_REDIR_MB) megabyte file is copied by an
+ * in-process cat with "<" to the null device, then to a file with ">>"
+ * (append), ">" (truncate) and ">|" (truncate), REDIR_BENCH_RUNS times
+ * each. The output file's size is checked after every mode, so a
+ * truncation that leaves a stale tail (or an append that doesn't) fails
+ * the suite rather than reporting a number.
+ *
+ * Per mode: MB/s and the output file's size.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include "bench.h"
+
+
+
+/* REDIR_BENCH_MB: Megabytes in the input file by default. */
+#define REDIR_BENCH_MB 2048
+
+/* REDIR_BENCH_RUNS: Times each mode is run. */
+#define REDIR_BENCH_RUNS 2
+
+/* REDIR_BENCH_IN, REDIR_BENCH_OUT: Input and output files. */
+#define REDIR_BENCH_IN L"bench_redir_in.dat"
+#define REDIR_BENCH_OUT L"bench_redir_out.dat"
+
+/* RESULT_CAP: Capacity in WCHARs of one result object. */
+#define RESULT_CAP 512
+
+/* CMDLINE_CAP: Capacity in WCHARs of one command line. */
+#define CMDLINE_CAP 256
+
+
+
+/**
+ * redir_mode_t struct
+ *
+ * A way of redirecting cat's output.
+ */
+typedef struct _redir_mode {
+
+    /* name: Name of the mode in the results. */
+    const WCHAR *name;
+
+    /* op: Redirection operator. */
+    const WCHAR *op;
+
+    /* to_null: Does it go to the null device rather than REDIR_BENCH_OUT? */
+    BOOL to_null;
+
+    /* is_append: Does every run add to the file (rather than replace it)? */
+    BOOL is_append;
+
+} redir_mode_t;
+
+/* redir_modes: Every mode, in the order they run. The truncating ones run
+                over the bigger file the appending one left. */
+static const redir_mode_t redir_modes[] = {
+    { L"null", L">", TRUE, FALSE },
+    { L"append", L">>", FALSE, TRUE },
+    { L"truncate", L">", FALSE, FALSE },
+    { L"clobber", L">|", FALSE, FALSE }
+};
+
+
+
+/**
+ * file_size
+ *
+ * Return Value: Returns the size of the file at path in bytes, or -1 if it
+ *               can't be opened.
+ */
+static int64_t file_size(const WCHAR *path) {
+
+    LARGE_INTEGER size;
+
+    HANDLE file_h = CreateFileW(
+        path,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (file_h == INVALID_HANDLE_VALUE)
+        return -1;
+    BOOL ok = GetFileSizeEx(file_h, &size);
+    CloseHandle(file_h);
+    return ok ? size.QuadPart : -1;
+}
+
+
+
+/**
+ * run_redir
+ *
+ * Runs and reports one mode.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (or if the output
+ *               file ended up the wrong size).
+ */
+static BOOL run_redir(out_stream_t *out, const redir_mode_t *mode,
+                      int64_t n_mb) {
+
+    WCHAR cmdline[CMDLINE_CAP];
+    WCHAR result[RESULT_CAP];
+    WCHAR out_bytes_json[24] = L"null";
+
+    _snwprintf(cmdline, CMDLINE_CAP, L"cat < %ls %ls %ls", REDIR_BENCH_IN,
+               mode->op, mode->to_null ? bench_null_path : REDIR_BENCH_OUT);
+
+    // Appending starts from nothing
+    if (mode->is_append)
+        DeleteFileW(REDIR_BENCH_OUT);
+
+    int64_t started_us = bench_now_us();
+    for (int32_t i = 0; i < REDIR_BENCH_RUNS; i++) {
+        if (!bench_run_fg(cmdline, bench_null_h))
+            return FALSE;
+    }
+    double seconds = (bench_now_us() - started_us) / 1e6;
+
+    if (!mode->to_null) {
+        int64_t expected_bytes = (n_mb << 20)
+                                  * (mode->is_append ? REDIR_BENCH_RUNS : 1);
+        int64_t out_bytes = file_size(REDIR_BENCH_OUT);
+        if (out_bytes != expected_bytes) {
+            fwprintf(stderr, L"bench: %ls left %lld bytes, not %lld\n",
+                     cmdline, (long long)out_bytes,
+                     (long long)expected_bytes);
+            return FALSE;
+        }
+        _snwprintf(out_bytes_json, 24, L"%lld", (long long)out_bytes);
+    }
+
+    _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"redir\",\"mode\":\"%ls\",\"op\":\"%ls\",\"mb\":%lld,"
+        L"\"runs\":%d,\"seconds\":%.3f,\"mb_per_sec\":%.1f,"
+        L"\"out_bytes\":%ls}",
+        mode->name,
+        mode->op,
+        (long long)n_mb,
+        REDIR_BENCH_RUNS,
+        seconds,
+        (double)n_mb * REDIR_BENCH_RUNS / seconds,
+        out_bytes_json
+    );
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * redir_bench
+ *
+ * Redirection throughput with a multi-GB file: input redirection, and
+ * output redirection that truncates, clobbers and appends.
+ */
+BOOL redir_bench(out_stream_t *out) {
+
+    int64_t n_mb = bench_env_int(L"WINSHELL_BENCH_REDIR_MB", REDIR_BENCH_MB);
+    BOOL ok = bench_make_file(REDIR_BENCH_IN, n_mb << 20);
+
+    for (int32_t i = 0;
+          i < (int32_t)(sizeof(redir_modes) / sizeof(*redir_modes)) && ok;
+          i++) {
+        ok = run_redir(out, &redir_modes[i], n_mb);
+    }
+
+    DeleteFileW(REDIR_BENCH_IN);
+    DeleteFileW(REDIR_BENCH_OUT);
+    return ok;
+}
@@ -0,0 +1,142 @@
+
+/**
+ * relay_bench.c
+ *
+ * The "relay" suite: what pipestat's relays cost. A file of RELAY_BENCH_MB
+ * (WINSHELL_BENCH_RELAY_MB) megabytes is pushed through pipelines of cat
+ * stages (in-process, so the pipes are what's measured) to the null device,
+ * first with direct pipe edges and then with every edge relayed.
+ *
+ * Per pipeline length: MB/s both ways and the relayed run's overhead.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include "bench.h"
+
+
+
+/* RELAY_BENCH_MB: Megabytes pushed through each pipeline by default. */
+#define RELAY_BENCH_MB 256
+
+/* RELAY_BENCH_RUNS: Times each pipeline is run each way. */
+#define RELAY_BENCH_RUNS 3
+
+/* RELAY_BENCH_FILE: File the first stage reads. */
+#define RELAY_BENCH_FILE L"bench_relay.dat"
+
+/* RESULT_CAP: Capacity in WCHARs of one result object. */
+#define RESULT_CAP 512
+
+/* CMDLINE_CAP: Capacity in WCHARs of a pipeline's cmdline. */
+#define CMDLINE_CAP 512
+
+/* pipeline_lens: Stages per pipeline (one pipe edge fewer). */
+static const int32_t pipeline_lens[] = { 2, 4, 8 };
+
+
+
+/**
+ * time_pipeline
+ *
+ * Runs cmdline RELAY_BENCH_RUNS times in the foreground with pipe edges
+ * relayed or not.
+ *
+ * Return Value: Returns the seconds it took, or a negative number on
+ *               failure.
+ */
+static double time_pipeline(const WCHAR *cmdline, BOOL is_relayed) {
+
+    BOOL saved_relay_enabled = pipe_relay_enabled;
+    pipe_relay_enabled = is_relayed;
+
+    BOOL ok = TRUE;
+    int64_t started_us = bench_now_us();
+    for (int32_t i = 0; i < RELAY_BENCH_RUNS && ok; i++)
+        ok = bench_run_fg(cmdline, bench_null_h);
+    double seconds = (bench_now_us() - started_us) / 1e6;
+
+    pipe_relay_enabled = saved_relay_enabled;
+    return ok ? seconds : -1.0;
+}
+
+
+
+/**
+ * run_relay
+ *
+ * Runs and reports one pipeline length, direct and relayed.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_relay(out_stream_t *out, int32_t n_stages, int64_t n_mb) {
+
+    WCHAR cmdline[CMDLINE_CAP];
+    WCHAR result[RESULT_CAP];
+
+    int len = _snwprintf(cmdline, CMDLINE_CAP, L"cat %ls", RELAY_BENCH_FILE);
+    for (int32_t i = 1; i < n_stages; i++)
+        len += _snwprintf(cmdline + len, CMDLINE_CAP - len, L" | cat");
+    _snwprintf(cmdline + len, CMDLINE_CAP - len, L" > %ls", bench_null_path);
+
+    double direct_seconds = time_pipeline(cmdline, FALSE);
+    if (direct_seconds < 0)
+        return FALSE;
+    double relayed_seconds = time_pipeline(cmdline, TRUE);
+    if (relayed_seconds < 0)
+        return FALSE;
+
+    double n_mb_moved = (double)n_mb * RELAY_BENCH_RUNS;
+    _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"relay\",\"stages\":%d,\"edges\":%d,\"mb\":%lld,"
+        L"\"runs\":%d,\"direct_mb_per_sec\":%.1f,"
+        L"\"relayed_mb_per_sec\":%.1f,\"overhead_pct\":%.1f}",
+        n_stages,
+        n_stages - 1,
+        (long long)n_mb,
+        RELAY_BENCH_RUNS,
+        n_mb_moved / direct_seconds,
+        n_mb_moved / relayed_seconds,
+        (relayed_seconds / direct_seconds - 1) * 100
+    );
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * relay_bench
+ *
+ * Bulk data through pipelines of cat stages, with their pipe edges direct
+ * and relayed (pipestat on).
+ */
+BOOL relay_bench(out_stream_t *out) {
+
+    int64_t n_mb = bench_env_int(L"WINSHELL_BENCH_RELAY_MB", RELAY_BENCH_MB);
+    if (!bench_make_file(RELAY_BENCH_FILE, n_mb << 20)) {
+        DeleteFileW(RELAY_BENCH_FILE);
+        return FALSE;
+    }
+
+    BOOL ok = TRUE;
+    for (int32_t i = 0;
+          i < (int32_t)(sizeof(pipeline_lens) / sizeof(*pipeline_lens)) && ok;
+          i++) {
+        ok = run_relay(out, pipeline_lens[i], n_mb);
+    }
+
+    DeleteFileW(RELAY_BENCH_FILE);
+    return ok;
+}
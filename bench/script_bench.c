@@ -0,0 +1,177 @@
+
+/**
+ * script_bench.c
+ *
+ * The "script" suite: a compiled loop against the script a generator would
+ * have written for it. Five nested for-loops over 0..9 run
+ *
+ *     true $a$b$c$d$e
+ *
+ * SCRIPT_BENCH_ITERS times from one compiled chunk. The generated script is
+ * the same SCRIPT_BENCH_ITERS lines with the digits already in them
+ * ("true 00000" ... "true 99999"), each fed and run on its own like lines
+ * read from a file. Both are fed to script_feed, and their foreground jobs
+ * reaped, just like the shell loop does.
+ *
+ * Per variant: seconds, iterations per second, and the parse_us and
+ * spawn_us histograms.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include "bench.h"
+
+
+
+/* SCRIPT_BENCH_DEPTH: Nested loops over 0..9. */
+#define SCRIPT_BENCH_DEPTH 5
+
+/* SCRIPT_BENCH_ITERS: Iterations of the innermost loop (10 ^ DEPTH). */
+#define SCRIPT_BENCH_ITERS 100000
+
+/* RESULT_CAP: Capacity in WCHARs of one result object. */
+#define RESULT_CAP 1024
+
+/* LINE_CAP: Capacity in WCHARs of one script line. */
+#define LINE_CAP 64
+
+/* loop_vars: Variable of each nested loop, outermost first. */
+static const WCHAR *loop_vars[SCRIPT_BENCH_DEPTH] = {
+    L"a", L"b", L"c", L"d", L"e"
+};
+
+
+
+/**
+ * run_line
+ *
+ * Feeds a line to the script compiler, then reaps and resumes until the
+ * statements it completed have run.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_line(const WCHAR *line) {
+
+    int32_t fg_jid = script_feed(line);
+    while (fg_jid >= 0) {
+        while (job_status[fg_jid] == RUNNING) {
+            if (!bench_reap())
+                return FALSE;
+        }
+        const completion_t *record =
+            &completions[(n_completions - 1) % COMPLETIONS_CAP];
+        fg_jid = script_resume(
+            record->jid == fg_jid ? record->exit_code : 0
+        );
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * run_loop
+ *
+ * Feeds the nested loops, which run once the outermost "done" is in.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_loop() {
+
+    WCHAR line[LINE_CAP];
+
+    for (int32_t i = 0; i < SCRIPT_BENCH_DEPTH; i++) {
+        _snwprintf(line, LINE_CAP, L"for %ls in 0 1 2 3 4 5 6 7 8 9; do",
+                   loop_vars[i]);
+        if (!run_line(line))
+            return FALSE;
+    }
+    if (!run_line(L"true $a$b$c$d$e"))
+        return FALSE;
+    for (int32_t i = 0; i < SCRIPT_BENCH_DEPTH; i++) {
+        if (!run_line(L"done"))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * run_generated
+ *
+ * Feeds the generated script, one line per iteration.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_generated() {
+
+    WCHAR line[LINE_CAP];
+
+    for (int32_t i = 0; i < SCRIPT_BENCH_ITERS; i++) {
+        _snwprintf(line, LINE_CAP, L"true %0*d", SCRIPT_BENCH_DEPTH, i);
+        if (!run_line(line))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * run_script
+ *
+ * Runs and reports one variant.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_script(out_stream_t *out, const WCHAR *variant,
+                       BOOL (*run)()) {
+
+    WCHAR result[RESULT_CAP];
+
+    stats_reset();
+    int64_t started_us = bench_now_us();
+    if (!run())
+        return FALSE;
+    double seconds = (bench_now_us() - started_us) / 1e6;
+
+    int len = _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"script\",\"variant\":\"%ls\",\"iterations\":%d,"
+        L"\"seconds\":%.3f,\"iterations_per_sec\":%.1f,\"parse_us\":",
+        variant,
+        SCRIPT_BENCH_ITERS,
+        seconds,
+        SCRIPT_BENCH_ITERS / seconds
+    );
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_PARSE);
+    len += _snwprintf(result + len, RESULT_CAP - len, L",\"spawn_us\":");
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_SPAWN);
+    _snwprintf(result + len, RESULT_CAP - len, L"}");
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * script_bench
+ *
+ * A 100k-iteration compiled loop against the equivalent generated script.
+ */
+BOOL script_bench(out_stream_t *out) {
+
+    return run_script(out, L"loop", run_loop)
+            && run_script(out, L"generated", run_generated);
+}
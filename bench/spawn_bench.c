@@ -0,0 +1,208 @@
+
+/**
+ * spawn_bench.c
+ *
+ * The "spawn" suite: how fast jobs are started and retired. Every job is a
+ * background pipeline of do-nothing stages ("true", in-process, or an
+ * external program that exits right away), and up to a set number of them
+ * are kept outstanding (spawned but not yet reaped) - as fast as the shell
+ * can spawn one, reap one, spawn the next.
+ *
+ * Per run: jobs and processes per second, and the spawn_us (whole
+ * spawn_job), start_us (spawn_job to the first stage started) and reap_us
+ * (one reap_proc) histograms.
+ */
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include "bench.h"
+
+
+
+/* SPAWN_BENCH_PROCS: Roughly how many processes (stages) a run starts. */
+#define SPAWN_BENCH_PROCS 4096
+
+/* SPAWN_BENCH_MIN_JOBS: Fewest jobs a run spawns, however long they are. */
+#define SPAWN_BENCH_MIN_JOBS 16
+
+/* RESULT_CAP: Capacity in WCHARs of one result object. */
+#define RESULT_CAP 1024
+
+/* pipeline_lens: Stages per job in the pipeline length sweep (one job
+                  outstanding). */
+static const int32_t pipeline_lens[] = { 1, 2, 4, 16, 64, 256 };
+
+/* concurrencies: Jobs outstanding in the concurrency sweep (one stage per
+                  job). A Win32 wait takes at most MAXIMUM_WAIT_OBJECTS
+                  handles, so the larger ones only run on Linux. */
+static const int32_t concurrencies[] = { 1, 10, 100, 1000, 4000 };
+
+
+
+/**
+ * external_true
+ *
+ * Return Value: Returns the external program that stands in for "true":
+ *               WINSHELL_BENCH_TRUE if it's set, else a platform default.
+ */
+static const WCHAR *external_true() {
+
+    static WCHAR path[MAX_PATH + 1];
+
+    DWORD len_path = GetEnvironmentVariableW(
+        L"WINSHELL_BENCH_TRUE",
+        path,
+        MAX_PATH + 1
+    );
+    if (len_path > 0 && len_path <= MAX_PATH)
+        return path;
+#ifdef _WIN32
+    return L"C:\\Windows\\System32\\whoami.exe";
+#else
+    return L"/bin/true";
+#endif
+}
+
+
+
+/**
+ * build_cmdline
+ *
+ * Writes a background job of n_stages stages of stage piped together to
+ * cmdline.
+ *
+ * Return Value: Returns TRUE on success, FALSE if it doesn't fit.
+ */
+static BOOL build_cmdline(WCHAR *cmdline, size_t cap_cmdline,
+                          const WCHAR *stage, int32_t n_stages) {
+
+    size_t len_stage = wcslen(stage);
+    size_t len_cmdline = 0;
+
+    for (int32_t i = 0; i < n_stages; i++) {
+        if (len_cmdline + len_stage + 4 >= cap_cmdline)
+            return FALSE;
+        if (i > 0) {
+            wcscpy(cmdline + len_cmdline, L" | ");
+            len_cmdline += 3;
+        }
+        wcscpy(cmdline + len_cmdline, stage);
+        len_cmdline += len_stage;
+    }
+    wcscpy(cmdline + len_cmdline, L" &");
+    return TRUE;
+}
+
+
+
+/**
+ * run_spawn
+ *
+ * Runs and reports one combination: n_jobs jobs of n_stages stages each,
+ * at most concurrency of them outstanding at a time.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_spawn(out_stream_t *out, BOOL is_external,
+                      int32_t n_stages, int32_t concurrency) {
+
+    static WCHAR cmdline[MAX_CMDLINE + 1];
+    WCHAR result[RESULT_CAP];
+
+    const WCHAR *stage = is_external ? external_true() : L"true";
+    if (!build_cmdline(cmdline, MAX_CMDLINE + 1, stage, n_stages)) {
+        fwprintf(stderr, L"bench: %d stages don't fit a cmdline\n",
+                 n_stages);
+        return FALSE;
+    }
+
+    int32_t n_jobs = SPAWN_BENCH_PROCS / n_stages;
+    if (n_jobs < SPAWN_BENCH_MIN_JOBS)
+        n_jobs = SPAWN_BENCH_MIN_JOBS;
+    if (n_jobs < 2 * concurrency)
+        n_jobs = 2 * concurrency;
+
+    stats_reset();
+    int64_t n_done_before = n_completions;
+    int32_t n_spawned = 0;
+    int64_t started_us = bench_now_us();
+
+    while (n_completions - n_done_before < n_jobs) {
+        while (n_spawned < n_jobs
+                && n_spawned - (n_completions - n_done_before)
+                    < concurrency) {
+            if (bench_spawn(cmdline, bench_null_h) < 0)
+                return FALSE;
+            n_spawned++;
+        }
+        if (!bench_reap())
+            return FALSE;
+    }
+
+    double seconds = (bench_now_us() - started_us) / 1e6;
+    int len = _snwprintf(
+        result,
+        RESULT_CAP,
+        L"{\"suite\":\"spawn\",\"kind\":\"%ls\",\"stages\":%d,"
+        L"\"concurrency\":%d,\"jobs\":%d,\"seconds\":%.3f,"
+        L"\"jobs_per_sec\":%.1f,\"procs_per_sec\":%.1f,\"spawn_us\":",
+        is_external ? L"external" : L"builtin",
+        n_stages,
+        concurrency,
+        n_jobs,
+        seconds,
+        n_jobs / seconds,
+        (double)n_jobs * n_stages / seconds
+    );
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_SPAWN);
+    len += _snwprintf(result + len, RESULT_CAP - len, L",\"start_us\":");
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_START);
+    len += _snwprintf(result + len, RESULT_CAP - len, L",\"reap_us\":");
+    len += bench_hist_json(result + len, RESULT_CAP - len, STAT_HIST_REAP);
+    _snwprintf(result + len, RESULT_CAP - len, L"}");
+    bench_emit(out, result);
+    return TRUE;
+}
+
+
+
+/**
+ * spawn_bench
+ *
+ * Spawn and reap throughput: pipeline length and background concurrency
+ * sweeps, with in-process builtins and with external programs.
+ */
+BOOL spawn_bench(out_stream_t *out) {
+
+    for (int is_external = 0; is_external <= 1; is_external++) {
+
+        for (int32_t i = 0;
+              i < (int32_t)(sizeof(pipeline_lens) / sizeof(*pipeline_lens));
+              i++) {
+            if (!run_spawn(out, is_external, pipeline_lens[i], 1))
+                return FALSE;
+        }
+
+        // The concurrency sweep's first run is the sweep above's first one
+        for (int32_t i = 1;
+              i < (int32_t)(sizeof(concurrencies) / sizeof(*concurrencies));
+              i++) {
+#ifdef _WIN32
+            if (concurrencies[i] >= MAXIMUM_WAIT_OBJECTS)
+                break;
+#endif
+            if (!run_spawn(out, is_external, 1, concurrencies[i]))
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
@@ -6,24 +6,43 @@
 
 
 #include <windows.h>
+#include <wchar.h>
 #include <iso646.h>
 #include "_winshell_private.h"
 
 
 
+/**
+ * cd_err
+ * 
+ * Writes a cd error message to stderr.
+ * 
+ * Return Value: Returns TRUE on success. Returns FALSE on failure.
+ */
+static BOOL cd_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, message);
+    return out_stream_close(&err);
+}
+
+
+
 /**
  * cd_builtin
  * 
- * Changes the current working directory.
+ * Changes the shell's working directory (shell_cwd). The process's current
+ * directory is left alone.
  * 
  * parsed_proc: Contains information about command line that called this 
  *              builtin. The directory to move to will be extracted from this.
- * startup_info: Contains I/O redirection information. Not used.
+ * stdio: Standard streams after I/O redirection. Not used.
  * 
  * Return Value: Returns TRUE on success. Returns FALSE on failure.
  */
 BOOL cd_builtin(parsed_process_t *parsed_proc, 
-                STARTUPINFO *startup_info) {
+                stdio_handles_t *stdio) {
 
     BOOL bool_rc;
     WCHAR my_new_dir[MAX_PATH + 1];
@@ -34,15 +53,9 @@ BOOL cd_builtin(parsed_process_t *parsed_proc,
 
     // Directory not provided
     if (new_dir_end_p == new_dir_p) {
-        bool_rc = WriteConsoleW(
-            GetStdHandle(STD_ERROR_HANDLE),
-            L"directory not provided\n",
-            wcslen(L"directory not provided\n"),
-            NULL,
-            NULL
-        );
+        bool_rc = cd_err(L"directory not provided\n");
         if (not bool_rc) {
-            print_err(L"cd_builtin -> WriteConsoleW");
+            print_err(L"cd_builtin -> cd_err");
             return FALSE;
         }
         return FALSE;
@@ -52,15 +65,9 @@ BOOL cd_builtin(parsed_process_t *parsed_proc,
 
     // Directory is too long
     if (len_new_dir > MAX_PATH) {
-        bool_rc = WriteConsoleW(
-            GetStdHandle(STD_ERROR_HANDLE),
-            L"directory too long\n",
-            wcslen(L"directory too long\n"),
-            NULL,
-            NULL
-        );
+        bool_rc = cd_err(L"directory too long\n");
         if (not bool_rc) {
-            print_err(L"cd_builtin -> WriteConsoleW");
+            print_err(L"cd_builtin -> cd_err");
             return FALSE;
         }
         return FALSE;
@@ -74,25 +81,14 @@ BOOL cd_builtin(parsed_process_t *parsed_proc,
     );
     my_new_dir[len_new_dir] = L'\0';
     
-    bool_rc = SetCurrentDirectoryW(my_new_dir);
-    if (not bool_rc 
-         and (GetLastError() == ERROR_INVALID_NAME 
-               or GetLastError() == ERROR_FILE_NOT_FOUND)) {
-        bool_rc = WriteConsoleW(
-            GetStdHandle(STD_ERROR_HANDLE),
-            L"Directory not found\n",
-            wcslen(L"Directory not found\n"),
-            NULL,
-            NULL
-        );
-        if (not bool_rc) {
-            print_err(L"cd_builtin -> WriteConsoleW");
-            return FALSE;
-        }
-    }
-    else if (not bool_rc) {
-        print_err(L"cd_builtin -> SetCurrentDirectoryW");
-        return FALSE;
+    // Only the shell's state changes: jobs are started in a copy of it.
+    // Inside a (cd DIR; ...) scope, the shell's directory stays put.
+    WCHAR full_dir[MAX_PATH + 1];
+    if (not find_dir(parsed_proc->cwd, my_new_dir, full_dir))
+        return TRUE;
+    if (parsed_proc->cwd == shell_cwd) {
+        wcscpy(shell_cwd, full_dir);
+        forget_app_paths(); // SearchPathW looks in the working directory
     }
 
     return TRUE;
@@ -17,9 +17,27 @@ HANDLE cmdline_reader_thread_h;
 
 
 
-/* cmdline: Contains a line read from stdin waiting to be read by the job 
-            spawner thread. */
-WCHAR cmdline[MAX_CMDLINE + 1];
+/* stdin_is_console: TRUE if stdin is a console, FALSE if it's a pipe or a
+                     file. Set once by init_winshell. */
+BOOL stdin_is_console;
+
+
+
+/* cmdline_batch: Contains one or more NULL-terminated lines read from stdin,
+                  stored back to back, waiting to be read by the job spawner
+                  thread. */
+WCHAR cmdline_batch[CMDLINE_BATCH_CAP];
+
+/* len_cmdline_batch: Number of WCHARs used in cmdline_batch (including the
+                      NULL terminators). */
+int32_t len_cmdline_batch;
+
+/* n_cmdline_batch: Number of lines in cmdline_batch. */
+int32_t n_cmdline_batch;
+
+/* cmdline_eof: Set by the reader thread once stdin has no more lines. The
+                batch it's set with may still contain lines. */
+BOOL cmdline_eof;
 
 /* cmdline_consumed_e: After reading and setting cmdline, the reader thread
                        will wait on this condition before reading another line.
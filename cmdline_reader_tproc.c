@@ -10,6 +10,30 @@
 
 
 
+/* CTRL_R: What ReadConsoleW reads for Ctrl+R. */
+#define CTRL_R L'\x12'
+
+
+
+/**
+ * back_search_t struct
+ *
+ * A reverse incremental history search (Ctrl+R) on the line being typed.
+ */
+typedef struct _back_search {
+
+    /* query: Text searched for - the line as it was when the search began. */
+    WCHAR query[MAX_CMDLINE + 1];
+    int32_t len_query;
+
+    /* match_id: Entry the line was replaced with by the last step, -1 if 
+                 none. */
+    int32_t match_id;
+
+} back_search_t;
+
+
+
 /* exited: FALSE while shell is running, TRUE when the shell is exiting (and
            cmdline reader thread needs to terminated). */
 BOOL exited = FALSE;
@@ -24,15 +48,195 @@ HANDLE exited_e;
 
 
 
+/**
+ * redraw_line
+ * 
+ * Redraws the line being typed after a Tab completion. Ambiguous matches are
+ * listed on their own line first.
+ * 
+ * line: Line being typed (not NULL-terminated).
+ * len_line: Number of WCHARs in line.
+ * candidates: Listing of matches, or NULL if nothing was listed.
+ */
+static void redraw_line(const WCHAR *line, int32_t len_line,
+                        const out_stream_t *candidates) {
+
+    out_stream_t out;
+    out_stream_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    if (candidates != NULL) {
+        out_stream_write(&out, L"\n", 1);
+        out_stream_write(&out, candidates->buf, candidates->len);
+        out_stream_write(&out, L"\n", 1);
+    }
+    out_stream_write(&out, L"\r", 1);
+    out_stream_puts(&out, PROMPT);
+    out_stream_write(&out, line, len_line);
+    out_stream_close(&out);
+}
+
+
+
+/**
+ * search_back
+ *
+ * Handles Ctrl+R: the newest history entry containing the text typed so far
+ * replaces the line. Ctrl+R again, with the match left as it is, goes on to
+ * the next older entry containing the same text. The search is shown above 
+ * the redrawn line.
+ *
+ * in_out_len_line: Length of the line in cmdline_batch. Updated.
+ * search: Search state, kept across the Ctrl+Rs of a line.
+ */
+static void search_back(int32_t *in_out_len_line, back_search_t *search) {
+
+    int32_t len_line = *in_out_len_line;
+    int32_t len_entry;
+    int32_t before_id;
+
+    const WCHAR *entry = history_entry(search->match_id, &len_entry);
+    if (entry != NULL && len_entry == len_line 
+         && wmemcmp(entry, cmdline_batch, len_line) == 0) {
+        before_id = search->match_id;
+    }
+    else {
+        memcpy(search->query, cmdline_batch, len_line * sizeof(WCHAR));
+        search->len_query = len_line;
+        before_id = history_count();
+    }
+
+    out_stream_t status;
+    out_stream_init(&status, GetStdHandle(STD_OUTPUT_HANDLE));
+    int32_t id = history_search_older(search->query, search->len_query, 
+                                      before_id);
+    entry = history_entry(id, &len_entry);
+    if (entry != NULL && len_entry < MAX_CMDLINE) {
+        memcpy(cmdline_batch, entry, len_entry * sizeof(WCHAR));
+        *in_out_len_line = len_entry;
+        search->match_id = id;
+        out_stream_puts(&status, L"(reverse-i-search)`");
+    }
+    else {
+        out_stream_puts(&status, L"(failed reverse-i-search)`");
+    }
+    out_stream_write(&status, search->query, search->len_query);
+    out_stream_puts(&status, L"'");
+
+    redraw_line(cmdline_batch, *in_out_len_line, &status);
+    status.len = 0; // already shown by redraw_line
+    out_stream_close(&status);
+}
+
+
+
+/**
+ * read_console_line
+ *
+ * Reads a single line from the console into cmdline_batch.
+ * The read wakes up on Tab: the word before the cursor is completed, the line
+ * is redrawn and the read continues with the completed text already typed.
+ * It also wakes up on Ctrl+R, to search the history (see search_back).
+ *
+ * Note: The caller must hold cmdline_lock.
+ *
+ * stdin_h: HANDLE to the console input.
+ */
+static void read_console_line(HANDLE stdin_h) {
+
+    BOOL bool_rc;
+    DWORD wchars_read;
+    static back_search_t search;
+
+    CONSOLE_READCONSOLE_CONTROL read_control = {
+        .nLength = sizeof(CONSOLE_READCONSOLE_CONTROL),
+        .nInitialChars = 0,
+        .dwCtrlWakeupMask = 1 << L'\t' | 1 << CTRL_R,
+        .dwControlKeyState = 0
+    };
+    search.match_id = -1;
+
+    while (TRUE) {
+
+        bool_rc = ReadConsoleW(
+            stdin_h,
+            cmdline_batch,
+            MAX_CMDLINE,
+            &wchars_read,
+            &read_control
+        );
+        if (!bool_rc) {
+            print_err(L"cmdline_reader_tproc -> ReadConsoleW");
+            ExitProcess(1);
+        }
+
+        // Enter was pressed
+        int32_t len_line = 0;
+        while (len_line < (int32_t)wchars_read 
+                && cmdline_batch[len_line] != L'\t'
+                && cmdline_batch[len_line] != CTRL_R)
+            len_line++;
+        if (len_line == (int32_t)wchars_read)
+            break;
+
+        // Ctrl+R was pressed: search the history for the text before it
+        if (cmdline_batch[len_line] == CTRL_R) {
+            search_back(&len_line, &search);
+            read_control.nInitialChars = (ULONG)len_line;
+            continue;
+        }
+
+        // Tab was pressed: complete the text before the cursor
+        out_stream_t candidates;
+        out_stream_init(&candidates, GetStdHandle(STD_OUTPUT_HANDLE));
+        BOOL listed = complete_cmdline(cmdline_batch, &len_line, &candidates);
+        redraw_line(cmdline_batch, len_line, listed ? &candidates : NULL);
+        candidates.len = 0; // already shown by redraw_line
+        out_stream_close(&candidates);
+
+        read_control.nInitialChars = (ULONG)len_line;
+    }
+
+    // Strip the '\r\n' (it may be missing if the line filled the buffer)
+    while (wchars_read > 0
+            && (cmdline_batch[wchars_read - 1] == L'\n'
+                 || cmdline_batch[wchars_read - 1] == L'\r')) {
+        wchars_read--;
+    }
+    cmdline_batch[wchars_read] = L'\0';
+
+    // "!!" / "!prefix": replace with the newest matching history entry
+    if (cmdline_batch[0] == L'!') {
+        out_stream_t out;
+        out_stream_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+        if (history_expand(cmdline_batch)) {
+            out_stream_puts(&out, cmdline_batch);
+        }
+        else {
+            out_stream_puts(&out, L"event not found");
+            cmdline_batch[0] = L'\0';
+        }
+        out_stream_write(&out, L"\n", 1);
+        out_stream_close(&out);
+        wchars_read = (DWORD)wcslen(cmdline_batch);
+    }
+
+    history_add(cmdline_batch, (int32_t)wchars_read);
+
+    len_cmdline_batch = (int32_t)wchars_read + 1;
+    n_cmdline_batch = 1;
+}
+
+
+
 /**
  * cmdline_reader_tproc
  * 
  * This is the thread procedure of the thread that reads commands from stdin
- * and places them in the cmdline buffer.
+ * and places them in the cmdline batch.
+ * A console is read one line at a time. A pipe or file is read in bulk by
+ * fill_cmdline_batch, and every complete line buffered is handed over at once.
  */
 DWORD WINAPI cmdline_reader_tproc(void *arg) {
     
-    DWORD dw_rc;
     BOOL bool_rc;
 
     HANDLE stdin_exited_hs[] = {
@@ -41,83 +245,108 @@ DWORD WINAPI cmdline_reader_tproc(void *arg) {
     };
 
     // lock exited_lock for loop condition check
-    dw_rc = WaitForSingleObject(exited_lock, INFINITE);
-    if (dw_rc == WAIT_FAILED) {
-        print_err(L"cmdline_reader_tproc -> WaitForSingleObject exited_lock");
+    bool_rc = plat_mutex_lock(exited_lock);
+    if (!bool_rc) {
+        print_err(L"cmdline_reader_tproc -> plat_mutex_lock exited_lock");
         ExitProcess(1);
     }
 
     while (!exited) {
 
-        ReleaseMutex(exited_lock);
+        plat_mutex_unlock(exited_lock);
 
         // Wait for stdin or exit
-        dw_rc = WaitForMultipleObjects(
-            2,
-            stdin_exited_hs,
-            FALSE,
-            INFINITE
-        );
-        if (dw_rc == WAIT_FAILED) {
-            print_err(L"cmdline_reader_tproc -> WaitForMultipleObjects");
-            ExitProcess(1);
-        }
-        DWORD signaled_i = dw_rc - WAIT_OBJECT_0;
+        // Note: Pipes and files aren't waitable - fill_cmdline_batch blocks 
+        //       in ReadFile instead, and exit_builtin cancels that read.
+        if (stdin_is_console) {
+            // Get completion listings ready while the user starts typing
+            dir_cache_warm();
 
-        // exited_e was signaled
-        if (signaled_i == 1) {
-            WaitForSingleObject(exited_lock, INFINITE);
-            if (exited) {
-                ReleaseMutex(exited_lock);
-                ExitThread(0);
+            int32_t signaled_i = plat_wait_any(
+                stdin_exited_hs,
+                2,
+                PLAT_INFINITE
+            );
+            if (signaled_i < 0) {
+                print_err(L"cmdline_reader_tproc -> plat_wait_any");
+                ExitProcess(1);
+            }
+
+            // exited_e was signaled
+            if (signaled_i == 1) {
+                plat_mutex_lock(exited_lock);
+                if (exited) {
+                    plat_mutex_unlock(exited_lock);
+                    ExitThread(0);
+                }
+                plat_mutex_unlock(exited_lock);
             }
-            ReleaseMutex(exited_lock);
         }
 
-        // Lock cmdline_lock and read stdin into cmdline buffer
+        // Lock cmdline_lock and read stdin into cmdline batch
         HANDLE stdin_h = stdin_exited_hs[0];
-        DWORD wchars_read;
 
-        dw_rc = WaitForSingleObject(cmdline_lock, INFINITE);
-        if (dw_rc == WAIT_FAILED) {
-            print_err(L"cmdline_read_tproc -> WaitForSingleObject cmdline_lock");
+        bool_rc = plat_mutex_lock(cmdline_lock);
+        if (!bool_rc) {
+            print_err(L"cmdline_read_tproc -> plat_mutex_lock cmdline_lock");
             ExitProcess(1);
         }
 
-        bool_rc = ReadConsoleW(stdin_h, cmdline, MAX_CMDLINE, &wchars_read, NULL);
-        if (!bool_rc) {
-            print_err(L"cmdline_reader_tproc -> ReadConsoleW");
-            ExitProcess(1);
+        if (stdin_is_console) {
+            read_console_line(stdin_h);
+        }
+        else {
+            bool_rc = fill_cmdline_batch(stdin_h);
+            if (!bool_rc && GetLastError() == ERROR_OPERATION_ABORTED) {
+                plat_mutex_unlock(cmdline_lock);
+                ExitThread(0);
+            }
+            else if (!bool_rc) {
+                print_err(L"cmdline_reader_tproc -> fill_cmdline_batch");
+                ExitProcess(1);
+            }
         }
 
-        cmdline[wchars_read - 2] = L'\0'; // wchars_read - 2 is the '\r\n' char
+        TRACE(TRACE_LINE_READ, n_cmdline_batch);
 
-        // Signal job spawner that cmdline is avaiable
-        bool_rc = SetEvent(cmdline_available_e);
+        // Signal job spawner that cmdline batch is avaiable
+        TRACE(TRACE_HANDOFF_SEND, n_cmdline_batch);
+        bool_rc = plat_event_set(cmdline_available_e);
         if (!bool_rc) {
-            print_err(L"cmdline_reader_tproc -> SetEvent cmdline_available_e");
+            print_err(
+                L"cmdline_reader_tproc -> plat_event_set cmdline_available_e"
+            );
             ExitProcess(1);
         }
-        bool_rc = ReleaseMutex(cmdline_lock);
+        bool_rc = plat_mutex_unlock(cmdline_lock);
         if (!bool_rc) {
-            print_err(L"cmdline_reader_tproc -> ReleaseMutex cmdline_lock");
+            print_err(
+                L"cmdline_reader_tproc -> plat_mutex_unlock cmdline_lock"
+            );
+        }
+
+        // Nothing left to read
+        if (cmdline_eof) {
+            ExitThread(0);
         }
         
-        // Wait for the job spawner to finish using cmdline
-        dw_rc = WaitForSingleObject(cmdline_consumed_e, INFINITE);
-        if (dw_rc == WAIT_FAILED) {
+        // Wait for the job spawner to finish using cmdline batch
+        if (plat_wait_any(&cmdline_consumed_e, 1, PLAT_INFINITE) < 0) {
             print_err(
                 L"cmdline_reader_tproc -> "
-                L"WaitForSingleObject cmdline_consumed_e"
+                L"plat_wait_any cmdline_consumed_e"
             );
             ExitProcess(1);
         }
 
         // lock exited_lock for loop condition check
-        dw_rc = WaitForSingleObject(exited_lock, INFINITE);
-        if (dw_rc == WAIT_FAILED) {
-            print_err(L"cmdline_reader_tproc -> WaitForSingleObject exited_lock");
+        bool_rc = plat_mutex_lock(exited_lock);
+        if (!bool_rc) {
+            print_err(L"cmdline_reader_tproc -> plat_mutex_lock exited_lock");
             ExitProcess(1);
         }
     }
+
+    plat_mutex_unlock(exited_lock);
+    return 0;
 }
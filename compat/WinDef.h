@@ -0,0 +1,10 @@
+
+/**
+ * WinDef.h
+ *
+ * Linux stand-in: everything winshell uses is declared in windows.h.
+ */
+
+
+
+#include "windows.h"
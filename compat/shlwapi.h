@@ -0,0 +1,10 @@
+
+/**
+ * shlwapi.h
+ *
+ * Linux stand-in: everything winshell uses is declared in windows.h.
+ */
+
+
+
+#include "windows.h"
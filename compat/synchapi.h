@@ -0,0 +1,10 @@
+
+/**
+ * synchapi.h
+ *
+ * Linux stand-in: everything winshell uses is declared in windows.h.
+ */
+
+
+
+#include "windows.h"
@@ -0,0 +1,288 @@
+
+/**
+ * win32_compat.h
+ *
+ * Private declarations of the Win32 subset in compat/: the table that says
+ * what kind of object each file descriptor behind a HANDLE is, and the
+ * helpers the compat files and platform_linux.c share.
+ */
+
+
+
+#ifndef _WIN32_COMPAT_H
+#define _WIN32_COMPAT_H
+
+
+
+#include <sys/types.h>
+#include <windows.h>
+
+
+
+/* COMPAT_MAX_FDS: Size of the handle table. File descriptors at or above it
+                   can't be HANDLEs; the limit on open files is raised to at
+                   most this at startup. */
+#define COMPAT_MAX_FDS 65536
+
+
+
+/**
+ * compat_kind_t enum
+ *
+ * What a HANDLE's file descriptor is, which decides how a wait treats it.
+ */
+typedef enum _compat_kind {
+
+    /* COMPAT_FREE: Not a HANDLE (also unknown fds, treated like files). */
+    COMPAT_FREE = 0,
+
+    /* COMPAT_FILE: A file, pipe end or terminal. */
+    COMPAT_FILE,
+
+    /* COMPAT_PROCESS: A pidfd; signaled once the process exited. */
+    COMPAT_PROCESS,
+
+    /* COMPAT_EVENT, COMPAT_AUTO_EVENT: An eventfd that's readable while the
+                                        event is set. A wait resets an
+                                        auto-reset one. */
+    COMPAT_EVENT,
+    COMPAT_AUTO_EVENT,
+
+    /* COMPAT_MUTEX: An eventfd semaphore holding 1 while the mutex is free.
+                     A wait takes it. Not recursive. */
+    COMPAT_MUTEX,
+
+    /* COMPAT_TIMER, COMPAT_AUTO_TIMER: A timerfd. A wait resets an
+                                        auto-reset one. */
+    COMPAT_TIMER,
+    COMPAT_AUTO_TIMER,
+
+    /* COMPAT_THREAD: An eventfd written once the thread exited. */
+    COMPAT_THREAD,
+
+    /* COMPAT_NOTIFY: An inotify descriptor (a change notification). */
+    COMPAT_NOTIFY,
+
+    /* COMPAT_MAPPING: A duplicate of a mapped file's descriptor. */
+    COMPAT_MAPPING
+
+} compat_kind_t;
+
+
+
+/**
+ * compat_thread_t struct
+ *
+ * A thread made by CreateThread. Shared by the thread and its HANDLEs.
+ */
+typedef struct _compat_thread {
+
+    pthread_t pthread;
+
+    /* proc, arg: Thread procedure and its argument. */
+    LPTHREAD_START_ROUTINE proc;
+    void *arg;
+
+    /* exit_code: STILL_ACTIVE until the thread exits. */
+    volatile DWORD exit_code;
+
+    /* cancel_io: Set by CancelSynchronousIo; the thread's blocking ReadFile
+                  or WriteFile fails with ERROR_OPERATION_ABORTED. */
+    volatile int cancel_io;
+
+    /* started, ended, user, sys: Times in 100ns units (see
+                                  compat_now). */
+    uint64_t started;
+    uint64_t ended;
+    uint64_t user;
+    uint64_t sys;
+
+    /* done_fd: eventfd written when the thread exits. Its HANDLEs are
+                duplicates of it. */
+    int done_fd;
+
+    /* n_refs: The thread itself and each HANDLE of it. */
+    int32_t n_refs;
+
+} compat_thread_t;
+
+
+
+/**
+ * compat_obj_t struct
+ *
+ * The handle table entry of a file descriptor.
+ */
+typedef struct _compat_obj {
+
+    compat_kind_t kind;
+
+    /* thread: The thread of a COMPAT_THREAD. */
+    compat_thread_t *thread;
+
+    /* started, ended, user, sys: Times of a COMPAT_PROCESS in 100ns units.
+                                  ended, user and sys are set once it's
+                                  collected. */
+    uint64_t started;
+    uint64_t ended;
+    uint64_t user;
+    uint64_t sys;
+
+    /* map_size: Size of a COMPAT_MAPPING. */
+    off_t map_size;
+
+} compat_obj_t;
+
+
+
+/**
+ * compat_wrap
+ *
+ * Enters a file descriptor in the handle table.
+ *
+ * Return Value: Returns its HANDLE, NULL (with the last error set) if fd is
+ *               negative or too large.
+ */
+HANDLE compat_wrap(int fd, compat_kind_t kind);
+
+
+
+/* COMPAT_WAIT_TIMEOUT, COMPAT_WAIT_FAILED: compat_wait_any return codes. */
+#define COMPAT_WAIT_TIMEOUT -1
+#define COMPAT_WAIT_FAILED -2
+
+
+
+/**
+ * compat_wait_any
+ *
+ * WaitForMultipleObjects for any one of the handles, with no limit on how
+ * many there are: past WAIT_TIMEOUT handles, WAIT_OBJECT_0 + i can't be
+ * told from a timeout or failure.
+ *
+ * Return Value: Returns the index of a signaled handle.
+ *               Returns COMPAT_WAIT_TIMEOUT if none was signaled in time.
+ *               Returns COMPAT_WAIT_FAILED (with the last error set) on
+ *               failure.
+ */
+int32_t compat_wait_any(DWORD n_hs, const HANDLE *hs, DWORD timeout_ms);
+
+
+
+/**
+ * compat_fd
+ *
+ * Return Value: Returns the file descriptor behind a HANDLE, -1 if it isn't
+ *               one.
+ */
+int compat_fd(HANDLE h);
+
+
+
+/**
+ * compat_obj
+ *
+ * Return Value: Returns the handle table entry of a HANDLE, NULL if it
+ *               isn't one.
+ */
+compat_obj_t *compat_obj(HANDLE h);
+
+
+
+/**
+ * compat_set_errno
+ *
+ * Sets the calling thread's last error from an errno value.
+ */
+void compat_set_errno(int err);
+
+
+
+/**
+ * compat_now
+ *
+ * Return Value: Returns the monotonic clock in 100ns units.
+ */
+uint64_t compat_now(void);
+
+
+
+/**
+ * compat_self
+ *
+ * Return Value: Returns the calling thread's compat_thread_t, NULL for the
+ *               main thread.
+ */
+compat_thread_t *compat_self(void);
+
+
+
+/**
+ * compat_encode
+ *
+ * Return Value: Returns a WCHAR string as UTF-8 (the caller frees it), NULL
+ *               on failure.
+ */
+char *compat_encode(const WCHAR *str);
+
+
+
+/**
+ * compat_decode
+ *
+ * Decodes UTF-8 (bytes that aren't are taken as Latin-1) into at most
+ * cap_dst - 1 WCHARs and a terminating L'\0'.
+ *
+ * Return Value: Returns the number of WCHARs the whole string needs, without
+ *               the terminator.
+ */
+size_t compat_decode(const char *str, WCHAR *dst, size_t cap_dst);
+
+
+
+/**
+ * compat_console_wait_begin, compat_console_wait_end
+ *
+ * Put the terminal in the raw mode ReadConsoleW reads it in around a wait
+ * on the console input (a key press has to end the wait, not a whole line).
+ * end restores the terminal unless the wait returned for the console, in
+ * which case ReadConsoleW is about to run.
+ */
+void compat_console_wait_begin(void);
+void compat_console_wait_end(BOOL console_signaled);
+
+
+
+/**
+ * compat_is_console
+ *
+ * Return Value: Returns TRUE if fd is the terminal the shell was started
+ *               with.
+ */
+BOOL compat_is_console(int fd);
+
+
+
+/**
+ * compat_console_init, compat_console_restore
+ *
+ * Remember the terminal's settings at startup, and put them back (at exit
+ * or on a fatal signal).
+ */
+void compat_console_init(void);
+void compat_console_restore(void);
+
+
+
+/**
+ * compat_sync_init
+ *
+ * Sets up the handle table, signal handling and the open file limit. Called
+ * from main before anything else.
+ */
+void compat_sync_init(void);
+
+
+
+// ifndef _WIN32_COMPAT_H
+#endif
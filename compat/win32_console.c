@@ -0,0 +1,348 @@
+
+/**
+ * win32_console.c
+ *
+ * The Win32 console functions of compat/windows.h, on the terminal the shell
+ * was started from. ReadConsoleW is a small line editor over the terminal in
+ * raw mode (typing, Backspace, Ctrl+U, Enter) that, like the Windows console,
+ * also ends the read on the control keys in dwCtrlWakeupMask. The terminal
+ * is in its normal mode whenever the shell isn't reading a line from it, so
+ * the processes it starts see it as the user left it.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "win32_compat.h"
+
+
+
+/* CONSOLE_FD: The console input. */
+#define CONSOLE_FD 0
+
+/* CTRL_D, CTRL_U, ESC, DEL: Keys the line editor handles. */
+#define CTRL_D 0x04
+#define CTRL_U 0x15
+#define ESC 0x1B
+#define DEL 0x7F
+
+
+
+/* saved_termios, have_termios: The terminal's settings at startup. */
+static struct termios saved_termios;
+static BOOL have_termios = FALSE;
+
+/* is_raw: The terminal is in the line editor's raw mode. */
+static volatile int is_raw = 0;
+
+
+
+/**
+ * set_raw
+ *
+ * Puts the terminal in raw mode: bytes as they're typed, no echo. Ctrl+C
+ * still interrupts, and output still gets "\r\n" line ends.
+ */
+static void set_raw(void) {
+
+    if (!have_termios || __atomic_exchange_n(&is_raw, 1, __ATOMIC_ACQ_REL))
+        return;
+    struct termios raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(CONSOLE_FD, TCSANOW, &raw);
+}
+
+
+
+/**
+ * compat_console_restore
+ *
+ * Puts the terminal's settings from startup back.
+ */
+void compat_console_restore(void) {
+
+    if (have_termios && __atomic_exchange_n(&is_raw, 0, __ATOMIC_ACQ_REL))
+        tcsetattr(CONSOLE_FD, TCSANOW, &saved_termios);
+}
+
+
+
+/**
+ * compat_console_init
+ *
+ * Remembers the terminal's settings at startup.
+ */
+void compat_console_init(void) {
+    have_termios = tcgetattr(CONSOLE_FD, &saved_termios) == 0;
+}
+
+
+
+/**
+ * compat_is_console
+ *
+ * Return Value: Returns TRUE if fd is the terminal the shell was started
+ *               with.
+ */
+BOOL compat_is_console(int fd) {
+    return have_termios && fd == CONSOLE_FD;
+}
+
+
+
+/**
+ * compat_console_wait_begin
+ *
+ * Called before a wait on the console input.
+ */
+void compat_console_wait_begin(void) {
+    set_raw();
+}
+
+
+
+/**
+ * compat_console_wait_end
+ *
+ * Called after a wait on the console input. Leaves raw mode on for the
+ * ReadConsoleW that follows if the console is what ended the wait.
+ */
+void compat_console_wait_end(BOOL console_signaled) {
+
+    if (!console_signaled)
+        compat_console_restore();
+}
+
+
+
+/**
+ * write_all
+ *
+ * Writes bytes to a file descriptor, retrying short writes.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL write_all(int fd, const char *bytes, size_t n_bytes) {
+
+    while (n_bytes > 0) {
+        ssize_t n = write(fd, bytes, n_bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            compat_set_errno(errno);
+            return FALSE;
+        }
+        bytes += n;
+        n_bytes -= (size_t)n;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * read_byte
+ *
+ * Reads one byte of console input.
+ *
+ * Return Value: Returns the byte, -1 on failure or end of input (with the
+ *               last error set; ERROR_OPERATION_ABORTED if
+ *               CancelSynchronousIo interrupted the read).
+ */
+static int read_byte(void) {
+
+    unsigned char byte;
+    compat_thread_t *self = compat_self();
+
+    while (TRUE) {
+        if (self != NULL
+             && __atomic_exchange_n(&self->cancel_io, 0, __ATOMIC_ACQ_REL)) {
+            SetLastError(ERROR_OPERATION_ABORTED);
+            return -1;
+        }
+        ssize_t n = read(CONSOLE_FD, &byte, 1);
+        if (n == 1)
+            return byte;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            SetLastError(ERROR_HANDLE_EOF);
+        else
+            compat_set_errno(errno);
+        return -1;
+    }
+}
+
+
+
+HANDLE GetStdHandle(DWORD std_handle) {
+
+    switch (std_handle) {
+        case STD_INPUT_HANDLE:
+            return (HANDLE)(intptr_t)1;
+        case STD_OUTPUT_HANDLE:
+            return (HANDLE)(intptr_t)2;
+        case STD_ERROR_HANDLE:
+            return (HANDLE)(intptr_t)3;
+    }
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return INVALID_HANDLE_VALUE;
+}
+
+
+
+BOOL GetConsoleMode(HANDLE h, LPDWORD out_mode) {
+
+    int fd = compat_fd(h);
+    if (fd < 0 || !isatty(fd)) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    *out_mode = 0;
+    return TRUE;
+}
+
+
+
+BOOL ReadConsoleW(HANDLE h, LPVOID buf, DWORD cap_buf, LPDWORD out_n_read,
+                  CONSOLE_READCONSOLE_CONTROL *control) {
+
+    WCHAR *line = buf;
+    DWORD len_line = control != NULL ? control->nInitialChars : 0;
+    ULONG wakeup_mask = control != NULL ? control->dwCtrlWakeupMask : 0;
+    BOOL ok = TRUE;
+    char echo[8];
+
+    if (compat_fd(h) != CONSOLE_FD || cap_buf < 3) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    set_raw();
+
+    while (TRUE) {
+        int byte = read_byte();
+        if (byte < 0) {
+            ok = GetLastError() == ERROR_HANDLE_EOF;
+            break;
+        }
+
+        // Enter: the line is done, with its "\r\n"
+        if (byte == '\r' || byte == '\n') {
+            line[len_line++] = L'\r';
+            line[len_line++] = L'\n';
+            write_all(STDOUT_FILENO, "\n", 1); // ONLCR adds the \r
+            break;
+        }
+
+        // Backspace, Ctrl+U: erase a character, or the whole line
+        if (byte == DEL || byte == '\b' || byte == CTRL_U) {
+            DWORD n_erase = byte == CTRL_U ? len_line : len_line > 0;
+            for (DWORD i = 0; i < n_erase; i++)
+                write_all(STDOUT_FILENO, "\b \b", 3);
+            len_line -= n_erase;
+            continue;
+        }
+
+        // Arrow and function keys: swallow the whole escape sequence
+        if (byte == ESC) {
+            byte = read_byte();
+            if (byte == '[' || byte == 'O') {
+                do {
+                    byte = read_byte();
+                } while (byte >= 0 && (byte < 0x40 || byte > 0x7E));
+            }
+            continue;
+        }
+
+        // A wakeup control key ends the read, and is left at the end
+        if (byte < 0x20) {
+            if (byte != CTRL_D && (wakeup_mask & 1u << byte)) {
+                line[len_line++] = (WCHAR)byte;
+                break;
+            }
+            continue;
+        }
+
+        // A character, and the rest of its UTF-8 sequence
+        int len_seq = byte < 0x80 ? 1 : byte >= 0xF0 ? 4
+                       : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 0;
+        if (len_seq == 0)
+            continue;
+        uint32_t code_point = len_seq == 1
+                               ? (uint32_t)byte
+                               : (uint32_t)byte & (0x7F >> len_seq);
+        echo[0] = (char)byte;
+        int i;
+        for (i = 1; i < len_seq; i++) {
+            int next = read_byte();
+            if (next < 0 || (next & 0xC0) != 0x80)
+                break;
+            echo[i] = (char)next;
+            code_point = code_point << 6 | (uint32_t)(next & 0x3F);
+        }
+        if (i < len_seq || len_line + 3 > cap_buf)
+            continue; // broken sequence, or the line is full
+        line[len_line++] = (WCHAR)code_point;
+        write_all(STDOUT_FILENO, echo, (size_t)len_seq);
+    }
+
+    compat_console_restore();
+    if (!ok)
+        return FALSE;
+    *out_n_read = len_line;
+    return TRUE;
+}
+
+
+
+BOOL WriteConsoleW(HANDLE h, const void *buf, DWORD n_wchars,
+                   LPDWORD out_n_written, LPVOID reserved) {
+
+    (void)reserved;
+
+    const WCHAR *text = buf;
+    char *bytes = malloc((size_t)n_wchars * 4 + 1);
+    if (bytes == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    size_t n_bytes = 0;
+    for (DWORD i = 0; i < n_wchars; i++) {
+        uint32_t c = (uint32_t)text[i];
+        if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+            c = 0xFFFD;
+        if (c < 0x80) {
+            bytes[n_bytes++] = (char)c;
+        }
+        else if (c < 0x800) {
+            bytes[n_bytes++] = (char)(0xC0 | c >> 6);
+            bytes[n_bytes++] = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            bytes[n_bytes++] = (char)(0xE0 | c >> 12);
+            bytes[n_bytes++] = (char)(0x80 | (c >> 6 & 0x3F));
+            bytes[n_bytes++] = (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            bytes[n_bytes++] = (char)(0xF0 | c >> 18);
+            bytes[n_bytes++] = (char)(0x80 | (c >> 12 & 0x3F));
+            bytes[n_bytes++] = (char)(0x80 | (c >> 6 & 0x3F));
+            bytes[n_bytes++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+
+    BOOL ok = write_all(compat_fd(h), bytes, n_bytes);
+    free(bytes);
+    if (ok && out_n_written != NULL)
+        *out_n_written = n_wchars;
+    return ok;
+}
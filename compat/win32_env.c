@@ -0,0 +1,272 @@
+
+/**
+ * win32_env.c
+ *
+ * The Win32 environment and text conversion functions of compat/windows.h,
+ * the UTF-8 helpers the other compat files share, and main. PATH is handed
+ * out with ';' separators, which is what winshell splits it on, and
+ * USERPROFILE falls back to HOME.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include "win32_compat.h"
+
+
+
+/* ERROR_ENVVAR_NOT_FOUND: GetEnvironmentVariableW found no such variable. */
+#define ERROR_ENVVAR_NOT_FOUND 203
+
+extern char **environ;
+
+
+
+/**
+ * decode_utf8
+ *
+ * Decodes the UTF-8 sequence at the start of bytes.
+ *
+ * out_code_point: Code point is placed here.
+ *
+ * Return Value: Returns the length of the sequence, 0 if it isn't a valid
+ *               one (overlong, a surrogate, past U+10FFFF or cut short).
+ */
+static int decode_utf8(const unsigned char *bytes, size_t n_bytes,
+                       uint32_t *out_code_point) {
+
+    unsigned char lead = bytes[0];
+    int len_seq = lead < 0x80 ? 1 : lead >= 0xF8 ? 0 : lead >= 0xF0 ? 4
+                   : lead >= 0xE0 ? 3 : lead >= 0xC2 ? 2 : 0;
+    if (len_seq == 0 || (size_t)len_seq > n_bytes)
+        return 0;
+
+    uint32_t code_point = len_seq == 1 ? lead : lead & (0x7F >> len_seq);
+    for (int i = 1; i < len_seq; i++) {
+        if ((bytes[i] & 0xC0) != 0x80)
+            return 0;
+        code_point = code_point << 6 | (bytes[i] & 0x3F);
+    }
+    static const uint32_t min_by_len[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (code_point < min_by_len[len_seq] || code_point > 0x10FFFF
+         || (code_point >= 0xD800 && code_point <= 0xDFFF))
+        return 0;
+    *out_code_point = code_point;
+    return len_seq;
+}
+
+
+
+/**
+ * compat_encode
+ *
+ * Return Value: Returns a WCHAR string as UTF-8 (the caller frees it), NULL
+ *               on failure.
+ */
+char *compat_encode(const WCHAR *str) {
+
+    char *buf = malloc(wcslen(str) * 4 + 1);
+    if (buf == NULL)
+        return NULL;
+
+    char *buf_p = buf;
+    for (; *str != L'\0'; str++) {
+        uint32_t c = (uint32_t)*str;
+        if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+            c = 0xFFFD;
+        if (c < 0x80) {
+            *buf_p++ = (char)c;
+        }
+        else if (c < 0x800) {
+            *buf_p++ = (char)(0xC0 | c >> 6);
+            *buf_p++ = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            *buf_p++ = (char)(0xE0 | c >> 12);
+            *buf_p++ = (char)(0x80 | (c >> 6 & 0x3F));
+            *buf_p++ = (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            *buf_p++ = (char)(0xF0 | c >> 18);
+            *buf_p++ = (char)(0x80 | (c >> 12 & 0x3F));
+            *buf_p++ = (char)(0x80 | (c >> 6 & 0x3F));
+            *buf_p++ = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    *buf_p = '\0';
+    return buf;
+}
+
+
+
+/**
+ * compat_decode
+ *
+ * Decodes UTF-8 (bytes that aren't are taken as Latin-1) into at most
+ * cap_dst - 1 WCHARs and a terminating L'\0'.
+ *
+ * Return Value: Returns the number of WCHARs the whole string needs, without
+ *               the terminator.
+ */
+size_t compat_decode(const char *str, WCHAR *dst, size_t cap_dst) {
+
+    const unsigned char *p = (const unsigned char *)str;
+    size_t n_bytes = strlen(str);
+    size_t len = 0;
+
+    while (n_bytes > 0) {
+        uint32_t code_point;
+        int len_seq = decode_utf8(p, n_bytes, &code_point);
+        if (len_seq == 0) {
+            code_point = *p;
+            len_seq = 1;
+        }
+        if (len + 1 < cap_dst)
+            dst[len] = (WCHAR)code_point;
+        len++;
+        p += len_seq;
+        n_bytes -= (size_t)len_seq;
+    }
+    if (cap_dst > 0)
+        dst[len < cap_dst ? len : cap_dst - 1] = L'\0';
+    return len;
+}
+
+
+
+DWORD GetEnvironmentVariableW(LPCWSTR name, LPWSTR buf, DWORD cap_buf) {
+
+    char *linux_name = compat_encode(name);
+    if (linux_name == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+    const char *value = getenv(linux_name);
+    if (value == NULL && strcmp(linux_name, "USERPROFILE") == 0)
+        value = getenv("HOME");
+    BOOL is_path = strcmp(linux_name, "PATH") == 0;
+    free(linux_name);
+    if (value == NULL) {
+        SetLastError(ERROR_ENVVAR_NOT_FOUND);
+        return 0;
+    }
+
+    size_t len_value = compat_decode(value, buf, cap_buf);
+    if (len_value >= cap_buf)
+        return (DWORD)len_value + 1;
+    if (is_path) {
+        for (WCHAR *p = buf; *p != L'\0'; p++) {
+            if (*p == L':')
+                *p = L';';
+        }
+    }
+    return (DWORD)len_value;
+}
+
+
+
+LPWSTR GetEnvironmentStringsW(void) {
+
+    size_t n_wchars = 1;
+    for (char **var_p = environ; *var_p != NULL; var_p++)
+        n_wchars += compat_decode(*var_p, NULL, 0) + 1;
+
+    WCHAR *block = malloc(n_wchars * sizeof(WCHAR));
+    if (block == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    WCHAR *block_p = block;
+    for (char **var_p = environ; *var_p != NULL; var_p++)
+        block_p += compat_decode(*var_p, block_p, n_wchars) + 1;
+    *block_p = L'\0';
+    return block;
+}
+
+
+
+BOOL FreeEnvironmentStringsW(LPWSTR env) {
+    free(env);
+    return TRUE;
+}
+
+
+
+int MultiByteToWideChar(UINT code_page, DWORD flags, LPCSTR src, int len_src,
+                        LPWSTR dst, int cap_dst) {
+
+    const unsigned char *p = (const unsigned char *)src;
+    size_t n_bytes = len_src < 0 ? strlen(src) + 1 : (size_t)len_src;
+    int len_dst = 0;
+
+    while (n_bytes > 0) {
+        uint32_t code_point = *p;
+        int len_seq = 1;
+        if (code_page == CP_UTF8) {
+            len_seq = decode_utf8(p, n_bytes, &code_point);
+            if (len_seq == 0) {
+                if (flags & MB_ERR_INVALID_CHARS) {
+                    SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+                    return 0;
+                }
+                code_point = 0xFFFD;
+                len_seq = 1;
+            }
+        }
+        if (cap_dst > 0) {
+            if (len_dst == cap_dst) {
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return 0;
+            }
+            dst[len_dst] = (WCHAR)code_point;
+        }
+        len_dst++;
+        p += len_seq;
+        n_bytes -= (size_t)len_seq;
+    }
+    return len_dst;
+}
+
+
+
+int StrToIntW(LPCWSTR str) {
+    return (int)wcstol(str, NULL, 10);
+}
+
+
+
+/**
+ * main
+ *
+ * Sets up the compat layer and runs the shell. Like on Windows, wWinMain
+ * gets the arguments (without the program name) as one command line.
+ */
+int main(int argc, char **argv) {
+
+    // Wide stdio (fwprintf to stderr) needs a UTF-8 locale
+    if (setlocale(LC_ALL, "") == NULL
+         || MB_CUR_MAX == 1)
+        setlocale(LC_CTYPE, "C.UTF-8");
+
+    size_t len_cmd_line = 0;
+    for (int i = 1; i < argc; i++)
+        len_cmd_line += compat_decode(argv[i], NULL, 0) + 1;
+    WCHAR *cmd_line = malloc((len_cmd_line + 1) * sizeof(WCHAR));
+    if (cmd_line == NULL)
+        return 1;
+    WCHAR *cmd_line_p = cmd_line;
+    for (int i = 1; i < argc; i++) {
+        if (i > 1)
+            *cmd_line_p++ = L' ';
+        cmd_line_p += compat_decode(argv[i], cmd_line_p, len_cmd_line + 1);
+    }
+    *cmd_line_p = L'\0';
+
+    compat_sync_init();
+    compat_console_init();
+    return wWinMain(NULL, NULL, cmd_line, 0);
+}
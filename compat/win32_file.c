@@ -0,0 +1,865 @@
+
+/**
+ * win32_file.c
+ *
+ * The Win32 file, mapping, directory listing, change notification and path
+ * functions of compat/windows.h. Paths may use '\' or '/' separators; "NUL"
+ * is /dev/null. A blocking ReadFile or WriteFile gives up with
+ * ERROR_OPERATION_ABORTED once CancelSynchronousIo interrupted it.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "win32_compat.h"
+
+
+
+/**
+ * find_t struct
+ *
+ * What a FindFirstFileExW HANDLE points to.
+ */
+typedef struct _find {
+
+    DIR *dir;
+
+    /* dir_path: Directory being listed, '/'-terminated. */
+    char *dir_path;
+
+    /* pattern: Names to report ('*' and '?' wildcards). */
+    WCHAR pattern[MAX_PATH + 1];
+
+    /* dirs_only: FindExSearchLimitToDirectories. Like on Windows it's only
+                  a hint, so files may still be reported. */
+    BOOL dirs_only;
+
+} find_t;
+
+
+
+/**
+ * view_t struct
+ *
+ * A MapViewOfFile view, remembered for UnmapViewOfFile.
+ */
+typedef struct _view {
+    void *addr;
+    size_t len;
+    struct _view *next;
+} view_t;
+
+
+
+/* views, views_lock: Views that are mapped. */
+static view_t *views = NULL;
+static pthread_mutex_t views_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/**
+ * encode_path
+ *
+ * Return Value: Returns a Win32 path as a UTF-8 Linux path (the caller frees
+ *               it): '\' separators become '/', and "NUL" /dev/null. NULL
+ *               on failure.
+ */
+static char *encode_path(const WCHAR *path) {
+
+    if (wcscasecmp(path, L"NUL") == 0)
+        return strdup("/dev/null");
+    char *buf = compat_encode(path);
+    if (buf == NULL)
+        return NULL;
+    for (char *p = buf; *p != '\0'; p++) {
+        if (*p == '\\')
+            *p = '/';
+    }
+    return buf;
+}
+
+
+
+/**
+ * io_cancelled
+ *
+ * Called when a blocking read or write was interrupted.
+ *
+ * Return Value: Returns TRUE (with ERROR_OPERATION_ABORTED set) if
+ *               CancelSynchronousIo is what interrupted it.
+ */
+static BOOL io_cancelled(void) {
+
+    compat_thread_t *self = compat_self();
+    if (self == NULL
+         || !__atomic_exchange_n(&self->cancel_io, 0, __ATOMIC_ACQ_REL))
+        return FALSE;
+    SetLastError(ERROR_OPERATION_ABORTED);
+    return TRUE;
+}
+
+
+
+HANDLE CreateFileW(LPCWSTR path, DWORD access, DWORD share,
+                   SECURITY_ATTRIBUTES *sa, DWORD disposition, DWORD flags,
+                   HANDLE template_h) {
+
+    (void)share;
+    (void)sa;
+    (void)template_h;
+
+    int open_flags = O_CLOEXEC;
+    BOOL reads = (access & GENERIC_READ) != 0;
+    BOOL writes = (access & (GENERIC_WRITE | FILE_APPEND_DATA)) != 0;
+    if (reads && writes)
+        open_flags |= O_RDWR;
+    else if (writes)
+        open_flags |= O_WRONLY;
+    if ((access & FILE_APPEND_DATA) && !(access & GENERIC_WRITE))
+        open_flags |= O_APPEND;
+
+    switch (disposition) {
+        case CREATE_NEW:
+            open_flags |= O_CREAT | O_EXCL;
+            break;
+        case CREATE_ALWAYS:
+            open_flags |= O_CREAT | O_TRUNC;
+            break;
+        case OPEN_ALWAYS:
+            open_flags |= O_CREAT;
+            break;
+        case TRUNCATE_EXISTING:
+            open_flags |= O_TRUNC;
+            break;
+    }
+
+    char *linux_path = encode_path(path);
+    if (linux_path == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    int fd = open(linux_path, open_flags, 0666);
+    int open_errno = errno;
+    free(linux_path);
+    if (fd < 0) {
+        compat_set_errno(open_errno);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (flags & FILE_FLAG_SEQUENTIAL_SCAN)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    HANDLE h = compat_wrap(fd, COMPAT_FILE);
+    return h == NULL ? INVALID_HANDLE_VALUE : h;
+}
+
+
+
+BOOL ReadFile(HANDLE h, LPVOID buf, DWORD n_bytes, LPDWORD out_n_read,
+              OVERLAPPED *overlapped) {
+
+    int fd = compat_fd(h);
+    ssize_t n_read;
+
+    if (out_n_read != NULL)
+        *out_n_read = 0;
+    if (io_cancelled())
+        return FALSE;
+
+    while (TRUE) {
+        if (overlapped != NULL) {
+            off_t off = (off_t)overlapped->OffsetHigh << 32
+                         | overlapped->Offset;
+            n_read = pread(fd, buf, n_bytes, off);
+        }
+        else {
+            n_read = read(fd, buf, n_bytes);
+        }
+        if (n_read >= 0)
+            break;
+        if (errno != EINTR) {
+            compat_set_errno(errno);
+            return FALSE;
+        }
+        if (io_cancelled())
+            return FALSE;
+    }
+
+    if (out_n_read != NULL)
+        *out_n_read = (DWORD)n_read;
+    return TRUE;
+}
+
+
+
+BOOL WriteFile(HANDLE h, LPCVOID buf, DWORD n_bytes, LPDWORD out_n_written,
+               OVERLAPPED *overlapped) {
+
+    int fd = compat_fd(h);
+    const char *buf_p = buf;
+    DWORD n_written = 0;
+
+    if (out_n_written != NULL)
+        *out_n_written = 0;
+    if (io_cancelled())
+        return FALSE;
+
+    // Like a blocking WriteFile, only come back once all of it is written
+    while (n_written < n_bytes) {
+        ssize_t n;
+        if (overlapped != NULL) {
+            off_t off = ((off_t)overlapped->OffsetHigh << 32
+                          | overlapped->Offset) + n_written;
+            n = pwrite(fd, buf_p + n_written, n_bytes - n_written, off);
+        }
+        else {
+            n = write(fd, buf_p + n_written, n_bytes - n_written);
+        }
+        if (n < 0 && errno == EINTR) {
+            if (io_cancelled())
+                break;
+            continue;
+        }
+        if (n < 0) {
+            compat_set_errno(errno);
+            break;
+        }
+        n_written += (DWORD)n;
+    }
+
+    if (out_n_written != NULL)
+        *out_n_written = n_written;
+    return n_written == n_bytes;
+}
+
+
+
+BOOL GetFileSizeEx(HANDLE h, LARGE_INTEGER *out_size) {
+
+    struct stat st;
+    if (fstat(compat_fd(h), &st) != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    out_size->QuadPart = st.st_size;
+    return TRUE;
+}
+
+
+
+DWORD GetFileType(HANDLE h) {
+
+    struct stat st;
+    if (fstat(compat_fd(h), &st) != 0) {
+        compat_set_errno(errno);
+        return FILE_TYPE_UNKNOWN;
+    }
+    if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+        return FILE_TYPE_DISK;
+    if (S_ISCHR(st.st_mode))
+        return FILE_TYPE_CHAR;
+    if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))
+        return FILE_TYPE_PIPE;
+    return FILE_TYPE_UNKNOWN;
+}
+
+
+
+BOOL SetEndOfFile(HANDLE h) {
+
+    int fd = compat_fd(h);
+    struct stat st;
+
+    // Devices like NUL have no end to set, and Windows lets that go
+    if (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode))
+        return TRUE;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || ftruncate(fd, pos) != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+BOOL SetFileInformationByHandle(HANDLE h, FILE_INFO_BY_HANDLE_CLASS info_class,
+                                LPVOID info, DWORD len_info) {
+
+    if (info_class != FileAllocationInfo
+         || len_info < sizeof(FILE_ALLOCATION_INFO)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    const FILE_ALLOCATION_INFO *alloc_info = info;
+    if (fallocate(compat_fd(h), FALLOC_FL_KEEP_SIZE, 0,
+                  (off_t)alloc_info->AllocationSize.QuadPart) != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * set_lock
+ *
+ * LockFileEx and UnlockFileEx: an open file description lock, so that it's
+ * held by the HANDLE (like on Windows) and not by the whole process.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL set_lock(HANDLE h, short type, BOOL wait, DWORD len_low,
+                     DWORD len_high, const OVERLAPPED *overlapped) {
+
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = (off_t)((uint64_t)overlapped->OffsetHigh << 32
+                            | overlapped->Offset),
+        .l_len = (off_t)((uint64_t)len_high << 32 | len_low),
+        .l_pid = 0
+    };
+
+    int rc;
+    do {
+        rc = fcntl(compat_fd(h), wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+    } while (rc != 0 && errno == EINTR);
+    if (rc != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+BOOL LockFileEx(HANDLE h, DWORD flags, DWORD reserved, DWORD len_low,
+                DWORD len_high, OVERLAPPED *overlapped) {
+
+    (void)reserved;
+    return set_lock(
+        h,
+        flags & LOCKFILE_EXCLUSIVE_LOCK ? F_WRLCK : F_RDLCK,
+        !(flags & LOCKFILE_FAIL_IMMEDIATELY),
+        len_low,
+        len_high,
+        overlapped
+    );
+}
+
+
+
+BOOL UnlockFileEx(HANDLE h, DWORD reserved, DWORD len_low, DWORD len_high,
+                  OVERLAPPED *overlapped) {
+
+    (void)reserved;
+    return set_lock(h, F_UNLCK, FALSE, len_low, len_high, overlapped);
+}
+
+
+
+HANDLE CreateFileMappingW(HANDLE file_h, SECURITY_ATTRIBUTES *sa,
+                          DWORD protect, DWORD size_high, DWORD size_low,
+                          LPCWSTR name) {
+
+    struct stat st;
+
+    (void)sa;
+    (void)name;
+
+    int fd = compat_fd(file_h);
+    if (fstat(fd, &st) != 0) {
+        compat_set_errno(errno);
+        return NULL;
+    }
+
+    // Like on Windows, a mapping larger than the file grows the file
+    off_t size = (off_t)((uint64_t)size_high << 32 | size_low);
+    if (size == 0)
+        size = st.st_size;
+    if (size > st.st_size && protect == PAGE_READWRITE
+         && ftruncate(fd, size) != 0) {
+        compat_set_errno(errno);
+        return NULL;
+    }
+
+    HANDLE map_h = compat_wrap(fcntl(fd, F_DUPFD_CLOEXEC, 3), COMPAT_MAPPING);
+    if (map_h == NULL)
+        return NULL;
+    compat_obj(map_h)->map_size = size;
+    return map_h;
+}
+
+
+
+LPVOID MapViewOfFile(HANDLE map_h, DWORD access, DWORD off_high,
+                     DWORD off_low, SIZE_T n_bytes) {
+
+    compat_obj_t *obj = compat_obj(map_h);
+    if (obj == NULL || obj->kind != COMPAT_MAPPING) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+
+    off_t off = (off_t)((uint64_t)off_high << 32 | off_low);
+    size_t len = n_bytes != 0 ? n_bytes : (size_t)(obj->map_size - off);
+    int prot = PROT_READ;
+    if (access & FILE_MAP_WRITE)
+        prot |= PROT_WRITE;
+
+    view_t *view = malloc(sizeof(view_t));
+    if (view == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    void *addr = mmap(NULL, len, prot, MAP_SHARED, compat_fd(map_h), off);
+    if (addr == MAP_FAILED) {
+        compat_set_errno(errno);
+        free(view);
+        return NULL;
+    }
+
+    view->addr = addr;
+    view->len = len;
+    pthread_mutex_lock(&views_lock);
+    view->next = views;
+    views = view;
+    pthread_mutex_unlock(&views_lock);
+    return addr;
+}
+
+
+
+BOOL UnmapViewOfFile(LPCVOID addr) {
+
+    pthread_mutex_lock(&views_lock);
+    view_t **link_p = &views;
+    while (*link_p != NULL && (*link_p)->addr != addr)
+        link_p = &(*link_p)->next;
+    view_t *view = *link_p;
+    if (view != NULL)
+        *link_p = view->next;
+    pthread_mutex_unlock(&views_lock);
+
+    if (view == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    munmap(view->addr, view->len);
+    free(view);
+    return TRUE;
+}
+
+
+
+/**
+ * attrs_of
+ *
+ * Return Value: Returns the file attributes Windows would report for a file
+ *               with this name and stat.
+ */
+static DWORD attrs_of(const char *name, const struct stat *st,
+                      BOOL is_link) {
+
+    DWORD attrs = S_ISDIR(st->st_mode)
+                   ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+    if (name[0] == '.' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+        attrs |= FILE_ATTRIBUTE_HIDDEN;
+    if (is_link)
+        attrs |= FILE_ATTRIBUTE_REPARSE_POINT;
+    return attrs;
+}
+
+
+
+DWORD GetFileAttributesW(LPCWSTR path) {
+
+    struct stat st;
+
+    char *linux_path = encode_path(path);
+    if (linux_path == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_FILE_ATTRIBUTES;
+    }
+    DWORD attrs = INVALID_FILE_ATTRIBUTES;
+    if (stat(linux_path, &st) == 0) {
+        const char *name = strrchr(linux_path, '/');
+        attrs = attrs_of(name != NULL ? name + 1 : linux_path, &st, FALSE);
+    }
+    else {
+        compat_set_errno(errno);
+    }
+    free(linux_path);
+    return attrs;
+}
+
+
+
+BOOL DeleteFileW(LPCWSTR path) {
+
+    char *linux_path = encode_path(path);
+    if (linux_path == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    BOOL ok = unlink(linux_path) == 0;
+    if (!ok)
+        compat_set_errno(errno);
+    free(linux_path);
+    return ok;
+}
+
+
+
+/**
+ * match_wildcards
+ *
+ * Return Value: Returns TRUE if name matches a pattern of '*' (any run of
+ *               characters) and '?' (any one character) wildcards.
+ */
+static BOOL match_wildcards(const WCHAR *pattern, const WCHAR *name) {
+
+    const WCHAR *star_p = NULL, *star_name = NULL;
+
+    while (*name != L'\0') {
+        if (*pattern == L'*') {
+            star_p = ++pattern;
+            star_name = name;
+        }
+        else if (*pattern == L'?' || *pattern == *name) {
+            pattern++;
+            name++;
+        }
+        else if (star_p != NULL) {
+            pattern = star_p;
+            name = ++star_name;
+        }
+        else {
+            return FALSE;
+        }
+    }
+    while (*pattern == L'*')
+        pattern++;
+    return *pattern == L'\0';
+}
+
+
+
+/**
+ * next_match
+ *
+ * Reads directory entries until one matches the find's pattern, and fills
+ * out_data with it.
+ *
+ * Return Value: Returns TRUE if one was found, FALSE at the end (with
+ *               ERROR_NO_MORE_FILES set).
+ */
+static BOOL next_match(find_t *find, WIN32_FIND_DATAW *out_data) {
+
+    struct dirent *entry;
+    struct stat st;
+    char path[4096];
+
+    while ((entry = readdir(find->dir)) != NULL) {
+        if (compat_decode(entry->d_name, out_data->cFileName, MAX_PATH)
+             >= MAX_PATH)
+            continue;
+        if (!match_wildcards(find->pattern, out_data->cFileName))
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", find->dir_path, entry->d_name);
+        BOOL is_link = entry->d_type == DT_LNK;
+        if (stat(path, &st) != 0 && lstat(path, &st) != 0)
+            continue;
+        if (find->dirs_only && !S_ISDIR(st.st_mode))
+            continue;
+
+        out_data->dwFileAttributes = attrs_of(entry->d_name, &st, is_link);
+        out_data->nFileSizeHigh = (DWORD)((uint64_t)st.st_size >> 32);
+        out_data->nFileSizeLow = (DWORD)st.st_size;
+        out_data->cAlternateFileName[0] = L'\0';
+        return TRUE;
+    }
+
+    SetLastError(ERROR_NO_MORE_FILES);
+    return FALSE;
+}
+
+
+
+HANDLE FindFirstFileExW(LPCWSTR pattern, FINDEX_INFO_LEVELS info_level,
+                        LPVOID out_data, FINDEX_SEARCH_OPS search_op,
+                        LPVOID search_filter, DWORD flags) {
+
+    (void)info_level;
+    (void)search_filter;
+    (void)flags;
+
+    find_t *find = calloc(1, sizeof(find_t));
+    if (find == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    find->dirs_only = search_op == FindExSearchLimitToDirectories;
+
+    // "dir\pattern": list dir, report the names matching pattern
+    const WCHAR *name_p = pattern;
+    for (const WCHAR *p = pattern; *p != L'\0'; p++) {
+        if (*p == L'\\' || *p == L'/')
+            name_p = p + 1;
+    }
+    if (wcslen(name_p) > MAX_PATH)
+        goto failed;
+    wcscpy(find->pattern, name_p);
+    find->dir_path = encode_path(pattern);
+    if (find->dir_path == NULL)
+        goto failed;
+    char *slash_p = strrchr(find->dir_path, '/');
+    if (slash_p != NULL)
+        slash_p[1] = '\0';
+    else
+        find->dir_path[0] = '\0';
+
+    find->dir = opendir(find->dir_path[0] != '\0' ? find->dir_path : ".");
+    if (find->dir == NULL) {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        goto failed;
+    }
+    if (!next_match(find, out_data)) {
+        closedir(find->dir);
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        goto failed;
+    }
+    return find;
+
+failed:
+    free(find->dir_path);
+    free(find);
+    return INVALID_HANDLE_VALUE;
+}
+
+
+
+BOOL FindNextFileW(HANDLE find_h, WIN32_FIND_DATAW *out_data) {
+    return next_match(find_h, out_data);
+}
+
+
+
+BOOL FindClose(HANDLE find_h) {
+
+    find_t *find = find_h;
+    closedir(find->dir);
+    free(find->dir_path);
+    free(find);
+    return TRUE;
+}
+
+
+
+HANDLE FindFirstChangeNotificationW(LPCWSTR dir, BOOL watch_subtree,
+                                    DWORD filter) {
+
+    (void)watch_subtree; // only ever FALSE
+
+    uint32_t mask = 0;
+    if (filter & (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME))
+        mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+    char *linux_path = encode_path(dir);
+    if (linux_path == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd >= 0 && inotify_add_watch(fd, linux_path, mask) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    int notify_errno = errno;
+    free(linux_path);
+    if (fd < 0) {
+        compat_set_errno(notify_errno);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    HANDLE h = compat_wrap(fd, COMPAT_NOTIFY);
+    return h == NULL ? INVALID_HANDLE_VALUE : h;
+}
+
+
+
+BOOL FindNextChangeNotification(HANDLE change_h) {
+
+    char events[4096];
+    while (read(compat_fd(change_h), events, sizeof(events)) > 0)
+        ;
+    return TRUE;
+}
+
+
+
+BOOL FindCloseChangeNotification(HANDLE change_h) {
+    return CloseHandle(change_h);
+}
+
+
+
+DWORD GetCurrentDirectoryW(DWORD cap_buf, LPWSTR buf) {
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        compat_set_errno(errno);
+        return 0;
+    }
+    size_t len_cwd = compat_decode(cwd, buf, cap_buf);
+    return (DWORD)(len_cwd < cap_buf ? len_cwd : len_cwd + 1);
+}
+
+
+
+DWORD GetFullPathNameW(LPCWSTR path, DWORD cap_buf, LPWSTR buf,
+                       LPWSTR *out_file_part) {
+
+    WCHAR cwd[MAX_PATH + 1];
+    WCHAR *full;
+
+    // Relative paths are taken from the process's current directory
+    size_t len_path = wcslen(path);
+    size_t len_cwd = 0;
+    BOOL relative = path[0] != L'/' && path[0] != L'\\';
+    if (relative) {
+        len_cwd = GetCurrentDirectoryW(MAX_PATH + 1, cwd);
+        if (len_cwd == 0 || len_cwd > MAX_PATH)
+            return 0;
+    }
+    full = malloc((len_cwd + len_path + 3) * sizeof(WCHAR));
+    if (full == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+
+    // Copy component by component, resolving "." and ".."
+    size_t len_full = 0;
+    const WCHAR *sources[2] = { relative ? cwd : L"", path };
+    for (int i = 0; i < 2; i++) {
+        const WCHAR *p = sources[i];
+        while (*p != L'\0') {
+            while (*p == L'/' || *p == L'\\')
+                p++;
+            const WCHAR *end_p = p;
+            while (*end_p != L'\0' && *end_p != L'/' && *end_p != L'\\')
+                end_p++;
+            size_t len_comp = (size_t)(end_p - p);
+            BOOL is_dot = len_comp == 1 && p[0] == L'.';
+            if (len_comp == 2 && p[0] == L'.' && p[1] == L'.') {
+                while (len_full > 0 && full[len_full - 1] != L'/')
+                    len_full--;
+                if (len_full > 0)
+                    len_full--;
+            }
+            else if (len_comp > 0 && !is_dot) {
+                full[len_full++] = L'/';
+                wmemcpy(full + len_full, p, len_comp);
+                len_full += len_comp;
+            }
+            p = end_p;
+        }
+    }
+    if (len_full == 0)
+        full[len_full++] = L'/';
+    full[len_full] = L'\0';
+
+    DWORD rc = (DWORD)len_full;
+    if (len_full < cap_buf) {
+        wmemcpy(buf, full, len_full + 1);
+        if (out_file_part != NULL)
+            *out_file_part = wcsrchr(buf, L'/') + 1;
+    }
+    else {
+        rc = (DWORD)len_full + 1;
+    }
+    free(full);
+    return rc;
+}
+
+
+
+/**
+ * is_executable
+ *
+ * Return Value: Returns TRUE if path is a regular file the shell may run.
+ */
+static BOOL is_executable(const WCHAR *path) {
+
+    struct stat st;
+
+    char *linux_path = encode_path(path);
+    if (linux_path == NULL)
+        return FALSE;
+    BOOL rc = stat(linux_path, &st) == 0 && S_ISREG(st.st_mode)
+               && access(linux_path, X_OK) == 0;
+    free(linux_path);
+    return rc;
+}
+
+
+
+DWORD SearchPathW(LPCWSTR dirs, LPCWSTR name, LPCWSTR ext, DWORD cap_buf,
+                  LPWSTR buf, LPWSTR *out_file_part) {
+
+    WCHAR path[2 * (MAX_PATH + 1)];
+    WCHAR path_env[32768];
+
+    (void)ext; // Linux executables have no extension to add
+
+    // Given dirs (';'-separated), or else the PATH
+    if (dirs == NULL) {
+        DWORD len_env = GetEnvironmentVariableW(L"PATH", path_env, 32768);
+        if (len_env == 0 || len_env >= 32768)
+            path_env[0] = L'\0';
+        dirs = path_env;
+    }
+
+    // A name with a directory in it isn't searched for
+    BOOL has_dir = wcschr(name, L'/') != NULL || wcschr(name, L'\\') != NULL;
+    const WCHAR *dir_p = dirs;
+    while (TRUE) {
+        const WCHAR *end_p = has_dir ? dir_p : wcschr(dir_p, L';');
+        if (end_p == NULL)
+            end_p = dir_p + wcslen(dir_p);
+        size_t len_dir = (size_t)(end_p - dir_p);
+
+        if ((has_dir || len_dir > 0) && len_dir + wcslen(name) + 1 <=
+             2 * MAX_PATH) {
+            BOOL absolute = name[0] == L'/' || name[0] == L'\\';
+            size_t len = absolute ? 0 : len_dir;
+            wmemcpy(path, dir_p, len);
+            if (len > 0)
+                path[len++] = L'/';
+            wcscpy(path + len, name);
+            if (is_executable(path))
+                return GetFullPathNameW(path, cap_buf, buf, out_file_part);
+        }
+
+        if (has_dir || *end_p == L'\0')
+            break;
+        dir_p = end_p + 1;
+    }
+
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return 0;
+}
@@ -0,0 +1,1227 @@
+
+/**
+ * win32_sync.c
+ *
+ * The handle table, and the Win32 handle, synchronization, thread, time and
+ * error functions of compat/windows.h. Every waitable is a file descriptor,
+ * so WaitForMultipleObjects is a poll of a few of them, or a wait on the
+ * calling thread's epoll set for many (the shell's wait on every job); 
+ * waiting on an auto-reset event, an auto-reset timer or a mutex also has to
+ * read it, which only one of the threads woken by it manages to do.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include "win32_compat.h"
+
+
+
+/* THREAD_STACK_SIZE: Stack of a CreateThread thread that doesn't ask for
+                      one (WCHARs take twice the room they do on Windows). */
+#define THREAD_STACK_SIZE (2 * 1024 * 1024)
+
+/* POLL_STACK_CAP: Waits on at most this many handles don't allocate. */
+#define POLL_STACK_CAP 64
+
+/* EPOLL_MIN_HANDLES: Waits on at least this many handles use the calling
+                      thread's epoll set instead of a poll. */
+#define EPOLL_MIN_HANDLES 16
+
+/* EPOLL_EVENTS_CAP: Ready handles taken by each epoll_wait. */
+#define EPOLL_EVENTS_CAP 64
+
+/* FILETIME_UNIX_EPOCH: 1970-01-01 as a FILETIME (100ns units since 1601). */
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL
+
+
+
+/**
+ * epoll_entry_t struct
+ *
+ * What a thread's epoll set knows about one file descriptor.
+ */
+typedef struct _epoll_entry {
+
+    /* gen: handle_gens of the fd when it was registered. */
+    uint32_t gen;
+
+    /* registered: Has the fd been added to the set? */
+    BOOL registered;
+
+} epoll_entry_t;
+
+
+
+/**
+ * epoll_set_t struct
+ *
+ * A thread's epoll set. Handles stay in it between waits, so a wait on the
+ * same handles as the last one, or on a job more or less (even with the
+ * rest moved up or down), only looks up the ones that changed and makes no
+ * more than an epoll_ctl or two.
+ * CloseHandle takes a handle out of the closing thread's set; one that
+ * fires while no longer waited on is taken out then. A closed fd another
+ * thread added, whose file a duplicate keeps open, can't be taken out any
+ * more: the set is made anew when it fires.
+ */
+typedef struct _epoll_set {
+
+    int epoll_fd;
+
+    /* last_hs, last_gens: Handles of the last wait and their handle_gens. */
+    HANDLE *last_hs;
+    uint32_t *last_gens;
+    DWORD n_last;
+    DWORD cap_last;
+
+    /* ready: Bit per fd, set while a wait looks for the lowest index among
+              the fds epoll_wait returned. */
+    uint64_t ready[COMPAT_MAX_FDS / 64];
+
+    /* entries: Indexed by file descriptor. */
+    epoll_entry_t entries[COMPAT_MAX_FDS];
+
+} epoll_set_t;
+
+
+
+/* handle_table: Indexed by file descriptor. */
+static compat_obj_t handle_table[COMPAT_MAX_FDS];
+
+/* handle_gens: Bumped every time an fd is entered in the handle table, so
+                an epoll set can tell a reused fd from the one it added. */
+static uint32_t handle_gens[COMPAT_MAX_FDS];
+
+/* my_epoll_set: The calling thread's epoll set, NULL until its first wait
+                 on EPOLL_MIN_HANDLES handles. */
+static __thread epoll_set_t *my_epoll_set;
+
+/* last_error: GetLastError's value. */
+static __thread DWORD last_error;
+
+/* self_thread: The compat_thread_t of a CreateThread thread. */
+static __thread compat_thread_t *self_thread;
+
+/* exit_lock: Orders CancelSynchronousIo's pthread_kill before the thread's
+              exit (a detached thread's pthread_t is gone after it). */
+static pthread_mutex_t exit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/**
+ * errno_map
+ *
+ * errno values and the Win32 errors they stand for.
+ */
+static const struct {
+    int err;
+    DWORD code;
+} errno_map[] = {
+    { ENOENT, ERROR_FILE_NOT_FOUND },
+    { ENOTDIR, ERROR_PATH_NOT_FOUND },
+    { EMFILE, ERROR_TOO_MANY_OPEN_FILES },
+    { ENFILE, ERROR_TOO_MANY_OPEN_FILES },
+    { EACCES, ERROR_ACCESS_DENIED },
+    { EPERM, ERROR_ACCESS_DENIED },
+    { EBADF, ERROR_INVALID_HANDLE },
+    { ENOMEM, ERROR_NOT_ENOUGH_MEMORY },
+    { EIO, ERROR_WRITE_FAULT },
+    { EAGAIN, ERROR_LOCK_VIOLATION },
+    { EOPNOTSUPP, ERROR_NOT_SUPPORTED },
+    { EEXIST, ERROR_FILE_EXISTS },
+    { EINVAL, ERROR_INVALID_PARAMETER },
+    { EPIPE, ERROR_NO_DATA },
+    { ENOSPC, ERROR_DISK_FULL },
+    { ERANGE, ERROR_INSUFFICIENT_BUFFER },
+    { ENAMETOOLONG, ERROR_FILENAME_EXCED_RANGE },
+    { ENOTEMPTY, ERROR_DIR_NOT_EMPTY },
+    { EBUSY, ERROR_BUSY },
+    { EISDIR, ERROR_DIRECTORY },
+    { EILSEQ, ERROR_NO_UNICODE_TRANSLATION },
+    { ECANCELED, ERROR_OPERATION_ABORTED }
+};
+
+
+
+/**
+ * on_cancel_signal
+ *
+ * SIGUSR2 handler. Does nothing: the signal is only there to make the
+ * cancelled thread's blocking call fail with EINTR.
+ */
+static void on_cancel_signal(int sig) {
+    (void)sig;
+}
+
+
+
+/**
+ * on_fatal_signal
+ *
+ * SIGINT, SIGTERM and SIGHUP handler: puts the terminal back before the
+ * signal (now back to its default action) ends the shell.
+ */
+static void on_fatal_signal(int sig) {
+    compat_console_restore();
+    raise(sig);
+}
+
+
+
+/**
+ * compat_sync_init
+ *
+ * Sets up the handle table, signal handling and the open file limit. Called
+ * from main before anything else.
+ */
+void compat_sync_init(void) {
+
+    struct sigaction action;
+    struct rlimit limit;
+
+    // Every job is a handful of pidfds and pipe ends
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max < COMPAT_MAX_FDS
+                          ? limit.rlim_max : COMPAT_MAX_FDS;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    for (int fd = 0; fd <= 2; fd++)
+        handle_table[fd].kind = COMPAT_FILE;
+
+    // No SA_RESTART: a cancelled read or write has to come back with EINTR
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_cancel_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+
+    // A write to a pipe whose reader is gone fails with ERROR_NO_DATA
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    action.sa_handler = on_fatal_signal;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+}
+
+
+
+/**
+ * compat_wrap
+ *
+ * Enters a file descriptor in the handle table.
+ *
+ * Return Value: Returns its HANDLE, NULL (with the last error set) if fd is
+ *               negative or too large.
+ */
+HANDLE compat_wrap(int fd, compat_kind_t kind) {
+
+    if (fd < 0) {
+        compat_set_errno(errno);
+        return NULL;
+    }
+    if (fd >= COMPAT_MAX_FDS) {
+        close(fd);
+        SetLastError(ERROR_TOO_MANY_OPEN_FILES);
+        return NULL;
+    }
+    memset(&handle_table[fd], 0, sizeof(compat_obj_t));
+    handle_table[fd].kind = kind;
+    __atomic_add_fetch(&handle_gens[fd], 1, __ATOMIC_RELAXED);
+    return (HANDLE)(intptr_t)(fd + 1);
+}
+
+
+
+/**
+ * compat_fd
+ *
+ * Return Value: Returns the file descriptor behind a HANDLE, -1 if it isn't
+ *               one.
+ */
+int compat_fd(HANDLE h) {
+
+    intptr_t value = (intptr_t)h;
+    if (value <= 0 || value > COMPAT_MAX_FDS)
+        return -1;
+    return (int)(value - 1);
+}
+
+
+
+/**
+ * compat_obj
+ *
+ * Return Value: Returns the handle table entry of a HANDLE, NULL if it
+ *               isn't one.
+ */
+compat_obj_t *compat_obj(HANDLE h) {
+
+    int fd = compat_fd(h);
+    return fd < 0 ? NULL : &handle_table[fd];
+}
+
+
+
+/**
+ * compat_set_errno
+ *
+ * Sets the calling thread's last error from an errno value.
+ */
+void compat_set_errno(int err) {
+
+    for (size_t i = 0; i < sizeof(errno_map) / sizeof(errno_map[0]); i++) {
+        if (errno_map[i].err == err) {
+            last_error = errno_map[i].code;
+            return;
+        }
+    }
+    last_error = ERROR_INVALID_FUNCTION;
+}
+
+
+
+/**
+ * compat_now
+ *
+ * Return Value: Returns the monotonic clock in 100ns units.
+ */
+uint64_t compat_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 10000000 + (uint64_t)ts.tv_nsec / 100;
+}
+
+
+
+/**
+ * compat_self
+ *
+ * Return Value: Returns the calling thread's compat_thread_t, NULL for the
+ *               main thread.
+ */
+compat_thread_t *compat_self(void) {
+    return self_thread;
+}
+
+
+
+/**
+ * release_thread
+ *
+ * Drops a reference to a thread, freeing it with the last one.
+ */
+static void release_thread(compat_thread_t *thread) {
+
+    if (__atomic_sub_fetch(&thread->n_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(thread->done_fd);
+        free(thread);
+    }
+}
+
+
+
+DWORD GetLastError(void) {
+    return last_error;
+}
+
+
+
+void SetLastError(DWORD code) {
+    last_error = code;
+}
+
+
+
+BOOL CloseHandle(HANDLE h) {
+
+    int fd = compat_fd(h);
+    if (fd < 0) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    // Before the fd can be reused: the set can only tell fds apart while
+    // they're open
+    epoll_set_t *set = my_epoll_set;
+    if (set != NULL && set->entries[fd].registered) {
+        epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        set->entries[fd].registered = FALSE;
+    }
+
+    compat_obj_t *obj = &handle_table[fd];
+    if (obj->kind == COMPAT_THREAD)
+        release_thread(obj->thread);
+    memset(obj, 0, sizeof(compat_obj_t));
+    if (close(fd) != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+BOOL DuplicateHandle(HANDLE src_proc, HANDLE h, HANDLE dst_proc,
+                     HANDLE *out_h, DWORD access, BOOL inherit,
+                     DWORD options) {
+
+    (void)src_proc;
+    (void)dst_proc;
+    (void)access;
+    (void)inherit; // plat_spawn dup2s what a child gets
+
+    int fd = compat_fd(h);
+    if (fd < 0) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    compat_obj_t obj = handle_table[fd];
+    if (obj.kind == COMPAT_FREE)
+        obj.kind = COMPAT_FILE;
+
+    HANDLE dup_h = compat_wrap(fcntl(fd, F_DUPFD_CLOEXEC, 3), obj.kind);
+    if (dup_h == NULL)
+        return FALSE;
+    *compat_obj(dup_h) = obj;
+    if (obj.kind == COMPAT_THREAD)
+        __atomic_add_fetch(&obj.thread->n_refs, 1, __ATOMIC_ACQ_REL);
+
+    if (options & DUPLICATE_CLOSE_SOURCE)
+        CloseHandle(h);
+    *out_h = dup_h;
+    return TRUE;
+}
+
+
+
+HANDLE GetCurrentProcess(void) {
+    return (HANDLE)(intptr_t)-1;
+}
+
+
+
+DWORD GetCurrentProcessId(void) {
+    return (DWORD)getpid();
+}
+
+
+
+DWORD GetCurrentThreadId(void) {
+    return (DWORD)syscall(SYS_gettid);
+}
+
+
+
+HANDLE CreateEventW(SECURITY_ATTRIBUTES *sa, BOOL manual_reset,
+                    BOOL initial_state, LPCWSTR name) {
+
+    (void)sa;
+    (void)name;
+    return compat_wrap(
+        eventfd(initial_state ? 1 : 0, EFD_CLOEXEC | EFD_NONBLOCK),
+        manual_reset ? COMPAT_EVENT : COMPAT_AUTO_EVENT
+    );
+}
+
+
+
+BOOL SetEvent(HANDLE event) {
+
+    uint64_t one = 1;
+    if (write(compat_fd(event), &one, sizeof(one)) != sizeof(one)
+         && errno != EAGAIN) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+BOOL ResetEvent(HANDLE event) {
+
+    uint64_t count;
+    if (read(compat_fd(event), &count, sizeof(count)) < 0
+         && errno != EAGAIN) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+HANDLE CreateMutexW(SECURITY_ATTRIBUTES *sa, BOOL initial_owner,
+                    LPCWSTR name) {
+
+    (void)sa;
+    (void)name;
+    return compat_wrap(
+        eventfd(
+            initial_owner ? 0 : 1,
+            EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE
+        ),
+        COMPAT_MUTEX
+    );
+}
+
+
+
+BOOL ReleaseMutex(HANDLE mutex) {
+    return SetEvent(mutex);
+}
+
+
+
+HANDLE CreateWaitableTimerW(SECURITY_ATTRIBUTES *sa, BOOL manual_reset,
+                            LPCWSTR name) {
+
+    (void)sa;
+    (void)name;
+    return compat_wrap(
+        timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK),
+        manual_reset ? COMPAT_TIMER : COMPAT_AUTO_TIMER
+    );
+}
+
+
+
+BOOL SetWaitableTimer(HANDLE timer, const LARGE_INTEGER *due, LONG period,
+                      void *completion_routine, LPVOID arg, BOOL resume) {
+
+    struct itimerspec spec;
+    struct timespec now;
+
+    (void)completion_routine;
+    (void)arg;
+    (void)resume;
+
+    // Negative: relative, in 100ns units. Positive: an absolute FILETIME.
+    int64_t wait_100ns = due->QuadPart;
+    if (wait_100ns < 0) {
+        wait_100ns = -wait_100ns;
+    }
+    else {
+        clock_gettime(CLOCK_REALTIME, &now);
+        wait_100ns -= (int64_t)(FILETIME_UNIX_EPOCH
+                                 + (uint64_t)now.tv_sec * 10000000
+                                 + (uint64_t)now.tv_nsec / 100);
+        if (wait_100ns < 0)
+            wait_100ns = 0;
+    }
+
+    // An all-zero it_value would disarm the timer instead
+    int64_t wait_ns = wait_100ns * 100 + 1;
+    spec.it_value.tv_sec = wait_ns / 1000000000;
+    spec.it_value.tv_nsec = wait_ns % 1000000000;
+    spec.it_interval.tv_sec = period / 1000;
+    spec.it_interval.tv_nsec = (long)(period % 1000) * 1000000;
+
+    // Setting the timer also clears expirations nobody waited for
+    if (timerfd_settime(compat_fd(timer), 0, &spec, NULL) != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * take_signaled
+ *
+ * Called for a handle a wait found ready. Resets an auto-reset event or timer
+ * and takes a mutex, if no other thread got there first.
+ *
+ * Return Value: Returns TRUE if the wait is satisfied by the handle.
+ */
+static BOOL take_signaled(int fd) {
+
+    uint64_t count;
+
+    switch (handle_table[fd].kind) {
+        case COMPAT_AUTO_EVENT:
+        case COMPAT_AUTO_TIMER:
+        case COMPAT_MUTEX:
+            return read(fd, &count, sizeof(count)) == sizeof(count);
+        default:
+            return TRUE;
+    }
+}
+
+
+
+/**
+ * close_epoll_set
+ *
+ * Frees the calling thread's epoll set, if it has one.
+ */
+static void close_epoll_set(void) {
+
+    epoll_set_t *set = my_epoll_set;
+    if (set == NULL)
+        return;
+    close(set->epoll_fd);
+    free(set->last_hs);
+    free(set->last_gens);
+    free(set);
+    my_epoll_set = NULL;
+}
+
+
+
+/**
+ * open_epoll_set
+ *
+ * Return Value: Returns the calling thread's epoll set, made (anew, if
+ *               fresh is TRUE) if need be. Returns NULL on failure.
+ */
+static epoll_set_t *open_epoll_set(BOOL fresh) {
+
+    if (my_epoll_set != NULL && !fresh)
+        return my_epoll_set;
+    close_epoll_set();
+
+    epoll_set_t *set = calloc(1, sizeof(epoll_set_t));
+    if (set == NULL)
+        return NULL;
+    set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (set->epoll_fd < 0) {
+        free(set);
+        return NULL;
+    }
+    my_epoll_set = set;
+    return set;
+}
+
+
+
+/**
+ * prepare_epoll_set
+ *
+ * Makes the calling thread's epoll set ready for a wait on hs: adds the
+ * handles it doesn't have (or has an older fd of). The handles are walked
+ * alongside the last wait's, so only the ones that aren't there are looked
+ * up.
+ *
+ * Return Value: Returns TRUE on success. Returns FALSE if the handles can't
+ *               be waited on this way (the console input, regular files),
+ *               with the last error set if one is invalid.
+ */
+static BOOL prepare_epoll_set(epoll_set_t *set, DWORD n_hs, 
+                              const HANDLE *hs) {
+
+    struct epoll_event event;
+    DWORD last_i = 0;
+
+    if (n_hs > set->cap_last) {
+        HANDLE *last_hs = realloc(set->last_hs, n_hs * sizeof(HANDLE));
+        if (last_hs != NULL)
+            set->last_hs = last_hs;
+        uint32_t *last_gens = realloc(set->last_gens, 
+                                      n_hs * sizeof(uint32_t));
+        if (last_gens != NULL)
+            set->last_gens = last_gens;
+        if (last_hs == NULL || last_gens == NULL)
+            return FALSE;
+        set->cap_last = n_hs;
+    }
+
+    for (DWORD i = 0; i < n_hs; i++) {
+        int fd = compat_fd(hs[i]);
+        if (fd < 0) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+        uint32_t gen = __atomic_load_n(&handle_gens[fd], __ATOMIC_RELAXED);
+
+        // In the last wait too, maybe after one that's gone since
+        if (last_i + 1 < set->n_last && set->last_hs[last_i] != hs[i]
+             && set->last_hs[last_i + 1] == hs[i])
+            last_i++;
+        BOOL was_waited_on = last_i < set->n_last 
+                              && set->last_hs[last_i] == hs[i]
+                              && set->last_gens[last_i] == gen;
+        last_i++;
+        if (was_waited_on)
+            continue;
+
+        if (compat_is_console(fd))
+            return FALSE;
+        epoll_entry_t *entry = &set->entries[fd];
+        if (!entry->registered || entry->gen != gen) {
+            event.events = EPOLLIN;
+            event.data.u64 = (uint64_t)gen << 32 | (uint32_t)fd;
+            int rc = epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            // A duplicate of an fd that was added under the same number
+            if (rc != 0 && errno == EEXIST)
+                rc = epoll_ctl(set->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+            if (rc != 0)
+                return FALSE;
+            entry->registered = TRUE;
+            entry->gen = gen;
+        }
+    }
+
+    // The handles are only copied once they're all in the set
+    memcpy(set->last_hs, hs, n_hs * sizeof(HANDLE));
+    for (DWORD i = 0; i < n_hs; i++)
+        set->last_gens[i] = handle_gens[compat_fd(hs[i])];
+    set->n_last = n_hs;
+    return TRUE;
+}
+
+
+
+/**
+ * find_ready
+ *
+ * Finds the lowest index in hs of the fds epoll_wait returned. If none of
+ * them is in hs, they're taken out of the set: nothing waits on them any
+ * more.
+ *
+ * Return Value: Returns the index, n_hs if there isn't one.
+ */
+static DWORD find_ready(epoll_set_t *set, DWORD n_hs, const HANDLE *hs,
+                        const struct epoll_event *events, int n_events) {
+
+    DWORD ready_i = n_hs;
+
+    for (int i = 0; i < n_events; i++) {
+        int fd = (int)(uint32_t)events[i].data.u64;
+        set->ready[fd / 64] |= 1ULL << (fd % 64);
+    }
+    for (DWORD i = 0; i < n_hs && ready_i == n_hs; i++) {
+        int fd = compat_fd(hs[i]);
+        if (set->ready[fd / 64] & (1ULL << (fd % 64)))
+            ready_i = i;
+    }
+    for (int i = 0; i < n_events; i++) {
+        int fd = (int)(uint32_t)events[i].data.u64;
+        set->ready[fd / 64] &= ~(1ULL << (fd % 64));
+        if (ready_i == n_hs) {
+            epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            set->entries[fd].registered = FALSE;
+        }
+    }
+    return ready_i;
+}
+
+
+
+/**
+ * wait_epoll_set
+ *
+ * compat_wait_any on the calling thread's epoll set.
+ *
+ * out_rc: compat_wait_any's return value is placed here.
+ *
+ * Return Value: Returns TRUE if it waited, FALSE if the handles have to be
+ *               polled instead.
+ */
+static BOOL wait_epoll_set(DWORD n_hs, const HANDLE *hs, DWORD timeout_ms,
+                           int32_t *out_rc) {
+
+    struct epoll_event events[EPOLL_EVENTS_CAP];
+
+    epoll_set_t *set = open_epoll_set(FALSE);
+    if (set == NULL)
+        return FALSE;
+
+    uint64_t deadline = compat_now() + (uint64_t)timeout_ms * 10000;
+    while (TRUE) {
+
+        SetLastError(ERROR_SUCCESS);
+        if (!prepare_epoll_set(set, n_hs, hs)) {
+            set->n_last = 0;
+            if (GetLastError() == ERROR_SUCCESS)
+                return FALSE;
+            *out_rc = COMPAT_WAIT_FAILED;
+            return TRUE;
+        }
+
+        int epoll_timeout = -1;
+        if (timeout_ms != INFINITE) {
+            uint64_t now = compat_now();
+            epoll_timeout = now >= deadline
+                             ? 0 : (int)((deadline - now + 9999) / 10000);
+        }
+
+        int n_ready = epoll_wait(
+            set->epoll_fd, 
+            events, 
+            EPOLL_EVENTS_CAP, 
+            epoll_timeout
+        );
+        if (n_ready < 0 && errno == EINTR)
+            continue;
+        if (n_ready < 0) {
+            compat_set_errno(errno);
+            *out_rc = COMPAT_WAIT_FAILED;
+            return TRUE;
+        }
+        if (n_ready == 0) {
+            *out_rc = COMPAT_WAIT_TIMEOUT;
+            return TRUE;
+        }
+
+        // An fd that was closed (and maybe reused) while another thread's
+        // duplicate keeps its file open can't be taken out of the set
+        BOOL is_stale = FALSE;
+        for (int i = 0; i < n_ready && !is_stale; i++) {
+            epoll_entry_t *entry = 
+                &set->entries[(uint32_t)events[i].data.u64];
+            is_stale = !entry->registered 
+                        || entry->gen != (uint32_t)(events[i].data.u64 >> 32);
+        }
+        if (is_stale) {
+            set = open_epoll_set(TRUE);
+            if (set == NULL)
+                return FALSE;
+            continue;
+        }
+
+        // Lowest index first, like Windows
+        DWORD ready_i = find_ready(set, n_hs, hs, events, n_ready);
+        if (ready_i < n_hs && take_signaled(compat_fd(hs[ready_i]))) {
+            *out_rc = (int32_t)ready_i;
+            return TRUE;
+        }
+    }
+}
+
+
+
+int32_t compat_wait_any(DWORD n_hs, const HANDLE *hs, DWORD timeout_ms) {
+
+    struct pollfd stack_fds[POLL_STACK_CAP];
+    struct pollfd *fds = stack_fds;
+    int32_t rc = COMPAT_WAIT_FAILED;
+    BOOL console = FALSE;
+
+    if (n_hs == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return COMPAT_WAIT_FAILED;
+    }
+    if (n_hs >= EPOLL_MIN_HANDLES 
+         && wait_epoll_set(n_hs, hs, timeout_ms, &rc))
+        return rc;
+    if (n_hs > POLL_STACK_CAP) {
+        fds = malloc(n_hs * sizeof(struct pollfd));
+        if (fds == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return COMPAT_WAIT_FAILED;
+        }
+    }
+    for (DWORD i = 0; i < n_hs; i++) {
+        fds[i].fd = compat_fd(hs[i]);
+        fds[i].events = POLLIN;
+        if (fds[i].fd < 0) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            goto out;
+        }
+        if (compat_is_console(fds[i].fd))
+            console = TRUE;
+    }
+    if (console)
+        compat_console_wait_begin();
+
+    uint64_t deadline = compat_now() + (uint64_t)timeout_ms * 10000;
+    while (TRUE) {
+
+        int poll_timeout = -1;
+        if (timeout_ms != INFINITE) {
+            uint64_t now = compat_now();
+            poll_timeout = now >= deadline
+                            ? 0 : (int)((deadline - now + 9999) / 10000);
+        }
+
+        int n_ready = poll(fds, n_hs, poll_timeout);
+        if (n_ready < 0 && errno == EINTR)
+            continue;
+        if (n_ready < 0) {
+            compat_set_errno(errno);
+            break;
+        }
+        if (n_ready == 0) {
+            rc = COMPAT_WAIT_TIMEOUT;
+            break;
+        }
+
+        // Lowest index first, like Windows
+        for (DWORD i = 0; i < n_hs; i++) {
+            if (fds[i].revents & POLLNVAL) {
+                SetLastError(ERROR_INVALID_HANDLE);
+                goto out_console;
+            }
+            if (fds[i].revents != 0 && take_signaled(fds[i].fd)) {
+                rc = (int32_t)i;
+                goto out_console;
+            }
+        }
+    }
+
+out_console:
+    if (console) {
+        compat_console_wait_end(
+            rc >= 0 && compat_is_console(fds[rc].fd)
+        );
+    }
+out:
+    if (fds != stack_fds)
+        free(fds);
+    return rc;
+}
+
+
+
+DWORD WaitForMultipleObjects(DWORD n_hs, const HANDLE *hs, BOOL wait_all,
+                             DWORD timeout_ms) {
+
+    if (wait_all) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return WAIT_FAILED;
+    }
+    int32_t rc = compat_wait_any(n_hs, hs, timeout_ms);
+    if (rc == COMPAT_WAIT_TIMEOUT)
+        return WAIT_TIMEOUT;
+    if (rc == COMPAT_WAIT_FAILED)
+        return WAIT_FAILED;
+    return WAIT_OBJECT_0 + (DWORD)rc;
+}
+
+
+
+DWORD WaitForSingleObject(HANDLE h, DWORD timeout_ms) {
+    return WaitForMultipleObjects(1, &h, FALSE, timeout_ms);
+}
+
+
+
+/**
+ * finish_thread
+ *
+ * Records the calling thread's exit code and times, signals its HANDLEs and
+ * ends it.
+ */
+static __attribute__((noreturn)) void finish_thread(DWORD exit_code) {
+
+    compat_thread_t *thread = self_thread;
+    struct rusage usage;
+    uint64_t one = 1;
+
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+        thread->user = (uint64_t)usage.ru_utime.tv_sec * 10000000
+                        + (uint64_t)usage.ru_utime.tv_usec * 10;
+        thread->sys = (uint64_t)usage.ru_stime.tv_sec * 10000000
+                       + (uint64_t)usage.ru_stime.tv_usec * 10;
+    }
+    thread->ended = compat_now();
+
+    pthread_mutex_lock(&exit_lock);
+    __atomic_store_n(&thread->exit_code, exit_code, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&exit_lock);
+
+    while (write(thread->done_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+    close_epoll_set();
+    release_thread(thread);
+    pthread_exit(NULL);
+}
+
+
+
+/**
+ * thread_start
+ *
+ * pthread start routine of every CreateThread thread.
+ */
+static void *thread_start(void *arg) {
+
+    compat_thread_t *thread = arg;
+
+    self_thread = thread;
+    finish_thread(thread->proc(thread->arg));
+    return NULL;
+}
+
+
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES *sa, SIZE_T stack_size,
+                    LPTHREAD_START_ROUTINE proc, LPVOID arg, DWORD flags,
+                    LPDWORD out_thread_id) {
+
+    pthread_attr_t attr;
+
+    (void)sa;
+    (void)flags;
+
+    compat_thread_t *thread = calloc(1, sizeof(compat_thread_t));
+    if (thread == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    thread->proc = proc;
+    thread->arg = arg;
+    thread->exit_code = STILL_ACTIVE;
+    thread->n_refs = 2; // the thread and the returned HANDLE
+    thread->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (thread->done_fd < 0) {
+        compat_set_errno(errno);
+        free(thread);
+        return NULL;
+    }
+
+    // The HANDLE is a duplicate: it may be closed before the thread exits
+    HANDLE h = compat_wrap(
+        fcntl(thread->done_fd, F_DUPFD_CLOEXEC, 3),
+        COMPAT_THREAD
+    );
+    if (h == NULL) {
+        close(thread->done_fd);
+        free(thread);
+        return NULL;
+    }
+    compat_obj(h)->thread = thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(
+        &attr,
+        stack_size > THREAD_STACK_SIZE ? stack_size : THREAD_STACK_SIZE
+    );
+    thread->started = compat_now();
+    int rc = pthread_create(&thread->pthread, &attr, thread_start, thread);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        thread->n_refs = 1;
+        CloseHandle(h);
+        compat_set_errno(rc);
+        return NULL;
+    }
+
+    if (out_thread_id != NULL)
+        *out_thread_id = 0;
+    return h;
+}
+
+
+
+void ExitThread(DWORD exit_code) {
+
+    if (self_thread == NULL)
+        pthread_exit(NULL);
+    finish_thread(exit_code);
+}
+
+
+
+BOOL GetExitCodeThread(HANDLE thread, LPDWORD out_exit_code) {
+
+    compat_obj_t *obj = compat_obj(thread);
+    if (obj == NULL || obj->kind != COMPAT_THREAD) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    *out_exit_code = __atomic_load_n(&obj->thread->exit_code,
+                                     __ATOMIC_ACQUIRE);
+    return TRUE;
+}
+
+
+
+BOOL CancelSynchronousIo(HANDLE thread) {
+
+    compat_obj_t *obj = compat_obj(thread);
+    if (obj == NULL || obj->kind != COMPAT_THREAD) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    BOOL signaled = FALSE;
+    pthread_mutex_lock(&exit_lock);
+    if (obj->thread->exit_code == STILL_ACTIVE) {
+        __atomic_store_n(&obj->thread->cancel_io, 1, __ATOMIC_RELEASE);
+        signaled = pthread_kill(obj->thread->pthread, SIGUSR2) == 0;
+    }
+    pthread_mutex_unlock(&exit_lock);
+
+    if (!signaled) {
+        SetLastError(ERROR_NOT_FOUND);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+void ExitProcess(UINT exit_code) {
+
+    compat_console_restore();
+    fflush(NULL);
+    _exit((int)exit_code);
+}
+
+
+
+void Sleep(DWORD ms) {
+
+    struct timespec left = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (long)(ms % 1000) * 1000000
+    };
+    while (nanosleep(&left, &left) != 0 && errno == EINTR)
+        ;
+}
+
+
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs) {
+
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(cs, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+
+void DeleteCriticalSection(CRITICAL_SECTION *cs) {
+    pthread_mutex_destroy(cs);
+}
+
+
+
+void EnterCriticalSection(CRITICAL_SECTION *cs) {
+    pthread_mutex_lock(cs);
+}
+
+
+
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *cs) {
+    return pthread_mutex_trylock(cs) == 0;
+}
+
+
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs) {
+    pthread_mutex_unlock(cs);
+}
+
+
+
+ULONGLONG GetTickCount64(void) {
+    return compat_now() / 10000;
+}
+
+
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *out_count) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    out_count->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return TRUE;
+}
+
+
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *out_freq) {
+    out_freq->QuadPart = 1000000000;
+    return TRUE;
+}
+
+
+
+void GetLocalTime(SYSTEMTIME *out_time) {
+
+    struct timespec ts;
+    struct tm tm;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    out_time->wYear = (WORD)(tm.tm_year + 1900);
+    out_time->wMonth = (WORD)(tm.tm_mon + 1);
+    out_time->wDayOfWeek = (WORD)tm.tm_wday;
+    out_time->wDay = (WORD)tm.tm_mday;
+    out_time->wHour = (WORD)tm.tm_hour;
+    out_time->wMinute = (WORD)tm.tm_min;
+    out_time->wSecond = (WORD)tm.tm_sec;
+    out_time->wMilliseconds = (WORD)(ts.tv_nsec / 1000000);
+}
+
+
+
+DWORD FormatMessageW(DWORD flags, LPCVOID source, DWORD code, DWORD lang,
+                     LPWSTR buf, DWORD cap_buf, void *args) {
+
+    WCHAR message[256];
+    char errno_text[128];
+
+    (void)source;
+    (void)lang;
+    (void)args;
+
+    // print_err runs on several threads: strerror's buffer isn't safe
+    const char *text = NULL;
+    for (size_t i = 0; i < sizeof(errno_map) / sizeof(errno_map[0]); i++) {
+        if (errno_map[i].code == code) {
+            text = strerror_r(errno_map[i].err, errno_text,
+                              sizeof(errno_text));
+            break;
+        }
+    }
+    if (code == ERROR_HANDLE_EOF)
+        text = "Reached the end of the file";
+    else if (code == ERROR_BROKEN_PIPE)
+        text = "The pipe has been ended";
+
+    int len_message = text != NULL
+                       ? swprintf(message, 256, L"%s.\r\n", text)
+                       : swprintf(message, 256, L"Error %u.\r\n", code);
+    if (len_message < 0)
+        return 0;
+
+    if (flags & FORMAT_MESSAGE_ALLOCATE_BUFFER) {
+        WCHAR *copy = wcsdup(message);
+        if (copy == NULL)
+            return 0;
+        *(WCHAR **)buf = copy;
+        return (DWORD)len_message;
+    }
+    if ((DWORD)len_message >= cap_buf) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+    }
+    wcscpy(buf, message);
+    return (DWORD)len_message;
+}
+
+
+
+HANDLE LocalFree(HANDLE mem) {
+    free(mem);
+    return NULL;
+}
@@ -0,0 +1,452 @@
+
+/**
+ * windows.h
+ *
+ * The part of the Win32 API winshell uses, for building it on Linux. The
+ * compat/ directory goes first on the include path there, so this stands in
+ * for the real header; the functions are implemented by the other files in
+ * compat/ and by platform_linux.c.
+ *
+ * HANDLEs of waitable objects and open files are file descriptors plus one
+ * (so that fd 0 isn't NULL): events and thread exits are eventfds, waitable
+ * timers timerfds, processes pidfds and change notifications inotify
+ * descriptors, so any mix of them can be waited on with poll. Find handles
+ * are heap pointers. WCHAR is the platform's wchar_t (UTF-32), so WCHAR text
+ * has no surrogates.
+ */
+
+
+
+#ifndef _COMPAT_WINDOWS_H
+#define _COMPAT_WINDOWS_H
+
+
+
+// The real header brings in memcpy, malloc and friends too
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <pthread.h>
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Types
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+#define WINAPI
+#define CALLBACK
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint32_t UINT;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONGLONG;
+typedef uint64_t DWORD64;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef char CHAR;
+typedef wchar_t WCHAR;
+
+typedef void *HANDLE;
+typedef void *HINSTANCE;
+typedef void *HMODULE;
+typedef void *PVOID;
+typedef void *LPVOID;
+typedef const void *LPCVOID;
+typedef DWORD *LPDWORD;
+typedef WCHAR *PWSTR;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *PCWSTR;
+typedef const WCHAR *LPCWSTR;
+typedef char *LPSTR;
+typedef const char *LPCSTR;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        DWORD HighPart;
+    };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+/* FILETIME: 100ns units. Process and thread times are counted from an
+             arbitrary (monotonic) point, like on Windows only differences
+             between them mean anything. */
+typedef struct _FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct _SYSTEMTIME {
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct _SECURITY_ATTRIBUTES {
+    DWORD nLength;
+    LPVOID lpSecurityDescriptor;
+    BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+typedef struct _OVERLAPPED {
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    union {
+        struct {
+            DWORD Offset;
+            DWORD OffsetHigh;
+        };
+        PVOID Pointer;
+    };
+    HANDLE hEvent;
+} OVERLAPPED;
+
+typedef struct _WIN32_FIND_DATAW {
+    DWORD dwFileAttributes;
+    FILETIME ftCreationTime;
+    FILETIME ftLastAccessTime;
+    FILETIME ftLastWriteTime;
+    DWORD nFileSizeHigh;
+    DWORD nFileSizeLow;
+    DWORD dwReserved0;
+    DWORD dwReserved1;
+    WCHAR cFileName[260];
+    WCHAR cAlternateFileName[14];
+} WIN32_FIND_DATAW;
+
+typedef enum _FINDEX_INFO_LEVELS {
+    FindExInfoStandard,
+    FindExInfoBasic
+} FINDEX_INFO_LEVELS;
+
+typedef enum _FINDEX_SEARCH_OPS {
+    FindExSearchNameMatch,
+    FindExSearchLimitToDirectories
+} FINDEX_SEARCH_OPS;
+
+typedef enum _FILE_INFO_BY_HANDLE_CLASS {
+    FileAllocationInfo = 5
+} FILE_INFO_BY_HANDLE_CLASS;
+
+typedef struct _FILE_ALLOCATION_INFO {
+    LARGE_INTEGER AllocationSize;
+} FILE_ALLOCATION_INFO;
+
+typedef struct _CONSOLE_READCONSOLE_CONTROL {
+    ULONG nLength;
+    ULONG nInitialChars;
+    ULONG dwCtrlWakeupMask;
+    ULONG dwControlKeyState;
+} CONSOLE_READCONSOLE_CONTROL;
+
+/* CRITICAL_SECTION: A recursive pthread mutex. */
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+/* SRWLOCK: Only ever taken exclusively by winshell - a plain pthread mutex.
+            SRWLOCK_INIT is its static initializer. */
+typedef pthread_mutex_t SRWLOCK;
+#define SRWLOCK_INIT PTHREAD_MUTEX_INITIALIZER
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+#define TRUE 1
+#define FALSE 0
+
+#define MAX_PATH 260
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define STD_INPUT_HANDLE ((DWORD)-10)
+#define STD_OUTPUT_HANDLE ((DWORD)-11)
+#define STD_ERROR_HANDLE ((DWORD)-12)
+
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_ABANDONED_0 0x80
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED ((DWORD)0xFFFFFFFF)
+#define MAXIMUM_WAIT_OBJECTS 64
+#define STILL_ACTIVE 259
+
+#define DUPLICATE_CLOSE_SOURCE 1
+#define DUPLICATE_SAME_ACCESS 2
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_APPEND_DATA 0x0004
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define FILE_SHARE_DELETE 0x4
+#define CREATE_NEW 1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define TRUNCATE_EXISTING 5
+#define FILE_ATTRIBUTE_HIDDEN 0x2
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_ATTRIBUTE_REPARSE_POINT 0x400
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define FILE_FLAG_BACKUP_SEMANTICS 0x02000000
+#define FILE_TYPE_UNKNOWN 0
+#define FILE_TYPE_DISK 1
+#define FILE_TYPE_CHAR 2
+#define FILE_TYPE_PIPE 3
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#define FILE_NOTIFY_CHANGE_FILE_NAME 0x1
+#define FILE_NOTIFY_CHANGE_DIR_NAME 0x2
+#define LOCKFILE_FAIL_IMMEDIATELY 0x1
+#define LOCKFILE_EXCLUSIVE_LOCK 0x2
+
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_WRITE 0x2
+#define FILE_MAP_READ 0x4
+#define FILE_MAP_ALL_ACCESS 0xF001F
+
+#define CREATE_WAITABLE_TIMER_MANUAL_RESET 0x1
+
+#define CP_OEMCP 1
+#define CP_UTF8 65001
+#define MB_ERR_INVALID_CHARS 0x8
+
+#define FORMAT_MESSAGE_ALLOCATE_BUFFER 0x100
+#define FORMAT_MESSAGE_IGNORE_INSERTS 0x200
+#define FORMAT_MESSAGE_FROM_SYSTEM 0x1000
+#define LANG_NEUTRAL 0x00
+#define SUBLANG_DEFAULT 0x01
+#define MAKELANGID(p, s) ((((WORD)(s)) << 10) | (WORD)(p))
+
+#define ERROR_SUCCESS 0
+#define ERROR_INVALID_FUNCTION 1
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_PATH_NOT_FOUND 3
+#define ERROR_TOO_MANY_OPEN_FILES 4
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_NO_MORE_FILES 18
+#define ERROR_WRITE_FAULT 29
+#define ERROR_READ_FAULT 30
+#define ERROR_SHARING_VIOLATION 32
+#define ERROR_LOCK_VIOLATION 33
+#define ERROR_HANDLE_EOF 38
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_FILE_EXISTS 80
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_BROKEN_PIPE 109
+#define ERROR_DISK_FULL 112
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_INVALID_NAME 123
+#define ERROR_DIR_NOT_EMPTY 145
+#define ERROR_BUSY 170
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_FILENAME_EXCED_RANGE 206
+#define ERROR_NO_DATA 232
+#define ERROR_MORE_DATA 234
+#define ERROR_DIRECTORY 267
+#define ERROR_NOT_FOUND 1168
+#define ERROR_NO_UNICODE_TRANSLATION 1113
+#define ERROR_OPERATION_ABORTED 995
+#define ERROR_IO_PENDING 997
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Handles, synchronization and threads (compat/win32_sync.c)
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+BOOL CloseHandle(HANDLE h);
+BOOL DuplicateHandle(HANDLE src_proc, HANDLE h, HANDLE dst_proc,
+                     HANDLE *out_h, DWORD access, BOOL inherit,
+                     DWORD options);
+HANDLE GetCurrentProcess(void);
+DWORD GetCurrentProcessId(void);
+DWORD GetCurrentThreadId(void);
+
+HANDLE CreateEventW(SECURITY_ATTRIBUTES *sa, BOOL manual_reset,
+                    BOOL initial_state, LPCWSTR name);
+BOOL SetEvent(HANDLE event);
+BOOL ResetEvent(HANDLE event);
+HANDLE CreateMutexW(SECURITY_ATTRIBUTES *sa, BOOL initial_owner,
+                    LPCWSTR name);
+BOOL ReleaseMutex(HANDLE mutex);
+HANDLE CreateWaitableTimerW(SECURITY_ATTRIBUTES *sa, BOOL manual_reset,
+                            LPCWSTR name);
+BOOL SetWaitableTimer(HANDLE timer, const LARGE_INTEGER *due, LONG period,
+                      void *completion_routine, LPVOID arg, BOOL resume);
+DWORD WaitForSingleObject(HANDLE h, DWORD timeout_ms);
+DWORD WaitForMultipleObjects(DWORD n_hs, const HANDLE *hs, BOOL wait_all,
+                             DWORD timeout_ms);
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES *sa, SIZE_T stack_size,
+                    LPTHREAD_START_ROUTINE proc, LPVOID arg, DWORD flags,
+                    LPDWORD out_thread_id);
+void ExitThread(DWORD exit_code) __attribute__((noreturn));
+BOOL GetExitCodeThread(HANDLE thread, LPDWORD out_exit_code);
+BOOL CancelSynchronousIo(HANDLE thread);
+void ExitProcess(UINT exit_code) __attribute__((noreturn));
+void Sleep(DWORD ms);
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+void DeleteCriticalSection(CRITICAL_SECTION *cs);
+void EnterCriticalSection(CRITICAL_SECTION *cs);
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *cs);
+void LeaveCriticalSection(CRITICAL_SECTION *cs);
+#define AcquireSRWLockExclusive(lock) pthread_mutex_lock(lock)
+#define ReleaseSRWLockExclusive(lock) pthread_mutex_unlock(lock)
+
+#define InterlockedIncrement(p) \
+    ({ __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST); })
+#define InterlockedDecrement(p) \
+    ({ __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST); })
+#define InterlockedExchange(p, v) \
+    ({ __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST); })
+#define InterlockedExchange64 InterlockedExchange
+#define InterlockedExchangePointer InterlockedExchange
+#define InterlockedExchangeAdd(p, v) \
+    ({ __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST); })
+#define InterlockedExchangeAdd64 InterlockedExchangeAdd
+#define InterlockedCompareExchange(p, v, cmp) \
+    __sync_val_compare_and_swap((p), (cmp), (v))
+
+ULONGLONG GetTickCount64(void);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *out_count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *out_freq);
+void GetLocalTime(SYSTEMTIME *out_time);
+
+DWORD GetLastError(void);
+void SetLastError(DWORD code);
+DWORD FormatMessageW(DWORD flags, LPCVOID source, DWORD code, DWORD lang,
+                     LPWSTR buf, DWORD cap_buf, void *args);
+HANDLE LocalFree(HANDLE mem);
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Files and paths (compat/win32_file.c)
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+HANDLE CreateFileW(LPCWSTR path, DWORD access, DWORD share,
+                   SECURITY_ATTRIBUTES *sa, DWORD disposition, DWORD flags,
+                   HANDLE template_h);
+BOOL ReadFile(HANDLE h, LPVOID buf, DWORD n_bytes, LPDWORD out_n_read,
+              OVERLAPPED *overlapped);
+BOOL WriteFile(HANDLE h, LPCVOID buf, DWORD n_bytes, LPDWORD out_n_written,
+               OVERLAPPED *overlapped);
+BOOL GetFileSizeEx(HANDLE h, LARGE_INTEGER *out_size);
+DWORD GetFileType(HANDLE h);
+BOOL SetEndOfFile(HANDLE h);
+BOOL SetFileInformationByHandle(HANDLE h, FILE_INFO_BY_HANDLE_CLASS info_class,
+                                LPVOID info, DWORD len_info);
+BOOL LockFileEx(HANDLE h, DWORD flags, DWORD reserved, DWORD len_low,
+                DWORD len_high, OVERLAPPED *overlapped);
+BOOL UnlockFileEx(HANDLE h, DWORD reserved, DWORD len_low, DWORD len_high,
+                  OVERLAPPED *overlapped);
+HANDLE CreateFileMappingW(HANDLE file_h, SECURITY_ATTRIBUTES *sa,
+                          DWORD protect, DWORD size_high, DWORD size_low,
+                          LPCWSTR name);
+LPVOID MapViewOfFile(HANDLE map_h, DWORD access, DWORD off_high,
+                     DWORD off_low, SIZE_T n_bytes);
+BOOL UnmapViewOfFile(LPCVOID view);
+
+DWORD GetFileAttributesW(LPCWSTR path);
+BOOL DeleteFileW(LPCWSTR path);
+HANDLE FindFirstFileExW(LPCWSTR pattern, FINDEX_INFO_LEVELS info_level,
+                        LPVOID out_data, FINDEX_SEARCH_OPS search_op,
+                        LPVOID search_filter, DWORD flags);
+BOOL FindNextFileW(HANDLE find_h, WIN32_FIND_DATAW *out_data);
+BOOL FindClose(HANDLE find_h);
+HANDLE FindFirstChangeNotificationW(LPCWSTR dir, BOOL watch_subtree,
+                                    DWORD filter);
+BOOL FindNextChangeNotification(HANDLE change_h);
+BOOL FindCloseChangeNotification(HANDLE change_h);
+
+DWORD GetCurrentDirectoryW(DWORD cap_buf, LPWSTR buf);
+DWORD GetFullPathNameW(LPCWSTR path, DWORD cap_buf, LPWSTR buf,
+                       LPWSTR *out_file_part);
+DWORD SearchPathW(LPCWSTR dirs, LPCWSTR name, LPCWSTR ext, DWORD cap_buf,
+                  LPWSTR buf, LPWSTR *out_file_part);
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Console (compat/win32_console.c)
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+HANDLE GetStdHandle(DWORD std_handle);
+BOOL GetConsoleMode(HANDLE h, LPDWORD out_mode);
+BOOL ReadConsoleW(HANDLE h, LPVOID buf, DWORD cap_buf, LPDWORD out_n_read,
+                  CONSOLE_READCONSOLE_CONTROL *control);
+BOOL WriteConsoleW(HANDLE h, const void *buf, DWORD n_wchars,
+                   LPDWORD out_n_written, LPVOID reserved);
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Environment and text (compat/win32_env.c)
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+DWORD GetEnvironmentVariableW(LPCWSTR name, LPWSTR buf, DWORD cap_buf);
+LPWSTR GetEnvironmentStringsW(void);
+BOOL FreeEnvironmentStringsW(LPWSTR env);
+int MultiByteToWideChar(UINT code_page, DWORD flags, LPCSTR src, int len_src,
+                        LPWSTR dst, int cap_dst);
+int StrToIntW(LPCWSTR str);
+
+#define _wcsicmp wcscasecmp
+#define _wcsnicmp wcsncasecmp
+#define _wcsdup wcsdup
+#define _snwprintf swprintf
+
+/* wWinMain: winshell's entry point. compat/win32_env.c has the main that
+             calls it. */
+int WINAPI wWinMain(HINSTANCE instance, HINSTANCE prev_instance,
+                    PWSTR cmd_line, int cmd_show);
+
+
+
+// ifndef _COMPAT_WINDOWS_H
+#endif
@@ -0,0 +1,295 @@
+
+/**
+ * complete_cmdline.c
+ */
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <string.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* MAX_LISTED_CANDIDATES: Most candidates listed when a completion is
+                          ambiguous. Small enough that the listing never
+                          reaches OUT_STREAM_FLUSH_AT. */
+#define MAX_LISTED_CANDIDATES 200
+
+
+
+/* builtin_names: Builtins, completed as commands. */
+static const WCHAR *builtin_names[] = {
+    L"alias", L"cat", L"cd", L"echo", L"env", L"exit", L"false", 
+    L"history", L"jobs", L"kill", L"pipestat", L"printf", L"pwd", L"sleep",
+    L"stats", L"time", L"trace", L"true", L"unalias",
+    L"xargs"
+};
+
+
+
+/**
+ * candidates_t
+ *
+ * Running state while candidates are collected: the count, the longest
+ * common prefix, the first candidate and the listing shown if the completion
+ * is ambiguous.
+ */
+typedef struct _candidates {
+    int32_t n;
+    WCHAR lcp[MAX_PATH + 1];
+    int32_t len_lcp;
+    WCHAR first[MAX_PATH + 1];
+    BOOL first_is_dir;
+    out_stream_t *list;
+} candidates_t;
+
+
+
+/**
+ * add_candidate
+ *
+ * Adds a candidate name: narrows the longest common prefix (case-insensitive)
+ * and appends the name to the listing.
+ */
+static void add_candidate(candidates_t *cands, const WCHAR *name,
+                          BOOL is_dir) {
+
+    int32_t len_name = (int32_t)wcslen(name);
+    if (len_name > MAX_PATH)
+        return;
+
+    if (cands->n == 0) {
+        memcpy(cands->first, name, (len_name + 1) * sizeof(WCHAR));
+        memcpy(cands->lcp, name, (len_name + 1) * sizeof(WCHAR));
+        cands->len_lcp = len_name;
+        cands->first_is_dir = is_dir;
+    }
+    else {
+        int32_t i = 0;
+        while (i < cands->len_lcp and i < len_name
+                and towlower(cands->lcp[i]) == towlower(name[i]))
+            i++;
+        cands->len_lcp = i;
+    }
+
+    if (cands->n < MAX_LISTED_CANDIDATES) {
+        WCHAR dir_suffix[] = { PLAT_PATH_SEP, L' ', L' ', L'\0' };
+        out_stream_puts(cands->list, name);
+        out_stream_puts(cands->list, is_dir ? dir_suffix : dir_suffix + 1);
+    }
+    cands->n++;
+}
+
+
+
+/**
+ * add_dir_candidates
+ *
+ * Adds the names in dir that start with prefix.
+ *
+ * exes_only: If TRUE, only files that are commands (plat_is_command) are
+ *            added.
+ */
+static void add_dir_candidates(candidates_t *cands, const WCHAR *dir,
+                               const WCHAR *prefix, int32_t len_prefix,
+                               BOOL exes_only) {
+
+    int32_t first;
+
+    const dir_listing_t *listing = dir_cache_get(dir);
+    if (listing == NULL)
+        return;
+    int32_t n_matches = dir_listing_find_prefix(
+        listing,
+        prefix,
+        len_prefix,
+        &first
+    );
+    for (int32_t i = first; i < first + n_matches; i++) {
+        const WCHAR *name = listing->name_pool + listing->names[i];
+        if (exes_only and (listing->is_dir[i]
+                            or not plat_is_command(dir, name)))
+            continue;
+        add_candidate(cands, name, listing->is_dir[i]);
+    }
+}
+
+
+
+/**
+ * add_path_candidates
+ *
+ * Adds the builtins and the executables in every PATH directory that start
+ * with prefix.
+ */
+static void add_path_candidates(candidates_t *cands, const WCHAR *prefix,
+                                int32_t len_prefix) {
+
+    static WCHAR path[32768];
+
+    for (int i = 0; i < sizeof(builtin_names) / sizeof(*builtin_names); i++) {
+        if (_wcsnicmp(builtin_names[i], prefix, len_prefix) == 0)
+            add_candidate(cands, builtin_names[i], FALSE);
+    }
+
+    DWORD len_path = GetEnvironmentVariableW(L"PATH", path, 32768);
+    if (len_path == 0 or len_path >= 32768)
+        return;
+
+    WCHAR *dir_p = path;
+    while (*dir_p != L'\0') {
+        WCHAR *semi_p = wcschr(dir_p, L';');
+        if (semi_p != NULL)
+            *semi_p = L'\0';
+        if (*dir_p != L'\0')
+            add_dir_candidates(cands, dir_p, prefix, len_prefix, TRUE);
+        if (semi_p == NULL)
+            break;
+        dir_p = semi_p + 1;
+    }
+}
+
+
+
+/**
+ * add_jid_candidates
+ *
+ * Adds the jids of live jobs that start with prefix.
+ */
+static void add_jid_candidates(candidates_t *cands, const WCHAR *prefix,
+                               int32_t len_prefix) {
+
+    WCHAR jid_str[16];
+
+    for (int32_t jid = live_jobs_head; jid >= 0; jid = jobs[jid].next_live) {
+        _snwprintf(jid_str, 16, L"%d", jid);
+        if (wcsncmp(jid_str, prefix, len_prefix) == 0)
+            add_candidate(cands, jid_str, FALSE);
+    }
+}
+
+
+
+/**
+ * complete_cmdline
+ *
+ * Completes the last word of a partially typed line in place:
+ *  - the first word of a pipeline stage completes to a builtin or an
+ *    executable in PATH (or a path if it contains a '\' or '/')
+ *  - the argument of kill completes to a live jid
+ *  - anything else completes to a file or directory path
+ * A unique match is completed fully. Otherwise the word is extended to the
+ * longest common prefix of the matches, and if that adds nothing the matches
+ * are listed.
+ *
+ * line: Line being typed, with room for MAX_CMDLINE + 1 WCHARs. Doesn't need
+ *       to be NULL-terminated.
+ * in_out_len_line: Length of line. Updated to the completed length.
+ * candidates_out: The listing of ambiguous matches is written here.
+ *
+ * Return Value: Returns TRUE if matches were listed to candidates_out.
+ */
+BOOL complete_cmdline(WCHAR *line, int32_t *in_out_len_line,
+                      out_stream_t *candidates_out) {
+
+    int32_t len_line = *in_out_len_line;
+    candidates_t cands = { .n = 0, .list = candidates_out };
+    WCHAR dir[MAX_PATH + 1];
+
+    // Find the word being completed
+    int32_t word_start = len_line;
+    while (word_start > 0 and not iswspace(line[word_start - 1])
+            and line[word_start - 1] != L'|')
+        word_start--;
+    BOOL quoted = word_start < len_line and line[word_start] == L'"';
+    int32_t name_start = word_start + (quoted ? 1 : 0);
+    for (int32_t i = name_start; i < len_line; i++) {
+        if (line[i] == L'\\' or line[i] == L'/')
+            name_start = i + 1;
+    }
+    const WCHAR *name = line + name_start;
+    int32_t len_name = len_line - name_start;
+
+    // What kind of word is it?
+    int32_t prev_end = word_start;
+    while (prev_end > 0 and iswspace(line[prev_end - 1]))
+        prev_end--;
+    int32_t prev_start = prev_end;
+    while (prev_start > 0 and not iswspace(line[prev_start - 1])
+            and line[prev_start - 1] != L'|')
+        prev_start--;
+    BOOL has_dir = name_start > word_start + (quoted ? 1 : 0);
+    BOOL is_command = prev_end == 0
+                       or (line[prev_end - 1] == L'|'
+                            and (prev_end < 2 or line[prev_end - 2] != L'>'));
+    BOOL is_jid = not is_command and prev_end - prev_start == 4
+                   and wcsncmp(line + prev_start, L"kill", 4) == 0;
+
+    // Collect candidates
+    if (is_jid) {
+        add_jid_candidates(&cands, name, len_name);
+    }
+    else if (is_command and not has_dir) {
+        add_path_candidates(&cands, name, len_name);
+    }
+    else {
+        int32_t dir_start = word_start + (quoted ? 1 : 0);
+        int32_t len_dir = name_start - dir_start;
+        if (len_dir > MAX_PATH)
+            return FALSE;
+        memcpy(dir, line + dir_start, len_dir * sizeof(WCHAR));
+        dir[len_dir] = L'\0';
+        if (len_dir == 0)
+            wcscpy(dir, L".");
+        add_dir_candidates(&cands, dir, name, len_name, FALSE);
+    }
+
+    if (cands.n == 0) {
+        candidates_out->len = 0;
+        return FALSE;
+    }
+
+    // Unique: complete fully, add a separator
+    if (cands.n == 1) {
+        int32_t len_first = (int32_t)wcslen(cands.first);
+        BOOL needs_quotes = not quoted and not is_jid
+                             and wcschr(cands.first, L' ') != NULL;
+        if (name_start + len_first + 3 > MAX_CMDLINE) {
+            candidates_out->len = 0;
+            return FALSE;
+        }
+        if (needs_quotes) {
+            memmove(line + word_start + 1, line + word_start,
+                    (name_start - word_start) * sizeof(WCHAR));
+            line[word_start] = L'"';
+            name_start++;
+            quoted = TRUE;
+        }
+        memcpy(line + name_start, cands.first, len_first * sizeof(WCHAR));
+        len_line = name_start + len_first;
+        if (cands.first_is_dir) {
+            line[len_line++] = PLAT_PATH_SEP;
+        }
+        else {
+            if (quoted)
+                line[len_line++] = L'"';
+            line[len_line++] = L' ';
+        }
+        *in_out_len_line = len_line;
+        candidates_out->len = 0;
+        return FALSE;
+    }
+
+    // Ambiguous: extend to the common prefix, or list the matches
+    if (cands.len_lcp > len_name and name_start + cands.len_lcp <= MAX_CMDLINE) {
+        memcpy(line + name_start, cands.lcp, cands.len_lcp * sizeof(WCHAR));
+        *in_out_len_line = name_start + cands.len_lcp;
+        candidates_out->len = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
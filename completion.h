@@ -0,0 +1,57 @@
+
+/**
+ * completion.h
+ *
+ * completion_t struct defined here.
+ */
+
+
+
+#ifndef _COMPLETION_H
+#define _COMPLETION_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+#include "job_arena.h"
+
+
+
+/**
+ * completion_t struct
+ *
+ * Record of a job that finished, on its own or killed (kill, exit). The
+ * job's slot is freed as soon as its last process is reaped; this is what
+ * "jobs" reports about it afterwards.
+ */
+typedef struct _completion {
+
+    /* jid: jid the job had (may have been reused since). */
+    int32_t jid;
+
+    /* arena: The job's arena, kept alive for cmdline. Released when the
+              record is overwritten. */
+    job_arena_t *arena;
+
+    /* cmdline, len_cmdline: Command that spawned the job. */
+    const wchar_t *cmdline;
+    int32_t len_cmdline;
+
+    /* exit_code: Exit code of the job's last process. */
+    DWORD exit_code;
+
+    /* was_terminated: Was the job killed rather than finishing on its own? */
+    BOOL was_terminated;
+
+    /* started_at, finished_at: Tick counts when the job was spawned and when
+                                its last process was reaped. */
+    ULONGLONG started_at;
+    ULONGLONG finished_at;
+
+} completion_t;
+
+
+
+// ifndef _COMPLETION_H
+#endif
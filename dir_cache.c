@@ -0,0 +1,327 @@
+
+/**
+ * dir_cache.c
+ *
+ * Directory listing cache used by completion. A listing is read once with a
+ * large-fetch FindFirstFileExW and kept until its change notification HANDLE
+ * is signaled.
+ *
+ * Note: Only the cmdline reader thread uses the cache.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* DIR_CACHE_CAP: Number of directories kept in the cache. The least recently
+                  used one is evicted when it's full. */
+#define DIR_CACHE_CAP 128
+
+/* DIR_CACHE_TTL_MS: How long a listing is trusted when its directory doesn't
+                     support change notifications. */
+#define DIR_CACHE_TTL_MS 2000
+
+
+
+static dir_listing_t dir_cache[DIR_CACHE_CAP];
+
+
+
+/* sort_pool: name_pool being sorted (qsort has no context argument). */
+static const WCHAR *sort_pool;
+
+/**
+ * cmp_names
+ *
+ * qsort comparator for name offsets (case-insensitive).
+ */
+static int cmp_names(const void *a, const void *b) {
+    return _wcsicmp(
+        sort_pool + *(const int32_t *)a,
+        sort_pool + *(const int32_t *)b
+    );
+}
+
+
+
+/**
+ * free_listing
+ *
+ * Frees a listing's names and closes its change HANDLE. Keeps dir.
+ */
+static void free_listing(dir_listing_t *listing) {
+
+    free(listing->names);
+    free(listing->is_dir);
+    free(listing->name_pool);
+    listing->names = NULL;
+    listing->is_dir = NULL;
+    listing->name_pool = NULL;
+    listing->n_names = 0;
+    if (listing->change_h != NULL and listing->change_h != INVALID_HANDLE_VALUE)
+        FindCloseChangeNotification(listing->change_h);
+    listing->change_h = NULL;
+}
+
+
+
+/**
+ * read_listing
+ *
+ * (Re)reads listing->dir. The change notification is armed before the
+ * directory is read so that no change can be missed.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL read_listing(dir_listing_t *listing) {
+
+    WIN32_FIND_DATAW find_data;
+    WCHAR pattern[MAX_PATH + 3];
+
+    free_listing(listing);
+
+    listing->change_h = FindFirstChangeNotificationW(
+        listing->dir,
+        FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME
+    );
+
+    size_t len_dir = wcslen(listing->dir);
+    if (len_dir + 2 > MAX_PATH + 2)
+        return FALSE;
+    memcpy(pattern, listing->dir, len_dir * sizeof(WCHAR));
+    if (len_dir > 0 and pattern[len_dir - 1] != L'\\')
+        pattern[len_dir++] = L'\\';
+    pattern[len_dir++] = L'*';
+    pattern[len_dir] = L'\0';
+
+    HANDLE find_h = FindFirstFileExW(
+        pattern,
+        FindExInfoBasic,
+        &find_data,
+        FindExSearchNameMatch,
+        NULL,
+        FIND_FIRST_EX_LARGE_FETCH
+    );
+    if (find_h == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    int32_t cap_names = 256, len_pool = 0, cap_pool = 4096;
+    listing->names = malloc(cap_names * sizeof(int32_t));
+    listing->is_dir = malloc(cap_names);
+    listing->name_pool = malloc(cap_pool * sizeof(WCHAR));
+    if (listing->names == NULL or listing->is_dir == NULL
+         or listing->name_pool == NULL) {
+        FindClose(find_h);
+        free_listing(listing);
+        return FALSE;
+    }
+
+    do {
+        const WCHAR *name = find_data.cFileName;
+        if (wcscmp(name, L".") == 0 or wcscmp(name, L"..") == 0)
+            continue;
+        int32_t len_name = (int32_t)wcslen(name);
+
+        // Grow
+        if (listing->n_names == cap_names) {
+            cap_names *= 2;
+            int32_t *new_names = realloc(listing->names,
+                                         cap_names * sizeof(int32_t));
+            BYTE *new_is_dir = realloc(listing->is_dir, cap_names);
+            if (new_names != NULL)
+                listing->names = new_names;
+            if (new_is_dir != NULL)
+                listing->is_dir = new_is_dir;
+            if (new_names == NULL or new_is_dir == NULL)
+                break;
+        }
+        if (len_pool + len_name + 1 > cap_pool) {
+            while (len_pool + len_name + 1 > cap_pool)
+                cap_pool *= 2;
+            WCHAR *new_pool = realloc(listing->name_pool,
+                                      cap_pool * sizeof(WCHAR));
+            if (new_pool == NULL)
+                break;
+            listing->name_pool = new_pool;
+        }
+
+        memcpy(listing->name_pool + len_pool, name,
+               (len_name + 1) * sizeof(WCHAR));
+        listing->names[listing->n_names] = len_pool;
+        listing->is_dir[listing->n_names] =
+            (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        listing->n_names++;
+        len_pool += len_name + 1;
+
+    } while (FindNextFileW(find_h, &find_data));
+    FindClose(find_h);
+    listing->read_at = GetTickCount64();
+
+    // Sort offsets and carry is_dir along via the pool: directories are
+    // marked by looking them up again after the sort
+    BYTE *is_dir_by_off = calloc(len_pool > 0 ? len_pool : 1, 1);
+    if (is_dir_by_off != NULL) {
+        for (int32_t i = 0; i < listing->n_names; i++)
+            is_dir_by_off[listing->names[i]] = listing->is_dir[i];
+    }
+    sort_pool = listing->name_pool;
+    qsort(listing->names, listing->n_names, sizeof(int32_t), cmp_names);
+    if (is_dir_by_off != NULL) {
+        for (int32_t i = 0; i < listing->n_names; i++)
+            listing->is_dir[i] = is_dir_by_off[listing->names[i]];
+        free(is_dir_by_off);
+    }
+
+    return TRUE;
+}
+
+
+
+/**
+ * dir_cache_get
+ *
+ * Gets the listing of a directory, reading it if it isn't cached or has
+ * changed since it was read.
+ *
+ * dir: Directory path (relative paths are taken from shell_cwd).
+ *
+ * Return Value: Returns the listing, valid until the next dir_cache_get.
+ *               Returns NULL if the directory can't be read.
+ */
+const dir_listing_t *dir_cache_get(const WCHAR *dir) {
+
+    WCHAR full_dir[MAX_PATH + 1];
+
+    if (not make_abs_path(shell_cwd, dir, full_dir))
+        return NULL;
+
+    ULONGLONG now = GetTickCount64();
+    dir_listing_t *listing = NULL, *lru = &dir_cache[0];
+
+    for (int32_t i = 0; i < DIR_CACHE_CAP; i++) {
+        dir_listing_t *curr = &dir_cache[i];
+        if (curr->dir != NULL and _wcsicmp(curr->dir, full_dir) == 0) {
+            listing = curr;
+            break;
+        }
+        if (curr->dir == NULL) {
+            if (lru->dir != NULL)
+                lru = curr; // prefer an unused slot
+        }
+        else if (lru->dir != NULL and curr->last_used < lru->last_used) {
+            lru = curr;
+        }
+    }
+
+    // Hit: reread only if the directory changed
+    if (listing != NULL) {
+        listing->last_used = now;
+        BOOL has_notify = listing->change_h != NULL
+                           and listing->change_h != INVALID_HANDLE_VALUE;
+        if ((has_notify 
+              and WaitForSingleObject(listing->change_h, 0) == WAIT_OBJECT_0)
+             or (not has_notify 
+                  and now - listing->read_at > DIR_CACHE_TTL_MS)) {
+            if (not read_listing(listing))
+                return NULL;
+        }
+        return listing;
+    }
+
+    // Miss: evict the least recently used slot
+    free_listing(lru);
+    free(lru->dir);
+    lru->dir = _wcsdup(full_dir);
+    if (lru->dir == NULL)
+        return NULL;
+    lru->last_used = now;
+    if (not read_listing(lru)) {
+        free(lru->dir);
+        lru->dir = NULL;
+        return NULL;
+    }
+    return lru;
+}
+
+
+
+/**
+ * dir_listing_find_prefix
+ *
+ * Finds the names in a listing that start with prefix (case-insensitive).
+ *
+ * listing: Listing to search.
+ * prefix: Prefix to look for (doesn't need to be NULL-terminated).
+ * len_prefix: Number of WCHARs in prefix.
+ * out_first: Index into listing->names of the first match is placed here.
+ *
+ * Return Value: Returns the number of matches (they are contiguous).
+ */
+int32_t dir_listing_find_prefix(const dir_listing_t *listing,
+                                const WCHAR *prefix,
+                                int32_t len_prefix,
+                                int32_t *out_first) {
+
+    int32_t lo = 0, hi = listing->n_names;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        const WCHAR *name = listing->name_pool + listing->names[mid];
+        if (_wcsnicmp(name, prefix, len_prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int32_t first = lo;
+    hi = listing->n_names;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        const WCHAR *name = listing->name_pool + listing->names[mid];
+        if (_wcsnicmp(name, prefix, len_prefix) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *out_first = first;
+    return lo - first;
+}
+
+
+
+/**
+ * dir_cache_warm
+ *
+ * Reads the current directory and every PATH directory into the cache (only
+ * the ones that aren't cached or have changed). Called by the cmdline reader
+ * thread while it's idle so that completion doesn't have to list them.
+ */
+void dir_cache_warm() {
+
+    static WCHAR path[32768];
+
+    dir_cache_get(L".");
+
+    DWORD len_path = GetEnvironmentVariableW(L"PATH", path, 32768);
+    if (len_path == 0 or len_path >= 32768)
+        return;
+
+    WCHAR *dir_p = path;
+    while (*dir_p != L'\0') {
+        WCHAR *semi_p = wcschr(dir_p, L';');
+        if (semi_p != NULL)
+            *semi_p = L'\0';
+        if (*dir_p != L'\0')
+            dir_cache_get(dir_p);
+        if (semi_p == NULL)
+            break;
+        dir_p = semi_p + 1;
+    }
+}
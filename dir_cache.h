@@ -0,0 +1,60 @@
+
+/**
+ * dir_cache.h
+ *
+ * dir_listing_t struct defined here.
+ */
+
+
+
+#ifndef _DIR_CACHE_H
+#define _DIR_CACHE_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/**
+ * dir_listing_t struct
+ *
+ * Cached listing of one directory, used for completion. Names are sorted
+ * case-insensitively so that a prefix lookup is a binary search.
+ */
+typedef struct _dir_listing {
+
+    /* dir: Full path of the directory (heap-allocated). NULL if this cache 
+            slot is unused. */
+    WCHAR *dir;
+
+    /* change_h: FindFirstChangeNotificationW HANDLE for dir. Signaled once a
+                 file is added, removed or renamed - the listing is stale. */
+    HANDLE change_h;
+
+    /* names: Offsets into name_pool of each NULL-terminated name, sorted. */
+    int32_t *names;
+
+    /* is_dir: is_dir[i] is TRUE if names[i] is a directory. */
+    BYTE *is_dir;
+
+    /* n_names: Number of names. */
+    int32_t n_names;
+
+    /* name_pool: All the names, back to back (heap-allocated). */
+    WCHAR *name_pool;
+
+    /* read_at: Tick count when the listing was read. Only used for 
+                directories that don't support change notifications. */
+    ULONGLONG read_at;
+
+    /* last_used: Tick count of the last lookup, for eviction. */
+    ULONGLONG last_used;
+
+} dir_listing_t;
+
+
+
+// ifndef _DIR_CACHE_H
+#endif
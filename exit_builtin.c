@@ -7,70 +7,286 @@
 
 #include <windows.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <wctype.h>
 #include <iso646.h>
 #include "_winshell_private.h"
 
 
 
+/* EXIT_GRACE_MS: How long jobs get to exit after being asked to, before 
+                  they're killed. WINSHELL_EXIT_GRACE_MS overrides it (0 kills
+                  right away). */
+#define EXIT_GRACE_MS 1000
+
+/* EXIT_KILL_WAIT_MS: How long killed processes get to go away before they're
+                      reported as survivors. */
+#define EXIT_KILL_WAIT_MS 5000
+
+/* WAIT_WINDOW: Most processes waited on by a single plat_wait_any. */
+#define WAIT_WINDOW 64
+
+/* WAIT_SLICE_MS: With more than WAIT_WINDOW processes, each window is waited
+                  on this long before moving on to the next one. */
+#define WAIT_SLICE_MS 20
+
+
+
+/**
+ * exit_grace_ms
+ * 
+ * Return Value: Returns WINSHELL_EXIT_GRACE_MS if it's set to a number, else
+ *               EXIT_GRACE_MS.
+ */
+static DWORD exit_grace_ms() {
+
+    WCHAR value[16];
+
+    DWORD len_value = GetEnvironmentVariableW(
+        L"WINSHELL_EXIT_GRACE_MS", 
+        value, 
+        16
+    );
+    if (len_value == 0 or len_value >= 16 or not iswdigit(value[0]))
+        return EXIT_GRACE_MS;
+    return (DWORD)wcstoul(value, NULL, 10);
+}
+
+
+
+/**
+ * collect_proc
+ * 
+ * Collects the process at procs[i] (which has exited) and closes it. The 
+ * last process takes its place.
+ */
+static void collect_proc(HANDLE *procs, int32_t *proc_jids, 
+                         int32_t *in_out_n_procs, int32_t i) {
+
+    DWORD exit_code;
+
+    job_t *job = &jobs[proc_jids[i]];
+    if (stage_query_exit(procs[i], &exit_code)
+         and procs[i] == job->last_proc_h)
+        job->exit_code = exit_code;
+    stage_close(procs[i]);
+    (*in_out_n_procs)--;
+    procs[i] = procs[*in_out_n_procs];
+    proc_jids[i] = proc_jids[*in_out_n_procs];
+}
+
+
+
+/**
+ * wait_procs
+ * 
+ * Waits for all the given processes to exit, or for timeout_ms to pass, and
+ * collects the ones that exit. Up to WAIT_WINDOW of them are waited on at a 
+ * time; with more, the windows take turns.
+ * 
+ * procs: Processes to wait on. The ones still running are moved to the 
+ *        front.
+ * proc_jids: jid of each process, moved along with procs.
+ * n_procs: Number of processes.
+ * timeout_ms: Longest time to wait in total.
+ * 
+ * Return Value: Returns the number of processes still running.
+ */
+static int32_t wait_procs(HANDLE *procs, int32_t *proc_jids, int32_t n_procs,
+                          DWORD timeout_ms) {
+
+    ULONGLONG deadline = GetTickCount64() + timeout_ms;
+    int32_t base = 0, window, i;
+
+    while (n_procs > 0) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline)
+            break;
+        if (base >= n_procs)
+            base = 0;
+        window = n_procs - base < WAIT_WINDOW ? n_procs - base : WAIT_WINDOW;
+        DWORD slice = (DWORD)(deadline - now);
+        if (n_procs > WAIT_WINDOW and slice > WAIT_SLICE_MS)
+            slice = WAIT_SLICE_MS;
+
+        i = plat_wait_any(procs + base, window, slice);
+        if (i == PLAT_WAIT_FAILED) {
+            print_err(L"exit_builtin -> plat_wait_any");
+            break;
+        }
+        if (i == PLAT_WAIT_TIMEOUT)
+            base += window;
+        else
+            collect_proc(procs, proc_jids, &n_procs, base + i);
+    }
+
+    // Pick up exits outside the last window waited on
+    for (base = 0; base < n_procs; ) {
+        window = n_procs - base < WAIT_WINDOW ? n_procs - base : WAIT_WINDOW;
+        i = plat_wait_any(procs + base, window, 0);
+        if (i >= 0)
+            collect_proc(procs, proc_jids, &n_procs, base + i);
+        else
+            base += window;
+    }
+
+    return n_procs;
+}
+
+
+
+/**
+ * stop_all_jobs
+ * 
+ * Stops every live job at once: asks each job's process group to exit, waits
+ * up to exit_grace_ms for all of them together, kills whatever is left, 
+ * waits for that, and reports the processes that still didn't go away.
+ * Frees the jobs.
+ */
+static void stop_all_jobs() {
+
+    int32_t n_procs = 0, jid, next_jid;
+
+    for (jid = live_jobs_head; jid >= 0; jid = jobs[jid].next_live)
+        n_procs += job_n_procs_alive[jid];
+    if (n_procs == 0)
+        goto free_jobs;
+
+    HANDLE *procs = malloc(n_procs * sizeof(HANDLE));
+    int32_t *proc_jids = malloc(n_procs * sizeof(int32_t));
+    if (procs == NULL or proc_jids == NULL) {
+        // Fall back to killing the jobs one at a time
+        free(procs);
+        free(proc_jids);
+        for (jid = live_jobs_head; jid >= 0; jid = next_jid) {
+            next_jid = jobs[jid].next_live; // terminate_job unlinks the job
+            job_status[jid] = TERMINATED;
+            terminate_job(&jobs[jid]);
+        }
+        return;
+    }
+
+    // Ask every job to exit
+    DWORD grace_ms = exit_grace_ms();
+    n_procs = 0;
+    for (jid = live_jobs_head; jid >= 0; jid = jobs[jid].next_live) {
+        for (int32_t i = 0; i < job_n_procs_alive[jid]; i++) {
+            HANDLE proc_h = jobs[jid].proc_hs[i];
+            if (grace_ms > 0 and jobs[jid].group_pid != 0 
+                 and plat_pid(proc_h) == jobs[jid].group_pid)
+                plat_interrupt(proc_h);
+            procs[n_procs] = proc_h;
+            proc_jids[n_procs] = jid;
+            n_procs++;
+        }
+    }
+    if (grace_ms > 0)
+        n_procs = wait_procs(procs, proc_jids, n_procs, grace_ms);
+
+    // Kill the rest
+    for (int32_t i = 0; i < n_procs; i++)
+        stage_terminate(procs[i], 1);
+    n_procs = wait_procs(procs, proc_jids, n_procs, EXIT_KILL_WAIT_MS);
+
+    // Report survivors
+    if (n_procs > 0) {
+        out_stream_t err;
+        WCHAR line[64];
+        out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+        for (int32_t i = 0; i < n_procs; i++) {
+            int len = _snwprintf(
+                line, 
+                64, 
+                L"exit: [%d] pid %lu would not die: ",
+                proc_jids[i],
+                (unsigned long)plat_pid(procs[i])
+            );
+            if (len > 0)
+                out_stream_write(&err, line, len);
+            out_stream_write(
+                &err, 
+                jobs[proc_jids[i]].cmdline, 
+                jobs[proc_jids[i]].len_cmdline
+            );
+            out_stream_write(&err, L"\n", 1);
+        }
+        out_stream_close(&err);
+    }
+    free(procs);
+    free(proc_jids);
+
+free_jobs:
+    for (jid = live_jobs_head; jid >= 0; jid = next_jid) {
+        next_jid = jobs[jid].next_live; // record_completion unlinks the job
+        job_status[jid] = TERMINATED;
+        record_completion(jid);
+    }
+}
+
+
+
 /**
  * exit_builtin
  * 
- * Kills all running processes and terminates the shell.
+ * Stops all running jobs (see stop_all_jobs) and terminates the shell.
  * This function doesn't return - the process terminates.
  * 
  * parsed_proc: Parsed info from command that called this builtin, not
  *              used.
- * startup_info: Redirection info, not used.
+ * stdio: Standard streams after redirection, not used.
  */
 void exit_builtin(parsed_process_t *parsed_proc, 
-                  STARTUPINFO *startup_info) {
+                  stdio_handles_t *stdio) {
     
     BOOL bool_rc;
     DWORD dw_rc;
     
-    // Kill all jobs
-    for (int32_t job_i = 0; job_i < MAX_JOBS; job_i++) {
-        job_t *job = &jobs[job_i];
-        if (job->status == GARBAGE) 
-            continue;
-        terminate_job(job);
-    }
+    // Stop all jobs
+    stop_all_jobs();
 
     // Signal the cmdline reader thread
-    dw_rc = WaitForSingleObject(exited_lock, INFINITE);
-    if (dw_rc == WAIT_FAILED) {
-        print_err(L"exit_builtin -> WaitForSingleObject exited_lock");
+    bool_rc = plat_mutex_lock(exited_lock);
+    if (not bool_rc) {
+        print_err(L"exit_builtin -> plat_mutex_lock exited_lock");
         ExitProcess(1);
     }
     exited = TRUE;
-    bool_rc = SetEvent(exited_e);
+    bool_rc = plat_event_set(exited_e);
     if (not bool_rc) {
-        print_err(L"exit_builtin -> SetEvent exited_e");
+        print_err(L"exit_builtin -> plat_event_set exited_e");
         ExitProcess(1);
     }
-    bool_rc = SetEvent(cmdline_consumed_e);
+    bool_rc = plat_event_set(cmdline_consumed_e);
     if (not bool_rc) {
-        print_err(L"exit_builtin -> SetEvent cmdline_consumed_e");
+        print_err(L"exit_builtin -> plat_event_set cmdline_consumed_e");
     }
-    bool_rc = ReleaseMutex(exited_lock);
+    bool_rc = plat_mutex_unlock(exited_lock);
     if (not bool_rc) {
-        print_err(L"exit_builtin -> ReleaseMutex exited_lock");
+        print_err(L"exit_builtin -> plat_mutex_unlock exited_lock");
         ExitProcess(1);
     }
-    dw_rc = WaitForSingleObject(cmdline_reader_thread_h, INFINITE);
+    // A pipe/file reader may be blocked in ReadFile: keep cancelling its read
+    // until it notices exited
+    dw_rc = WaitForSingleObject(
+        cmdline_reader_thread_h, 
+        stdin_is_console ? INFINITE : 50
+    );
+    while (dw_rc == WAIT_TIMEOUT) {
+        CancelSynchronousIo(cmdline_reader_thread_h);
+        dw_rc = WaitForSingleObject(cmdline_reader_thread_h, 50);
+    }
     if (dw_rc == WAIT_FAILED) {
         print_err(L"exit_builtin -> WaitForSingleObject cmdline_reader_thread_h");
         ExitProcess(1);
     }
 
-    // Print goodbye message
-    bool_rc = WriteConsoleW( // idc if this fails
-        GetStdHandle(STD_OUTPUT_HANDLE),
-        L"see ya!\n",
-        wcslen(L"see ya!\n"),
-        NULL,
-        NULL
-    );
+    // Print goodbye message (and any suppressed error repeats)
+    print_err_summary();
+    out_stream_t out; // idc if this fails
+    out_stream_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    out_stream_puts(&out, L"see ya!\n");
+    out_stream_close(&out);
 
     // Terminate process
     ExitProcess(0);
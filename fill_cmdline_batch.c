@@ -0,0 +1,349 @@
+
+/**
+ * fill_cmdline_batch.c
+ *
+ * Line reader used by the cmdline reader thread when stdin isn't a console
+ * (a pipe or a redirected file). stdin is read with large ReadFile calls into
+ * a ring buffer and split into as many lines as fit in the cmdline batch.
+ */
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+#include <string.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* RING_CAP: Capacity of the stdin ring buffer in bytes. Must be a power of
+             two and big enough to hold a MAX_CMDLINE UTF-16 line. */
+#define RING_CAP (1 << 17)
+
+/* RING_MASK: Turns a free-running ring index into an offset into ring. */
+#define RING_MASK (RING_CAP - 1)
+
+/* READ_CHUNK: Maximum number of bytes requested by a single ReadFile call. */
+#define READ_CHUNK (1 << 16)
+
+
+
+/**
+ * stdin_encoding_t
+ *
+ * Encoding of the bytes coming from stdin. Detected once from the first bytes
+ * read (BOM, or a zero high byte for UTF-16LE without a BOM).
+ */
+typedef enum _stdin_encoding {
+    ENC_UNKNOWN,
+    ENC_UTF8,
+    ENC_UTF16LE
+} stdin_encoding_t;
+
+
+
+/* ring: Bytes read from stdin that haven't been turned into lines yet. */
+static BYTE ring[RING_CAP];
+
+/* ring_head, ring_tail: Free-running indices of the first unconsumed byte and
+                         one past the last byte read. */
+static uint32_t ring_head, ring_tail;
+
+/* ring_scanned: Number of bytes after ring_head already known not to contain
+                 a newline - so that a partial line isn't rescanned after every
+                 read. */
+static uint32_t ring_scanned;
+
+/* line_scratch: Contiguous copy of a line that wraps around the end of ring. */
+static BYTE line_scratch[RING_CAP];
+
+static stdin_encoding_t encoding = ENC_UNKNOWN;
+
+/* discarding: TRUE while dropping the rest of a line that was too long. */
+static BOOL discarding = FALSE;
+
+/* stdin_eof: TRUE once ReadFile reports end of input. */
+static BOOL stdin_eof = FALSE;
+
+
+
+/**
+ * write_reader_err
+ *
+ * Writes a reader error message to stderr.
+ */
+static void write_reader_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, message);
+    out_stream_close(&err);
+}
+
+
+
+/**
+ * read_more
+ *
+ * Reads as much as fits (up to READ_CHUNK bytes) from stdin into the free
+ * contiguous space at the ring tail. Sets stdin_eof at end of input.
+ *
+ * Return Value: Returns TRUE on success, FALSE if ReadFile failed.
+ */
+static BOOL read_more(HANDLE stdin_h) {
+
+    BOOL bool_rc;
+    DWORD bytes_read;
+
+    uint32_t used = ring_tail - ring_head;
+    uint32_t tail_off = ring_tail & RING_MASK;
+    uint32_t n_free = RING_CAP - used;
+    uint32_t n_contiguous = RING_CAP - tail_off;
+    uint32_t n_to_read = n_free < n_contiguous ? n_free : n_contiguous;
+    if (n_to_read > READ_CHUNK)
+        n_to_read = READ_CHUNK;
+
+    bool_rc = ReadFile(stdin_h, &ring[tail_off], n_to_read, &bytes_read, NULL);
+    if (not bool_rc) {
+        if (GetLastError() == ERROR_BROKEN_PIPE
+             or GetLastError() == ERROR_HANDLE_EOF) {
+            stdin_eof = TRUE;
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    if (bytes_read == 0)
+        stdin_eof = TRUE;
+    ring_tail += bytes_read;
+
+    return TRUE;
+}
+
+
+
+/**
+ * detect_encoding
+ *
+ * Looks at the first bytes of input to decide between UTF-8 and UTF-16LE and
+ * skips a BOM if one is present. Waits for 4 bytes (or EOF) before deciding.
+ */
+static void detect_encoding() {
+
+    uint32_t used = ring_tail - ring_head;
+    if (used < 4 and not stdin_eof)
+        return;
+
+    if (used >= 2 and ring[0] == 0xFF and ring[1] == 0xFE) {
+        encoding = ENC_UTF16LE;
+        ring_head += 2;
+    }
+    else if (used >= 3 and ring[0] == 0xEF and ring[1] == 0xBB
+              and ring[2] == 0xBF) {
+        encoding = ENC_UTF8;
+        ring_head += 3;
+    }
+    else if (used >= 2 and ring[0] != 0 and ring[1] == 0) {
+        encoding = ENC_UTF16LE;
+    }
+    else {
+        encoding = ENC_UTF8;
+    }
+}
+
+
+
+/**
+ * find_newline
+ *
+ * Scans the unscanned part of the ring for the next newline.
+ *
+ * Return Value: Returns the offset from ring_head of the first byte of the
+ *               newline, or -1 if the ring doesn't contain a full line yet.
+ */
+static int64_t find_newline() {
+
+    uint32_t used = ring_tail - ring_head;
+
+    if (encoding == ENC_UTF16LE) {
+        // Code units sit at even offsets from ring_head
+        uint32_t i = ring_scanned & ~(uint32_t)1;
+        for (; i + 1 < used; i += 2) {
+            uint32_t off = (ring_head + i) & RING_MASK;
+            if (ring[off] == '\n' and ring[(off + 1) & RING_MASK] == 0)
+                return i;
+        }
+        ring_scanned = i;
+        return -1;
+    }
+
+    // UTF-8: memchr over the (at most two) contiguous segments
+    while (ring_scanned < used) {
+        uint32_t off = (ring_head + ring_scanned) & RING_MASK;
+        uint32_t n_seg = used - ring_scanned;
+        if (n_seg > RING_CAP - off)
+            n_seg = RING_CAP - off;
+        const BYTE *nl_p = memchr(&ring[off], '\n', n_seg);
+        if (nl_p != NULL)
+            return ring_scanned + (uint32_t)(nl_p - &ring[off]);
+        ring_scanned += n_seg;
+    }
+    return -1;
+}
+
+
+
+/**
+ * consume
+ *
+ * Drops n_bytes from the front of the ring.
+ */
+static void consume(uint32_t n_bytes) {
+    ring_head += n_bytes;
+    ring_scanned = 0;
+}
+
+
+
+/**
+ * emit_line
+ *
+ * Converts the first len_line bytes of the ring (not including the newline)
+ * to UTF-16 and appends it to cmdline_batch. Strips a trailing '\r'. Empty
+ * lines are kept (they may be part of a here-document body). Lines longer 
+ * than MAX_CMDLINE are reported and skipped.
+ *
+ * Return Value: Returns TRUE if the line was handled (appended or skipped).
+ *               Returns FALSE if cmdline_batch doesn't have room for it - the
+ *               line is left in the ring for the next batch.
+ */
+static BOOL emit_line(uint32_t len_line) {
+
+    uint32_t off = ring_head & RING_MASK;
+    const BYTE *line_p = &ring[off];
+
+    // Make the line contiguous if it wraps
+    if (off + len_line > RING_CAP) {
+        uint32_t n_first = RING_CAP - off;
+        memcpy(line_scratch, &ring[off], n_first);
+        memcpy(line_scratch + n_first, ring, len_line - n_first);
+        line_p = line_scratch;
+    }
+
+    WCHAR *dst = &cmdline_batch[len_cmdline_batch];
+    int32_t n_room = CMDLINE_BATCH_CAP - len_cmdline_batch - 1;
+    int32_t n_wchars;
+
+    if (encoding == ENC_UTF16LE) {
+        int32_t n_units = (int32_t)(len_line / 2);
+        if (n_units > 0 and line_p[2 * n_units - 2] == '\r'
+             and line_p[2 * n_units - 1] == 0)
+            n_units--;
+        if (n_units > MAX_CMDLINE) {
+            write_reader_err(L"Error: command line too long\n");
+            return TRUE;
+        }
+        if (n_units > n_room)
+            return FALSE;
+        n_wchars = utf16le_to_wchar(line_p, n_units, dst);
+    }
+    else {
+        if (len_line > 0 and line_p[len_line - 1] == '\r')
+            len_line--;
+        // A UTF-8 line never converts to more WCHARs than it has bytes
+        if ((int32_t)len_line > n_room
+             and n_room < MAX_CMDLINE)
+            return FALSE;
+        n_wchars = len_line == 0 ? 0 : MultiByteToWideChar(
+            CP_UTF8,
+            0,
+            (const char *)line_p,
+            (int)len_line,
+            dst,
+            n_room < MAX_CMDLINE ? n_room : MAX_CMDLINE
+        );
+        if (n_wchars == 0 and len_line > 0) {
+            write_reader_err(L"Error: command line too long\n");
+            return TRUE;
+        }
+    }
+
+    dst[n_wchars] = L'\0';
+    len_cmdline_batch += n_wchars + 1;
+    n_cmdline_batch++;
+    return TRUE;
+}
+
+
+
+/**
+ * fill_cmdline_batch
+ *
+ * Fills cmdline_batch with as many complete lines from non-console stdin as
+ * are available (at least one unless stdin is at EOF). Only blocks in
+ * ReadFile when no complete line is buffered yet.
+ * Sets cmdline_eof once the end of input has been reached and every line has
+ * been handed out.
+ *
+ * Note: The caller must hold cmdline_lock.
+ *
+ * stdin_h: HANDLE to stdin (a pipe or a file).
+ *
+ * Return Value: Returns TRUE on success.
+ *               Returns FALSE if ReadFile failed (GetLastError is
+ *               ERROR_OPERATION_ABORTED if the read was cancelled on exit).
+ */
+BOOL fill_cmdline_batch(HANDLE stdin_h) {
+
+    len_cmdline_batch = 0;
+    n_cmdline_batch = 0;
+
+    while (TRUE) {
+
+        if (encoding == ENC_UNKNOWN)
+            detect_encoding();
+
+        // Split out every complete line that's already buffered
+        if (encoding != ENC_UNKNOWN) {
+            int64_t nl_i;
+            uint32_t len_nl = encoding == ENC_UTF16LE ? 2 : 1;
+            while ((nl_i = find_newline()) >= 0) {
+                if (discarding) {
+                    discarding = FALSE;
+                }
+                else if (not emit_line((uint32_t)nl_i)) {
+                    return TRUE; // batch is full
+                }
+                consume((uint32_t)nl_i + len_nl);
+            }
+        }
+
+        if (n_cmdline_batch > 0)
+            return TRUE;
+
+        if (stdin_eof) {
+            // Last line may not end with a newline
+            uint32_t used = ring_tail - ring_head;
+            if (used > 0 and not discarding) {
+                if (encoding == ENC_UNKNOWN)
+                    encoding = ENC_UTF8;
+                emit_line(used);
+            }
+            consume(used);
+            cmdline_eof = TRUE;
+            return TRUE;
+        }
+
+        // Ring is full and still has no newline: line is too long
+        if (ring_tail - ring_head == RING_CAP) {
+            if (not discarding)
+                write_reader_err(L"Error: command line too long\n");
+            discarding = TRUE;
+            consume(RING_CAP);
+        }
+
+        if (not read_more(stdin_h))
+            return FALSE;
+    }
+}
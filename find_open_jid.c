@@ -11,21 +11,45 @@
 
 
 
+/**
+ * lowest_set_bit
+ * 
+ * Return Value: Returns the index of the lowest 1 bit in word (word != 0).
+ */
+static int32_t lowest_set_bit(uint64_t word) {
+#if defined(_MSC_VER)
+    unsigned long bit_i;
+    _BitScanForward64(&bit_i, word);
+    return (int32_t)bit_i;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+
+
 /**
  * find_open_jid
  *
- * Finds the first jid that's open to be used for a new job.
+ * Finds the lowest jid that's open to be used for a new job. Grows the job 
+ * table if every jid is in use.
  *
  * Return Value: Returns the jid on success.
- *               Return -1 if the jobs array is full.
+ *               Return -1 if the job table couldn't be grown.
  */
 int32_t find_open_jid() {
 
-    for (int jid = 0; jid < MAX_JOBS; jid++) {
-        if (jobs[jid].status == GARBAGE) {
-            return jid;
+    int32_t n_words = cap_jobs / 64;
+
+    for (int32_t word_i = 0; word_i < n_words; word_i++) {
+        if (free_jid_bits[word_i] != 0) {
+            return word_i * 64 + lowest_set_bit(free_jid_bits[word_i]);
         }
     }
 
-    return -1;
+    // Every jid is in use: the first new one is free
+    if (!grow_jobs()) {
+        return -1;
+    }
+    return n_words * 64;
 }
@@ -0,0 +1,549 @@
+
+/**
+ * glob.c
+ *
+ * Wildcard expansion of process arguments: "*", "?", "[...]" within a path
+ * component and "**" for any number of directories. Each argument's pattern
+ * is compiled once into tokens, and every directory it touches is listed in
+ * one large-fetch FindFirstFileExW pass. Matching is case-insensitive, like
+ * the file system. An argument that matches nothing is passed on as it is.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* GLOB_MAX_TOKENS: Most tokens in a compiled pattern (a pattern is at most
+                    MAX_PATH WCHARs, and each WCHAR makes at most one). */
+#define GLOB_MAX_TOKENS (MAX_PATH + 1)
+
+
+
+/**
+ * glob_tok_kind_t
+ *
+ * What a token of a compiled path component matches.
+ */
+typedef enum _glob_tok_kind {
+    GLOB_LITERAL,   // text, exactly (case-insensitive)
+    GLOB_ANY,       // "?": any one character
+    GLOB_STAR,      // "*": any run of characters
+    GLOB_CLASS      // "[...]": one character from a set
+} glob_tok_kind_t;
+
+typedef struct _glob_tok {
+    glob_tok_kind_t kind;
+    /* text, len_text: The literal text, or the inside of the brackets. */
+    const WCHAR *text;
+    int32_t len_text;
+    /* negated: "[!...]" or "[^...]". */
+    BOOL negated;
+} glob_tok_t;
+
+
+
+/**
+ * glob_seg_t
+ *
+ * A path component of a compiled pattern: literal text, "**", or a run of
+ * tokens.
+ */
+typedef struct _glob_seg {
+    const WCHAR *text;
+    int32_t len_text;
+    BOOL is_literal;
+    BOOL is_globstar;
+    int32_t first_tok;
+    int32_t n_toks;
+    /* sep: Separator that followed the component (L'\0' for the last). */
+    WCHAR sep;
+} glob_seg_t;
+
+
+
+/* toks, segs: The compiled pattern of the argument being expanded. */
+static glob_tok_t toks[GLOB_MAX_TOKENS];
+static glob_seg_t segs[GLOB_MAX_TOKENS];
+static int32_t n_toks, n_segs;
+
+/* match_pool, match_offs: Paths matched so far (NULL-terminated, back to
+                           back) and where each one starts. */
+static WCHAR *match_pool = NULL;
+static int32_t len_match_pool = 0, cap_match_pool = 0;
+static int32_t *match_offs = NULL;
+static int32_t n_matches = 0, cap_matches = 0;
+
+/* len_glob_base: Length of the working directory the walk's paths start
+                  with (0 for an absolute pattern). It isn't part of the
+                  matches. */
+static int32_t len_glob_base;
+
+/* glob_overflow: Set once the matches can't fit in a command line. */
+static BOOL glob_overflow;
+
+/* sort_pool: match_pool while it's being sorted (qsort has no context). */
+static const WCHAR *sort_pool;
+
+
+
+/**
+ * compile_pattern
+ *
+ * Splits pattern into path components and compiles each one into tokens.
+ *
+ * pattern: Argument to compile (no quotes).
+ * len_pattern: Length of pattern, at most MAX_PATH.
+ *
+ * Return Value: Returns TRUE if the pattern has a wildcard anywhere.
+ */
+static BOOL compile_pattern(const WCHAR *pattern, int32_t len_pattern) {
+
+    BOOL has_wildcard = FALSE;
+    const WCHAR *p = pattern, *end = pattern + len_pattern;
+
+    n_toks = 0;
+    n_segs = 0;
+
+    while (TRUE) {
+        glob_seg_t *seg = &segs[n_segs++];
+        const WCHAR *seg_end = p;
+        while (seg_end < end and *seg_end != L'\\' and *seg_end != L'/')
+            seg_end++;
+
+        seg->text = p;
+        seg->len_text = (int32_t)(seg_end - p);
+        seg->sep = seg_end < end ? *seg_end : L'\0';
+        seg->first_tok = n_toks;
+        // "**" as the last component is just "*"
+        seg->is_globstar = seg->len_text == 2 and p[0] == L'*' 
+                            and p[1] == L'*' and seg_end < end;
+        seg->is_literal = TRUE;
+
+        while (p < seg_end and not seg->is_globstar) {
+            glob_tok_t *tok = &toks[n_toks];
+            if (*p == L'*') {
+                // "**" within a name is just "*"
+                if (n_toks == seg->first_tok
+                     or toks[n_toks - 1].kind != GLOB_STAR) {
+                    tok->kind = GLOB_STAR;
+                    n_toks++;
+                }
+                p++;
+                seg->is_literal = FALSE;
+                continue;
+            }
+            if (*p == L'?') {
+                tok->kind = GLOB_ANY;
+                p++;
+                n_toks++;
+                seg->is_literal = FALSE;
+                continue;
+            }
+            if (*p == L'[') {
+                const WCHAR *class_p = p + 1;
+                BOOL negated = class_p < seg_end
+                                and (*class_p == L'!' or *class_p == L'^');
+                if (negated)
+                    class_p++;
+                const WCHAR *close_p = class_p < seg_end ? class_p + 1 : NULL;
+                while (close_p != NULL and close_p < seg_end
+                        and *close_p != L']')
+                    close_p++;
+                if (close_p != NULL and close_p < seg_end) {
+                    tok->kind = GLOB_CLASS;
+                    tok->text = class_p;
+                    tok->len_text = (int32_t)(close_p - class_p);
+                    tok->negated = negated;
+                    p = close_p + 1;
+                    n_toks++;
+                    seg->is_literal = FALSE;
+                    continue;
+                }
+                // No closing ']': the '[' is literal
+            }
+            // Literal run (extends the previous literal token)
+            if (n_toks > seg->first_tok
+                 and toks[n_toks - 1].kind == GLOB_LITERAL
+                 and toks[n_toks - 1].text + toks[n_toks - 1].len_text == p) {
+                toks[n_toks - 1].len_text++;
+            }
+            else {
+                tok->kind = GLOB_LITERAL;
+                tok->text = p;
+                tok->len_text = 1;
+                n_toks++;
+            }
+            p++;
+        }
+        seg->n_toks = n_toks - seg->first_tok;
+        if (seg->is_globstar)
+            seg->is_literal = FALSE;
+        if (not seg->is_literal)
+            has_wildcard = TRUE;
+
+        if (seg_end >= end)
+            break;
+        p = seg_end + 1;
+    }
+
+    return has_wildcard;
+}
+
+
+
+/**
+ * class_matches
+ *
+ * Return Value: Returns TRUE if c is in the set of a GLOB_CLASS token.
+ */
+static BOOL class_matches(const glob_tok_t *tok, WCHAR c) {
+
+    BOOL found = FALSE;
+    c = towlower(c);
+
+    for (int32_t i = 0; i < tok->len_text and not found; i++) {
+        WCHAR lo = towlower(tok->text[i]);
+        if (i + 2 < tok->len_text and tok->text[i + 1] == L'-') {
+            WCHAR hi = towlower(tok->text[i + 2]);
+            found = c >= lo and c <= hi;
+            i += 2;
+        }
+        else {
+            found = c == lo;
+        }
+    }
+    return found != tok->negated;
+}
+
+
+
+/**
+ * seg_matches
+ *
+ * Matches a file name against a compiled path component. A "*" backs off one
+ * character at a time when the rest doesn't match.
+ *
+ * Return Value: Returns TRUE if name matches.
+ */
+static BOOL seg_matches(const glob_seg_t *seg, const WCHAR *name) {
+
+    const glob_tok_t *seg_toks = &toks[seg->first_tok];
+    int32_t t = 0, star_t = -1;
+    const WCHAR *s = name, *star_s = NULL;
+
+    // A leading '.' only matches a literal '.'
+    if (name[0] == L'.' and (seg->n_toks == 0
+                              or seg_toks[0].kind != GLOB_LITERAL))
+        return FALSE;
+
+    while (TRUE) {
+        if (t < seg->n_toks) {
+            const glob_tok_t *tok = &seg_toks[t];
+            if (tok->kind == GLOB_STAR) {
+                star_t = t++;
+                star_s = s;
+                continue;
+            }
+            if (tok->kind == GLOB_ANY and *s != L'\0') {
+                s++;
+                t++;
+                continue;
+            }
+            if (tok->kind == GLOB_CLASS and *s != L'\0'
+                 and class_matches(tok, *s)) {
+                s++;
+                t++;
+                continue;
+            }
+            if (tok->kind == GLOB_LITERAL
+                 and _wcsnicmp(s, tok->text, tok->len_text) == 0) {
+                s += tok->len_text;
+                t++;
+                continue;
+            }
+        }
+        else if (*s == L'\0') {
+            return TRUE;
+        }
+
+        // Mismatch: let the last "*" take one more character
+        if (star_t < 0 or *star_s == L'\0')
+            return FALSE;
+        s = ++star_s;
+        t = star_t + 1;
+    }
+}
+
+
+
+/**
+ * add_match
+ *
+ * Adds a matched path. Sets glob_overflow instead once the matches are more
+ * than a command line can hold.
+ */
+static void add_match(const WCHAR *path, int32_t len_path) {
+
+    path += len_glob_base; // matches stay relative, like the pattern
+    len_path -= len_glob_base;
+    if (glob_overflow)
+        return;
+    if (len_match_pool + len_path + 1 > MAX_CMDLINE) {
+        glob_overflow = TRUE;
+        return;
+    }
+
+    if (len_match_pool + len_path + 1 > cap_match_pool) {
+        int32_t new_cap = cap_match_pool ? cap_match_pool * 2 : 4096;
+        while (new_cap < len_match_pool + len_path + 1)
+            new_cap *= 2;
+        WCHAR *new_pool = realloc(match_pool, new_cap * sizeof(WCHAR));
+        if (new_pool == NULL) {
+            glob_overflow = TRUE;
+            return;
+        }
+        match_pool = new_pool;
+        cap_match_pool = new_cap;
+    }
+    if (n_matches == cap_matches) {
+        int32_t new_cap = cap_matches ? cap_matches * 2 : 256;
+        int32_t *new_offs = realloc(match_offs, new_cap * sizeof(int32_t));
+        if (new_offs == NULL) {
+            glob_overflow = TRUE;
+            return;
+        }
+        match_offs = new_offs;
+        cap_matches = new_cap;
+    }
+
+    memcpy(match_pool + len_match_pool, path, len_path * sizeof(WCHAR));
+    match_offs[n_matches++] = len_match_pool;
+    len_match_pool += len_path;
+    match_pool[len_match_pool++] = L'\0';
+}
+
+
+
+/**
+ * glob_walk
+ *
+ * Matches components seg_i onwards under the directory path, adding every
+ * full match.
+ *
+ * path: Directory matched so far, ending with a separator (at first, the
+ *       working directory of a relative pattern, or empty). Has room for
+ *       MAX_PATH + 1 WCHARs; it's extended in place and restored.
+ * len_path: Length of path.
+ */
+static void glob_walk(int32_t seg_i, WCHAR *path, int32_t len_path) {
+
+    WIN32_FIND_DATAW find_data;
+
+    if (glob_overflow)
+        return;
+
+    const glob_seg_t *seg = &segs[seg_i];
+    BOOL is_last = seg_i == n_segs - 1;
+
+    // Literal component: no listing needed
+    if (seg->is_literal) {
+        int32_t len_next = len_path + seg->len_text + (is_last ? 0 : 1);
+        if (len_next > MAX_PATH)
+            return;
+        memcpy(path + len_path, seg->text, seg->len_text * sizeof(WCHAR));
+        if (is_last) {
+            path[len_next] = L'\0';
+            if (GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES)
+                add_match(path, len_next);
+        }
+        else {
+            path[len_next - 1] = seg->sep;
+            glob_walk(seg_i + 1, path, len_next);
+        }
+        return;
+    }
+
+    // "**" matches no directory at all, too
+    if (seg->is_globstar)
+        glob_walk(seg_i + 1, path, len_path);
+
+    // List the directory in one large-fetch pass
+    if (len_path + 1 > MAX_PATH)
+        return;
+    path[len_path] = L'*';
+    path[len_path + 1] = L'\0';
+    HANDLE find_h = FindFirstFileExW(
+        path,
+        FindExInfoBasic,
+        &find_data,
+        is_last ? FindExSearchNameMatch : FindExSearchLimitToDirectories,
+        NULL,
+        FIND_FIRST_EX_LARGE_FETCH
+    );
+    path[len_path] = L'\0';
+    if (find_h == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        const WCHAR *name = find_data.cFileName;
+        BOOL is_dir =
+            (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (wcscmp(name, L".") == 0 or wcscmp(name, L"..") == 0)
+            continue;
+        if (not is_dir and not is_last)
+            continue;
+        if (seg->is_globstar) {
+            // Descend, staying on the "**"
+            if (not is_dir or name[0] == L'.'
+                 or (find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                continue;
+        }
+        else if (not seg_matches(seg, name)) {
+            continue;
+        }
+
+        int32_t len_name = (int32_t)wcslen(name);
+        int32_t len_next = len_path + len_name + (is_last ? 0 : 1);
+        if (len_next > MAX_PATH)
+            continue;
+        memcpy(path + len_path, name, len_name * sizeof(WCHAR));
+        if (is_last) {
+            add_match(path, len_next);
+        }
+        else {
+            path[len_next - 1] = seg->sep != L'\0' ? seg->sep : L'\\';
+            path[len_next] = L'\0';
+            glob_walk(seg->is_globstar ? seg_i : seg_i + 1, path, len_next);
+        }
+        path[len_path] = L'\0';
+
+    } while (not glob_overflow and FindNextFileW(find_h, &find_data));
+    FindClose(find_h);
+}
+
+
+
+/**
+ * cmp_matches
+ *
+ * qsort comparator for match offsets (case-insensitive).
+ */
+static int cmp_matches(const void *a, const void *b) {
+    return _wcsicmp(
+        sort_pool + *(const int32_t *)a,
+        sort_pool + *(const int32_t *)b
+    );
+}
+
+
+
+/**
+ * expand_globs
+ *
+ * Replaces every argument of a process command line (not the application
+ * name) that has an unquoted wildcard with the sorted paths it matches.
+ * Matches with spaces are quoted. Arguments with quotes are left alone.
+ *
+ * cmd_line: NULL-terminated process command line. Expanded in place.
+ * cap_cmd_line: Capacity of cmd_line in WCHARs.
+ * cwd: Working directory relative patterns are matched in.
+ *
+ * Return Value: Returns TRUE on success. Returns FALSE if the expanded
+ *               command line wouldn't fit (cmd_line is left unchanged).
+ */
+BOOL expand_globs(WCHAR *cmd_line, int32_t cap_cmd_line, const WCHAR *cwd) {
+
+    static WCHAR expanded[MAX_CMDLINE + 1];
+    WCHAR path[MAX_PATH + 1];
+
+    // Nothing to do (the common case)
+    const WCHAR *arg_p = arg_end(skip_whitespace(cmd_line));
+    if (arg_p == NULL or wcspbrk(arg_p, L"*?[") == NULL)
+        return TRUE;
+
+    int32_t len_expanded = (int32_t)(arg_p - cmd_line);
+    int32_t cap_expanded = cap_cmd_line < MAX_CMDLINE + 1 ? cap_cmd_line
+                                                         : MAX_CMDLINE + 1;
+    memcpy(expanded, cmd_line, len_expanded * sizeof(WCHAR));
+
+    while (*arg_p != L'\0') {
+
+        // Whitespace is copied as it is
+        const WCHAR *next_p = skip_whitespace(arg_p);
+        int32_t len_space = (int32_t)(next_p - arg_p);
+        if (len_expanded + len_space >= cap_expanded)
+            return FALSE;
+        memcpy(expanded + len_expanded, arg_p, len_space * sizeof(WCHAR));
+        len_expanded += len_space;
+        arg_p = next_p;
+        if (*arg_p == L'\0')
+            break;
+
+        const WCHAR *arg_end_p = arg_end(arg_p);
+        if (arg_end_p == NULL)
+            arg_end_p = arg_p + wcslen(arg_p);
+        int32_t len_arg = (int32_t)(arg_end_p - arg_p);
+
+        // Expand it if it's an unquoted pattern that matches something
+        n_matches = 0;
+        len_match_pool = 0;
+        glob_overflow = FALSE;
+        if (len_arg <= MAX_PATH and wmemchr(arg_p, L'"', len_arg) == NULL
+             and compile_pattern(arg_p, len_arg)) {
+            len_glob_base = 0;
+            BOOL is_abs = arg_p[0] == L'\\' or arg_p[0] == L'/'
+                           or (len_arg > 1 and arg_p[1] == L':');
+            size_t len_cwd = wcslen(cwd);
+            if (not is_abs and len_cwd < MAX_PATH) {
+                memcpy(path, cwd, len_cwd * sizeof(WCHAR));
+                len_glob_base = (int32_t)len_cwd;
+                if (len_cwd > 0 and path[len_cwd - 1] != L'\\')
+                    path[len_glob_base++] = L'\\';
+            }
+            path[len_glob_base] = L'\0';
+            glob_walk(0, path, len_glob_base);
+            if (glob_overflow)
+                return FALSE;
+        }
+
+        if (n_matches == 0) {
+            if (len_expanded + len_arg >= cap_expanded)
+                return FALSE;
+            memcpy(expanded + len_expanded, arg_p, len_arg * sizeof(WCHAR));
+            len_expanded += len_arg;
+        }
+        else {
+            sort_pool = match_pool;
+            qsort(match_offs, n_matches, sizeof(int32_t), cmp_matches);
+            for (int32_t i = 0; i < n_matches; i++) {
+                const WCHAR *match = match_pool + match_offs[i];
+                int32_t len_match = (int32_t)wcslen(match);
+                BOOL needs_quotes = wcschr(match, L' ') != NULL;
+                if (len_expanded + len_match + 3 >= cap_expanded)
+                    return FALSE;
+                if (i > 0)
+                    expanded[len_expanded++] = L' ';
+                if (needs_quotes)
+                    expanded[len_expanded++] = L'"';
+                memcpy(expanded + len_expanded, match,
+                       len_match * sizeof(WCHAR));
+                len_expanded += len_match;
+                if (needs_quotes)
+                    expanded[len_expanded++] = L'"';
+            }
+        }
+        arg_p = arg_end_p;
+    }
+
+    memcpy(cmd_line, expanded, len_expanded * sizeof(WCHAR));
+    cmd_line[len_expanded] = L'\0';
+    return TRUE;
+}
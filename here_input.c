@@ -0,0 +1,294 @@
+
+/**
+ * here_input.c
+ *
+ * Here-strings ("cmd <<< text") and here-documents ("cmd <<TAG", followed by
+ * lines up to a line that is just TAG). The text never touches disk: the
+ * child gets the read end of a pipe and a writer thread feeds it, so a big
+ * here-document streams in while the shell goes on spawning and reaping.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* HERE_TAG_CAP: Longest here-document terminator, in WCHARs. */
+#define HERE_TAG_CAP 64
+
+/* HERE_WRITE_CHUNK: Bytes handed to each WriteFile by a writer thread. */
+#define HERE_WRITE_CHUNK (1 << 16)
+
+
+
+/* here_doc_body: Body of the here-document whose command line was last
+                  returned by here_doc_feed, one '\n' after every line. 
+                  len_here_doc_body is -1 for every other command line. */
+WCHAR *here_doc_body = NULL;
+int32_t len_here_doc_body = -1;
+static int32_t cap_here_doc_body = 0;
+
+/* here_doc_input: Body fed to a "<<TAG" of the job being spawned. A block's
+                   lines are all read before any of it runs, so the body is
+                   kept in the command's IR node and set here from there. */
+const WCHAR *here_doc_input = NULL;
+int32_t len_here_doc_input = 0;
+
+/* here_cmdline: Command line waiting for its here-document body. */
+static WCHAR here_cmdline[MAX_CMDLINE + 1];
+
+/* here_tag: Terminator of the here-document being collected. */
+static WCHAR here_tag[HERE_TAG_CAP + 1];
+
+/* collecting: TRUE while here-document body lines are being collected. */
+static BOOL collecting = FALSE;
+
+/* body_failed: Set if here_doc_body couldn't grow for a line. */
+static BOOL body_failed = FALSE;
+
+
+
+/**
+ * here_writer_t
+ *
+ * What a writer thread writes (UTF-8) and where. Freed by the thread.
+ */
+typedef struct _here_writer {
+    HANDLE write_h;
+    int32_t n_bytes;
+    char bytes[];
+} here_writer_t;
+
+
+
+/**
+ * write_here_err
+ *
+ * Writes a here-document error message to stderr.
+ */
+static void write_here_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, message);
+    out_stream_close(&err);
+}
+
+
+
+/**
+ * find_here_doc_tag
+ *
+ * Looks for a non-quoted "<<TAG" (not "<<<") in a command line and copies
+ * TAG (without quotes) into here_tag.
+ *
+ * Return Value: Returns TRUE if the line starts a here-document.
+ */
+static BOOL find_here_doc_tag(const WCHAR *line) {
+
+    const WCHAR *arrow_p = line;
+
+    while ((arrow_p = nonquoted_wcschr(arrow_p, L'<')) != NULL) {
+        if (arrow_p[1] == L'<' and arrow_p[2] == L'<') {
+            arrow_p += 3;
+            continue;
+        }
+        if (arrow_p[1] != L'<') {
+            arrow_p++;
+            continue;
+        }
+
+        const WCHAR *tag_p = skip_whitespace(arrow_p + 2);
+        const WCHAR *tag_end = arg_end(tag_p);
+        if (tag_end == NULL)
+            return FALSE;
+        if (*tag_p == L'"' and tag_end - tag_p >= 2) {
+            tag_p++;
+            tag_end--;
+        }
+        if (tag_end == tag_p or tag_end - tag_p > HERE_TAG_CAP)
+            return FALSE;
+        memcpy(here_tag, tag_p, (tag_end - tag_p) * sizeof(WCHAR));
+        here_tag[tag_end - tag_p] = L'\0';
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * append_body_line
+ *
+ * Appends a line and a '\n' to here_doc_body, growing it if needed.
+ */
+static void append_body_line(const WCHAR *line) {
+
+    int32_t len_line = (int32_t)wcslen(line);
+
+    if (body_failed)
+        return;
+    if (len_here_doc_body + len_line + 1 > cap_here_doc_body) {
+        int32_t new_cap = cap_here_doc_body ? cap_here_doc_body : 4096;
+        while (len_here_doc_body + len_line + 1 > new_cap)
+            new_cap *= 2;
+        WCHAR *new_body = realloc(here_doc_body, new_cap * sizeof(WCHAR));
+        if (new_body == NULL) {
+            body_failed = TRUE;
+            return;
+        }
+        here_doc_body = new_body;
+        cap_here_doc_body = new_cap;
+    }
+    memcpy(here_doc_body + len_here_doc_body, line, len_line * sizeof(WCHAR));
+    len_here_doc_body += len_line;
+    here_doc_body[len_here_doc_body++] = L'\n';
+}
+
+
+
+/**
+ * here_doc_feed
+ *
+ * Passes every line read through here-document collection. A line with a
+ * "<<TAG" is held back, and the lines after it become its body until a line
+ * that is just TAG. Other lines pass straight through.
+ *
+ * line: Line that was read, or NULL at the end of input (a here-document
+ *       still being collected is then cut short with a warning).
+ * out_cmdline: If a command line is ready to spawn, it's placed here. It's
+ *              valid until the next call.
+ *
+ * Return Value: Returns TRUE if *out_cmdline is ready to spawn, FALSE if the
+ *               line was taken as (part of) a here-document.
+ */
+BOOL here_doc_feed(const WCHAR *line, const WCHAR **out_cmdline) {
+
+    if (not collecting) {
+        len_here_doc_body = -1;
+        if (line == NULL)
+            return FALSE;
+        if (not find_here_doc_tag(line)) {
+            *out_cmdline = line;
+            return TRUE;
+        }
+        len_here_doc_body = 0;
+        wcsncpy(here_cmdline, line, MAX_CMDLINE);
+        here_cmdline[MAX_CMDLINE] = L'\0';
+        collecting = TRUE;
+        body_failed = FALSE;
+        return FALSE;
+    }
+
+    if (line == NULL) {
+        write_here_err(L"Warning: here-document ended by end of input\n");
+    }
+    else if (wcscmp(line, here_tag) != 0) {
+        append_body_line(line);
+        return FALSE;
+    }
+
+    collecting = FALSE;
+    if (body_failed) {
+        write_here_err(L"Error: here-document too large\n");
+        len_here_doc_body = -1;
+        return FALSE;
+    }
+    *out_cmdline = here_cmdline;
+    return TRUE;
+}
+
+
+
+/**
+ * here_doc_pending
+ *
+ * Return Value: Returns TRUE while a here-document body is being collected.
+ */
+BOOL here_doc_pending() {
+    return collecting;
+}
+
+
+
+/**
+ * here_writer_tproc
+ *
+ * Writes a here_writer_t's bytes to its pipe, then closes the pipe (the
+ * child sees EOF) and frees it. Stops early if the child stops reading.
+ */
+static DWORD WINAPI here_writer_tproc(void *arg) {
+
+    here_writer_t *writer = arg;
+    DWORD bytes_written;
+    int32_t off = 0;
+
+    while (off < writer->n_bytes) {
+        DWORD n_to_write = writer->n_bytes - off;
+        if (n_to_write > HERE_WRITE_CHUNK)
+            n_to_write = HERE_WRITE_CHUNK;
+        if (not WriteFile(writer->write_h, writer->bytes + off, n_to_write,
+                          &bytes_written, NULL))
+            break; // ERROR_NO_DATA: reader is gone
+        off += bytes_written;
+    }
+
+    plat_close(writer->write_h);
+    free(writer);
+    return 0;
+}
+
+
+
+/**
+ * start_here_writer
+ *
+ * Creates a pipe for a child's stdin and starts a writer thread that feeds
+ * it data (as UTF-8). The data is copied, so it can be reused right away.
+ *
+ * data: Text to feed.
+ * len_data: Number of WCHARs in data.
+ * out_read_h: Inheritable read end of the pipe is placed here. Close it once
+ *             the child has been spawned.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL start_here_writer(const WCHAR *data, int32_t len_data,
+                       HANDLE *out_read_h) {
+
+    HANDLE read_h;
+
+    here_writer_t *writer = malloc(sizeof(here_writer_t)
+                                    + UTF8_MAX_PER_WCHAR * (size_t)len_data);
+    if (writer == NULL) {
+        print_err(L"start_here_writer -> malloc");
+        return FALSE;
+    }
+    writer->n_bytes = utf16_to_utf8(data, len_data, writer->bytes);
+
+    if (not plat_input_pipe(&read_h, &writer->write_h)) {
+        print_err(L"start_here_writer -> plat_input_pipe");
+        free(writer);
+        return FALSE;
+    }
+
+    HANDLE writer_thread_h = CreateThread(NULL, 0, here_writer_tproc, writer,
+                                          0, NULL);
+    if (writer_thread_h == NULL) {
+        print_err(L"start_here_writer -> CreateThread");
+        plat_close(read_h);
+        plat_close(writer->write_h);
+        free(writer);
+        return FALSE;
+    }
+    CloseHandle(writer_thread_h); // the thread cleans up after itself
+
+    *out_read_h = read_h;
+    return TRUE;
+}
@@ -0,0 +1,1053 @@
+
+/**
+ * history.c
+ *
+ * Persistent command history. Lines typed at the console are appended to a
+ * memory-mapped, append-only file (one line per entry, '\n' separated,
+ * UTF-16). Two in-memory indexes are kept over the mapping: entry offsets in
+ * the order the entries were added, and a gram index - for every 3 WCHAR
+ * sequence (gram), the ids of the entries it occurs in. Both are only ever
+ * appended to, so adding an entry costs a lookup per WCHAR in it. A search
+ * takes the pattern's rarest gram and checks just the entries on its list,
+ * newest first, so it stays interactive at millions of entries. Entries are
+ * indexed with an anchor at each end, which makes a prefix a pattern too.
+ *
+ * Several shells can share the file. Appends and compactions are made under
+ * a lock on the file, and each shell catches up on the others' entries
+ * before it appends or searches. The file starts with a header line holding
+ * a generation number that a compaction bumps, telling the other shells to
+ * index the file again from scratch.
+ *
+ * Note: Entries are only added, and searched with Ctrl+R, by the reader
+ *       thread before it signals cmdline_available_e, and only searched by
+ *       the job spawner thread before it signals cmdline_consumed_e, so the
+ *       cmdline handshake already keeps the two threads from touching the
+ *       history at the same time.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* HISTORY_MAX_WCHARS: Largest the history file/mapping is allowed to get (in
+                       WCHARs). Once it's full the oldest half is dropped. */
+#define HISTORY_MAX_WCHARS (32 * 1024 * 1024)
+
+/* HISTORY_MAX_ENTRIES: Most entries kept. Bounds the size of the indexes. */
+#define HISTORY_MAX_ENTRIES (1 << 21)
+
+/* HISTORY_MAP_CHUNK: The mapping grows by at least this many WCHARs. */
+#define HISTORY_MAP_CHUNK (512 * 1024)
+
+/* HISTORY_MAX_POSTINGS: Most uint32s the gram lists may take, and 
+                         HISTORY_MAX_GRAMS the most distinct grams. They bound
+                         the gram index - when either is reached the oldest
+                         half of the entries is dropped. */
+#define HISTORY_MAX_POSTINGS (1 << 24)
+#define HISTORY_MAX_GRAMS (1 << 20)
+
+/* GRAM_LEN: Number of WCHARs in a gram. Patterns shorter than a gram are 
+             searched by scanning the entries, newest first. */
+#define GRAM_LEN 3
+
+/* GRAM_ANCHOR: Stands for the start and the end of an entry in its grams
+                (it's never part of an entry). */
+#define GRAM_ANCHOR L'\n'
+
+/* GRAM_BLOCK_MIN, GRAM_BLOCK_MAX: Capacity of the first block of a gram's
+                                   list, and of the largest - each block
+                                   doubles the last. */
+#define GRAM_BLOCK_MIN 2
+#define GRAM_BLOCK_MAX 256
+
+/* GRAM_NO_BLOCK: Ends a gram's chain of blocks. */
+#define GRAM_NO_BLOCK UINT32_MAX
+
+/* HISTORY_MAGIC: Start of the header line. The generation follows it as 8 
+                  hex digits. */
+#define HISTORY_MAGIC L"#winshell-history "
+
+/* HISTORY_HEADER_LEN: Length of the header line in WCHARs, L'\n' included. */
+#define HISTORY_HEADER_LEN (sizeof(HISTORY_MAGIC) / sizeof(WCHAR) - 1 + 8 + 1)
+
+/* HISTORY_LOCK_OFFSET_HIGH: High DWORD of the offset of the byte locked to 
+                             serialize shells. It's far past any data so 
+                             that the lock doesn't get in the way of I/O. */
+#define HISTORY_LOCK_OFFSET_HIGH 0x7FFFFFFF
+
+
+
+static HANDLE hist_file_h = INVALID_HANDLE_VALUE;
+static HANDLE hist_map_h = NULL;
+
+/* hist_view: The mapped history file. Entries end with L'\n', the unused
+              tail of the mapping is all L'\0'. */
+static WCHAR *hist_view = NULL;
+
+/* hist_len: Number of WCHARs of hist_view used by entries. */
+static uint32_t hist_len = 0;
+
+/* hist_cap: Number of WCHARs mapped. */
+static uint32_t hist_cap = 0;
+
+/* hist_offsets: Offset into hist_view of each entry, oldest first. The index
+                 into this array is the entry id. */
+static uint32_t *hist_offsets = NULL;
+
+static int32_t n_hist = 0;
+static int32_t cap_hist = 0;
+
+
+
+/**
+ * gram_list_t struct
+ *
+ * The ids of the entries a gram occurs in, oldest first. They're kept in a 
+ * chain of blocks in gram_pool, newest block first. A block is its previous
+ * block's index (GRAM_NO_BLOCK for the oldest), its capacity and its ids.
+ */
+typedef struct _gram_list {
+
+    /* key: The gram (see gram_key). 0 if the slot is unused. */
+    uint64_t key;
+
+    /* last_block: Index in gram_pool of the newest block. */
+    uint32_t last_block;
+
+    /* n_last: Number of ids in the newest block. */
+    uint32_t n_last;
+
+    /* n_ids: Number of ids in the list. */
+    uint32_t n_ids;
+
+} gram_list_t;
+
+
+
+/* gram_slots: Open addressing hash table of gram lists. */
+static gram_list_t *gram_slots = NULL;
+static uint32_t cap_gram_slots = 0;
+static uint32_t n_grams = 0;
+
+/* gram_pool: Blocks of every gram list. */
+static uint32_t *gram_pool = NULL;
+static uint32_t len_gram_pool = 0;
+static uint32_t cap_gram_pool = 0;
+
+/* hist_gen: Generation of the file the indexes were built for. */
+static uint32_t hist_gen = 0;
+
+
+
+/**
+ * map_history
+ *
+ * (Re)maps the history file with room for cap WCHARs. Grows the file if it's
+ * smaller than that.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL map_history(uint32_t cap) {
+
+    if (hist_view != NULL) {
+        UnmapViewOfFile(hist_view);
+        hist_view = NULL;
+    }
+    if (hist_map_h != NULL) {
+        CloseHandle(hist_map_h);
+        hist_map_h = NULL;
+    }
+
+    uint64_t n_bytes = (uint64_t)cap * sizeof(WCHAR);
+    hist_map_h = CreateFileMappingW(
+        hist_file_h,
+        NULL,
+        PAGE_READWRITE,
+        (DWORD)(n_bytes >> 32),
+        (DWORD)n_bytes,
+        NULL
+    );
+    if (hist_map_h == NULL) {
+        print_err(L"map_history -> CreateFileMappingW");
+        goto unmapped;
+    }
+    hist_view = MapViewOfFile(hist_map_h, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (hist_view == NULL) {
+        print_err(L"map_history -> MapViewOfFile");
+        CloseHandle(hist_map_h);
+        hist_map_h = NULL;
+        goto unmapped;
+    }
+
+    hist_cap = cap;
+    return TRUE;
+
+unmapped:
+    // Nothing to look at any more: the history is empty from now on
+    n_hist = 0;
+    hist_len = 0;
+    hist_cap = 0;
+    return FALSE;
+}
+
+
+
+/**
+ * line_len
+ *
+ * Return Value: Returns the length of the entry starting at offset off (not
+ *               including the L'\n').
+ */
+static uint32_t line_len(uint32_t off) {
+    const WCHAR *nl_p = wmemchr(hist_view + off, L'\n', hist_len - off);
+    if (nl_p == NULL) // another shell is rewriting the file
+        return hist_len - off;
+    return (uint32_t)(nl_p - (hist_view + off));
+}
+
+
+
+/**
+ * gram_key
+ *
+ * Return Value: Returns the key of the gram made of a, b and c. Never 0.
+ */
+static uint64_t gram_key(WCHAR a, WCHAR b, WCHAR c) {
+    return (uint64_t)(a & 0x1FFFFF) << 42 
+            | (uint64_t)(b & 0x1FFFFF) << 21 
+            | (uint64_t)(c & 0x1FFFFF);
+}
+
+
+
+/**
+ * find_slot
+ *
+ * Return Value: Returns the slot of gram_slots that holds key, or the 
+ *               unused slot it would go in.
+ */
+static gram_list_t *find_slot(uint64_t key) {
+
+    uint32_t i = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32)
+                  & (cap_gram_slots - 1);
+    while (gram_slots[i].key != 0 and gram_slots[i].key != key)
+        i = (i + 1) & (cap_gram_slots - 1);
+    return &gram_slots[i];
+}
+
+
+
+/**
+ * find_gram
+ *
+ * Return Value: Returns the list of a gram, NULL if it occurs in no entry.
+ */
+static gram_list_t *find_gram(uint64_t key) {
+
+    if (n_grams == 0)
+        return NULL;
+    gram_list_t *list = find_slot(key);
+    return list->key != 0 ? list : NULL;
+}
+
+
+
+/**
+ * add_gram
+ *
+ * Return Value: Returns the list of a gram, adding an empty one if it has
+ *               none. Returns NULL if the gram index is full (or out of
+ *               memory).
+ */
+static gram_list_t *add_gram(uint64_t key) {
+
+    if (n_grams > 0) {
+        gram_list_t *list = find_slot(key);
+        if (list->key != 0)
+            return list;
+    }
+    if (n_grams == HISTORY_MAX_GRAMS)
+        return NULL;
+
+    // Keep the table at most half full
+    if (2 * (n_grams + 1) > cap_gram_slots) {
+        uint32_t old_cap = cap_gram_slots;
+        gram_list_t *old_slots = gram_slots;
+        uint32_t new_cap = old_cap ? 2 * old_cap : 4096;
+        gram_list_t *new_slots = calloc(new_cap, sizeof(gram_list_t));
+        if (new_slots == NULL)
+            return NULL;
+        gram_slots = new_slots;
+        cap_gram_slots = new_cap;
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old_slots[i].key != 0)
+                *find_slot(old_slots[i].key) = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    gram_list_t *list = find_slot(key);
+    list->key = key;
+    list->n_ids = 0;
+    n_grams++;
+    return list;
+}
+
+
+
+/**
+ * add_id
+ *
+ * Appends an entry id to a gram's list, unless it's already the newest id
+ * there (the gram occurs twice in the entry).
+ *
+ * Return Value: Returns TRUE on success, FALSE if the gram index is full (or
+ *               out of memory).
+ */
+static BOOL add_id(gram_list_t *list, uint32_t id) {
+
+    if (list->n_ids > 0 
+         and gram_pool[list->last_block + 2 + list->n_last - 1] == id)
+        return TRUE;
+
+    // Start a new block, twice as big as the last one
+    if (list->n_ids == 0 or list->n_last == gram_pool[list->last_block + 1]) {
+        uint32_t block_cap = GRAM_BLOCK_MIN;
+        if (list->n_ids > 0) {
+            block_cap = 2 * gram_pool[list->last_block + 1];
+            if (block_cap > GRAM_BLOCK_MAX)
+                block_cap = GRAM_BLOCK_MAX;
+        }
+        uint32_t len_block = 2 + block_cap;
+        if (len_gram_pool + len_block > HISTORY_MAX_POSTINGS)
+            return FALSE;
+        if (len_gram_pool + len_block > cap_gram_pool) {
+            uint32_t new_cap = cap_gram_pool ? 2 * cap_gram_pool : 65536;
+            if (new_cap > HISTORY_MAX_POSTINGS)
+                new_cap = HISTORY_MAX_POSTINGS;
+            uint32_t *new_pool = realloc(gram_pool, 
+                                         new_cap * sizeof(uint32_t));
+            if (new_pool == NULL)
+                return FALSE;
+            gram_pool = new_pool;
+            cap_gram_pool = new_cap;
+        }
+        uint32_t block = len_gram_pool;
+        gram_pool[block] = list->n_ids > 0 ? list->last_block : GRAM_NO_BLOCK;
+        gram_pool[block + 1] = block_cap;
+        len_gram_pool += len_block;
+        list->last_block = block;
+        list->n_last = 0;
+    }
+
+    gram_pool[list->last_block + 2 + list->n_last] = id;
+    list->n_last++;
+    list->n_ids++;
+    return TRUE;
+}
+
+
+
+/**
+ * anchored_char
+ *
+ * Return Value: Returns WCHAR i of text as it's indexed - with GRAM_ANCHOR
+ *               before and after it.
+ */
+static WCHAR anchored_char(const WCHAR *text, uint32_t len_text, uint32_t i) {
+    return i == 0 or i == len_text + 1 ? GRAM_ANCHOR : text[i - 1];
+}
+
+
+
+/**
+ * index_grams
+ *
+ * Adds an entry to the lists of all its grams (anchors included).
+ *
+ * Return Value: Returns TRUE on success, FALSE if the gram index is full (or
+ *               out of memory).
+ */
+static BOOL index_grams(uint32_t id, const WCHAR *text, uint32_t len_text) {
+
+    for (uint32_t i = 0; i + GRAM_LEN <= len_text + 2; i++) {
+        gram_list_t *list = add_gram(gram_key(
+            anchored_char(text, len_text, i),
+            anchored_char(text, len_text, i + 1),
+            anchored_char(text, len_text, i + 2)
+        ));
+        if (list == NULL or not add_id(list, id))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * ensure_index_cap
+ *
+ * Grows hist_offsets to hold at least n entries.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL ensure_index_cap(int32_t n) {
+
+    if (n <= cap_hist)
+        return TRUE;
+    int32_t new_cap = cap_hist ? cap_hist : 1024;
+    while (new_cap < n)
+        new_cap *= 2;
+    if (new_cap > HISTORY_MAX_ENTRIES)
+        new_cap = HISTORY_MAX_ENTRIES;
+
+    uint32_t *new_offsets = realloc(hist_offsets, new_cap * sizeof(uint32_t));
+    if (new_offsets == NULL)
+        return FALSE;
+    hist_offsets = new_offsets;
+    cap_hist = new_cap;
+    return TRUE;
+}
+
+
+
+/**
+ * lock_history
+ *
+ * Takes the lock other shells sharing the file respect (blocks until it's 
+ * free).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL lock_history() {
+
+    OVERLAPPED overlapped = {
+        .Offset = 0,
+        .OffsetHigh = HISTORY_LOCK_OFFSET_HIGH
+    };
+    return LockFileEx(hist_file_h, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0,
+                      &overlapped);
+}
+
+
+
+/**
+ * unlock_history
+ *
+ * Releases the lock taken by lock_history.
+ */
+static void unlock_history() {
+
+    OVERLAPPED overlapped = {
+        .Offset = 0,
+        .OffsetHigh = HISTORY_LOCK_OFFSET_HIGH
+    };
+    UnlockFileEx(hist_file_h, 0, 1, 0, &overlapped);
+}
+
+
+
+/**
+ * used_len
+ *
+ * Return Value: Returns the number of WCHARs of the mapping used by the 
+ *               header and entries - the rest is all L'\0'.
+ */
+static uint32_t used_len() {
+    const WCHAR *end_p = wmemchr(hist_view, L'\0', hist_cap);
+    return end_p ? (uint32_t)(end_p - hist_view) : hist_cap;
+}
+
+
+
+/**
+ * read_gen
+ *
+ * Return Value: Returns the generation in the file's header.
+ */
+static uint32_t read_gen() {
+
+    WCHAR gen_str[9];
+    memcpy(gen_str, hist_view + HISTORY_HEADER_LEN - 9, 8 * sizeof(WCHAR));
+    gen_str[8] = L'\0';
+    return (uint32_t)wcstoul(gen_str, NULL, 16);
+}
+
+
+
+/**
+ * write_header
+ *
+ * Writes the header line with generation gen at the start of the mapping.
+ */
+static void write_header(uint32_t gen) {
+
+    WCHAR header[HISTORY_HEADER_LEN + 1];
+    _snwprintf(header, HISTORY_HEADER_LEN + 1, L"%ls%08x\n", HISTORY_MAGIC,
+               gen);
+    memcpy(hist_view, header, HISTORY_HEADER_LEN * sizeof(WCHAR));
+}
+
+
+
+static BOOL compact_history();
+
+
+
+/**
+ * build_index
+ *
+ * Builds both indexes from scratch from the entries in the mapping. If they
+ * don't all fit, the oldest half is dropped (see compact_history).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL build_index() {
+
+    n_hist = 0;
+    n_grams = 0;
+    len_gram_pool = 0;
+    if (gram_slots != NULL)
+        memset(gram_slots, 0, cap_gram_slots * sizeof(gram_list_t));
+
+    uint32_t off = HISTORY_HEADER_LEN;
+    while (off < hist_len) {
+        const WCHAR *nl_p = wmemchr(hist_view + off, L'\n', hist_len - off);
+        if (nl_p == NULL) // torn last entry
+            break;
+        if (n_hist == HISTORY_MAX_ENTRIES)
+            return compact_history();
+        if (not ensure_index_cap(n_hist + 1))
+            return FALSE;
+        hist_offsets[n_hist] = off;
+        n_hist++;
+        uint32_t len_text = (uint32_t)(nl_p - (hist_view + off));
+        if (not index_grams(n_hist - 1, hist_view + off, len_text))
+            return compact_history();
+        off += len_text + 1;
+    }
+    // Drop a torn tail so the file ends cleanly
+    memset(hist_view + off, 0, (hist_len - off) * sizeof(WCHAR));
+    hist_len = off;
+    return TRUE;
+}
+
+
+
+/**
+ * index_entry
+ *
+ * Adds the entry at the end of the used part of the mapping (at hist_len, 
+ * len_line WCHARs and its L'\n') to the indexes. Called with room for it in
+ * hist_offsets. If the gram index is full, the oldest half of the entries is
+ * dropped (see compact_history).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL index_entry(uint32_t len_line) {
+
+    uint32_t off = hist_len;
+    hist_len += len_line + 1;
+    hist_offsets[n_hist] = off;
+    n_hist++;
+    if (not index_grams(n_hist - 1, hist_view + off, len_line))
+        return compact_history();
+    return TRUE;
+}
+
+
+
+/**
+ * compact_history
+ *
+ * Drops the oldest half of the entries, moves the rest to the start of the
+ * file (right after the header), bumps the generation and rebuilds the 
+ * indexes. Called with the lock held.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL compact_history() {
+
+    int32_t n_drop = (n_hist + 1) / 2;
+    uint32_t drop_off = n_drop < n_hist ? hist_offsets[n_drop] : hist_len;
+    uint32_t n_dropped = drop_off - HISTORY_HEADER_LEN;
+
+    memmove(
+        hist_view + HISTORY_HEADER_LEN,
+        hist_view + drop_off,
+        (hist_len - drop_off) * sizeof(WCHAR)
+    );
+    memset(hist_view + hist_len - n_dropped, 0, n_dropped * sizeof(WCHAR));
+    hist_len -= n_dropped;
+
+    hist_gen++;
+    write_header(hist_gen);
+    return build_index();
+}
+
+
+
+/**
+ * sync_history
+ *
+ * Catches up on what other shells did to the file: indexes the entries 
+ * they appended, or everything again if one of them compacted it. Called 
+ * with the lock held.
+ */
+static void sync_history() {
+
+    // Another shell grew the file past our mapping
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(hist_file_h, &file_size)) {
+        uint64_t n_file_wchars = (uint64_t)file_size.QuadPart / sizeof(WCHAR);
+        if (n_file_wchars > HISTORY_MAX_WCHARS)
+            n_file_wchars = HISTORY_MAX_WCHARS;
+        if (n_file_wchars > hist_cap 
+             and not map_history((uint32_t)n_file_wchars))
+            return;
+    }
+
+    if (read_gen() != hist_gen) {
+        hist_gen = read_gen();
+        hist_len = used_len();
+        build_index();
+        return;
+    }
+
+    while (hist_len < hist_cap and hist_view[hist_len] != L'\0') {
+        const WCHAR *nl_p = wmemchr(hist_view + hist_len, L'\n', 
+                                    hist_cap - hist_len);
+        if (nl_p == NULL or not ensure_index_cap(n_hist + 1))
+            break;
+        if (n_hist == HISTORY_MAX_ENTRIES) {
+            compact_history();
+            break;
+        }
+        if (not index_entry((uint32_t)(nl_p - (hist_view + hist_len))))
+            break;
+    }
+}
+
+
+
+/**
+ * refresh_history
+ *
+ * Catches up on what other shells did to the file (see sync_history), 
+ * taking the lock for it.
+ */
+static void refresh_history() {
+
+    if (hist_view == NULL or not lock_history())
+        return;
+    sync_history();
+    unlock_history();
+}
+
+
+
+/**
+ * history_open
+ *
+ * Opens (creating if needed) the history file - WINSHELL_HISTFILE, or
+ * %USERPROFILE%\.winshell_history - maps it and indexes its entries. Other
+ * shells can have it open at the same time.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure. The shell runs
+ *               without history if this fails.
+ */
+BOOL history_open() {
+
+    WCHAR path[MAX_PATH + 1];
+    DWORD dw_rc;
+    BOOL bool_rc;
+
+    dw_rc = GetEnvironmentVariableW(L"WINSHELL_HISTFILE", path, MAX_PATH + 1);
+    if (dw_rc == 0 or dw_rc > MAX_PATH) {
+        dw_rc = GetEnvironmentVariableW(L"USERPROFILE", path, MAX_PATH + 1);
+        if (dw_rc == 0 or dw_rc + wcslen(L"\\.winshell_history") > MAX_PATH)
+            return FALSE;
+        wcscat(path, L"\\.winshell_history");
+    }
+
+    hist_file_h = CreateFileW(
+        path,
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (hist_file_h == INVALID_HANDLE_VALUE) {
+        print_err(L"history_open -> CreateFileW");
+        return FALSE;
+    }
+    if (not lock_history()) {
+        print_err(L"history_open -> LockFileEx");
+        goto failed;
+    }
+
+    LARGE_INTEGER file_size;
+    bool_rc = GetFileSizeEx(hist_file_h, &file_size);
+    if (not bool_rc) {
+        print_err(L"history_open -> GetFileSizeEx");
+        goto failed_locked;
+    }
+
+    uint64_t n_file_wchars = (uint64_t)file_size.QuadPart / sizeof(WCHAR);
+    if (n_file_wchars > HISTORY_MAX_WCHARS)
+        n_file_wchars = HISTORY_MAX_WCHARS;
+    uint32_t cap =
+        (uint32_t)((n_file_wchars / HISTORY_MAP_CHUNK + 1) * HISTORY_MAP_CHUNK);
+    if (cap > HISTORY_MAX_WCHARS)
+        cap = HISTORY_MAX_WCHARS;
+
+    if (not map_history(cap))
+        goto failed_locked;
+    hist_len = used_len();
+
+    // A new file, or one from before the header: put the header in front
+    if (hist_len < HISTORY_HEADER_LEN
+         or wmemcmp(hist_view, HISTORY_MAGIC, HISTORY_HEADER_LEN - 9) != 0) {
+        if (hist_len + HISTORY_HEADER_LEN > hist_cap)
+            hist_len = hist_cap - HISTORY_HEADER_LEN;
+        memmove(
+            hist_view + HISTORY_HEADER_LEN, 
+            hist_view, 
+            hist_len * sizeof(WCHAR)
+        );
+        write_header(0);
+        hist_len += HISTORY_HEADER_LEN;
+    }
+
+    hist_gen = read_gen();
+    bool_rc = build_index();
+    unlock_history();
+    return bool_rc;
+
+failed_locked:
+    unlock_history();
+failed:
+    CloseHandle(hist_file_h);
+    hist_file_h = INVALID_HANDLE_VALUE;
+    return FALSE;
+}
+
+
+
+/**
+ * history_add
+ *
+ * Appends a line to the history file and indexes it. Empty lines and a line
+ * equal to the newest entry aren't added.
+ *
+ * line: Line to add (doesn't need to be NULL-terminated).
+ * len_line: Number of WCHARs in line.
+ */
+void history_add(const WCHAR *line, int32_t len_line) {
+
+    if (hist_view == NULL or len_line <= 0)
+        return;
+    if (not lock_history())
+        return;
+    sync_history();
+    if (hist_view == NULL)
+        goto done;
+
+    uint32_t len_entry = (uint32_t)len_line + 1;
+
+    // Same as the newest entry
+    if (n_hist > 0) {
+        uint32_t last_off = hist_offsets[n_hist - 1];
+        if (line_len(last_off) == (uint32_t)len_line
+             and wmemcmp(hist_view + last_off, line, len_line) == 0)
+            goto done;
+    }
+
+    // Stay inside the size bounds
+    if (n_hist == HISTORY_MAX_ENTRIES
+         or hist_len + len_entry > HISTORY_MAX_WCHARS)
+        compact_history();
+    if (hist_len + len_entry > HISTORY_MAX_WCHARS)
+        goto done;
+    if (not ensure_index_cap(n_hist + 1))
+        goto done;
+    if (hist_len + len_entry > hist_cap) {
+        uint32_t new_cap = hist_cap + HISTORY_MAP_CHUNK;
+        if (new_cap < hist_len + len_entry)
+            new_cap = hist_len + len_entry;
+        if (new_cap > HISTORY_MAX_WCHARS)
+            new_cap = HISTORY_MAX_WCHARS;
+        if (not map_history(new_cap))
+            goto done;
+    }
+
+    // Append
+    memcpy(hist_view + hist_len, line, len_line * sizeof(WCHAR));
+    hist_view[hist_len + len_line] = L'\n';
+    index_entry((uint32_t)len_line);
+
+done:
+    unlock_history();
+}
+
+
+
+/**
+ * wcs_find
+ *
+ * Return Value: Returns TRUE if needle occurs in hay[0..len_hay).
+ */
+static BOOL wcs_find(const WCHAR *hay, uint32_t len_hay,
+                     const WCHAR *needle, uint32_t len_needle) {
+
+    if (len_needle == 0)
+        return TRUE;
+    const WCHAR *hay_p = hay, *hay_end = hay + len_hay;
+    while ((uint32_t)(hay_end - hay_p) >= len_needle) {
+        hay_p = wmemchr(hay_p, needle[0], (hay_end - hay_p) - len_needle + 1);
+        if (hay_p == NULL)
+            return FALSE;
+        if (wmemcmp(hay_p, needle, len_needle) == 0)
+            return TRUE;
+        hay_p++;
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * entry_matches
+ *
+ * Return Value: Returns TRUE if entry id starts with (or contains) pattern.
+ */
+static BOOL entry_matches(int32_t id, const WCHAR *pattern, 
+                          uint32_t len_pattern, BOOL is_prefix) {
+
+    uint32_t off = hist_offsets[id];
+    uint32_t len_entry = line_len(off);
+    if (is_prefix)
+        return len_entry >= len_pattern
+                and wmemcmp(hist_view + off, pattern, len_pattern) == 0;
+    return wcs_find(hist_view + off, len_entry, pattern, len_pattern);
+}
+
+
+
+/**
+ * rarest_gram
+ *
+ * Finds the pattern's gram that occurs in the fewest entries - a prefix is
+ * anchored at the start, like the entries are.
+ *
+ * out_list: The gram's list is placed here, NULL if some gram of the 
+ *           pattern occurs in no entry (so nothing can match).
+ *
+ * Return Value: Returns FALSE if the pattern is too short to have a gram.
+ */
+static BOOL rarest_gram(const WCHAR *pattern, uint32_t len_pattern, 
+                        BOOL is_prefix, gram_list_t **out_list) {
+
+    uint32_t len_query = len_pattern + (is_prefix ? 1 : 0);
+    if (len_query < GRAM_LEN)
+        return FALSE;
+
+    *out_list = NULL;
+    for (uint32_t i = 0; i + GRAM_LEN <= len_query; i++) {
+        // Position in the pattern as it's indexed (anchor in front)
+        uint32_t j = is_prefix ? i : i + 1;
+        gram_list_t *list = find_gram(gram_key(
+            anchored_char(pattern, len_pattern, j),
+            anchored_char(pattern, len_pattern, j + 1),
+            anchored_char(pattern, len_pattern, j + 2)
+        ));
+        if (list == NULL) {
+            *out_list = NULL;
+            return TRUE;
+        }
+        if (*out_list == NULL or list->n_ids < (*out_list)->n_ids)
+            *out_list = list;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * search_older
+ *
+ * Finds the newest entries older than before_id that start with (or 
+ * contain) pattern. The entries on the list of the pattern's rarest gram are
+ * checked, newest first. A pattern too short to have a gram is checked 
+ * against every entry, newest first.
+ *
+ * Return Value: Returns the number of ids placed in out_ids, newest first.
+ */
+static int32_t search_older(const WCHAR *pattern, uint32_t len_pattern,
+                            BOOL is_prefix, int32_t before_id, 
+                            int32_t *out_ids, int32_t max_ids) {
+
+    int32_t n_found = 0;
+    gram_list_t *list;
+
+    if (before_id > n_hist)
+        before_id = n_hist;
+
+    if (not rarest_gram(pattern, len_pattern, is_prefix, &list)) {
+        for (int32_t id = before_id - 1; id >= 0 and n_found < max_ids; 
+              id--) {
+            if (entry_matches(id, pattern, len_pattern, is_prefix))
+                out_ids[n_found++] = id;
+        }
+        return n_found;
+    }
+    if (list == NULL)
+        return 0;
+
+    uint32_t block = list->last_block, n_block = list->n_last;
+    while (n_found < max_ids) {
+        for (uint32_t i = n_block; i-- > 0 and n_found < max_ids; ) {
+            int32_t id = (int32_t)gram_pool[block + 2 + i];
+            if (id < before_id 
+                 and entry_matches(id, pattern, len_pattern, is_prefix))
+                out_ids[n_found++] = id;
+        }
+        block = gram_pool[block];
+        if (block == GRAM_NO_BLOCK)
+            break;
+        n_block = gram_pool[block + 1];
+    }
+    return n_found;
+}
+
+
+
+/**
+ * history_search
+ *
+ * Finds the newest entries that start with (or contain) pattern, through 
+ * the gram index.
+ *
+ * pattern: Text to search for (doesn't need to be NULL-terminated).
+ * len_pattern: Number of WCHARs in pattern.
+ * is_prefix: TRUE for a prefix search, FALSE for a substring search.
+ * out_ids: Matching entry ids are placed here, newest first.
+ * max_ids: Capacity of out_ids.
+ *
+ * Return Value: Returns the number of ids placed in out_ids.
+ */
+int32_t history_search(const WCHAR *pattern, int32_t len_pattern,
+                       BOOL is_prefix, int32_t *out_ids, int32_t max_ids) {
+
+    refresh_history();
+    return search_older(pattern, (uint32_t)len_pattern, is_prefix, n_hist,
+                        out_ids, max_ids);
+}
+
+
+
+/**
+ * history_search_older
+ *
+ * One step of a reverse incremental search: finds the newest entry older 
+ * than before_id that contains pattern.
+ *
+ * pattern: Text to search for (doesn't need to be NULL-terminated).
+ * len_pattern: Number of WCHARs in pattern.
+ * before_id: Only entries older than this are looked at - history_count() 
+ *            for the first step, the last match for the next ones.
+ *
+ * Return Value: Returns the id of the entry, -1 if there's none.
+ */
+int32_t history_search_older(const WCHAR *pattern, int32_t len_pattern,
+                             int32_t before_id) {
+
+    int32_t id;
+
+    refresh_history();
+    if (search_older(pattern, (uint32_t)len_pattern, FALSE, before_id, &id, 
+                     1) == 0)
+        return -1;
+    return id;
+}
+
+
+
+/**
+ * history_entry
+ *
+ * Looks up an entry by id.
+ *
+ * id: Entry id (0 is the oldest).
+ * out_len_entry: Length of the entry is placed here.
+ *
+ * Return Value: Returns a pointer to the entry text (not NULL-terminated).
+ *               Only valid until the next history_add.
+ *               Returns NULL if there is no such entry.
+ */
+const WCHAR *history_entry(int32_t id, int32_t *out_len_entry) {
+
+    if (id < 0 or id >= n_hist)
+        return NULL;
+    uint32_t off = hist_offsets[id];
+    *out_len_entry = (int32_t)line_len(off);
+    return hist_view + off;
+}
+
+
+
+/**
+ * history_count
+ *
+ * Return Value: Returns the number of entries in the history.
+ */
+int32_t history_count() {
+    refresh_history();
+    return n_hist;
+}
+
+
+
+/**
+ * history_expand
+ *
+ * Expands a line that starts with '!': "!!" becomes the newest entry and
+ * "!text" becomes the newest entry that starts with text.
+ *
+ * line: NULL-terminated line, with room for MAX_CMDLINE + 1 WCHARs. Replaced
+ *       with the expansion.
+ *
+ * Return Value: Returns TRUE if line was expanded (or didn't need to be).
+ *               Returns FALSE if no entry matched - line is left as is.
+ */
+BOOL history_expand(WCHAR *line) {
+
+    int32_t id, len_entry;
+
+    if (line[0] != L'!' or line[1] == L'\0')
+        return TRUE;
+
+    if (line[1] == L'!' and line[2] == L'\0') {
+        id = history_count() - 1;
+    }
+    else if (history_search(line + 1, (int32_t)wcslen(line + 1), TRUE,
+                            &id, 1) == 0) {
+        return FALSE;
+    }
+
+    const WCHAR *entry = history_entry(id, &len_entry);
+    if (entry == NULL)
+        return FALSE;
+    memcpy(line, entry, len_entry * sizeof(WCHAR));
+    line[len_entry] = L'\0';
+    return TRUE;
+}
@@ -0,0 +1,114 @@
+
+/**
+ * history_builtin.c
+ */
+
+
+
+#include <windows.h>
+#include <stdio.h>
+#include <wctype.h>
+#include <iso646.h>
+#include <shlwapi.h>
+#include "_winshell_private.h"
+
+
+
+/* HISTORY_DEFAULT_SHOW: Number of entries listed when no count is given. */
+#define HISTORY_DEFAULT_SHOW 32
+
+/* HISTORY_MAX_SHOW: Most entries a single history call will list. */
+#define HISTORY_MAX_SHOW 4096
+
+
+
+/**
+ * write_entry
+ * 
+ * Writes "  id  entry\n" for a history entry.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL write_entry(out_stream_t *out, int32_t id) {
+
+    WCHAR id_str[16];
+    int32_t len_entry;
+
+    const WCHAR *entry = history_entry(id, &len_entry);
+    if (entry == NULL)
+        return TRUE;
+    int len_id_str = _snwprintf(id_str, 16, L"%6d  ", id + 1);
+    return out_stream_write(out, id_str, len_id_str)
+            and out_stream_write(out, entry, len_entry)
+            and out_stream_write(out, L"\n", 1);
+}
+
+
+
+/**
+ * history_builtin
+ * 
+ * Lists or searches the command history.
+ *  - history         lists the newest HISTORY_DEFAULT_SHOW entries
+ *  - history N       lists the newest N entries
+ *  - history -p text lists entries that start with text, newest first
+ *  - history -s text lists entries that contain text, newest first
+ * 
+ * parsed_proc: Contains parsed information about the command line that 
+ *              called this builtin.
+ * stdio: Standard streams after redirection - will output to std_out.
+ * 
+ * Return Value: Returns TRUE on success, returns FALSE on failure.
+ */
+BOOL history_builtin(parsed_process_t *parsed_proc, 
+                     stdio_handles_t *stdio) {
+
+    BOOL bool_rc = TRUE;
+    static int32_t found_ids[HISTORY_MAX_SHOW];
+    out_stream_t out;
+
+    const WCHAR *history_p = skip_whitespace(parsed_proc->cmd_line);
+    const WCHAR *arg_p = skip_whitespace(arg_end(history_p));
+
+    out_stream_init(&out, stdio->std_out);
+
+    // Search: the pattern is the rest of the line (trailing spaces trimmed)
+    if (arg_p[0] == L'-' and (arg_p[1] == L'p' or arg_p[1] == L's')
+         and (arg_p[2] == L'\0' or iswspace(arg_p[2]))) {
+        BOOL is_prefix = arg_p[1] == L'p';
+        const WCHAR *pattern = skip_whitespace(arg_p + 2);
+        int32_t len_pattern = (int32_t)wcslen(pattern);
+        while (len_pattern > 0 and iswspace(pattern[len_pattern - 1]))
+            len_pattern--;
+
+        int32_t n_found = history_search(
+            pattern,
+            len_pattern,
+            is_prefix,
+            found_ids,
+            HISTORY_MAX_SHOW
+        );
+        for (int32_t i = 0; i < n_found and bool_rc; i++) {
+            bool_rc = write_entry(&out, found_ids[i]);
+        }
+    }
+
+    // List the newest entries, oldest of them first
+    else {
+        int32_t n_show = HISTORY_DEFAULT_SHOW;
+        if (iswdigit(*arg_p))
+            n_show = (int32_t)StrToIntW(arg_p);
+        int32_t n_hist = history_count();
+        int32_t first_id = n_show < n_hist ? n_hist - n_show : 0;
+        for (int32_t id = first_id; id < n_hist and bool_rc; id++) {
+            bool_rc = write_entry(&out, id);
+        }
+    }
+
+    if (not out_stream_close(&out))
+        bool_rc = FALSE;
+    if (not bool_rc)
+        print_err(L"history_builtin -> out_stream_write");
+
+    return bool_rc;
+}
@@ -23,52 +23,88 @@
  * 
  * Does some initialization tasks that must be done before the main shell loop
  * is run:
- *  - initializes the jobs array
+ *  - allocates the job table
  */
 int init_winshell() {
+
+    DWORD dw_rc;
     
-    // Initialize jobs array
-    for (int32_t i = 0; i < MAX_JOBS; i++) {
-        jobs[i].jid = i;
-        jobs[i].status = GARBAGE;
+    // Allocate the job table
+    if (!grow_jobs()) {
+        print_err(L"init_winshell -> grow_jobs");
+        return 1;
+    }
+
+    InitializeCriticalSection(&spawn_lock);
+
+    // The shell's working directory starts out as the process's
+    dw_rc = GetCurrentDirectoryW(MAX_PATH + 1, shell_cwd);
+    if (dw_rc == 0 || dw_rc > MAX_PATH) {
+        print_err(L"init_winshell -> GetCurrentDirectoryW");
+        return 1;
+    }
+
+    // Is stdin a console, or a pipe/file fed by another program?
+    DWORD console_mode;
+    stdin_is_console = GetConsoleMode(
+        GetStdHandle(STD_INPUT_HANDLE), 
+        &console_mode
+    );
+
+    // Builtin output encoding for files and pipes (UTF-8 unless asked for)
+    WCHAR out_encoding[16];
+    dw_rc = GetEnvironmentVariableW(
+        L"WINSHELL_OUTPUT_ENCODING", 
+        out_encoding, 
+        16
+    );
+    if (dw_rc > 0 && dw_rc < 16 
+         && (_wcsicmp(out_encoding, L"utf-16") == 0 
+              || _wcsicmp(out_encoding, L"utf16") == 0)) {
+        redirected_out_encoding = OUT_ENC_UTF16;
+    }
+    else {
+        redirected_out_encoding = OUT_ENC_UTF8;
     }
 
     // Initialize cmdline_data synchronization objects
-    cmdline_lock = CreateMutexW(NULL, FALSE, NULL);
+    cmdline_lock = plat_mutex_create();
     if (cmdline_lock == NULL) {
-        print_err(L"cmdline_lock CreateMutexW");
+        print_err(L"cmdline_lock plat_mutex_create");
         return -1;
     }
-    cmdline_available_e = CreateEventW(
-        NULL, 
-        FALSE, // This is autoreset event (Wait resets signal state)
-        FALSE, 
-        NULL
+    cmdline_available_e = plat_event_create(
+        FALSE // This is autoreset event (Wait resets signal state)
     );
     if (cmdline_available_e == NULL) {
-        print_err(L"cmdline_available_e CreateEventW");
+        print_err(L"cmdline_available_e plat_event_create");
         return -1;
     }
-    cmdline_consumed_e = CreateEventW(NULL, FALSE, FALSE, NULL);
+    cmdline_consumed_e = plat_event_create(FALSE);
     if (cmdline_consumed_e == NULL) {
-        print_err(L"init_winshell -> CreateEventW cmdline_consumed_e");
+        print_err(L"init_winshell -> plat_event_create cmdline_consumed_e");
         ExitProcess(1);
     }
 
     // Initialize exited synchronization objects
-    exited_lock = CreateMutexW(NULL, FALSE, NULL);
+    exited_lock = plat_mutex_create();
     if (exited_lock == NULL) {
-        print_err(L"init_winshell -> CreateMutexW exited_lock");
+        print_err(L"init_winshell -> plat_mutex_create exited_lock");
         return -1;
     }
-    exited_e = CreateEventW(NULL, FALSE, FALSE, NULL);
-    if (exited_lock == NULL) {
-        print_err(L"init_winshell -> CreateEventW exited_e");
+    exited_e = plat_event_create(FALSE);
+    if (exited_e == NULL) {
+        print_err(L"init_winshell -> plat_event_create exited_e");
         return -1;
     }
 
+    // Command history (the shell works without it)
+    if (stdin_is_console) {
+        history_open();
+    }
+
     // Allocate and initialize the wait_handles array
-    cap_wait_handles = 1 + MAX_JOBS * 3;
+    cap_wait_handles = 1 + JOBS_INIT_CAP * 3;
     n_wait_handles = 1;
     wait_handles = malloc(cap_wait_handles * sizeof(HANDLE));
     wait_handles[0] = cmdline_available_e;
@@ -0,0 +1,1365 @@
+
+/**
+ * inproc_stage.c
+ *
+ * In-process builtins: echo, printf, cat, env, xargs, sleep, true and false
+ * run inside the shell instead of in a new process, but as a stage of their
+ * job like any other. Each stage has a HANDLE that's signaled when it's done
+ * and sits in job->proc_hs, so it's waited on and reaped with the processes:
+ *  - echo, printf, cat, env: a thread that reads and writes the stage's own
+ *    duplicates of its stdin/stdout (pipes, files or the console)
+ *  - xargs: a thread that packs the items it reads into as few command
+ *    lines as possible and runs (and waits for) those itself
+ *  - sleep: a waitable timer, so nothing runs at all while it sleeps
+ *  - true, false: an event that's signaled from the start
+ * The stage_* functions stand in for the plat_* process functions on any
+ * HANDLE in job->proc_hs.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* STAGE_BUCKETS: Number of buckets in the live stage table. Must be a power
+                  of two. */
+#define STAGE_BUCKETS 256
+
+/* STAGE_CHUNK: Bytes moved by each ReadFile/WriteFile of cat and xargs. */
+#define STAGE_CHUNK (1 << 16)
+
+/* IS_THREAD_STAGE: Does a stage of this kind run on a thread? */
+#define IS_THREAD_STAGE(kind) ((kind) <= INPROC_XARGS)
+
+/* XARGS_MAX_LEN: Longest command line xargs packs. CreateProcessW takes
+                  MAX_CMDLINE WCHARs, the terminating NULL included. */
+#define XARGS_MAX_LEN (MAX_CMDLINE - 1)
+
+/* XARGS_MAX_PARALLEL: Most command lines xargs runs at once (one wait slot
+                       is left for its stop event). */
+#define XARGS_MAX_PARALLEL (MAXIMUM_WAIT_OBJECTS - 1)
+
+/* SPAWN_LOCK_POLL_MS: How long xargs waits for a stop between tries at 
+                       spawn_lock. */
+#define SPAWN_LOCK_POLL_MS 1
+
+/* PRINTF_SPEC_CAP: Longest printf conversion, '%' to conversion character.
+   PRINTF_MAX_WIDTH: Widest width or precision of a printf conversion. */
+#define PRINTF_SPEC_CAP 24
+#define PRINTF_MAX_WIDTH 1024
+
+/* XARGS_ITEM_CAP: Longest item xargs reads, in UTF-8 bytes. */
+#define XARGS_ITEM_CAP (3 * XARGS_MAX_LEN)
+
+
+
+/**
+ * inproc_kind_t
+ *
+ * Which builtin a stage runs.
+ */
+typedef enum _inproc_kind {
+    INPROC_ECHO,        // thread stages first (see IS_THREAD_STAGE)
+    INPROC_PRINTF,
+    INPROC_CAT,
+    INPROC_ENV,
+    INPROC_XARGS,
+    INPROC_SLEEP,
+    INPROC_TRUE,
+    INPROC_FALSE
+} inproc_kind_t;
+
+
+
+/**
+ * xargs_opts_t struct
+ *
+ * What an xargs stage was asked to do. Parsed on the shell thread.
+ */
+typedef struct _xargs_opts {
+
+    /* max_items: Most items per command line (-n), 0 for no limit. */
+    int32_t max_items;
+
+    /* max_parallel: Most command lines running at once (-P). */
+    int32_t max_parallel;
+
+    /* verbose: Report how many processes were saved (-v)? */
+    BOOL verbose;
+
+    /* in_file: Absolute path of the file items are read from (-a). Empty
+                if they come from stdin. */
+    WCHAR in_file[MAX_PATH + 1];
+
+    /* app_path: Executable every command line runs. */
+    WCHAR app_path[MAX_PATH + 1];
+
+    /* cmd: Command and fixed arguments every command line starts with, as
+            they were typed (in the stage's args). */
+    const WCHAR *cmd;
+
+} xargs_opts_t;
+
+
+
+/**
+ * inproc_stage_t struct
+ *
+ * A running in-process stage.
+ */
+typedef struct _inproc_stage {
+
+    /* h: Thread, timer or event the job waits on. */
+    HANDLE h;
+
+    /* kind: Builtin the stage runs. */
+    inproc_kind_t kind;
+
+    /* refs: One for the shell (until stage_close), one for the thread while
+             it runs. Freed when it drops to 0. */
+    volatile LONG refs;
+
+    /* stopping: Set by stage_terminate - the thread gives up. */
+    volatile LONG stopping;
+
+    /* exit_code: Exit code of a timer or event stage. */
+    DWORD exit_code;
+
+    /* started_at, ended_at: Tick counts when a timer or event stage started
+                             and when it's done (a sleep's due time, until
+                             it's stopped early). */
+    ULONGLONG started_at;
+    ULONGLONG ended_at;
+
+    /* in_h, out_h: The thread's own (non-inheritable) duplicates of the
+                    stage's stdin and stdout. NULL if it doesn't use one. */
+    HANDLE in_h;
+    HANDLE out_h;
+
+    /* cwd: Working directory of the job (cat's files are in it). */
+    WCHAR cwd[MAX_PATH + 1];
+
+    /* stop_e: Set by stage_terminate to wake a thread that waits on more
+               than its own I/O (xargs, on its command lines). NULL if the
+               stage has none. */
+    HANDLE stop_e;
+
+    /* xargs: Options of an xargs stage. */
+    xargs_opts_t xargs;
+
+    /* next: Next live stage in the same bucket. */
+    struct _inproc_stage *next;
+
+    /* args: Command line after the builtin's name (the thread cuts it up). */
+    WCHAR args[];
+
+} inproc_stage_t;
+
+
+
+/* inproc_names: Builtins that run in-process, indexed by inproc_kind_t. */
+static const WCHAR *inproc_names[] = {
+    L"echo", L"printf", L"cat", L"env", L"xargs", L"sleep", L"true",
+    L"false"
+};
+
+/* live_stages: Stages that haven't been closed yet, chained by the hash of
+                their HANDLE. */
+static inproc_stage_t *live_stages[STAGE_BUCKETS];
+
+
+
+/**
+ * stage_link
+ *
+ * Return Value: Returns the link to the live stage whose HANDLE is h (the
+ *               bucket head or the previous stage's next), or to the NULL
+ *               at the end of h's bucket if h isn't an in-process stage.
+ */
+static inproc_stage_t **stage_link(HANDLE h) {
+
+    // Multiplicative hash: HANDLEs are aligned, so their low bits are fixed
+    uint32_t hash = (uint32_t)(((uint64_t)(uintptr_t)h
+                                * 11400714819323198485ull) >> 32);
+    inproc_stage_t **link_p = &live_stages[hash & (STAGE_BUCKETS - 1)];
+    while (*link_p != NULL and (*link_p)->h != h)
+        link_p = &(*link_p)->next;
+    return link_p;
+}
+
+
+
+/**
+ * find_stage
+ *
+ * Return Value: Returns the live stage whose HANDLE is h, NULL if h isn't
+ *               an in-process stage (it's a process).
+ */
+static inproc_stage_t *find_stage(HANDLE h) {
+    return *stage_link(h);
+}
+
+
+
+/**
+ * release_stage
+ *
+ * Drops a reference to a stage and frees it once nobody holds one.
+ */
+static void release_stage(inproc_stage_t *stage) {
+    if (InterlockedDecrement(&stage->refs) == 0) {
+        if (stage->stop_e != NULL)
+            CloseHandle(stage->stop_e);
+        free(stage);
+    }
+}
+
+
+
+/**
+ * stage_err
+ *
+ * Writes "<builtin>: <message><detail>\n" to stderr.
+ */
+static void stage_err(const inproc_stage_t *stage, const WCHAR *message,
+                      const WCHAR *detail) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, inproc_names[stage->kind]);
+    out_stream_puts(&err, L": ");
+    out_stream_puts(&err, message);
+    out_stream_puts(&err, detail);
+    out_stream_puts(&err, L"\n");
+    out_stream_close(&err);
+}
+
+
+
+/**
+ * next_arg
+ *
+ * Cuts the next argument out of a command line in place, unquoting it the
+ * way a child's CommandLineToArgvW would: quotes group, \" is a quote and 
+ * backslashes before a quote are halved.
+ *
+ * in_out_p: Where to look. Moved past the argument.
+ *
+ * Return Value: Returns the NULL-terminated argument, NULL if there are no
+ *               more.
+ */
+static WCHAR *next_arg(WCHAR **in_out_p) {
+
+    WCHAR *arg = skip_whitespace(*in_out_p);
+    if (*arg == L'\0')
+        return NULL;
+
+    // Unquoting never lengthens it, so it's done in place
+    WCHAR *src = arg, *dst = arg;
+    BOOL is_quoted = FALSE;
+    while (*src != L'\0' and (is_quoted or not iswspace(*src))) {
+        int32_t n_backslashes = 0;
+        while (src[n_backslashes] == L'\\')
+            n_backslashes++;
+        if (src[n_backslashes] == L'"') {
+            for (int32_t i = 0; i < n_backslashes / 2; i++)
+                *dst++ = L'\\';
+            if (n_backslashes % 2 == 1)
+                *dst++ = L'"';
+            else
+                is_quoted = not is_quoted;
+            src += n_backslashes + 1;
+        }
+        else if (n_backslashes > 0) {
+            for (int32_t i = 0; i < n_backslashes; i++)
+                *dst++ = *src++;
+        }
+        else {
+            *dst++ = *src++;
+        }
+    }
+    *in_out_p = *src != L'\0' ? src + 1 : src;
+    *dst = L'\0';
+    return arg;
+}
+
+
+
+/**
+ * write_escaped
+ *
+ * Writes text to out, turning \n, \t, \\ and \" into the characters.
+ */
+static void write_escaped(out_stream_t *out, const WCHAR *text,
+                          int32_t len_text) {
+
+    for (int32_t i = 0; i < len_text; i++) {
+        WCHAR c = text[i];
+        if (c == L'\\' and i + 1 < len_text) {
+            switch (text[i + 1]) {
+            case L'n':  c = L'\n'; i++; break;
+            case L't':  c = L'\t'; i++; break;
+            case L'r':  c = L'\r'; i++; break;
+            case L'\\': c = L'\\'; i++; break;
+            case L'"':  c = L'"';  i++; break;
+            }
+        }
+        out_stream_write(out, &c, 1);
+    }
+}
+
+
+
+/**
+ * run_echo
+ *
+ * echo [-n] args...: writes the arguments separated by spaces, then a
+ * newline unless -n is given.
+ */
+static DWORD run_echo(inproc_stage_t *stage, out_stream_t *out) {
+
+    WCHAR *p = stage->args;
+    WCHAR *arg = next_arg(&p);
+    BOOL newline = TRUE;
+
+    if (arg != NULL and wcscmp(arg, L"-n") == 0) {
+        newline = FALSE;
+        arg = next_arg(&p);
+    }
+    for (BOOL first = TRUE; arg != NULL; arg = next_arg(&p), first = FALSE) {
+        if (not first)
+            out_stream_write(out, L" ", 1);
+        out_stream_puts(out, arg);
+    }
+    if (newline)
+        out_stream_write(out, L"\n", 1);
+    return 0;
+}
+
+
+
+/**
+ * write_padded
+ *
+ * Writes len_text WCHARs of text to out, padded with spaces to width (on
+ * the right if is_left, else on the left).
+ */
+static void write_padded(out_stream_t *out, const WCHAR *text,
+                         int32_t len_text, int32_t width, BOOL is_left) {
+
+    if (not is_left) {
+        for (int32_t i = len_text; i < width; i++)
+            out_stream_write(out, L" ", 1);
+    }
+    out_stream_write(out, text, len_text);
+    if (is_left) {
+        for (int32_t i = len_text; i < width; i++)
+            out_stream_write(out, L" ", 1);
+    }
+}
+
+
+
+/**
+ * write_conversion
+ *
+ * Writes one printf conversion of value to out.
+ *
+ * spec: The conversion as it's in the format, '%' to the conversion
+ *       character (flags, width and precision in between).
+ * width, precision: Width and precision in spec, -1 if there's none.
+ */
+static void write_conversion(out_stream_t *out, const WCHAR *spec,
+                             int32_t len_spec, int32_t width,
+                             int32_t precision, const WCHAR *value) {
+
+    WCHAR c_spec[PRINTF_SPEC_CAP + 4];
+    WCHAR formatted[PRINTF_MAX_WIDTH * 2 + 64];
+    WCHAR conversion = spec[len_spec - 1];
+    BOOL is_left = wmemchr(spec, L'-', len_spec) != NULL;
+    int len;
+
+    if (conversion == L's' or conversion == L'c') {
+        int32_t len_value = (int32_t)wcslen(value);
+        if (conversion == L'c' and len_value > 1)
+            len_value = 1;
+        if (precision >= 0 and len_value > precision)
+            len_value = precision;
+        write_padded(out, value, len_value, width, is_left);
+        return;
+    }
+
+    // The same conversion, with a length modifier for the argument's type
+    memcpy(c_spec, spec, (len_spec - 1) * sizeof(WCHAR));
+    int32_t len_c_spec = len_spec - 1;
+    if (conversion == L'd' or conversion == L'i') {
+        c_spec[len_c_spec++] = L'l';
+        c_spec[len_c_spec++] = L'l';
+        c_spec[len_c_spec++] = conversion;
+        c_spec[len_c_spec] = L'\0';
+        len = _snwprintf(formatted, sizeof(formatted) / sizeof(WCHAR),
+                         c_spec, wcstoll(value, NULL, 0));
+    }
+    else if (wcschr(L"uoxX", conversion) != NULL) {
+        c_spec[len_c_spec++] = L'l';
+        c_spec[len_c_spec++] = L'l';
+        c_spec[len_c_spec++] = conversion;
+        c_spec[len_c_spec] = L'\0';
+        len = _snwprintf(formatted, sizeof(formatted) / sizeof(WCHAR),
+                         c_spec, wcstoull(value, NULL, 0));
+    }
+    else {
+        c_spec[len_c_spec++] = conversion;
+        c_spec[len_c_spec] = L'\0';
+        len = _snwprintf(formatted, sizeof(formatted) / sizeof(WCHAR),
+                         c_spec, wcstod(value, NULL));
+    }
+    if (len > 0)
+        out_stream_write(out, formatted, len);
+}
+
+
+
+/**
+ * run_printf
+ *
+ * printf format args...: %d, %i, %u, %o, %x, %X, %c, %s, %f, %e, %E, %g
+ * and %G in format take the arguments in turn, with the C flags ("-+ #0"),
+ * width and precision; %% is a '%', and \n, \t, \r, \\ are escapes. The
+ * format is reused while arguments are left.
+ */
+static DWORD run_printf(inproc_stage_t *stage, out_stream_t *out) {
+
+    WCHAR *p = stage->args;
+    const WCHAR *format = next_arg(&p);
+
+    if (format == NULL) {
+        stage_err(stage, L"usage: printf format [args...]", L"");
+        return 1;
+    }
+
+    WCHAR *arg = next_arg(&p);
+    do {
+        BOOL took_arg = FALSE;
+        const WCHAR *run = format;
+        for (const WCHAR *f = format; *f != L'\0'; f++) {
+            if (*f != L'%')
+                continue;
+
+            // %[flags][width][.precision]conversion
+            const WCHAR *spec_p = f + 1;
+            spec_p += wcsspn(spec_p, L"-+ #0");
+            int32_t width = -1, precision = -1;
+            if (iswdigit(*spec_p))
+                width = (int32_t)wcstol(spec_p, (WCHAR **)&spec_p, 10);
+            if (*spec_p == L'.') {
+                spec_p++;
+                precision = 0;
+                if (iswdigit(*spec_p))
+                    precision = (int32_t)wcstol(spec_p, (WCHAR **)&spec_p,
+                                                10);
+            }
+            int32_t len_spec = (int32_t)(spec_p - f) + 1;
+            if (*spec_p == L'\0'
+                 or wcschr(L"%diuoxXcsfeEgG", *spec_p) == NULL
+                 or len_spec > PRINTF_SPEC_CAP or width > PRINTF_MAX_WIDTH
+                 or precision > PRINTF_MAX_WIDTH)
+                continue; // not a conversion: written as is
+
+            write_escaped(out, run, (int32_t)(f - run));
+            run = spec_p + 1;
+            if (*spec_p == L'%') {
+                out_stream_write(out, L"%", 1);
+            }
+            else {
+                write_conversion(out, f, len_spec, width, precision,
+                                 arg != NULL ? arg : L"");
+                took_arg = TRUE;
+                arg = arg != NULL ? next_arg(&p) : NULL;
+            }
+            f = spec_p;
+        }
+        write_escaped(out, run, (int32_t)wcslen(run));
+        if (not took_arg)
+            break;
+    } while (arg != NULL);
+    return 0;
+}
+
+
+
+/**
+ * copy_bytes
+ *
+ * Copies everything from in_h to out_h, for cat.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the stage was stopped or
+ *               the output went away.
+ */
+static BOOL copy_bytes(inproc_stage_t *stage, HANDLE in_h, BYTE *buf) {
+
+    DWORD bytes_read, bytes_written;
+
+    while (not stage->stopping) {
+        if (not ReadFile(in_h, buf, STAGE_CHUNK, &bytes_read, NULL)
+             or bytes_read == 0)
+            return not stage->stopping; // EOF or broken pipe: input is done
+        DWORD off = 0;
+        while (off < bytes_read) {
+            if (stage->stopping
+                 or not WriteFile(stage->out_h, buf + off, bytes_read - off,
+                                  &bytes_written, NULL))
+                return FALSE; // ERROR_NO_DATA: reader is gone
+            off += bytes_written;
+        }
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * reserve_output
+ *
+ * When stdout is a file, has room for file_h's bytes allocated in it up
+ * front, so a large copy doesn't grow (and fragment) it write by write.
+ * Best effort: failures are ignored.
+ */
+static void reserve_output(const inproc_stage_t *stage, HANDLE file_h) {
+
+    LARGE_INTEGER len_in, len_out;
+    if (GetFileType(stage->out_h) != FILE_TYPE_DISK
+         or not GetFileSizeEx(file_h, &len_in)
+         or not GetFileSizeEx(stage->out_h, &len_out))
+        return;
+    FILE_ALLOCATION_INFO alloc_info = {
+        .AllocationSize.QuadPart = len_out.QuadPart + len_in.QuadPart
+    };
+    SetFileInformationByHandle(stage->out_h, FileAllocationInfo, &alloc_info,
+                               sizeof(alloc_info));
+}
+
+
+
+/**
+ * run_cat
+ *
+ * cat [files...]: copies the files (or stdin if there are none, or for
+ * "-") to stdout, byte for byte.
+ */
+static DWORD run_cat(inproc_stage_t *stage) {
+
+    DWORD exit_code = 0;
+    WCHAR *p = stage->args;
+    WCHAR *file = next_arg(&p);
+
+    BYTE *buf = malloc(STAGE_CHUNK);
+    if (buf == NULL) {
+        stage_err(stage, L"out of memory", L"");
+        return 1;
+    }
+
+    if (file == NULL) {
+        if (not copy_bytes(stage, stage->in_h, buf))
+            exit_code = 1;
+    }
+    for (; file != NULL and not stage->stopping; file = next_arg(&p)) {
+        WCHAR path[MAX_PATH + 1];
+        if (wcscmp(file, L"-") == 0) {
+            if (not copy_bytes(stage, stage->in_h, buf))
+                exit_code = 1;
+            continue;
+        }
+        if (not make_abs_path(stage->cwd, file, path)) {
+            stage_err(stage, L"path too long: ", file);
+            exit_code = 1;
+            continue;
+        }
+        HANDLE file_h = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL
+        );
+        if (file_h == INVALID_HANDLE_VALUE) {
+            stage_err(stage, L"can't open ", file);
+            exit_code = 1;
+            continue;
+        }
+        reserve_output(stage, file_h);
+        if (not copy_bytes(stage, file_h, buf))
+            exit_code = 1;
+        CloseHandle(file_h);
+    }
+
+    free(buf);
+    return exit_code;
+}
+
+
+
+/**
+ * run_env
+ *
+ * env: writes the environment, one NAME=value per line.
+ */
+static DWORD run_env(inproc_stage_t *stage, out_stream_t *out) {
+
+    WCHAR *env = GetEnvironmentStringsW();
+    if (env == NULL) {
+        stage_err(stage, L"can't read the environment", L"");
+        return 1;
+    }
+    for (const WCHAR *var = env; *var != L'\0'; var += wcslen(var) + 1) {
+        if (*var == L'=')
+            continue; // per-drive current directories ("=C:=C:\...")
+        out_stream_puts(out, var);
+        out_stream_write(out, L"\n", 1);
+    }
+    FreeEnvironmentStringsW(env);
+    return 0;
+}
+
+
+
+/**
+ * xargs_run_t struct
+ *
+ * State of a running xargs stage.
+ */
+typedef struct _xargs_run {
+
+    /* stage: The xargs stage. */
+    inproc_stage_t *stage;
+
+    /* cmd_line, len_cmd_line: Command line being packed. It starts with the
+                               len_prefix WCHARs of the command. */
+    WCHAR *cmd_line;
+    int32_t len_cmd_line;
+    int32_t len_prefix;
+
+    /* n_batch_items: Items packed into cmd_line so far. */
+    int32_t n_batch_items;
+
+    /* item: The item being packed, as WCHARs. */
+    WCHAR *item;
+
+    /* procs, n_procs: Command lines still running. */
+    HANDLE procs[XARGS_MAX_PARALLEL];
+    int32_t n_procs;
+
+    /* null_h: NUL, the stdin of the command lines (xargs has the real one). */
+    HANDLE null_h;
+
+    /* n_items, n_batches: Items read and command lines run. */
+    int64_t n_items;
+    int64_t n_batches;
+
+    /* exit_code: 123 once a command line failed, 127 if none could run. */
+    DWORD exit_code;
+
+} xargs_run_t;
+
+
+
+/**
+ * dup_inheritable
+ *
+ * Return Value: Returns an inheritable duplicate of h for a child, NULL on
+ *               failure.
+ */
+static HANDLE dup_inheritable(HANDLE h) {
+
+    HANDLE dup_h;
+    if (h == NULL or not DuplicateHandle(GetCurrentProcess(), h,
+                                         GetCurrentProcess(), &dup_h, 0,
+                                         TRUE, DUPLICATE_SAME_ACCESS))
+        return NULL;
+    return dup_h;
+}
+
+
+
+/**
+ * wait_batches
+ *
+ * Waits until no more than max_running command lines are running. If the
+ * stage is stopped meanwhile, the command lines are terminated instead.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the stage was stopped.
+ */
+static BOOL wait_batches(xargs_run_t *run, int32_t max_running) {
+
+    HANDLE waitables[XARGS_MAX_PARALLEL + 1];
+    DWORD exit_code;
+
+    while (run->n_procs > max_running) {
+        waitables[0] = run->stage->stop_e;
+        memcpy(waitables + 1, run->procs, run->n_procs * sizeof(HANDLE));
+        int32_t i = plat_wait_any(waitables, run->n_procs + 1, PLAT_INFINITE);
+        if (i <= 0) {
+            for (i = 0; i < run->n_procs; i++) {
+                plat_terminate(run->procs[i], 1);
+                plat_close(run->procs[i]);
+            }
+            run->n_procs = 0;
+            return FALSE;
+        }
+        i--;
+        if (plat_query_exit(run->procs[i], &exit_code) and exit_code != 0
+             and run->exit_code == 0)
+            run->exit_code = 123;
+        plat_close(run->procs[i]);
+        run->procs[i] = run->procs[--run->n_procs];
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * start_batch
+ *
+ * Runs the packed command line (once a slot is free) and starts packing the
+ * next one.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the stage was stopped or
+ *               the command couldn't be run (it was reported).
+ */
+static BOOL start_batch(xargs_run_t *run) {
+
+    inproc_stage_t *stage = run->stage;
+    HANDLE proc_h;
+    DWORD pid;
+
+    if (not wait_batches(run, stage->xargs.max_parallel - 1))
+        return FALSE;
+
+    // The shell thread may be in the middle of a spawn of its own: its
+    // children mustn't get these handles, nor this child its handles. It
+    // holds spawn_lock through builtins too - kill or exit may be stopping
+    // this very stage while it waits, so it keeps an eye on stop_e.
+    while (not TryEnterCriticalSection(&spawn_lock)) {
+        if (WaitForSingleObject(stage->stop_e, SPAWN_LOCK_POLL_MS)
+             == WAIT_OBJECT_0)
+            return FALSE;
+    }
+    plat_spawn_t spawn_spec = {
+        .application_name = stage->xargs.app_path,
+        .cmd_line = run->cmd_line,
+        .std_in = dup_inheritable(run->null_h),
+        .std_out = dup_inheritable(stage->out_h),
+        .std_err = dup_inheritable(GetStdHandle(STD_ERROR_HANDLE)),
+        .cwd = stage->cwd,
+        .new_group = FALSE
+    };
+    BOOL bool_rc = spawn_spec.std_in != NULL and spawn_spec.std_out != NULL
+                    and plat_spawn(&spawn_spec, &proc_h, &pid);
+    if (spawn_spec.std_in != NULL)
+        CloseHandle(spawn_spec.std_in);
+    if (spawn_spec.std_out != NULL)
+        CloseHandle(spawn_spec.std_out);
+    if (spawn_spec.std_err != NULL)
+        CloseHandle(spawn_spec.std_err);
+    LeaveCriticalSection(&spawn_lock);
+
+    if (not bool_rc) {
+        stage_err(stage, L"can't run ", stage->xargs.app_path);
+        run->exit_code = 127;
+        return FALSE;
+    }
+    run->procs[run->n_procs++] = proc_h;
+    run->n_batches++;
+
+    run->len_cmd_line = run->len_prefix;
+    run->cmd_line[run->len_cmd_line] = L'\0';
+    run->n_batch_items = 0;
+    return TRUE;
+}
+
+
+
+/**
+ * add_item
+ *
+ * Packs an item (UTF-8) into the command line, running the command line
+ * first if the item doesn't fit in it.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (xargs stops).
+ */
+static BOOL add_item(xargs_run_t *run, const char *item_bytes,
+                     int32_t len_item_bytes) {
+
+    const xargs_opts_t *opts = &run->stage->xargs;
+
+    int32_t len_item = 0;
+    if (len_item_bytes > 0) {
+        len_item = MultiByteToWideChar(CP_UTF8, 0, item_bytes,
+                                       len_item_bytes, run->item,
+                                       XARGS_MAX_LEN);
+        if (len_item == 0) {
+            stage_err(run->stage, L"item too long", L"");
+            run->exit_code = 1;
+            return FALSE;
+        }
+    }
+    int32_t len_quoted = quote_arg(run->item, len_item, FALSE, NULL);
+
+    if (run->n_batch_items > 0
+         and (run->n_batch_items == opts->max_items
+               or run->len_cmd_line + 1 + len_quoted > XARGS_MAX_LEN)) {
+        if (not start_batch(run))
+            return FALSE;
+    }
+    if (run->len_cmd_line + 1 + len_quoted > XARGS_MAX_LEN) {
+        stage_err(run->stage, L"item too long", L"");
+        run->exit_code = 1;
+        return FALSE;
+    }
+
+    run->cmd_line[run->len_cmd_line++] = L' ';
+    quote_arg(run->item, len_item, FALSE,
+              run->cmd_line + run->len_cmd_line);
+    run->len_cmd_line += len_quoted;
+    run->cmd_line[run->len_cmd_line] = L'\0';
+    run->n_batch_items++;
+    run->n_items++;
+    return TRUE;
+}
+
+
+
+/**
+ * run_xargs
+ *
+ * xargs [-n items] [-P procs] [-a file] [-v] cmd [args...]: reads items
+ * (UTF-8, separated by whitespace, double quotes group) from stdin or file
+ * and runs cmd with as many of them as fit in a command line (or -n at
+ * most), up to -P command lines at once. Nothing is run if there are no
+ * items. -v reports how many processes that saved compared to one per item.
+ */
+static DWORD run_xargs(inproc_stage_t *stage) {
+
+    const xargs_opts_t *opts = &stage->xargs;
+    xargs_run_t run = { .stage = stage };
+    HANDLE in_h = stage->in_h;
+    HANDLE file_h = INVALID_HANDLE_VALUE;
+    BOOL is_ok = TRUE;
+
+    BYTE *buf = malloc(STAGE_CHUNK);
+    char *item_bytes = malloc(XARGS_ITEM_CAP);
+    run.item = malloc(XARGS_MAX_LEN * sizeof(WCHAR));
+    run.cmd_line = malloc((MAX_CMDLINE + 1) * sizeof(WCHAR));
+    if (buf == NULL or item_bytes == NULL or run.item == NULL
+         or run.cmd_line == NULL) {
+        stage_err(stage, L"out of memory", L"");
+        run.exit_code = 1;
+        goto done;
+    }
+    run.null_h = CreateFileW(L"NUL", GENERIC_READ,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_EXISTING, 0, NULL);
+    if (run.null_h == INVALID_HANDLE_VALUE) {
+        run.null_h = NULL;
+        stage_err(stage, L"can't open NUL", L"");
+        run.exit_code = 1;
+        goto done;
+    }
+
+    // Every command line starts with the command as it was typed
+    run.len_prefix = (int32_t)wcslen(opts->cmd);
+    while (run.len_prefix > 0 and iswspace(opts->cmd[run.len_prefix - 1]))
+        run.len_prefix--;
+    if (run.len_prefix > XARGS_MAX_LEN) {
+        stage_err(stage, L"command too long", L"");
+        run.exit_code = 1;
+        goto done;
+    }
+    memcpy(run.cmd_line, opts->cmd, run.len_prefix * sizeof(WCHAR));
+    run.len_cmd_line = run.len_prefix;
+    run.cmd_line[run.len_cmd_line] = L'\0';
+
+    if (opts->in_file[0] != L'\0') {
+        file_h = CreateFileW(
+            opts->in_file,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL
+        );
+        if (file_h == INVALID_HANDLE_VALUE) {
+            stage_err(stage, L"can't open ", opts->in_file);
+            run.exit_code = 1;
+            goto done;
+        }
+        in_h = file_h;
+    }
+
+    // Cut the input into items as it comes, packing each one right away
+    BOOL in_quotes = FALSE, has_item = FALSE;
+    int32_t len_item_bytes = 0;
+    while (is_ok) {
+        DWORD n_read;
+        if (not ReadFile(in_h, buf, STAGE_CHUNK, &n_read, NULL)) {
+            if (stage->stopping) {
+                is_ok = FALSE;
+            }
+            else if (GetLastError() != ERROR_BROKEN_PIPE) {
+                stage_err(stage, L"can't read the items", L"");
+                run.exit_code = 1;
+                is_ok = FALSE;
+            }
+            break;
+        }
+        if (n_read == 0)
+            break;
+        for (DWORD i = 0; i < n_read and is_ok; i++) {
+            BYTE b = buf[i];
+            if (not in_quotes
+                 and (b == ' ' or b == '\t' or b == '\r' or b == '\n')) {
+                if (has_item)
+                    is_ok = add_item(&run, item_bytes, len_item_bytes);
+                has_item = FALSE;
+                len_item_bytes = 0;
+            }
+            else if (b == '"') {
+                in_quotes = not in_quotes;
+                has_item = TRUE;
+            }
+            else if (len_item_bytes == XARGS_ITEM_CAP) {
+                stage_err(stage, L"item too long", L"");
+                run.exit_code = 1;
+                is_ok = FALSE;
+            }
+            else {
+                item_bytes[len_item_bytes++] = (char)b;
+                has_item = TRUE;
+            }
+        }
+    }
+    if (is_ok and has_item)
+        is_ok = add_item(&run, item_bytes, len_item_bytes);
+    if (is_ok and run.n_batch_items > 0)
+        start_batch(&run);
+    wait_batches(&run, 0);
+
+    STAT_ADD(STAT_XARGS_ITEMS, run.n_items);
+    if (run.n_items > run.n_batches)
+        STAT_ADD(STAT_XARGS_PROCS_SAVED, run.n_items - run.n_batches);
+    if (opts->verbose) {
+        WCHAR report[96];
+        _snwprintf(report, 96, L"%lld items in %lld processes (%lld saved)",
+                   run.n_items, run.n_batches,
+                   run.n_items > run.n_batches ? run.n_items - run.n_batches
+                                               : 0);
+        report[95] = L'\0';
+        stage_err(stage, report, L"");
+    }
+
+done:
+    if (file_h != INVALID_HANDLE_VALUE)
+        CloseHandle(file_h);
+    if (run.null_h != NULL)
+        CloseHandle(run.null_h);
+    free(buf);
+    free(item_bytes);
+    free(run.item);
+    free(run.cmd_line);
+    return run.exit_code;
+}
+
+
+
+/**
+ * parse_xargs
+ *
+ * Parses the options of an xargs stage and finds its command's executable,
+ * on the shell thread (the lookup cache isn't thread-safe). Usage errors
+ * are reported.
+ *
+ * Return Value: Returns TRUE on success, FALSE on a usage error.
+ */
+static BOOL parse_xargs(inproc_stage_t *stage) {
+
+    xargs_opts_t *opts = &stage->xargs;
+    WCHAR *p = stage->args;
+
+    opts->max_parallel = 1;
+    for (;;) {
+        p = skip_whitespace(p);
+        if (p[0] != L'-' or p[1] == L'\0'
+             or (p[2] != L'\0' and not iswspace(p[2])))
+            break;
+        WCHAR opt = p[1];
+        p += 2;
+        if (opt == L'v') {
+            opts->verbose = TRUE;
+            continue;
+        }
+
+        // The rest take a value
+        WCHAR *value = next_arg(&p);
+        if (value == NULL)
+            goto usage;
+        if (opt == L'n' or opt == L'P') {
+            WCHAR *number_end;
+            long number = wcstol(value, &number_end, 10);
+            if (*number_end != L'\0' or number < 1)
+                goto usage;
+            if (opt == L'n')
+                opts->max_items = (int32_t)number;
+            else
+                opts->max_parallel = number < XARGS_MAX_PARALLEL
+                                      ? (int32_t)number : XARGS_MAX_PARALLEL;
+        }
+        else if (opt == L'a') {
+            if (not make_abs_path(stage->cwd, value, opts->in_file))
+                goto usage;
+        }
+        else {
+            goto usage;
+        }
+    }
+    if (*p == L'\0')
+        goto usage;
+    opts->cmd = p;
+
+    // The executable: cmd's first word, without its quotes
+    WCHAR name_buf[MAX_PATH + 1];
+    const WCHAR *name_end = arg_end(p);
+    if (name_end == NULL or name_end - p > MAX_PATH)
+        goto usage;
+    memcpy(name_buf, p, (name_end - p) * sizeof(WCHAR));
+    name_buf[name_end - p] = L'\0';
+    WCHAR *name_p = name_buf;
+    WCHAR *name = next_arg(&name_p);
+    if (not resolve_app_path(name, stage->cwd, opts->app_path))
+        wcscpy(opts->app_path, name);
+    return TRUE;
+
+usage:
+    stage_err(stage, L"usage: xargs [-n items] [-P procs] [-a file] [-v] ",
+              L"cmd [args...]");
+    return FALSE;
+}
+
+
+
+/**
+ * stage_tproc
+ *
+ * Thread procedure of echo, printf, cat, env and xargs stages. Closes the
+ * stage's
+ * handles when it's done, so that the next stage sees EOF.
+ *
+ * Return Value: Returns the stage's exit code.
+ */
+static DWORD WINAPI stage_tproc(void *arg) {
+
+    inproc_stage_t *stage = arg;
+    out_stream_t out;
+    DWORD exit_code;
+
+    if (stage->kind == INPROC_CAT) {
+        exit_code = run_cat(stage);
+    }
+    else if (stage->kind == INPROC_XARGS) {
+        exit_code = run_xargs(stage);
+    }
+    else {
+        out_stream_init(&out, stage->out_h);
+        if (stage->kind == INPROC_ECHO)
+            exit_code = run_echo(stage, &out);
+        else if (stage->kind == INPROC_PRINTF)
+            exit_code = run_printf(stage, &out);
+        else
+            exit_code = run_env(stage, &out);
+        if (not out_stream_close(&out) and exit_code == 0)
+            exit_code = 1;
+    }
+
+    if (stage->in_h != NULL)
+        CloseHandle(stage->in_h);
+    CloseHandle(stage->out_h);
+    if (stage->stopping)
+        exit_code = 1;
+    release_stage(stage);
+    return exit_code;
+}
+
+
+
+/**
+ * dup_private
+ *
+ * Return Value: Returns a non-inheritable duplicate of h (so that children
+ *               spawned later don't hold the stage's pipes open), NULL on
+ *               failure.
+ */
+static HANDLE dup_private(HANDLE h) {
+
+    HANDLE dup_h;
+    if (not DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(),
+                            &dup_h, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        return NULL;
+    return dup_h;
+}
+
+
+
+/**
+ * start_sleep
+ *
+ * Arms a waitable timer for "sleep seconds" (fractions allowed). A bad
+ * argument gives a stage that's already done, with exit code 1.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL start_sleep(inproc_stage_t *stage) {
+
+    WCHAR *p = stage->args;
+    WCHAR *arg = next_arg(&p);
+    WCHAR *arg_end_p = NULL;
+    double seconds = arg != NULL ? wcstod(arg, &arg_end_p) : -1;
+
+    if (arg == NULL or *arg_end_p != L'\0' or seconds < 0) {
+        stage_err(stage, L"usage: sleep seconds", L"");
+        stage->exit_code = 1;
+        stage->h = CreateEventW(NULL, TRUE, TRUE, NULL);
+        return stage->h != NULL;
+    }
+
+    stage->h = CreateWaitableTimerW(NULL, TRUE, NULL);
+    if (stage->h == NULL)
+        return FALSE;
+    stage->ended_at = stage->started_at + (ULONGLONG)(seconds * 1000);
+    LARGE_INTEGER due = { .QuadPart = -(LONGLONG)(seconds * 1e7) - 1 };
+    if (not SetWaitableTimer(stage->h, &due, 0, NULL, NULL, FALSE)) {
+        CloseHandle(stage->h);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * is_inproc_builtin
+ *
+ * Return Value: Returns TRUE if application_name is run in-process.
+ */
+BOOL is_inproc_builtin(const WCHAR *application_name) {
+
+    for (int i = 0; i < sizeof(inproc_names) / sizeof(*inproc_names); i++) {
+        if (wcscmp(application_name, inproc_names[i]) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * start_inproc_stage
+ *
+ * Starts an in-process builtin as a stage of a job.
+ *
+ * parsed_proc: The stage (is_inproc_builtin is TRUE for its name).
+ * in_h, out_h: The stage's stdin and stdout. Duplicated - close them once
+ *              this returns, as for a process.
+ * out_stage_h: HANDLE that's signaled once the stage is done is placed
+ *              here. Use it like a process HANDLE, with the stage_*
+ *              functions.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL start_inproc_stage(const parsed_process_t *parsed_proc, HANDLE in_h,
+                        HANDLE out_h, HANDLE *out_stage_h) {
+
+    inproc_kind_t kind = 0;
+    while (wcscmp(parsed_proc->application_name, inproc_names[kind]) != 0)
+        kind++;
+
+    const WCHAR *args = arg_end(skip_whitespace(parsed_proc->cmd_line));
+    if (args == NULL)
+        args = L"";
+    size_t len_args = wcslen(args);
+    inproc_stage_t *stage = calloc(1, sizeof(inproc_stage_t)
+                                       + (len_args + 1) * sizeof(WCHAR));
+    if (stage == NULL) {
+        print_err(L"start_inproc_stage -> calloc");
+        return FALSE;
+    }
+    stage->kind = kind;
+    stage->refs = 1;
+    stage->started_at = stage->ended_at = GetTickCount64();
+    wcsncpy(stage->cwd, parsed_proc->cwd, MAX_PATH);
+    memcpy(stage->args, args, (len_args + 1) * sizeof(WCHAR));
+
+    // A bad xargs command line gives a stage that's already done, like false
+    if (kind == INPROC_XARGS and not parse_xargs(stage))
+        kind = stage->kind = INPROC_FALSE;
+
+    if (kind == INPROC_TRUE or kind == INPROC_FALSE) {
+        stage->exit_code = kind == INPROC_FALSE;
+        stage->h = CreateEventW(NULL, TRUE, TRUE, NULL);
+        if (stage->h == NULL) {
+            print_err(L"start_inproc_stage -> CreateEventW");
+            free(stage);
+            return FALSE;
+        }
+    }
+    else if (kind == INPROC_SLEEP) {
+        if (not start_sleep(stage)) {
+            print_err(L"start_inproc_stage -> start_sleep");
+            free(stage);
+            return FALSE;
+        }
+    }
+    else {
+        BOOL reads_stdin = kind == INPROC_CAT or kind == INPROC_XARGS;
+        stage->out_h = dup_private(out_h);
+        if (reads_stdin)
+            stage->in_h = dup_private(in_h);
+        if (stage->out_h == NULL or (reads_stdin and stage->in_h == NULL)) {
+            print_err(L"start_inproc_stage -> DuplicateHandle");
+            goto thread_failed;
+        }
+        if (kind == INPROC_XARGS) {
+            stage->stop_e = CreateEventW(NULL, TRUE, FALSE, NULL);
+            if (stage->stop_e == NULL) {
+                print_err(L"start_inproc_stage -> CreateEventW");
+                goto thread_failed;
+            }
+        }
+        stage->refs = 2;
+        stage->h = CreateThread(NULL, 0, stage_tproc, stage, 0, NULL);
+        if (stage->h == NULL) {
+            print_err(L"start_inproc_stage -> CreateThread");
+            goto thread_failed;
+        }
+    }
+
+    inproc_stage_t **link_p = stage_link(stage->h);
+    stage->next = *link_p;
+    *link_p = stage;
+    *out_stage_h = stage->h;
+    return TRUE;
+
+thread_failed:
+    if (stage->out_h != NULL)
+        CloseHandle(stage->out_h);
+    if (stage->in_h != NULL)
+        CloseHandle(stage->in_h);
+    if (stage->stop_e != NULL)
+        CloseHandle(stage->stop_e);
+    free(stage);
+    return FALSE;
+}
+
+
+
+/**
+ * stage_query_exit
+ *
+ * plat_query_exit for a process or an in-process stage.
+ */
+BOOL stage_query_exit(HANDLE h, DWORD *out_exit_code) {
+
+    inproc_stage_t *stage = find_stage(h);
+    if (stage == NULL)
+        return plat_query_exit(h, out_exit_code);
+
+    if (WaitForSingleObject(h, 0) != WAIT_OBJECT_0)
+        return FALSE;
+    if (IS_THREAD_STAGE(stage->kind))
+        return GetExitCodeThread(h, out_exit_code);
+    *out_exit_code = stage->exit_code;
+    return TRUE;
+}
+
+
+
+/**
+ * stage_times
+ *
+ * plat_proc_times for a process or an in-process stage. A timer or event
+ * stage uses no CPU time; its wall time is from when it started until it
+ * was due (or stopped).
+ */
+BOOL stage_times(HANDLE h, uint64_t *out_wall, uint64_t *out_user,
+                 uint64_t *out_sys) {
+
+    inproc_stage_t *stage = find_stage(h);
+    if (stage == NULL or IS_THREAD_STAGE(stage->kind))
+        return plat_proc_times(h, out_wall, out_user, out_sys);
+
+    if (WaitForSingleObject(h, 0) != WAIT_OBJECT_0)
+        return FALSE;
+    *out_wall = (stage->ended_at - stage->started_at) * 10000;
+    *out_user = 0;
+    *out_sys = 0;
+    return TRUE;
+}
+
+
+
+/**
+ * stage_terminate
+ *
+ * plat_terminate for a process or an in-process stage. A thread stage is
+ * told to stop and its blocking I/O is cancelled; a sleep ends right away.
+ */
+BOOL stage_terminate(HANDLE h, DWORD exit_code) {
+
+    inproc_stage_t *stage = find_stage(h);
+    if (stage == NULL)
+        return plat_terminate(h, exit_code);
+
+    if (WaitForSingleObject(h, 0) == WAIT_OBJECT_0)
+        return TRUE;
+    InterlockedExchange(&stage->stopping, 1);
+    if (IS_THREAD_STAGE(stage->kind)) {
+        CancelSynchronousIo(h);
+        if (stage->stop_e != NULL)
+            SetEvent(stage->stop_e);
+        return TRUE;
+    }
+    LARGE_INTEGER due = { .QuadPart = -1 };
+    stage->exit_code = exit_code;
+    stage->ended_at = GetTickCount64();
+    return SetWaitableTimer(h, &due, 0, NULL, NULL, FALSE);
+}
+
+
+
+/**
+ * stage_close
+ *
+ * plat_close for a process or an in-process stage.
+ */
+void stage_close(HANDLE h) {
+
+    inproc_stage_t **link_p = stage_link(h);
+    if (*link_p == NULL) {
+        plat_close(h);
+        return;
+    }
+
+    inproc_stage_t *stage = *link_p;
+    *link_p = stage->next;
+    CloseHandle(h);
+    release_stage(stage);
+}
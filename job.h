@@ -15,14 +15,17 @@
 #include <windows.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include "job_arena.h"
+#include "pipe_relay.h"
 
 
 
 /**
  * job_status_t 
  *
- * Job is RUNNING while 1 or more of its processes are alive, it becomes
- * TERMINATED once its last processes exits.
+ * Job is RUNNING while 1 or more of its processes are alive. Once its last 
+ * process exits it's moved to the completion history and becomes GARBAGE
+ * right away. TERMINATED is only seen by a job that's being killed.
  * GARBAGE means that this job (in the job array) can be overwritten.
  */
 typedef enum _job_status {
@@ -33,10 +36,44 @@ typedef enum _job_status {
 
 
 
+/* STAGE_NAME_CAP: Capacity in WCHARs of stage_time_t.name. Longer names are
+                   cut off. */
+#define STAGE_NAME_CAP 32
+
+
+
+/**
+ * stage_time_t struct
+ *
+ * Times of one process of a job run with "time", captured from its HANDLE
+ * when it's reaped. Times are in 100ns units.
+ */
+typedef struct _stage_time {
+
+    /* proc_h: HANDLE of the stage's process. */
+    HANDLE proc_h;
+
+    /* name: Application name of the stage (NULL-terminated, maybe cut off). */
+    WCHAR name[STAGE_NAME_CAP];
+
+    /* reaped: Have the times below been captured yet? */
+    BOOL reaped;
+
+    ULONGLONG wall;
+    ULONGLONG user;
+    ULONGLONG sys;
+
+} stage_time_t;
+
+
+
 /**
  * job_t struct
  *
- * Contains all information needed for managing the process of a single job.
+ * Contains the (cold) information needed for managing the processes of a
+ * single job. The hot fields that are checked on every scan - status and
+ * n_procs_alive - live in the job_status and job_n_procs_alive arrays,
+ * indexed by jid.
  */
 typedef struct _job {
     
@@ -44,26 +81,67 @@ typedef struct _job {
             index in the job_mgt_data.c jobs array. */
     int32_t jid;
 
-    /* status: RUNNING while >= 1 processes alive, TERMINATED once all
-               processes dead. We only keep the job around for telling user
-               job terminated on next "jobs" call. */
-    job_status_t status;
+    /* prev_live, next_live: jids of the neighbouring jobs in the live job 
+                             list (all non-GARBAGE jobs, oldest first). -1 at 
+                             the ends. */
+    int32_t prev_live;
+    int32_t next_live;
 
     /* foreground: Is this job a foreground job? */
     BOOL is_foreground;
 
-    /* n_procs_alive: Number of processes still running - this is the size of 
-                      the handles array. */
-    int32_t n_procs_alive;
+    /* arena: Holds proc_hs and cmdline. Released (with job_arena_release) 
+              once the job is done with - that frees both. */
+    job_arena_t *arena;
 
-    /* handles: Points to heap-allocated array that has the handles of all 
-                running processes. 
+    /* handles: Points to arena-allocated array that has the handles of all 
+                running processes. Its usage is job_n_procs_alive[jid].
                 Note: Remove processes from this arr when it terminates. */
     HANDLE *proc_hs;
 
-    /* cmdline: Points to heap-allocated string of the command that spawned 
-                this job. We only keep this around for printing on "jobs" call. */
-    wchar_t *cmdline;
+    /* cmdline: Points to the command that spawned this job - in arena, or
+                shared with another job that had the same command. We only
+                keep this around for printing on "jobs" call. */
+    const wchar_t *cmdline;
+
+    /* len_cmdline: Length of cmdline (not including the NULL terminator). */
+    int32_t len_cmdline;
+
+    /* cwd: Working directory the job's processes are started in - a copy 
+            (in arena) of the shell's when the job was spawned, so cd 
+            doesn't touch jobs already running. */
+    const WCHAR *cwd;
+
+    /* last_proc_h: HANDLE of the job's last (rightmost) process. Its exit 
+                    code is the job's. */
+    HANDLE last_proc_h;
+
+    /* group_pid: pid of the job's first process, which leads the job's 
+                  process group. 0 while the job has no process (only
+                  in-process stages). */
+    DWORD group_pid;
+
+    /* exit_code: Exit code of last_proc_h once it has been reaped. */
+    DWORD exit_code;
+
+    /* started_at: Tick count when the job was spawned. */
+    ULONGLONG started_at;
+
+    /* stage_times: Points to arena-allocated array with the times of each 
+                    process, in pipeline order, if the job was run with 
+                    "time". NULL otherwise. */
+    stage_time_t *stage_times;
+
+    /* n_stages: Usage of stage_times. */
+    int32_t n_stages;
+
+    /* relays: Points to arena-allocated array with the relay of each pipe 
+               edge (relays[i] sits between process i and i + 1) if the job 
+               was spawned with pipestat on. NULL otherwise. */
+    pipe_relay_t **relays;
+
+    /* n_relays: Usage of relays. */
+    int32_t n_relays;
 
 } job_t;
 
@@ -0,0 +1,234 @@
+
+/**
+ * job_arena.c
+ *
+ * Per-job arenas. Every job gets one block for its process HANDLE list and
+ * command line. Blocks are recycled through power-of-two free lists, and a
+ * command line identical to that of another live job is shared instead of
+ * copied.
+ *
+ * Note: Only the job spawner thread uses arenas.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* ARENA_MIN_CLASS, ARENA_MAX_CLASS: Smallest and largest block sizes (as 
+                                     powers of two) kept on free lists. */
+#define ARENA_MIN_CLASS 8
+#define ARENA_MAX_CLASS 20
+
+/* ARENA_FREE_LIST_CAP: Most blocks kept on each free list. */
+#define ARENA_FREE_LIST_CAP 64
+
+/* INTERN_BUCKETS: Number of buckets in the cmdline intern table. Must be a
+                   power of two. */
+#define INTERN_BUCKETS 1024
+
+
+
+static job_arena_t *free_lists[ARENA_MAX_CLASS + 1];
+static int32_t len_free_lists[ARENA_MAX_CLASS + 1];
+
+/* intern_table: Arenas that hold a command line, chained by hash. */
+static job_arena_t *intern_table[INTERN_BUCKETS];
+
+
+
+/**
+ * hash_cmdline
+ *
+ * Return Value: Returns the FNV-1a hash of a command line.
+ */
+static uint32_t hash_cmdline(const WCHAR *cmdline, int32_t len_cmdline) {
+
+    uint32_t hash = 2166136261u;
+    for (int32_t i = 0; i < len_cmdline; i++) {
+        hash ^= cmdline[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+
+/**
+ * unintern
+ *
+ * Removes an arena from the intern table.
+ */
+static void unintern(job_arena_t *arena) {
+
+    job_arena_t **link_p = &intern_table[arena->cmdline_hash 
+                                         & (INTERN_BUCKETS - 1)];
+    while (*link_p != NULL) {
+        if (*link_p == arena) {
+            *link_p = arena->next;
+            break;
+        }
+        link_p = &(*link_p)->next;
+    }
+    arena->cmdline = NULL;
+}
+
+
+
+/**
+ * job_arena_new
+ *
+ * Gets an arena with room for at least cap bytes, from a free list if one of
+ * the right size is available.
+ *
+ * cap: Number of bytes needed.
+ *
+ * Return Value: Returns the arena (with one reference) on success, NULL on
+ *               failure (malloc failed).
+ */
+job_arena_t *job_arena_new(size_t cap) {
+
+    size_t block_size = sizeof(job_arena_t) + cap;
+    int32_t size_class = ARENA_MIN_CLASS;
+    while (size_class <= ARENA_MAX_CLASS 
+            and ((size_t)1 << size_class) < block_size)
+        size_class++;
+
+    job_arena_t *arena;
+    if (size_class > ARENA_MAX_CLASS) {
+        arena = malloc(block_size);
+        if (arena == NULL)
+            return NULL;
+        size_class = -1;
+    }
+    else if (free_lists[size_class] != NULL) {
+        arena = free_lists[size_class];
+        free_lists[size_class] = arena->next;
+        len_free_lists[size_class]--;
+        block_size = (size_t)1 << size_class;
+    }
+    else {
+        block_size = (size_t)1 << size_class;
+        arena = malloc(block_size);
+        if (arena == NULL)
+            return NULL;
+    }
+
+    arena->refs = 1;
+    arena->size_class = size_class;
+    arena->used = 0;
+    arena->cap = block_size - sizeof(job_arena_t);
+    arena->cmdline_owner = arena;
+    arena->cmdline = NULL;
+    arena->len_cmdline = 0;
+    arena->cmdline_hash = 0;
+    arena->next = NULL;
+    return arena;
+}
+
+
+
+/**
+ * job_arena_alloc
+ *
+ * Bumps n_bytes (aligned to JOB_ARENA_ALIGN) out of an arena.
+ *
+ * Return Value: Returns the memory, or NULL if the arena doesn't have room.
+ */
+void *job_arena_alloc(job_arena_t *arena, size_t n_bytes) {
+
+    size_t n_aligned = 
+        (n_bytes + JOB_ARENA_ALIGN - 1) & ~(size_t)(JOB_ARENA_ALIGN - 1);
+    if (arena->used + n_aligned > arena->cap)
+        return NULL;
+    void *mem = (BYTE *)(arena + 1) + arena->used;
+    arena->used += n_aligned;
+    return mem;
+}
+
+
+
+/**
+ * job_arena_intern_cmdline
+ *
+ * Gives an arena's job its command line: if a live job has the same one, the
+ * arena shares it (and takes a reference to that job's arena). Otherwise it's
+ * copied into the arena and made available to later jobs.
+ *
+ * arena: Arena of the job. Must have room for len_cmdline + 1 WCHARs.
+ * cmdline: Command line (doesn't need to be NULL-terminated).
+ * len_cmdline: Length of cmdline.
+ *
+ * Return Value: Returns the NULL-terminated command line to use.
+ */
+const WCHAR *job_arena_intern_cmdline(job_arena_t *arena, 
+                                      const WCHAR *cmdline, 
+                                      int32_t len_cmdline) {
+
+    uint32_t hash = hash_cmdline(cmdline, len_cmdline);
+
+    for (job_arena_t *curr = intern_table[hash & (INTERN_BUCKETS - 1)];
+          curr != NULL; curr = curr->next) {
+        if (curr->cmdline_hash == hash and curr->len_cmdline == len_cmdline
+             and memcmp(curr->cmdline, cmdline, 
+                        len_cmdline * sizeof(WCHAR)) == 0) {
+            curr->refs++;
+            arena->cmdline_owner = curr;
+            STAT_ADD(STAT_CMDLINE_INTERN_HITS, 1);
+            return curr->cmdline;
+        }
+    }
+
+    WCHAR *copy = job_arena_alloc(arena, (len_cmdline + 1) * sizeof(WCHAR));
+    memcpy(copy, cmdline, len_cmdline * sizeof(WCHAR));
+    copy[len_cmdline] = L'\0';
+
+    arena->cmdline = copy;
+    arena->len_cmdline = len_cmdline;
+    arena->cmdline_hash = hash;
+    arena->next = intern_table[hash & (INTERN_BUCKETS - 1)];
+    intern_table[hash & (INTERN_BUCKETS - 1)] = arena;
+
+    return copy;
+}
+
+
+
+/**
+ * job_arena_release
+ *
+ * Drops a reference to an arena. Once the last one is gone, the arena stops
+ * being an intern source, drops its reference to the arena its cmdline came
+ * from and goes back on a free list (or is freed).
+ *
+ * arena: Arena to release. May be NULL.
+ */
+void job_arena_release(job_arena_t *arena) {
+
+    while (arena != NULL and --arena->refs == 0) {
+
+        job_arena_t *cmdline_owner = 
+            arena->cmdline_owner != arena ? arena->cmdline_owner : NULL;
+        if (arena->cmdline != NULL)
+            unintern(arena);
+
+        int32_t size_class = arena->size_class;
+        if (size_class >= 0 
+             and len_free_lists[size_class] < ARENA_FREE_LIST_CAP) {
+            arena->next = free_lists[size_class];
+            free_lists[size_class] = arena;
+            len_free_lists[size_class]++;
+        }
+        else {
+            free(arena);
+        }
+
+        arena = cmdline_owner;
+    }
+}
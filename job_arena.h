@@ -0,0 +1,73 @@
+
+/**
+ * job_arena.h
+ *
+ * job_arena_t struct defined here.
+ */
+
+
+
+#ifndef _JOB_ARENA_H
+#define _JOB_ARENA_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/* JOB_ARENA_ALIGN: Alignment of every arena allocation. */
+#define JOB_ARENA_ALIGN 8
+
+/* JOB_ARENA_SIZE: Bytes an arena needs for a job with n_procs processes and
+                   a command line of len_cmdline WCHARs. */
+#define JOB_ARENA_SIZE(n_procs, len_cmdline)                                \
+    ((size_t)(n_procs) * sizeof(HANDLE) + JOB_ARENA_ALIGN                   \
+      + ((size_t)(len_cmdline) + 1) * sizeof(WCHAR) + JOB_ARENA_ALIGN)
+
+
+
+/**
+ * job_arena_t struct
+ *
+ * Single block holding the memory a job owns for its lifetime: its process
+ * HANDLE list and (unless it was interned from another job) its command line.
+ * Allocations are bumped out of the bytes that follow this header, and the
+ * whole block is released at once. Released blocks are kept on per-size free
+ * lists for the next job.
+ */
+typedef struct _job_arena {
+
+    /* refs: Number of references - one from the owning job, plus one from 
+             every job whose cmdline was interned from this arena. */
+    int32_t refs;
+
+    /* size_class: Block holds 1 << size_class bytes (header included). -1 
+                   if it's too big for the free lists. */
+    int32_t size_class;
+
+    /* used, cap: Bytes handed out and bytes available after the header. */
+    size_t used;
+    size_t cap;
+
+    /* cmdline_owner: Arena holding this job's cmdline - this arena, or the 
+                      arena it was interned from (which this one holds a 
+                      reference to). */
+    struct _job_arena *cmdline_owner;
+
+    /* cmdline, len_cmdline, cmdline_hash: Command line stored in this arena,
+                                           if any, for interning. */
+    const WCHAR *cmdline;
+    int32_t len_cmdline;
+    uint32_t cmdline_hash;
+
+    /* next: Next arena in the same intern bucket or free list. */
+    struct _job_arena *next;
+
+} job_arena_t;
+
+
+
+// ifndef _JOB_ARENA_H
+#endif
@@ -32,5 +32,51 @@ int32_t cap_wait_handles;
 
 
 
-/* jobs: Array of job_t's. */
-job_t jobs[MAX_JOBS];
+/* jobs: Points to heap-allocated array of job_t's, indexed by jid. Grows (and
+         may move) when every jid is in use - don't hold job_t pointers across
+         a find_open_jid call. */
+job_t *jobs;
+
+
+
+/* job_status: Points to heap-allocated array with the status of each job, 
+               indexed by jid. Kept apart from the job_t's so that scans only
+               touch this. */
+job_status_t *job_status;
+
+
+
+/* job_n_procs_alive: Points to heap-allocated array with the number of live
+                      processes of each job (the usage of its proc_hs array),
+                      indexed by jid. */
+int32_t *job_n_procs_alive;
+
+
+
+/* cap_jobs: Current capacity of jobs, job_status and job_n_procs_alive. */
+int32_t cap_jobs;
+
+
+
+/* live_jobs_head, live_jobs_tail: jids of the first (oldest) and last job in
+                                   the live job list, -1 if it's empty. */
+int32_t live_jobs_head = -1;
+int32_t live_jobs_tail = -1;
+
+
+
+/* free_jid_bits: Points to heap-allocated bitmap with a 1 bit for every jid 
+                  that isn't in use (cap_jobs / 64 words). */
+uint64_t *free_jid_bits;
+
+
+
+/* completions: Ring of the last COMPLETIONS_CAP finished jobs. Record i 
+                (counting from the first job that ever finished) is at 
+                i % COMPLETIONS_CAP. */
+completion_t completions[COMPLETIONS_CAP];
+
+
+
+/* n_completions: Number of jobs that have ever finished. */
+int64_t n_completions = 0;
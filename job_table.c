@@ -0,0 +1,130 @@
+
+/**
+ * job_table.c
+ * 
+ * Growing the job table and moving jobs on and off the live job list.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "_winshell_private.h"
+
+
+
+/**
+ * grow_jobs
+ * 
+ * Doubles the capacity of the job table (or allocates it with JOBS_INIT_CAP
+ * jobs the first time). New jobs are GARBAGE.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure (realloc failed).
+ */
+BOOL grow_jobs() {
+
+    int32_t new_cap_jobs = cap_jobs ? cap_jobs * 2 : JOBS_INIT_CAP;
+
+    job_t *new_jobs = realloc(jobs, new_cap_jobs * sizeof(job_t));
+    if (new_jobs == NULL)
+        return FALSE;
+    jobs = new_jobs;
+
+    job_status_t *new_job_status = 
+        realloc(job_status, new_cap_jobs * sizeof(job_status_t));
+    if (new_job_status == NULL)
+        return FALSE;
+    job_status = new_job_status;
+
+    int32_t *new_job_n_procs_alive = 
+        realloc(job_n_procs_alive, new_cap_jobs * sizeof(int32_t));
+    if (new_job_n_procs_alive == NULL)
+        return FALSE;
+    job_n_procs_alive = new_job_n_procs_alive;
+
+    uint64_t *new_free_jid_bits = 
+        realloc(free_jid_bits, new_cap_jobs / 64 * sizeof(uint64_t));
+    if (new_free_jid_bits == NULL)
+        return FALSE;
+    free_jid_bits = new_free_jid_bits;
+
+    // Initialize the new jobs
+    for (int32_t jid = cap_jobs; jid < new_cap_jobs; jid++) {
+        memset(&jobs[jid], 0, sizeof(job_t));
+        jobs[jid].jid = jid;
+        jobs[jid].prev_live = -1;
+        jobs[jid].next_live = -1;
+        job_status[jid] = GARBAGE;
+        job_n_procs_alive[jid] = 0;
+    }
+    memset(
+        &free_jid_bits[cap_jobs / 64], 
+        0xFF, 
+        (new_cap_jobs - cap_jobs) / 64 * sizeof(uint64_t)
+    );
+
+    cap_jobs = new_cap_jobs;
+    return TRUE;
+}
+
+
+
+/**
+ * activate_job
+ * 
+ * Marks a GARBAGE job RUNNING, takes its jid out of the free set and appends
+ * it to the live job list.
+ * 
+ * jid: jid of the job.
+ */
+void activate_job(int32_t jid) {
+
+    job_t *job = &jobs[jid];
+
+    job_status[jid] = RUNNING;
+    free_jid_bits[jid / 64] &= ~((uint64_t)1 << (jid % 64));
+
+    job->prev_live = live_jobs_tail;
+    job->next_live = -1;
+    if (live_jobs_tail >= 0)
+        jobs[live_jobs_tail].next_live = jid;
+    else
+        live_jobs_head = jid;
+    live_jobs_tail = jid;
+}
+
+
+
+/**
+ * release_job
+ * 
+ * Marks a job GARBAGE, unlinks it from the live job list and returns its jid
+ * to the free set. Does nothing if the job is already GARBAGE.
+ * Doesn't free the job's resources.
+ * 
+ * jid: jid of the job.
+ */
+void release_job(int32_t jid) {
+
+    job_t *job = &jobs[jid];
+
+    if (job_status[jid] == GARBAGE)
+        return;
+
+    if (job->prev_live >= 0)
+        jobs[job->prev_live].next_live = job->next_live;
+    else
+        live_jobs_head = job->next_live;
+    if (job->next_live >= 0)
+        jobs[job->next_live].prev_live = job->prev_live;
+    else
+        live_jobs_tail = job->prev_live;
+    job->prev_live = -1;
+    job->next_live = -1;
+
+    job_status[jid] = GARBAGE;
+    job_n_procs_alive[jid] = 0;
+    free_jid_bits[jid / 64] |= (uint64_t)1 << (jid % 64);
+}
@@ -0,0 +1,145 @@
+
+/**
+ * job_times.c
+ *
+ * Times of jobs run with "time <pipeline>": each process's times are taken
+ * from its HANDLE when it's reaped, and the report goes to stderr once the
+ * last one is.
+ */
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <stdio.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/**
+ * write_times
+ *
+ * Appends "real S.MMMs  user S.MMMs  sys S.MMMs\n" to stream. Times are in 
+ * 100ns units.
+ */
+static void write_times(out_stream_t *stream, ULONGLONG wall, ULONGLONG user,
+                        ULONGLONG sys) {
+
+    WCHAR *dst = out_stream_reserve(stream, 96);
+    if (dst == NULL)
+        return;
+    wall /= 10000;
+    user /= 10000;
+    sys /= 10000;
+    int len = _snwprintf(
+        dst,
+        96,
+        L"real %llu.%03llus  user %llu.%03llus  sys %llu.%03llus\n",
+        wall / 1000, wall % 1000,
+        user / 1000, user % 1000,
+        sys / 1000, sys % 1000
+    );
+    if (len > 0)
+        stream->len += len;
+}
+
+
+
+/**
+ * capture_stage_times
+ * 
+ * Captures the wall, user and system time of a timed job's process that just
+ * exited. Does nothing if the job isn't timed.
+ * 
+ * Note: Must be called after stage_query_exit and before proc_h is closed.
+ * 
+ * job: Job the process belongs to.
+ * proc_h: HANDLE of the process.
+ */
+void capture_stage_times(job_t *job, HANDLE proc_h) {
+
+    uint64_t wall, user, sys;
+
+    for (int32_t i = 0; i < job->n_stages; i++) {
+        stage_time_t *stage = &job->stage_times[i];
+        if (stage->proc_h != proc_h)
+            continue;
+        if (stage_times(proc_h, &wall, &user, &sys)) {
+            stage->wall = wall;
+            stage->user = user;
+            stage->sys = sys;
+        }
+        stage->reaped = TRUE;
+        return;
+    }
+}
+
+
+
+/**
+ * report_job_times
+ * 
+ * Writes the time report of a timed job whose last process was just reaped
+ * to stderr: one line per stage and a total. The total's real time is the 
+ * job's wall time, user and sys are summed over the stages.
+ * 
+ * job: Job to report on.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL report_job_times(const job_t *job) {
+
+    out_stream_t err;
+    ULONGLONG total_user = 0, total_sys = 0;
+
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+
+    out_stream_write(&err, job->cmdline, job->len_cmdline);
+    out_stream_puts(&err, L"\n");
+
+    for (int32_t i = 0; i < job->n_stages; i++) {
+        const stage_time_t *stage = &job->stage_times[i];
+        WCHAR *dst = out_stream_reserve(&err, STAGE_NAME_CAP + 16);
+        if (dst != NULL) {
+            int len = _snwprintf(
+                dst, 
+                STAGE_NAME_CAP + 16, 
+                L"  [%d] %-*ls ", 
+                i, 
+                STAGE_NAME_CAP - 1, 
+                stage->name
+            );
+            if (len > 0)
+                err.len += len;
+        }
+        write_times(&err, stage->wall, stage->user, stage->sys);
+        total_user += stage->user;
+        total_sys += stage->sys;
+    }
+
+    WCHAR *dst = out_stream_reserve(&err, STAGE_NAME_CAP + 16);
+    if (dst != NULL) {
+        int len = _snwprintf(
+            dst, 
+            STAGE_NAME_CAP + 16, 
+            L"  %-*ls ", 
+            STAGE_NAME_CAP + 3, 
+            L"total"
+        );
+        if (len > 0)
+            err.len += len;
+    }
+    write_times(
+        &err, 
+        (GetTickCount64() - job->started_at) * 10000, 
+        total_user, 
+        total_sys
+    );
+
+    if (not out_stream_close(&err)) {
+        print_err(L"report_job_times -> out_stream_close");
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -6,39 +6,59 @@
 
 
 #include <windows.h>
-#include <stdlib.h>
-#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
 #include "_winshell_private.h"
 
 
 
-#define INIT_CAP 2
+/**
+ * status_prefix_t
+ * 
+ * The part of a job description that comes after the jid. One per status, 
+ * with its length worked out at compile time.
+ */
+typedef struct _status_prefix {
+    const WCHAR *str;
+    int32_t len;
+} status_prefix_t;
+
+#define STATUS_PREFIX(s) { s, (int32_t)(sizeof(s) / sizeof(WCHAR)) - 1 }
+
+/* status_prefixes: Indexed by job_status_t. */
+static const status_prefix_t status_prefixes[] = {
+    [RUNNING] = STATUS_PREFIX(L"] RUNNING\t\t"),
+    [TERMINATED] = STATUS_PREFIX(L"] TERMINATED\t\t"),
+    [GARBAGE] = STATUS_PREFIX(L"] GARBAGE\t\t")
+};
+
+/* error_prefix: Used for an out of range status (should never happen). */
+static const status_prefix_t error_prefix = STATUS_PREFIX(L"] ERROR\t\t");
 
 
 
 /**
- * job_status_to_str
+ * jid_to_str
  * 
- * status:
+ * Writes the decimal digits of a jid to out.
  * 
- * Return Value: Returns a pointer to a data section string containing
- *               the job status.
+ * Return Value: Returns the number of WCHARs written (at most 10).
  */
-static const WCHAR *job_status_to_str(job_status_t status) {
-    switch(status) {
-    case RUNNING:
-        return L"RUNNING";
-        break;
-    case TERMINATED:
-        return L"TERMINATED";
-        break;
-    case GARBAGE:
-        return L"GARBAGE";
-        break;
-    default: // This should never be reached
-        return L"ERROR";
-        break;
+static int32_t jid_to_str(int32_t jid, WCHAR *out) {
+
+    WCHAR digits[10];
+    int32_t n_digits = 0;
+    uint32_t n = (uint32_t)jid;
+
+    do {
+        digits[n_digits++] = L'0' + (WCHAR)(n % 10);
+        n /= 10;
+    } while (n != 0);
+
+    for (int32_t i = 0; i < n_digits; i++) {
+        out[i] = digits[n_digits - 1 - i];
     }
+    return n_digits;
 }
 
 
@@ -46,45 +66,109 @@ static const WCHAR *job_status_to_str(job_status_t status) {
 /**
  * job_to_str
  * 
- * Creates a string description for a given job.
+ * Writes the description of a job ("[jid] STATUS\t\tcmdline") to a 
+ * caller-supplied buffer. Doesn't allocate.
  * 
  * job: job_t object to describe.
+ * out: Buffer to write to. Must have room for JOB_STR_LEN(job) + 1 WCHARs.
+ * cap_out: Capacity of out in WCHARs.
  * 
- * Return Value: Returns a pointer to a heap-allocated NULL-terminated string 
- *               containing the description for the job. Must be freed with 
- *               free().
- *               Returns NULL on error.
+ * Return Value: Returns the length of the description (not including the 
+ *               NULL terminator that is also written).
+ *               Returns -1 if out is too small - nothing is written.
  */
-WCHAR *job_to_str(const job_t *job) {
-    
-    WCHAR *job_desc = malloc((INIT_CAP + 1) * sizeof(WCHAR));
-    if (job_desc == NULL) 
-        return NULL;
-    
-    int len = snwprintf(
-        job_desc,
-        INIT_CAP,
-        L"[%d] %s\t\t%s",
-        job->jid,
-        job_status_to_str(job->status),
-        job->cmdline
+int32_t job_to_str(const job_t *job, WCHAR *out, int32_t cap_out) {
+
+    if (cap_out < JOB_STR_LEN(job) + 1)
+        return -1;
+
+    const status_prefix_t *prefix = 
+        (uint32_t)job_status[job->jid] 
+                < sizeof(status_prefixes) / sizeof(*status_prefixes)
+            ? &status_prefixes[job_status[job->jid]]
+            : &error_prefix;
+
+    WCHAR *out_p = out;
+    *out_p++ = L'[';
+    out_p += jid_to_str(job->jid, out_p);
+    memcpy(out_p, prefix->str, prefix->len * sizeof(WCHAR));
+    out_p += prefix->len;
+    memcpy(out_p, job->cmdline, job->len_cmdline * sizeof(WCHAR));
+    out_p += job->len_cmdline;
+    *out_p = L'\0';
+
+    return (int32_t)(out_p - out);
+}
+
+
+
+/**
+ * write_job_line
+ * 
+ * Formats a job's description followed by a newline directly into an 
+ * out_stream's buffer.
+ * 
+ * stream: out_stream_t to append to.
+ * job: job_t object to describe.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL write_job_line(out_stream_t *stream, const job_t *job) {
+
+    int32_t cap_job_str = JOB_STR_LEN(job) + 1;
+    WCHAR *dst = out_stream_reserve(stream, cap_job_str);
+    if (dst == NULL)
+        return FALSE;
+
+    int32_t len_job_str = job_to_str(job, dst, cap_job_str);
+    dst[len_job_str] = L'\n'; // overwrites the NULL terminator
+    stream->len += len_job_str + 1;
+
+    return TRUE;
+}
+
+
+
+/**
+ * write_completion_line
+ * 
+ * Formats a completion record ("[jid] DONE (exit N, S.MMMs)\t\tcmdline",
+ * TERMINATED instead of DONE for a killed job) followed by a newline
+ * directly into an out_stream's buffer.
+ * 
+ * stream: out_stream_t to append to.
+ * record: completion_t to describe.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL write_completion_line(out_stream_t *stream, const completion_t *record) {
+
+    int32_t cap_str = COMPLETION_STR_MAX_PREFIX + record->len_cmdline + 1;
+    WCHAR *dst = out_stream_reserve(stream, cap_str);
+    if (dst == NULL)
+        return FALSE;
+
+    ULONGLONG elapsed_ms = record->finished_at - record->started_at;
+    int len_prefix = _snwprintf(
+        dst,
+        COMPLETION_STR_MAX_PREFIX,
+        L"[%d] %ls (exit %lu, %llu.%03llus)\t\t",
+        record->jid,
+        record->was_terminated ? L"TERMINATED" : L"DONE",
+        (unsigned long)record->exit_code,
+        elapsed_ms / 1000,
+        elapsed_ms % 1000
     );
+    if (len_prefix < 0)
+        return FALSE;
 
-    if (len > INIT_CAP) {
-        job_desc = realloc(job_desc, (len + 1) * sizeof(WCHAR));
-        if (job_desc == NULL) {
-            free(job_desc);
-            return NULL;
-        }
-        len = snwprintf(
-            job_desc,
-            len + 1,
-            L"[%d] %s\t\t%s",
-            job->jid,
-            job_status_to_str(job->status),
-            job->cmdline
-        );
-    }
+    memcpy(
+        dst + len_prefix, 
+        record->cmdline, 
+        record->len_cmdline * sizeof(WCHAR)
+    );
+    dst[len_prefix + record->len_cmdline] = L'\n';
+    stream->len += len_prefix + record->len_cmdline + 1;
 
-    return job_desc;
+    return TRUE;
 }
@@ -14,84 +14,41 @@
 /**
  * jobs_builtin
  * 
+ * Lists the live jobs, then the completion history (oldest first).
+ * 
  * parsed_proc: Contains parsed information about command line that called
  *              this builtin to be called.
- * startup_info: Contains redirection info - will output to hStdOutput.
+ * stdio: Standard streams after redirection - will output to std_out.
  * 
  * Return Value: Returns TRUE on success, returns FALSE on failure.
  */
 BOOL jobs_builtin(parsed_process_t *parsed_proc, 
-                  STARTUPINFO *startup_info) {
+                  stdio_handles_t *stdio) {
     
-    BOOL bool_rc;
+    BOOL bool_rc = TRUE;
+    out_stream_t out;
 
-    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (stdout_h == INVALID_HANDLE_VALUE) {
-        print_err(L"jobs_builtin -> GetStdHandle");
-        return FALSE;
-    }
+    out_stream_init(&out, stdio->std_out);
     
-    for (int i = 0; i < MAX_JOBS; i++) {
-
-        job_t *job = &jobs[i];
-
-        if (job->status == GARBAGE) {
-            continue;
-        }
-        
-        WCHAR *job_str = job_to_str(job);
-        if (job_str == NULL) 
-            continue;
-        
-        if (stdout_h == startup_info->hStdOutput) {
-            bool_rc = WriteConsoleW(stdout_h, job_str, wcslen(job_str), NULL, NULL);
-            if (not bool_rc) {
-                print_err(L"jobs_builtin -> WriteConsoleW");
-                free(job_str);
-                return FALSE;
-            }
-            bool_rc = WriteConsoleW(stdout_h, L"\n", 1, NULL, NULL);
-            if (not bool_rc) {
-                print_err(L"jobs_builtin -> WriteConsoleW");
-                free(job_str);
-                return FALSE;
-            }
-        }
-        else {
-            bool_rc = WriteFile(
-                startup_info->hStdOutput, 
-                job_str, 
-                wcslen(job_str) * sizeof(WCHAR),
-                NULL,
-                NULL
-            );
-            if (not bool_rc) {
-                print_err(L"jobs_builtin -> WriteFile");
-                free(job_str);
-                return FALSE;
-            }
-            bool_rc = WriteFile(
-                startup_info->hStdOutput,
-                L"\n",
-                1 * sizeof(WCHAR),
-                NULL,
-                NULL
-            );
-            if (not bool_rc) {
-                print_err(L"jobs_builtin -> WriteFile");
-                free(job_str);
-                return FALSE;
-            }
-        }
-
-        free(job_str);
+    for (int32_t jid = live_jobs_head; jid >= 0 and bool_rc; 
+          jid = jobs[jid].next_live) {
+        bool_rc = write_job_line(&out, &jobs[jid]);
+    }
 
-        if (job->status == TERMINATED) {
-            free(job->cmdline);
-            free(job->proc_hs);
-            job->status = GARBAGE;
-        }
+    int64_t first_completion = n_completions > COMPLETIONS_CAP 
+                                ? n_completions - COMPLETIONS_CAP 
+                                : 0;
+    for (int64_t i = first_completion; i < n_completions and bool_rc; i++) {
+        bool_rc = write_completion_line(
+            &out, 
+            &completions[i % COMPLETIONS_CAP]
+        );
     }
 
-    return TRUE;
+    if (not out_stream_close(&out))
+        bool_rc = FALSE;
+    if (not bool_rc)
+        print_err(L"jobs_builtin -> out_stream_write");
+
+    return bool_rc;
 }
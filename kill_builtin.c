@@ -39,80 +39,41 @@ static int32_t kill_cmdline_get_jid(const WCHAR *kill_cmdline) {
  * kill_builtin
  * 
  * parsed_proc: Parsed info about the command that called this builtin.
- * startup_info: Should be setup for I/O redirection. Will send output to
- *               the hStdOutput HANDLE.
+ * stdio: Standard streams after I/O redirection. Will send output to
+ *        std_out.
  * 
  * Return Value: Returns TRUE on success, FALSE on failure.
  */
 BOOL kill_builtin(parsed_process_t *parsed_proc, 
-                  STARTUPINFO *startup_info) {
+                  stdio_handles_t *stdio) {
     
     BOOL bool_rc;
 
     // Find the job
     int32_t jid = kill_cmdline_get_jid(parsed_proc->cmd_line);
-    if (jid < 0 or jobs[jid].status == GARBAGE) {
+    if (jid < 0 or jid >= cap_jobs or job_status[jid] == GARBAGE) {
         return FALSE;
     }
     job_t *job = &jobs[jid];
 
-    // Create the message string
-    job->status = TERMINATED;
-    WCHAR *job_str = job_to_str(job);
+    // Create the message (before terminate_job frees job->cmdline)
+    out_stream_t out;
+    out_stream_init(&out, stdio->std_out);
+    job_status[jid] = TERMINATED;
+    write_job_line(&out, job);
 
     // Terminate the job
     bool_rc = terminate_job(job);
     if (not bool_rc) {
+        out_stream_close(&out);
         return FALSE;
     }
 
     // Print message
-    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (stdout_h == INVALID_HANDLE_VALUE) {
-        print_err(L"kill_builtin -> GetStdHandle");
-        return FALSE;
-    }
-
-    if (stdout_h == startup_info->hStdOutput) {
-        bool_rc = WriteConsoleW(
-            stdout_h, 
-            job_str, 
-            wcslen(job_str),
-            NULL, 
-            NULL
-        );
-        if (not bool_rc) {
-            print_err(L"kill_builtin -> WriteConsoleW");
-        }
-        bool_rc = WriteConsoleW(stdout_h, L"\n", 1, NULL, NULL);
-        if (not bool_rc) {
-            print_err(L"kill_builtin -> WriteConsoleW");
-        }
-    }
-    else {
-        bool_rc = WriteFile(
-            startup_info->hStdOutput,
-            job_str, 
-            wcslen(job_str) * sizeof(WCHAR),
-            NULL,
-            NULL
-        );
-        if (not bool_rc) {
-            print_err(L"kill_builtin -> WriteFile");
-        }
-        bool_rc = WriteFile(
-            startup_info->hStdOutput,
-            L"\n",
-            1 * sizeof(WCHAR),
-            NULL,
-            NULL
-        );
-        if (not bool_rc) {
-            print_err(L"kill_builtin -> WriteFile");
-        }
+    bool_rc = out_stream_close(&out);
+    if (not bool_rc) {
+        print_err(L"kill_builtin -> out_stream_close");
     }
 
-    free(job_str);
-
     return TRUE;
 }
@@ -29,8 +29,6 @@ int WINAPI wWinMain(HINSTANCE hInstance,
 
     int rc; 
 
-    WCHAR buf[1];
-
     rc = init_winshell();
     if (rc < 0) {
         ExitProcess(1);
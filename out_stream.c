@@ -0,0 +1,376 @@
+
+/**
+ * out_stream.c
+ *
+ * Buffered output for builtins and shell messages.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* redirected_out_encoding: Encoding builtins use when their output goes to a
+                            file or a pipe. Set by init_winshell from the
+                            WINSHELL_OUTPUT_ENCODING environment variable. */
+out_encoding_t redirected_out_encoding = OUT_ENC_UTF8;
+
+/* spooled_out_h: Pipe a builtin run by spawn_job writes to. The stage that
+                  reads it isn't started until the builtin is done, so a
+                  stream writing to it is spooled rather than blocking once
+                  the pipe is full. NULL the rest of the time. */
+HANDLE spooled_out_h = NULL;
+
+
+
+/**
+ * out_stream_init
+ *
+ * Initializes an out_stream that writes to h. Doesn't allocate - the buffer
+ * is allocated on the first write.
+ *
+ * stream: out_stream_t to initialize.
+ * h: HANDLE to write to (console, file or pipe).
+ */
+void out_stream_init(out_stream_t *stream, HANDLE h) {
+
+    DWORD console_mode;
+
+    stream->h = h;
+    stream->is_console = GetConsoleMode(h, &console_mode);
+    stream->encoding = redirected_out_encoding;
+    stream->is_spooled = h != NULL and h == spooled_out_h;
+    stream->buf = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+    stream->bytes = NULL;
+    stream->cap_bytes = 0;
+}
+
+
+
+/**
+ * out_stream_reserve
+ *
+ * Makes sure there is room for n_wchars more WCHARs in the stream's buffer.
+ * Flushes first if OUT_STREAM_FLUSH_AT WCHARs are already pending (unless
+ * the stream is spooled).
+ *
+ * stream: out_stream_t to grow.
+ * n_wchars: Number of WCHARs about to be appended.
+ *
+ * Return Value: Returns a pointer to where the next WCHAR should be written.
+ *               Returns NULL on failure (realloc or flush failed).
+ */
+WCHAR *out_stream_reserve(out_stream_t *stream, int32_t n_wchars) {
+
+    if (stream->len >= OUT_STREAM_FLUSH_AT and not stream->is_spooled) {
+        if (not out_stream_flush(stream))
+            return NULL;
+    }
+
+    if (stream->len + n_wchars > stream->cap) {
+        int32_t new_cap = stream->cap ? stream->cap : OUT_STREAM_INIT_CAP;
+        while (new_cap < stream->len + n_wchars)
+            new_cap *= 2;
+        WCHAR *new_buf = realloc(stream->buf, new_cap * sizeof(WCHAR));
+        if (new_buf == NULL)
+            return NULL;
+        stream->buf = new_buf;
+        stream->cap = new_cap;
+    }
+
+    return stream->buf + stream->len;
+}
+
+
+
+/**
+ * out_stream_write
+ *
+ * Appends len_str WCHARs of str to the stream's buffer.
+ *
+ * stream: out_stream_t to append to.
+ * str: Text to append (doesn't need to be NULL-terminated).
+ * len_str: Number of WCHARs in str.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL out_stream_write(out_stream_t *stream, const WCHAR *str, int32_t len_str) {
+
+    WCHAR *dst = out_stream_reserve(stream, len_str);
+    if (dst == NULL)
+        return FALSE;
+    memcpy(dst, str, len_str * sizeof(WCHAR));
+    stream->len += len_str;
+    return TRUE;
+}
+
+
+
+/**
+ * out_stream_puts
+ *
+ * Appends a NULL-terminated string to the stream's buffer.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL out_stream_puts(out_stream_t *stream, const WCHAR *str) {
+    return out_stream_write(stream, str, (int32_t)wcslen(str));
+}
+
+
+
+/**
+ * write_utf8
+ *
+ * Transcodes the stream's pending WCHARs to UTF-8 and writes them with a
+ * single WriteFile. A trailing high surrogate is held back so that a pair
+ * split by a flush still converts correctly.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL write_utf8(out_stream_t *stream) {
+
+    BOOL bool_rc;
+
+    int32_t n_wchars = stream->len;
+    if (stream->buf[n_wchars - 1] >= 0xD800 
+         and stream->buf[n_wchars - 1] <= 0xDBFF)
+        n_wchars--;
+    if (n_wchars == 0)
+        return TRUE;
+
+    int32_t cap_needed = n_wchars * UTF8_MAX_PER_WCHAR;
+    if (cap_needed > stream->cap_bytes) {
+        char *new_bytes = realloc(stream->bytes, cap_needed);
+        if (new_bytes == NULL)
+            return FALSE;
+        stream->bytes = new_bytes;
+        stream->cap_bytes = cap_needed;
+    }
+
+    int32_t n_bytes = utf16_to_utf8(stream->buf, n_wchars, stream->bytes);
+    bool_rc = WriteFile(stream->h, stream->bytes, n_bytes, NULL, NULL);
+    if (bool_rc)
+        STAT_ADD(STAT_OUT_BYTES, n_bytes);
+
+    // Keep the held back high surrogate
+    if (n_wchars < stream->len)
+        stream->buf[0] = stream->buf[n_wchars];
+    stream->len -= n_wchars;
+
+    return bool_rc;
+}
+
+
+
+#if WCHAR_MAX > 0xFFFF
+/**
+ * write_utf16
+ *
+ * Transcodes the stream's pending WCHARs to UTF-16LE and writes them with a
+ * single WriteFile. Only needed where WCHAR is 32 bits (Linux); elsewhere
+ * the buffer already is UTF-16LE.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL write_utf16(out_stream_t *stream) {
+
+    BOOL bool_rc;
+
+    // A code point past U+FFFF takes a surrogate pair: 4 bytes
+    int32_t cap_needed = stream->len * 4;
+    if (cap_needed > stream->cap_bytes) {
+        char *new_bytes = realloc(stream->bytes, cap_needed);
+        if (new_bytes == NULL)
+            return FALSE;
+        stream->bytes = new_bytes;
+        stream->cap_bytes = cap_needed;
+    }
+
+    unsigned char *dst_p = (unsigned char *)stream->bytes;
+    for (int32_t i = 0; i < stream->len; i++) {
+        uint32_t c = (uint32_t)stream->buf[i];
+        if (c > 0x10FFFF)
+            c = 0xFFFD;
+        if (c > 0xFFFF) {
+            uint32_t high = 0xD800 + ((c - 0x10000) >> 10),
+                     low = 0xDC00 + ((c - 0x10000) & 0x3FF);
+            *dst_p++ = (unsigned char)high;
+            *dst_p++ = (unsigned char)(high >> 8);
+            c = low;
+        }
+        *dst_p++ = (unsigned char)c;
+        *dst_p++ = (unsigned char)(c >> 8);
+    }
+
+    int32_t n_bytes = (int32_t)(dst_p - (unsigned char *)stream->bytes);
+    bool_rc = WriteFile(stream->h, stream->bytes, n_bytes, NULL, NULL);
+    if (bool_rc)
+        STAT_ADD(STAT_OUT_BYTES, n_bytes);
+    stream->len = 0;
+    return bool_rc;
+}
+#endif
+
+
+
+/**
+ * out_stream_flush
+ *
+ * Writes everything pending in the stream's buffer with a single write call.
+ * A spooled stream isn't written until it's closed.
+ *
+ * stream: out_stream_t to flush.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL out_stream_flush(out_stream_t *stream) {
+
+    BOOL bool_rc = TRUE;
+
+    if (stream->len == 0 or stream->is_spooled)
+        return TRUE;
+
+    if (stream->is_console) {
+        bool_rc = WriteConsoleW(
+            stream->h,
+            stream->buf,
+            stream->len,
+            NULL,
+            NULL
+        );
+    }
+    else if (stream->encoding == OUT_ENC_UTF8) {
+        return write_utf8(stream);
+    }
+    else {
+#if WCHAR_MAX > 0xFFFF
+        return write_utf16(stream);
+#else
+        bool_rc = WriteFile(
+            stream->h,
+            stream->buf,
+            stream->len * sizeof(WCHAR),
+            NULL,
+            NULL
+        );
+#endif
+    }
+
+    if (bool_rc)
+        STAT_ADD(STAT_OUT_BYTES, stream->len * sizeof(WCHAR));
+    stream->len = 0;
+    return bool_rc;
+}
+
+
+
+/**
+ * spool_tproc
+ *
+ * Writes a spooled stream out, then closes its HANDLE (the reader sees EOF)
+ * and frees it. Stops early if the reader stops reading.
+ */
+static DWORD WINAPI spool_tproc(void *arg) {
+
+    out_stream_t *spool = arg;
+    HANDLE h = spool->h;
+
+    out_stream_close(spool);
+    plat_close(h);
+    free(spool);
+    return 0;
+}
+
+
+
+/**
+ * spool_stream
+ *
+ * Moves a spooled stream's buffer to a thread that writes it to its own
+ * duplicate of the HANDLE, so the builtin doesn't wait for the reader. If
+ * that can't be set up the buffer is written right away instead.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the write failed.
+ */
+static BOOL spool_stream(out_stream_t *stream) {
+
+    stream->is_spooled = FALSE;
+    if (stream->len == 0)
+        return out_stream_close(stream);
+
+    out_stream_t *spool = malloc(sizeof(out_stream_t));
+    if (spool == NULL)
+        return out_stream_close(stream);
+    *spool = *stream;
+
+    BOOL bool_rc = DuplicateHandle(
+        GetCurrentProcess(),
+        stream->h,
+        GetCurrentProcess(),
+        &spool->h,
+        0,
+        FALSE,
+        DUPLICATE_SAME_ACCESS
+    );
+    if (not bool_rc) {
+        free(spool);
+        return out_stream_close(stream);
+    }
+
+    HANDLE spool_thread_h = CreateThread(NULL, 0, spool_tproc, spool, 0,
+                                         NULL);
+    if (spool_thread_h == NULL) {
+        plat_close(spool->h);
+        free(spool);
+        return out_stream_close(stream);
+    }
+    CloseHandle(spool_thread_h); // the thread cleans up after itself
+
+    // The buffers belong to the spool now
+    stream->buf = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+    stream->bytes = NULL;
+    stream->cap_bytes = 0;
+    return TRUE;
+}
+
+
+
+/**
+ * out_stream_close
+ *
+ * Flushes the stream and frees its buffer. Doesn't close the HANDLE. A high
+ * surrogate still held back by write_utf8 never got its pair: it's written
+ * as U+FFFD rather than dropped. A spooled stream's buffer goes to a writer
+ * thread instead, which writes it and closes a duplicate of the HANDLE when
+ * it's done.
+ *
+ * Return Value: Returns TRUE on success, FALSE if the flush failed.
+ */
+BOOL out_stream_close(out_stream_t *stream) {
+
+    if (stream->is_spooled)
+        return spool_stream(stream);
+
+    BOOL bool_rc = out_stream_flush(stream);
+    if (bool_rc and stream->len > 0) {
+        stream->buf[0] = 0xFFFD;
+        bool_rc = write_utf8(stream);
+    }
+    free(stream->buf);
+    free(stream->bytes);
+    stream->buf = NULL;
+    stream->cap = 0;
+    stream->bytes = NULL;
+    stream->cap_bytes = 0;
+    return bool_rc;
+}
@@ -0,0 +1,86 @@
+
+/**
+ * out_stream.h
+ *
+ * out_stream_t struct defined here.
+ */
+
+
+
+#ifndef _OUT_STREAM_H
+#define _OUT_STREAM_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/* OUT_STREAM_INIT_CAP: Initial capacity (in WCHARs) of an out_stream buffer. */
+#define OUT_STREAM_INIT_CAP 4096
+
+/* OUT_STREAM_FLUSH_AT: Once this many WCHARs are buffered the stream is
+                        flushed before anything else is appended. */
+#define OUT_STREAM_FLUSH_AT 65536
+
+
+
+/**
+ * out_encoding_t
+ *
+ * Encoding used for text written to files and pipes. Consoles always get
+ * UTF-16 through WriteConsoleW.
+ */
+typedef enum _out_encoding {
+    OUT_ENC_UTF8,
+    OUT_ENC_UTF16
+} out_encoding_t;
+
+
+
+/**
+ * out_stream_t struct
+ *
+ * Buffered output stream used by builtins. Text is formatted into a growable
+ * buffer and written to the HANDLE with a single call on flush - WriteConsoleW
+ * for a console, WriteFile for files and pipes.
+ */
+typedef struct _out_stream {
+
+    /* h: HANDLE the stream writes to. */
+    HANDLE h;
+
+    /* is_console: Is h a console? Decides which write call is used. */
+    BOOL is_console;
+
+    /* encoding: Encoding written to h when it isn't a console. */
+    out_encoding_t encoding;
+
+    /* is_spooled: Is h spooled_out_h? Then nothing is written until close,
+                   which hands the buffer to a writer thread. */
+    BOOL is_spooled;
+
+    /* buf: Points to heap-allocated buffer of pending output. Not 
+            NULL-terminated. NULL until something is written. */
+    WCHAR *buf;
+
+    /* len: Number of WCHARs pending in buf. */
+    int32_t len;
+
+    /* cap: Capacity of buf in WCHARs. */
+    int32_t cap;
+
+    /* bytes: Points to heap-allocated scratch buffer that buf is transcoded
+              into on flush when encoding is OUT_ENC_UTF8. */
+    char *bytes;
+
+    /* cap_bytes: Capacity of bytes. */
+    int32_t cap_bytes;
+
+} out_stream_t;
+
+
+
+// ifndef _OUT_STREAM_H
+#endif
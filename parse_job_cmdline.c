@@ -52,6 +52,10 @@ static int32_t separate_procs(const WCHAR *job_cmdline,
         // Find start and end of proc cmdline
         proc_cmdline_p = skip_whitespace(job_cmdline_p);
         pipe_p = nonquoted_wcschr(proc_cmdline_p, L'|');
+        // ">|" is a redirection, not a pipe
+        while (pipe_p != NULL and pipe_p > proc_cmdline_p
+                and pipe_p[-1] == L'>')
+            pipe_p = nonquoted_wcschr(pipe_p + 1, L'|');
         // Set the start and length values
         out_proc_cmdlines[n_procs] = proc_cmdline_p;
         if (pipe_p != NULL) 
@@ -71,11 +75,72 @@ static int32_t separate_procs(const WCHAR *job_cmdline,
 
 
 
+/**
+ * set_here_input
+ * 
+ * Sets the given parsed process struct's here_data and len_here_data members
+ * for a "<<< text" here-string or a "<<TAG" here-document.
+ * 
+ * parsed_proc: parsed_process_t that already has cmd_line initialized.
+ * in_arrow_p: Points to the first L'<' of the redirection in cmd_line.
+ */
+static void set_here_input(parsed_process_t *parsed_proc, WCHAR *in_arrow_p) {
+
+    // "<<TAG": the body was collected when the line was read
+    if (in_arrow_p[2] != L'<') {
+        parsed_proc->here_data = here_doc_input;
+        parsed_proc->len_here_data = len_here_doc_input;
+        return;
+    }
+
+    // "<<< text": the text (unquoted) plus a newline. It stays in cmd_line,
+    // past the terminator that cuts the redirection off.
+    WCHAR *text_p = skip_whitespace(in_arrow_p + 3);
+    WCHAR *text_end = arg_end(text_p);
+    if (text_end == NULL)
+        text_end = text_p + wcslen(text_p);
+    if (*text_p == L'"') {
+        text_p++;
+        if (text_end > text_p and text_end[-1] == L'"')
+            text_end--;
+    }
+    *text_end = L'\n';
+    parsed_proc->here_data = text_p;
+    parsed_proc->len_here_data = (int32_t)(text_end - text_p) + 1;
+}
+
+
+
+/**
+ * copy_file_name
+ *
+ * Copies the file name of a redirection (the argument from start to end) 
+ * to file, without the double quotes around it. A name too long for file
+ * (MAX_PATH + 1 WCHARs) is left empty.
+ */
+static void copy_file_name(WCHAR *file, const WCHAR *start, 
+                           const WCHAR *end) {
+
+    if (end - start >= 2 and *start == L'"' and end[-1] == L'"') {
+        start++;
+        end--;
+    }
+    if (end - start > MAX_PATH) {
+        file[0] = L'\0';
+        return;
+    }
+    memcpy(file, start, (end - start) * sizeof(WCHAR));
+    file[end - start] = L'\0';
+}
+
+
+
 /**
  * set_file_redirection
  * 
- * Sets the given parsed process struct's in_file and out_file members
- * based on its command line.
+ * Sets the given parsed process struct's in_file, out_file, out_append and
+ * here_data members based on its command line. ">" and ">|" truncate the
+ * out file, ">>" appends to it.
  * Also adjusts the cmd_line member so that the string doesn't include the 
  * redirection arguments.
  * 
@@ -87,20 +152,24 @@ static void set_file_redirection(parsed_process_t *parsed_proc) {
     in_arrow_p = nonquoted_wcschr(parsed_proc->cmd_line, L'<');
     out_arrow_p = nonquoted_wcschr(parsed_proc->cmd_line, L'>');
 
-    if (in_arrow_p != NULL) {
+    parsed_proc->here_data = NULL;
+    parsed_proc->len_here_data = 0;
+    BOOL is_here_string = FALSE;
+
+    if (in_arrow_p != NULL and in_arrow_p[1] == L'<') {
+        set_here_input(parsed_proc, in_arrow_p);
+        is_here_string = in_arrow_p[2] == L'<';
+        parsed_proc->in_file[0] = L'\0';
+        *in_arrow_p = L'\0';
+    }
+    else if (in_arrow_p != NULL) {
         // Find and copy the file name
         WCHAR *in_file_p = skip_whitespace(in_arrow_p + 1);
         WCHAR *in_file_end = arg_end(in_file_p);
         if (in_file_end == NULL)
             parsed_proc->in_file[0] = L'\0';
-        else {
-            memcpy(
-                parsed_proc->in_file, 
-                in_file_p, 
-                sizeof(WCHAR) * (in_file_end - in_file_p)
-            );
-            parsed_proc->in_file[in_file_end - in_file_p] = L'\0';
-        }
+        else
+            copy_file_name(parsed_proc->in_file, in_file_p, in_file_end);
         // Add the new terminating character
         *in_arrow_p = L'\0';
     }
@@ -108,26 +177,42 @@ static void set_file_redirection(parsed_process_t *parsed_proc) {
         parsed_proc->in_file[0] = L'\0';
     }
 
+    parsed_proc->out_append = FALSE;
     if (out_arrow_p != NULL) {
         // Find and copy the out file name
-        WCHAR *out_file_p = skip_whitespace(out_arrow_p + 1);
+        WCHAR *out_file_p = out_arrow_p + 1;
+        if (*out_file_p == L'>') {
+            parsed_proc->out_append = TRUE;
+            out_file_p++;
+        }
+        else if (*out_file_p == L'|') {
+            out_file_p++;
+        }
+        out_file_p = skip_whitespace(out_file_p);
         WCHAR *out_file_end = arg_end(out_file_p);
         if (out_file_end == NULL)
             parsed_proc->out_file[0] = L'\0';
-        else {
-            memcpy(
-                parsed_proc->out_file,
-                out_file_p,
-                sizeof(WCHAR) * (out_file_end - out_file_p)
-            );
-            parsed_proc->out_file[out_file_end - out_file_p] = L'\0';
-        }
+        else
+            copy_file_name(parsed_proc->out_file, out_file_p, out_file_end);
         // Add the new terminating character
         *out_arrow_p = L'\0';
     }
     else {
         parsed_proc->out_file[0] = L'\0';
     }
+
+    // Move a here-string's text to the end of cmd_line, out of the way of
+    // glob expansion
+    if (is_here_string) {
+        WCHAR *tail_p = parsed_proc->cmd_line + MAX_CMDLINE + 1 
+                         - parsed_proc->len_here_data;
+        memmove(
+            tail_p, 
+            parsed_proc->here_data, 
+            parsed_proc->len_here_data * sizeof(WCHAR)
+        );
+        parsed_proc->here_data = tail_p;
+    }
 }
 
 
@@ -174,18 +259,22 @@ static BOOL is_foreground(WCHAR *job_cmdline) {
  * the processes.
  * 
  * job_cmdline: Job command line inputted by user.
+ * cwd: Working directory of the job (wildcards are matched in it).
  * out_n_procs: Number of processes to be spawned will be put here. This is 
  *              also the size of the returned array.
  * out_is_foreground: Whether this is a foreground job will be placed here.
  * 
- * Return Value: Returns a poitner to a heap-allocated array of parsed 
- *               processes.
+ * Return Value: Returns a pointer to an array of parsed processes. The array
+ *               is reused by the next call - don't free it.
  *               If an error occurs, NULL will be returned and one of these
  *               error codes will be placed in out_n_procs:
  *                - SPAWNJOB_EMPTY_PIPE
  *                - SPAWNJOB_EMPTY_CMDLINE
+ *                - SPAWNJOB_SYSCALL_FAILURE
+ *                - SPAWNJOB_CMDLINE_TOO_LONG
  */
 parsed_process_t *parse_job_cmdline(const WCHAR *job_cmdline,
+                                    const WCHAR *cwd,
                                     int32_t *out_n_procs,
                                     BOOL *out_is_foreground) {
 
@@ -207,8 +296,19 @@ parsed_process_t *parse_job_cmdline(const WCHAR *job_cmdline,
         return NULL;
     }
 
-    parsed_process_t *parsed_procs = 
-        malloc(sizeof(parsed_process_t) * n_procs);
+    // Reuse the scratch array from the last call (grow it if needed)
+    static parsed_process_t *parsed_procs = NULL;
+    static int32_t cap_parsed_procs = 0;
+    if (n_procs > cap_parsed_procs) {
+        parsed_process_t *new_parsed_procs = 
+            realloc(parsed_procs, sizeof(parsed_process_t) * n_procs);
+        if (new_parsed_procs == NULL) {
+            *out_n_procs = SPAWNJOB_SYSCALL_FAILURE;
+            return NULL;
+        }
+        parsed_procs = new_parsed_procs;
+        cap_parsed_procs = n_procs;
+    }
     
     for (int i = 0; i < n_procs; i++) {
 
@@ -262,6 +362,19 @@ parsed_process_t *parse_job_cmdline(const WCHAR *job_cmdline,
         // in_file and out_file
         set_file_redirection(parsed_proc);
 
+        // wildcards
+        int32_t cap_cmd_line = MAX_CMDLINE + 1;
+        if (parsed_proc->here_data != NULL 
+             and parsed_proc->here_data != here_doc_input)
+            cap_cmd_line = (int32_t)(parsed_proc->here_data 
+                                      - parsed_proc->cmd_line);
+        if (not expand_globs(parsed_proc->cmd_line, cap_cmd_line, cwd)) {
+            *out_n_procs = SPAWNJOB_CMDLINE_TOO_LONG;
+            return NULL;
+        }
+
+        parsed_proc->cwd = cwd;
+
         // pipe_input and pipe_output
         parsed_proc->pipe_input = i > 0;
         parsed_proc->pipe_output = i < n_procs - 1;
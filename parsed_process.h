@@ -11,6 +11,7 @@
 
 #include <windows.h>
 #include <WinDef.h>
+#include <inttypes.h>
 
 
 #ifndef MAX_CMDLINE
@@ -43,6 +44,23 @@ typedef struct _parsed_process {
                  name of the file. If not, this will be a zero-length string. */
     WCHAR out_file[MAX_PATH + 1];
 
+    /* out_append: Is out_file appended to (">>")? If not, it's truncated
+                   (">" or ">|"). */
+    bool out_append;
+
+    /* here_data: If stdin comes from a "<<< text" here-string or a "<<TAG"
+                  here-document, this points to the text to feed it (a
+                  here-string's text lives in cmd_line, after its
+                  terminator). NULL otherwise. */
+    const WCHAR *here_data;
+
+    /* len_here_data: Number of WCHARs in here_data. */
+    int32_t len_here_data;
+
+    /* cwd: Working directory the process runs in - shell_cwd itself, or
+           the directory of a "(cd DIR; cmd)" scope. */
+    const WCHAR *cwd;
+
     /* pipe_input: Is stdin piped from the previous process? */
     bool pipe_input;
 
@@ -53,4 +71,21 @@ typedef struct _parsed_process {
 
 
 
+/**
+ * stdio_handles struct
+ *
+ * Standard streams a builtin runs with, after I/O redirection.
+ */
+typedef struct _stdio_handles {
+
+    /* std_in, std_out, std_err: Where the builtin reads its input, writes
+                                 its output and writes its errors. */
+    HANDLE std_in;
+    HANDLE std_out;
+    HANDLE std_err;
+
+} stdio_handles_t;
+
+
+
 #endif
@@ -0,0 +1,226 @@
+
+/**
+ * pipe_relay.c
+ *
+ * Pipe edge relays for pipestat. With pipestat on, every pipe edge of a new
+ * job goes through the shell: a relay thread moves what the upstream stage
+ * writes on to the downstream stage (plat_relay_chunk - spliced from pipe
+ * to pipe on Linux), counting bytes and timing how long each side keeps it
+ * waiting. The extra hop isn't free, which is why pipestat starts off.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* RELAY_CHUNK: Most bytes moved by each plat_relay_chunk. Big enough that
+                the clock reads per chunk don't show. */
+#define RELAY_CHUNK (1 << 16)
+
+
+
+/* pipe_relay_enabled: Are pipe edges of new jobs relayed? Set by pipestat. */
+BOOL pipe_relay_enabled = FALSE;
+
+
+
+/**
+ * now_ticks
+ *
+ * Return Value: Returns the current QueryPerformanceCounter value.
+ */
+static LONG64 now_ticks() {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+
+
+/**
+ * release_relay
+ *
+ * Drops a reference to a relay and frees it once nobody holds one.
+ */
+static void release_relay(pipe_relay_t *relay) {
+    if (InterlockedDecrement(&relay->refs) == 0)
+        free(relay);
+}
+
+
+
+/**
+ * relay_tproc
+ *
+ * Copies the upstream pipe into the downstream pipe until the upstream stage
+ * is done writing or the downstream stage stops reading. Closing both ends
+ * afterwards gives the downstream stage EOF and the upstream stage a broken
+ * pipe, just like a direct pipe would.
+ *
+ * arg: The pipe_relay_t.
+ */
+static DWORD WINAPI relay_tproc(void *arg) {
+
+    pipe_relay_t *relay = arg;
+    BYTE buf[RELAY_CHUNK];
+    DWORD n_bytes;
+    int64_t read_wait, write_wait;
+
+    while (TRUE) {
+        BOOL ok = plat_relay_chunk(relay->in_h, relay->out_h, buf, 
+                                   RELAY_CHUNK, &n_bytes, &read_wait,
+                                   &write_wait);
+        InterlockedExchangeAdd64(&relay->read_wait, read_wait);
+        InterlockedExchangeAdd64(&relay->write_wait, write_wait);
+        InterlockedExchangeAdd64(&relay->bytes, n_bytes);
+        if (not ok or n_bytes == 0)
+            break; // downstream is gone, or upstream is done
+    }
+
+    plat_close(relay->in_h);
+    plat_close(relay->out_h);
+    InterlockedExchange64(&relay->finished_at, now_ticks());
+    release_relay(relay);
+    return 0;
+}
+
+
+
+/**
+ * start_pipe_relay
+ *
+ * Relays a pipe edge of a job through a new relay thread and adds the relay
+ * to job->relays.
+ *
+ * job: Job being spawned (job->relays has room for the edge).
+ * upstream_read_h: Private read end of the pipe the upstream stage writes
+ *                  to. Taken over by the relay on success.
+ * from, to: Application names of the upstream and downstream stages.
+ * out_downstream_read_h: Inheritable read end of the pipe for the downstream
+ *                        stage is placed here. Close it once the stage has
+ *                        been spawned.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (upstream_read_h
+ *               is left open).
+ */
+BOOL start_pipe_relay(job_t *job, HANDLE upstream_read_h, const WCHAR *from,
+                      const WCHAR *to, HANDLE *out_downstream_read_h) {
+
+    HANDLE downstream_read_h;
+
+    pipe_relay_t *relay = calloc(1, sizeof(pipe_relay_t));
+    if (relay == NULL) {
+        print_err(L"start_pipe_relay -> calloc");
+        return FALSE;
+    }
+    wcsncpy(relay->from, from, RELAY_NAME_CAP - 1);
+    wcsncpy(relay->to, to, RELAY_NAME_CAP - 1);
+
+    if (not plat_input_pipe(&downstream_read_h, &relay->out_h)) {
+        print_err(L"start_pipe_relay -> plat_input_pipe");
+        free(relay);
+        return FALSE;
+    }
+    relay->in_h = upstream_read_h;
+    relay->refs = 2;
+    relay->started_at = now_ticks();
+    relay->sampled_at = relay->started_at;
+
+    HANDLE relay_thread_h = CreateThread(NULL, 0, relay_tproc, relay, 0,
+                                         NULL);
+    if (relay_thread_h == NULL) {
+        print_err(L"start_pipe_relay -> CreateThread");
+        plat_close(downstream_read_h);
+        plat_close(relay->out_h);
+        free(relay);
+        return FALSE;
+    }
+    CloseHandle(relay_thread_h); // the thread cleans up after itself
+
+    job->relays[job->n_relays++] = relay;
+    *out_downstream_read_h = downstream_read_h;
+    return TRUE;
+}
+
+
+
+/**
+ * release_pipe_relays
+ *
+ * Drops the job's references to its relays. Relays that are still copying
+ * keep going until their pipes close.
+ *
+ * job: Job that's being done with.
+ */
+void release_pipe_relays(job_t *job) {
+
+    for (int32_t i = 0; i < job->n_relays; i++)
+        release_relay(job->relays[i]);
+    job->relays = NULL;
+    job->n_relays = 0;
+}
+
+
+
+/**
+ * write_pipe_stats
+ *
+ * Writes a line per relayed pipe edge of a job: bytes relayed, the rate
+ * since the last call and overall, and the share of time the relay waited
+ * on the upstream stage (slow to write) and on the downstream stage (slow to
+ * read - backpressure).
+ *
+ * stream: Where the lines go.
+ * job: Job whose edges are written.
+ */
+void write_pipe_stats(out_stream_t *stream, job_t *job) {
+
+    WCHAR line[256];
+    LARGE_INTEGER freq;
+
+    QueryPerformanceFrequency(&freq);
+    LONG64 now = now_ticks();
+
+    for (int32_t i = 0; i < job->n_relays; i++) {
+        pipe_relay_t *relay = job->relays[i];
+        LONG64 bytes = relay->bytes;
+        LONG64 finished_at = relay->finished_at;
+        LONG64 end = finished_at != 0 ? finished_at : now;
+
+        double elapsed = (double)(end - relay->started_at) / freq.QuadPart;
+        double since = (double)(end - relay->sampled_at) / freq.QuadPart;
+        double avg_rate = elapsed > 0 ? bytes / elapsed : 0;
+        double now_rate = since > 0 ? (bytes - relay->sampled_bytes) / since
+                                    : 0;
+        double span = (double)(end - relay->started_at);
+        double in_wait = span > 0 ? 100.0 * relay->read_wait / span : 0;
+        double out_wait = span > 0 ? 100.0 * relay->write_wait / span : 0;
+        relay->sampled_bytes = bytes;
+        relay->sampled_at = end;
+
+        int len = _snwprintf(
+            line,
+            256,
+            L"[%d] %ls -> %ls\t%lld bytes  %.1f KB/s now  %.1f KB/s avg"
+            L"  waiting on input %.0f%%  on output %.0f%%%ls\n",
+            job->jid,
+            relay->from,
+            relay->to,
+            (long long)bytes,
+            now_rate / 1024,
+            avg_rate / 1024,
+            in_wait,
+            out_wait,
+            finished_at != 0 ? L"  (done)" : L""
+        );
+        if (len > 0)
+            out_stream_write(stream, line, len);
+    }
+}
@@ -0,0 +1,74 @@
+
+/**
+ * pipe_relay.h
+ *
+ * pipe_relay_t struct defined here.
+ */
+
+
+
+#ifndef _PIPE_RELAY_H
+#define _PIPE_RELAY_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/* RELAY_NAME_CAP: Capacity in WCHARs of pipe_relay_t.from and .to. Longer
+                   names are cut off. */
+#define RELAY_NAME_CAP 32
+
+
+
+/**
+ * pipe_relay_t struct
+ *
+ * One pipe edge of a job spawned with pipestat on. The upstream stage writes
+ * into a pipe the shell reads, and a relay thread copies everything into the
+ * pipe the downstream stage reads, counting bytes and how long it waited on
+ * each side. Times are QueryPerformanceCounter ticks.
+ */
+typedef struct _pipe_relay {
+
+    /* refs: One for the job, one for the relay thread while it runs. Freed
+             when it drops to 0. */
+    volatile LONG refs;
+
+    /* in_h, out_h: Read end of the upstream pipe and write end of the
+                    downstream pipe. Owned by the relay thread. */
+    HANDLE in_h;
+    HANDLE out_h;
+
+    /* from, to: Application names of the upstream and downstream stages. */
+    WCHAR from[RELAY_NAME_CAP];
+    WCHAR to[RELAY_NAME_CAP];
+
+    /* bytes: Bytes relayed so far. */
+    volatile LONG64 bytes;
+
+    /* read_wait: Time spent waiting for the upstream stage to write. */
+    volatile LONG64 read_wait;
+
+    /* write_wait: Time spent waiting for the downstream stage to read
+                   (backpressure). */
+    volatile LONG64 write_wait;
+
+    /* started_at, finished_at: When the relay started and stopped (0 while
+                                it's running). */
+    LONG64 started_at;
+    volatile LONG64 finished_at;
+
+    /* sampled_bytes, sampled_at: bytes and time at the last pipestat, for
+                                  the current rate. */
+    LONG64 sampled_bytes;
+    LONG64 sampled_at;
+
+} pipe_relay_t;
+
+
+
+// ifndef _PIPE_RELAY_H
+#endif
@@ -0,0 +1,98 @@
+
+/**
+ * pipestat_builtin.c
+ */
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/**
+ * pipestat_err
+ *
+ * Writes a pipestat error message to stderr.
+ *
+ * Return Value: Returns TRUE on success. Returns FALSE on failure.
+ */
+static BOOL pipestat_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, message);
+    return out_stream_close(&err);
+}
+
+
+
+/**
+ * pipestat_builtin
+ *
+ * Per-edge throughput of pipelines.
+ *  - pipestat on     relays the pipe edges of jobs spawned from now on
+ *                    through the shell, so they can be measured
+ *  - pipestat off    spawns new jobs with direct pipes again
+ *  - pipestat %jid   shows bytes, rates and waits of each edge of job jid
+ *  - pipestat        shows them for every live job that has relays
+ * Off by default: a relayed edge costs a thread and an extra pipe hop (a 
+ * splice on Linux, a copy on Win32 - "winshell_bench relay" measures it).
+ *
+ * parsed_proc: Contains parsed information about the command line that
+ *              called this builtin.
+ * stdio: Standard streams after redirection - will output to std_out.
+ *
+ * Return Value: Returns TRUE on success, returns FALSE on failure.
+ */
+BOOL pipestat_builtin(parsed_process_t *parsed_proc,
+                      stdio_handles_t *stdio) {
+
+    out_stream_t out;
+
+    const WCHAR *arg_p = skip_whitespace(arg_end(
+        skip_whitespace(parsed_proc->cmd_line)
+    ));
+    const WCHAR *arg_end_p = arg_end(arg_p);
+
+    if (arg_end_p - arg_p == 2 and wcsncmp(arg_p, L"on", 2) == 0) {
+        pipe_relay_enabled = TRUE;
+        return TRUE;
+    }
+    if (arg_end_p - arg_p == 3 and wcsncmp(arg_p, L"off", 3) == 0) {
+        pipe_relay_enabled = FALSE;
+        return TRUE;
+    }
+
+    out_stream_init(&out, stdio->std_out);
+
+    if (*arg_p == L'\0') {
+        for (int32_t jid = live_jobs_head; jid >= 0;
+              jid = jobs[jid].next_live)
+            write_pipe_stats(&out, &jobs[jid]);
+    }
+    else {
+        if (*arg_p == L'%')
+            arg_p++;
+        int32_t jid = iswdigit(*arg_p) ? (int32_t)wcstol(arg_p, NULL, 10)
+                                       : -1;
+        if (jid < 0 or jid >= cap_jobs or job_status[jid] == GARBAGE) {
+            out_stream_close(&out);
+            pipestat_err(L"pipestat: usage: pipestat [on|off|%jid]\n");
+            return FALSE;
+        }
+        if (jobs[jid].n_relays == 0)
+            out_stream_puts(&out, L"pipestat: job wasn't spawned with "
+                                  L"pipestat on\n");
+        write_pipe_stats(&out, &jobs[jid]);
+    }
+
+    if (not out_stream_close(&out)) {
+        print_err(L"pipestat_builtin -> out_stream_close");
+        return FALSE;
+    }
+    return TRUE;
+}
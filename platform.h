@@ -0,0 +1,336 @@
+
+/**
+ * platform.h
+ *
+ * The platform layer: the handful of process primitives the job machinery
+ * needs - pipes, spawning, waiting for any of a set of waitables, 
+ * terminating and querying exit codes and times - and the events and 
+ * mutexes the reader thread and the spawner thread hand command lines over
+ * with. platform_win32.c implements it on Win32, platform_linux.c on Linux
+ * (file descriptors behind the HANDLEs of compat/windows.h, with processes
+ * as pidfds).
+ */
+
+
+
+#ifndef _PLATFORM_H
+#define _PLATFORM_H
+
+
+
+#include <inttypes.h>
+#include <windows.h>
+
+
+
+/* plat_handle_t: A process, a pipe end, a file, an event or a mutex. On
+                  Linux a HANDLE comes from the Win32 subset in compat/ and
+                  wraps a file descriptor. */
+typedef HANDLE plat_handle_t;
+
+#define PLAT_INVALID_HANDLE INVALID_HANDLE_VALUE
+
+
+
+/* PLAT_PATH_SEP: Separator the shell writes between path components (after
+                 a directory it completed). */
+#ifdef _WIN32
+#define PLAT_PATH_SEP L'\\'
+#else
+#define PLAT_PATH_SEP L'/'
+#endif
+
+/* PLAT_INFINITE: Timeout for plat_wait_any that never expires. */
+#define PLAT_INFINITE 0xFFFFFFFF
+
+/* PLAT_WAIT_TIMEOUT, PLAT_WAIT_FAILED: plat_wait_any return codes. */
+#define PLAT_WAIT_TIMEOUT -1
+#define PLAT_WAIT_FAILED -2
+
+
+
+/**
+ * plat_spawn_t struct
+ *
+ * What plat_spawn needs to start a process.
+ */
+typedef struct _plat_spawn {
+
+    /* application_name: Executable to run. */
+    const WCHAR *application_name;
+
+    /* cmd_line: Full command line, application name included (Windows 
+                 quoting rules). */
+    WCHAR *cmd_line;
+
+    /* std_in, std_out, std_err: Handles the child gets as its standard 
+                                 streams. Must be inheritable (see 
+                                 plat_make_inheritable). */
+    plat_handle_t std_in;
+    plat_handle_t std_out;
+    plat_handle_t std_err;
+
+    /* cwd: Absolute working directory of the process. The shell's own
+           current directory is never changed, so this is always given. */
+    const WCHAR *cwd;
+
+    /* new_group: Start the process in a new process group. */
+    BOOL new_group;
+
+} plat_spawn_t;
+
+
+
+/**
+ * plat_pipe
+ * 
+ * Creates a pipe whose read end stays private to the shell and whose write
+ * end can be passed to a child.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_pipe(plat_handle_t *out_read, plat_handle_t *out_write);
+
+
+
+/**
+ * plat_input_pipe
+ * 
+ * Creates a pipe whose read end can be passed to a child (as its stdin) and
+ * whose write end stays private to the shell.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_input_pipe(plat_handle_t *out_read, plat_handle_t *out_write);
+
+
+
+/**
+ * plat_relay_chunk
+ * 
+ * Moves the next chunk of a pipe on into another pipe, for a pipestat 
+ * relay: waits for the upstream pipe to have data, then for the downstream
+ * pipe to take it. On Linux the data is spliced from pipe to pipe in the
+ * kernel, without a trip through buf.
+ * 
+ * in, out: Upstream pipe's read end and downstream pipe's write end.
+ * buf, cap_buf: Scratch buffer the chunk can be copied through (at most 
+ *               cap_buf bytes are moved).
+ * out_bytes: Bytes moved are placed here - 0 once the upstream pipe is at
+ *            EOF.
+ * out_read_wait, out_write_wait: QueryPerformanceCounter ticks spent 
+ *                                waiting on each pipe are placed here.
+ * 
+ * Return Value: Returns TRUE on success (EOF included), FALSE on failure -
+ *               the downstream pipe's reader is gone, say. Bytes moved 
+ *               before a failure are still placed in out_bytes.
+ */
+BOOL plat_relay_chunk(plat_handle_t in, plat_handle_t out, BYTE *buf,
+                      DWORD cap_buf, DWORD *out_bytes, int64_t *out_read_wait,
+                      int64_t *out_write_wait);
+
+
+
+/**
+ * plat_make_inheritable
+ * 
+ * Turns a private handle into one that can be passed to a child. h is 
+ * closed (or reused) - only use the returned one afterwards.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure (h is left open).
+ */
+BOOL plat_make_inheritable(plat_handle_t h, plat_handle_t *out_h);
+
+
+
+/**
+ * plat_spawn
+ * 
+ * Starts a process.
+ * 
+ * spec: What to start and with which standard streams.
+ * out_proc: Handle of the new process is placed here. It's waitable with
+ *           plat_wait_any.
+ * out_pid: pid of the new process is placed here.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_spawn(const plat_spawn_t *spec, plat_handle_t *out_proc, 
+                DWORD *out_pid);
+
+
+
+/**
+ * plat_wait_any
+ * 
+ * Waits until any of the waitables (processes, threads, events, mutexes,
+ * timers or the console input) is signaled. A signaled auto-reset event is
+ * reset and a signaled mutex is taken by the wait that returns it.
+ * 
+ * waitables: Handles to wait on.
+ * n_waitables: Number of handles.
+ * timeout_ms: Longest time to wait, or PLAT_INFINITE.
+ * 
+ * Return Value: Returns the index of a signaled handle.
+ *               Returns PLAT_WAIT_TIMEOUT if none was signaled in time.
+ *               Returns PLAT_WAIT_FAILED on failure.
+ */
+int32_t plat_wait_any(const plat_handle_t *waitables, int32_t n_waitables,
+                      DWORD timeout_ms);
+
+
+
+/**
+ * plat_interrupt
+ * 
+ * Asks a process to exit: Ctrl+Break to the process group it leads on Win32
+ * (only call it for a process spawned with new_group), SIGTERM on Linux.
+ * Doesn't wait for it to exit.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_interrupt(plat_handle_t proc);
+
+
+
+/**
+ * plat_terminate
+ * 
+ * Forcibly terminates a process. Doesn't wait for it to exit.
+ * 
+ * exit_code: Exit code the process gets (where the platform allows it).
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_terminate(plat_handle_t proc, DWORD exit_code);
+
+
+
+/**
+ * plat_query_exit
+ * 
+ * Gets the exit code of a process that has exited. Should be called once per
+ * process, before it's closed (on Linux this collects the child).
+ * 
+ * out_exit_code: Exit code is placed here (128 + signal number for a Linux
+ *                process killed by a signal).
+ * 
+ * Return Value: Returns TRUE if the process has exited, FALSE if it's still
+ *               running or the query failed.
+ */
+BOOL plat_query_exit(plat_handle_t proc, DWORD *out_exit_code);
+
+
+
+/**
+ * plat_pid
+ * 
+ * Return Value: Returns the pid of a process, 0 on failure.
+ */
+DWORD plat_pid(plat_handle_t proc);
+
+
+
+/**
+ * plat_proc_times
+ * 
+ * Gets the times of a process or thread that has exited, in 100ns units. On
+ * Linux process times are only known after plat_query_exit collected it.
+ * 
+ * out_wall: Time from creation to exit is placed here.
+ * out_user: User mode CPU time is placed here.
+ * out_sys: Kernel mode CPU time is placed here.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_proc_times(plat_handle_t proc, uint64_t *out_wall, 
+                     uint64_t *out_user, uint64_t *out_sys);
+
+
+
+/**
+ * plat_event_create
+ * 
+ * Creates an unsignaled event, waitable with plat_wait_any.
+ * 
+ * manual_reset: TRUE if the event stays signaled until it's reset, FALSE if
+ *               a wait that sees it signaled resets it.
+ * 
+ * Return Value: Returns the event, NULL on failure.
+ */
+plat_handle_t plat_event_create(BOOL manual_reset);
+
+
+
+/**
+ * plat_event_set
+ * 
+ * Signals an event.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_event_set(plat_handle_t event);
+
+
+
+/**
+ * plat_mutex_create
+ * 
+ * Creates an unowned mutex. Unlike a CRITICAL_SECTION it can be waited on
+ * together with other handles by plat_wait_any, which takes it.
+ * 
+ * Return Value: Returns the mutex, NULL on failure.
+ */
+plat_handle_t plat_mutex_create(void);
+
+
+
+/**
+ * plat_mutex_lock
+ * 
+ * Waits until the mutex can be taken and takes it.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_mutex_lock(plat_handle_t mutex);
+
+
+
+/**
+ * plat_mutex_unlock
+ * 
+ * Releases a mutex taken by plat_mutex_lock or plat_wait_any.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_mutex_unlock(plat_handle_t mutex);
+
+
+
+/**
+ * plat_close
+ * 
+ * Closes a process, pipe, file, event or mutex handle.
+ */
+void plat_close(plat_handle_t h);
+
+
+
+/**
+ * plat_is_command
+ * 
+ * Tells whether a file found in a directory can be run as a command: on
+ * Win32 by its extension (.exe, .com, .bat, .cmd), on Linux by whether it's
+ * a regular file the shell may execute.
+ * 
+ * dir: Directory the file is in.
+ * name: Name of the file.
+ * 
+ * Return Value: Returns TRUE if it's a command.
+ */
+BOOL plat_is_command(const WCHAR *dir, const WCHAR *name);
+
+
+
+// ifndef _PLATFORM_H
+#endif
@@ -0,0 +1,682 @@
+
+/**
+ * platform_linux.c
+ *
+ * Linux implementation of the platform layer (see platform.h). HANDLEs are
+ * file descriptors entered in the handle table of compat/: processes are
+ * pidfds, events and mutexes eventfds, so that any of them can be waited on
+ * together. Children are started with posix_spawn.
+ */
+
+
+
+#ifdef __linux__
+
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "platform.h"
+#include "win32_compat.h"
+
+
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/* MAX_ARGV: Most arguments a spawned command line is split into. */
+#define MAX_ARGV 4096
+
+extern char **environ;
+
+
+
+/**
+ * encode_utf8
+ *
+ * Encodes a single code point as UTF-8.
+ *
+ * Return Value: Returns the number of bytes written to out (at most 4).
+ */
+static int encode_utf8(uint32_t cp, char *out) {
+
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | cp >> 12);
+        out[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | cp >> 18);
+    out[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+
+
+/**
+ * split_cmd_line
+ *
+ * Splits a command line into UTF-8 argv strings using the Windows rules:
+ * arguments are separated by whitespace, double quotes group, 2n 
+ * backslashes before a quote are n backslashes, 2n + 1 are n and a literal
+ * quote.
+ *
+ * out_buf: Receives the argument strings back to back. The caller frees it.
+ * argv: Receives pointers into out_buf, NULL-terminated.
+ *
+ * Return Value: Returns the number of arguments, -1 on failure.
+ */
+static int split_cmd_line(const WCHAR *cmd_line, char **out_buf, 
+                          char **argv) {
+
+    size_t len_cmd_line = wcslen(cmd_line);
+    char *buf = malloc(len_cmd_line * 4 + MAX_ARGV);
+    if (buf == NULL)
+        return -1;
+
+    char *buf_p = buf;
+    int argc = 0;
+    const WCHAR *p = cmd_line;
+    while (TRUE) {
+        while (*p == L' ' || *p == L'\t')
+            p++;
+        if (*p == L'\0' || argc == MAX_ARGV - 1)
+            break;
+
+        argv[argc++] = buf_p;
+        BOOL in_quotes = FALSE;
+        while (*p != L'\0' && (in_quotes || (*p != L' ' && *p != L'\t'))) {
+            if (*p == L'\\') {
+                size_t n_backslashes = 0;
+                while (*p == L'\\') {
+                    n_backslashes++;
+                    p++;
+                }
+                if (*p == L'"') {
+                    for (size_t i = 0; i < n_backslashes / 2; i++)
+                        *buf_p++ = '\\';
+                    if (n_backslashes % 2 == 1) {
+                        *buf_p++ = '"';
+                        p++;
+                    }
+                }
+                else {
+                    for (size_t i = 0; i < n_backslashes; i++)
+                        *buf_p++ = '\\';
+                }
+            }
+            else if (*p == L'"') {
+                in_quotes = !in_quotes;
+                p++;
+            }
+            else {
+                buf_p += encode_utf8((uint32_t)*p++, buf_p);
+            }
+        }
+        *buf_p++ = '\0';
+    }
+
+    argv[argc] = NULL;
+    *out_buf = buf;
+    return argc;
+}
+
+
+
+/**
+ * plat_pipe
+ * 
+ * Creates a pipe whose read end stays private to the shell and whose write
+ * end can be passed to a child.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_pipe(plat_handle_t *out_read, plat_handle_t *out_write) {
+
+    int fds[2];
+
+    // Both ends are O_CLOEXEC: plat_spawn dup2s the ones a child gets
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    *out_read = compat_wrap(fds[0], COMPAT_FILE);
+    *out_write = compat_wrap(fds[1], COMPAT_FILE);
+    if (*out_read == NULL || *out_write == NULL) {
+        if (*out_read != NULL)
+            CloseHandle(*out_read);
+        if (*out_write != NULL)
+            CloseHandle(*out_write);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * plat_input_pipe
+ * 
+ * Creates a pipe whose read end can be passed to a child (as its stdin) and
+ * whose write end stays private to the shell.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_input_pipe(plat_handle_t *out_read, plat_handle_t *out_write) {
+    return plat_pipe(out_read, out_write);
+}
+
+
+/**
+ * plat_relay_chunk
+ * 
+ * Moves the next chunk of a pipe on into another pipe, for a pipestat 
+ * relay: waits for the upstream pipe to have data, then for the downstream
+ * pipe to take it. On Linux the data is spliced from pipe to pipe in the
+ * kernel, without a trip through buf.
+ * 
+ * in, out: Upstream pipe's read end and downstream pipe's write end.
+ * buf, cap_buf: Scratch buffer the chunk can be copied through (at most 
+ *               cap_buf bytes are moved).
+ * out_bytes: Bytes moved are placed here - 0 once the upstream pipe is at
+ *            EOF.
+ * out_read_wait, out_write_wait: QueryPerformanceCounter ticks spent 
+ *                                waiting on each pipe are placed here.
+ * 
+ * Return Value: Returns TRUE on success (EOF included), FALSE on failure -
+ *               the downstream pipe's reader is gone, say. Bytes moved 
+ *               before a failure are still placed in out_bytes.
+ */
+BOOL plat_relay_chunk(plat_handle_t in, plat_handle_t out, BYTE *buf,
+                      DWORD cap_buf, DWORD *out_bytes, int64_t *out_read_wait,
+                      int64_t *out_write_wait) {
+
+    LARGE_INTEGER t0, t1, t2;
+    int in_fd = compat_fd(in), out_fd = compat_fd(out);
+    struct pollfd in_poll = { .fd = in_fd, .events = POLLIN };
+    ssize_t n;
+
+    *out_bytes = 0;
+    *out_write_wait = 0;
+
+    // Upstream: data, or EOF (POLLHUP) - splice tells which
+    QueryPerformanceCounter(&t0);
+    while (poll(&in_poll, 1, -1) < 0) {
+        if (errno != EINTR) {
+            compat_set_errno(errno);
+            return FALSE;
+        }
+    }
+    QueryPerformanceCounter(&t1);
+    *out_read_wait = t1.QuadPart - t0.QuadPart;
+
+    // Downstream: blocks only while its pipe is full
+    do {
+        n = splice(in_fd, NULL, out_fd, NULL, cap_buf, SPLICE_F_MOVE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EINVAL) {
+        // Not two pipes: copy through buf
+        DWORD bytes_read;
+        n = ReadFile(in, buf, cap_buf, &bytes_read, NULL) ? bytes_read : -1;
+        if (n > 0 && !WriteFile(out, buf, bytes_read, out_bytes, NULL))
+            n = -1;
+    }
+    else if (n < 0) {
+        compat_set_errno(errno);
+    }
+    else {
+        *out_bytes = (DWORD)n;
+    }
+    QueryPerformanceCounter(&t2);
+    *out_write_wait = t2.QuadPart - t1.QuadPart;
+    return n >= 0;
+}
+
+
+
+/**
+ * plat_make_inheritable
+ * 
+ * Turns a private handle into one that can be passed to a child. h is 
+ * closed (or reused) - only use the returned one afterwards.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure (h is left open).
+ */
+BOOL plat_make_inheritable(plat_handle_t h, plat_handle_t *out_h) {
+
+    // plat_spawn dup2s the child's standard streams, which clears O_CLOEXEC
+    *out_h = h;
+    return TRUE;
+}
+
+
+
+/**
+ * plat_spawn
+ * 
+ * Starts a process.
+ * 
+ * spec: What to start and with which standard streams.
+ * out_proc: Handle of the new process is placed here. It's waitable with
+ *           plat_wait_any.
+ * out_pid: pid of the new process is placed here.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_spawn(const plat_spawn_t *spec, plat_handle_t *out_proc, 
+                DWORD *out_pid) {
+
+    static char *argv[MAX_ARGV];
+    char *argv_buf, *app_buf, *cwd_buf;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid;
+
+    int in_fd = compat_fd(spec->std_in);
+    int out_fd = compat_fd(spec->std_out);
+    int err_fd = spec->std_err != NULL 
+                  ? compat_fd(spec->std_err) : STDERR_FILENO;
+
+    if (split_cmd_line(spec->cmd_line, &argv_buf, argv) <= 0)
+        return FALSE;
+    app_buf = compat_encode(spec->application_name);
+    cwd_buf = compat_encode(spec->cwd);
+    if (app_buf == NULL || cwd_buf == NULL) {
+        free(argv_buf);
+        free(app_buf);
+        free(cwd_buf);
+        return FALSE;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+    posix_spawn_file_actions_addchdir_np(&actions, cwd_buf);
+    posix_spawnattr_init(&attr);
+
+    // The shell ignores SIGPIPE; the child gets the default actions back
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+
+    // A process group other than the terminal's can't read the terminal
+    if (spec->new_group && !isatty(in_fd)) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    int rc = strchr(app_buf, '/') != NULL
+              ? posix_spawn(&pid, app_buf, &actions, &attr, argv, environ)
+              : posix_spawnp(&pid, app_buf, &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv_buf);
+    free(app_buf);
+    free(cwd_buf);
+    if (rc != 0) {
+        compat_set_errno(rc);
+        return FALSE;
+    }
+
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        compat_set_errno(errno);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return FALSE;
+    }
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+    HANDLE proc_h = compat_wrap(pidfd, COMPAT_PROCESS);
+    if (proc_h == NULL) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return FALSE;
+    }
+    compat_obj(proc_h)->started = compat_now();
+
+    *out_proc = proc_h;
+    *out_pid = (DWORD)pid;
+    return TRUE;
+}
+
+
+
+/**
+ * plat_wait_any
+ * 
+ * Waits until any of the waitables (processes, threads, events, mutexes,
+ * timers or the console input) is signaled. A signaled auto-reset event is
+ * reset and a signaled mutex is taken by the wait that returns it.
+ * 
+ * waitables: Handles to wait on.
+ * n_waitables: Number of handles.
+ * timeout_ms: Longest time to wait, or PLAT_INFINITE.
+ * 
+ * Return Value: Returns the index of a signaled handle.
+ *               Returns PLAT_WAIT_TIMEOUT if none was signaled in time.
+ *               Returns PLAT_WAIT_FAILED on failure.
+ */
+int32_t plat_wait_any(const plat_handle_t *waitables, int32_t n_waitables,
+                      DWORD timeout_ms) {
+
+    // The compat wait polls a few handles and uses the thread's epoll set
+    // for many; it also knows which kinds a wait has to reset or take
+    int32_t rc = compat_wait_any((DWORD)n_waitables, waitables, timeout_ms);
+    if (rc == COMPAT_WAIT_TIMEOUT)
+        return PLAT_WAIT_TIMEOUT;
+    if (rc == COMPAT_WAIT_FAILED)
+        return PLAT_WAIT_FAILED;
+    return rc;
+}
+
+
+
+/**
+ * plat_interrupt
+ * 
+ * Asks a process to exit: Ctrl+Break to the process group it leads on Win32
+ * (only call it for a process spawned with new_group), SIGTERM on Linux.
+ * Doesn't wait for it to exit.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_interrupt(plat_handle_t proc) {
+    return syscall(SYS_pidfd_send_signal, compat_fd(proc), SIGTERM, NULL, 
+                   0) == 0;
+}
+
+
+
+/**
+ * plat_terminate
+ * 
+ * Forcibly terminates a process. Doesn't wait for it to exit.
+ * 
+ * exit_code: Exit code the process gets (where the platform allows it).
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_terminate(plat_handle_t proc, DWORD exit_code) {
+    (void)exit_code; // a killed process reports 128 + SIGKILL
+    return syscall(SYS_pidfd_send_signal, compat_fd(proc), SIGKILL, NULL, 
+                   0) == 0;
+}
+
+
+
+/**
+ * timeval_to_100ns
+ *
+ * Return Value: Returns a timeval in 100ns units.
+ */
+static uint64_t timeval_to_100ns(struct timeval tv) {
+    return (uint64_t)tv.tv_sec * 10000000 + (uint64_t)tv.tv_usec * 10;
+}
+
+
+
+/**
+ * plat_query_exit
+ * 
+ * Gets the exit code of a process that has exited. Should be called once per
+ * process, before it's closed (on Linux this collects the child).
+ * 
+ * out_exit_code: Exit code is placed here (128 + signal number for a Linux
+ *                process killed by a signal).
+ * 
+ * Return Value: Returns TRUE if the process has exited, FALSE if it's still
+ *               running or the query failed.
+ */
+BOOL plat_query_exit(plat_handle_t proc, DWORD *out_exit_code) {
+
+    siginfo_t info;
+    struct rusage usage;
+
+    // The raw waitid also gives the child's resource usage (its times)
+    memset(&info, 0, sizeof(info));
+    memset(&usage, 0, sizeof(usage));
+    if (syscall(SYS_waitid, P_PIDFD, compat_fd(proc), &info, 
+                WEXITED | WNOHANG, &usage) != 0)
+        return FALSE;
+    if (info.si_pid == 0)
+        return FALSE;
+
+    compat_obj_t *obj = compat_obj(proc);
+    obj->ended = compat_now();
+    obj->user = timeval_to_100ns(usage.ru_utime);
+    obj->sys = timeval_to_100ns(usage.ru_stime);
+
+    if (info.si_code == CLD_EXITED)
+        *out_exit_code = (DWORD)info.si_status;
+    else
+        *out_exit_code = 128 + (DWORD)info.si_status;
+    return TRUE;
+}
+
+
+
+/**
+ * plat_pid
+ * 
+ * Return Value: Returns the pid of a process, 0 on failure.
+ */
+DWORD plat_pid(plat_handle_t proc) {
+
+    char path[64], line[128];
+    DWORD pid = 0;
+
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", compat_fd(proc));
+    FILE *fdinfo = fopen(path, "r");
+    if (fdinfo == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fdinfo) != NULL) {
+        if (strncmp(line, "Pid:", 4) == 0) {
+            pid = (DWORD)strtoul(line + 4, NULL, 10);
+            break;
+        }
+    }
+    fclose(fdinfo);
+    return pid;
+}
+
+
+
+/**
+ * plat_proc_times
+ * 
+ * Gets the times of a process or thread that has exited, in 100ns units. On
+ * Linux process times are only known after plat_query_exit collected it.
+ * 
+ * out_wall: Time from creation to exit is placed here.
+ * out_user: User mode CPU time is placed here.
+ * out_sys: Kernel mode CPU time is placed here.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_proc_times(plat_handle_t proc, uint64_t *out_wall, 
+                     uint64_t *out_user, uint64_t *out_sys) {
+
+    compat_obj_t *obj = compat_obj(proc);
+    if (obj == NULL)
+        return FALSE;
+
+    if (obj->kind == COMPAT_PROCESS && obj->ended != 0) {
+        *out_wall = obj->ended - obj->started;
+        *out_user = obj->user;
+        *out_sys = obj->sys;
+        return TRUE;
+    }
+    if (obj->kind == COMPAT_THREAD) {
+        compat_thread_t *thread = obj->thread;
+        if (__atomic_load_n(&thread->exit_code, __ATOMIC_ACQUIRE)
+             == STILL_ACTIVE)
+            return FALSE;
+        *out_wall = thread->ended - thread->started;
+        *out_user = thread->user;
+        *out_sys = thread->sys;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * plat_event_create
+ * 
+ * Creates an unsignaled event, waitable with plat_wait_any.
+ * 
+ * manual_reset: TRUE if the event stays signaled until it's reset, FALSE if
+ *               a wait that sees it signaled resets it.
+ * 
+ * Return Value: Returns the event, NULL on failure.
+ */
+plat_handle_t plat_event_create(BOOL manual_reset) {
+    return compat_wrap(
+        eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+        manual_reset ? COMPAT_EVENT : COMPAT_AUTO_EVENT
+    );
+}
+
+
+
+/**
+ * plat_event_set
+ * 
+ * Signals an event.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_event_set(plat_handle_t event) {
+
+    // Adds to the eventfd's count; a wait reads (resets) all of it at once
+    if (eventfd_write(compat_fd(event), 1) != 0 && errno != EAGAIN) {
+        compat_set_errno(errno);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * plat_mutex_create
+ * 
+ * Creates an unowned mutex. Unlike a CRITICAL_SECTION it can be waited on
+ * together with other handles by plat_wait_any, which takes it.
+ * 
+ * Return Value: Returns the mutex, NULL on failure.
+ */
+plat_handle_t plat_mutex_create(void) {
+
+    // A semaphore eventfd holding 1 while the mutex is free: a wait takes
+    // the 1, an unlock puts it back
+    return compat_wrap(
+        eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE),
+        COMPAT_MUTEX
+    );
+}
+
+
+
+/**
+ * plat_mutex_lock
+ * 
+ * Waits until the mutex can be taken and takes it.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_mutex_lock(plat_handle_t mutex) {
+    return plat_wait_any(&mutex, 1, PLAT_INFINITE) == 0;
+}
+
+
+
+/**
+ * plat_mutex_unlock
+ * 
+ * Releases a mutex taken by plat_mutex_lock or plat_wait_any.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_mutex_unlock(plat_handle_t mutex) {
+    return plat_event_set(mutex);
+}
+
+
+
+/**
+ * plat_close
+ * 
+ * Closes a process, pipe, file, event or mutex handle.
+ */
+void plat_close(plat_handle_t h) {
+    CloseHandle(h);
+}
+
+
+
+/**
+ * plat_is_command
+ * 
+ * Tells whether a file found in a directory can be run as a command: on
+ * Win32 by its extension (.exe, .com, .bat, .cmd), on Linux by whether it's
+ * a regular file the shell may execute.
+ * 
+ * dir: Directory the file is in.
+ * name: Name of the file.
+ * 
+ * Return Value: Returns TRUE if it's a command.
+ */
+BOOL plat_is_command(const WCHAR *dir, const WCHAR *name) {
+
+    WCHAR path[2 * (MAX_PATH + 1)];
+    struct stat st;
+
+    if (swprintf(path, 2 * (MAX_PATH + 1), L"%ls/%ls", dir, name) < 0)
+        return FALSE;
+    char *linux_path = compat_encode(path);
+    if (linux_path == NULL)
+        return FALSE;
+    BOOL is_command = stat(linux_path, &st) == 0 && S_ISREG(st.st_mode)
+                       && access(linux_path, X_OK) == 0;
+    free(linux_path);
+    return is_command;
+}
+
+
+
+// ifdef __linux__
+#endif
@@ -0,0 +1,478 @@
+
+/**
+ * platform_win32.c
+ *
+ * Win32 implementation of the platform layer (see platform.h).
+ */
+
+
+
+#ifdef _WIN32
+
+
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include "platform.h"
+
+
+
+/**
+ * plat_pipe
+ * 
+ * Creates a pipe whose read end stays private to the shell and whose write
+ * end can be passed to a child.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_pipe(plat_handle_t *out_read, plat_handle_t *out_write) {
+
+    BOOL bool_rc;
+    HANDLE my_read_pipe, my_write_pipe;
+
+    SECURITY_ATTRIBUTES pipe_sa = {
+        .nLength = sizeof(SECURITY_ATTRIBUTES),
+        .lpSecurityDescriptor = NULL,
+        .bInheritHandle = FALSE
+    };
+
+    bool_rc = CreatePipe(&my_read_pipe, &my_write_pipe, &pipe_sa, 0);
+    if (!bool_rc)
+        return FALSE;
+
+    HANDLE dup_write_pipe;
+    bool_rc = plat_make_inheritable(my_write_pipe, &dup_write_pipe);
+    if (!bool_rc) {
+        CloseHandle(my_read_pipe);
+        CloseHandle(my_write_pipe);
+        return FALSE;
+    }
+
+    *out_read = my_read_pipe;
+    *out_write = dup_write_pipe;
+    return TRUE;
+}
+
+
+
+/**
+ * plat_input_pipe
+ * 
+ * Creates a pipe whose read end can be passed to a child (as its stdin) and
+ * whose write end stays private to the shell.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_input_pipe(plat_handle_t *out_read, plat_handle_t *out_write) {
+
+    BOOL bool_rc;
+    HANDLE my_read_pipe, my_write_pipe;
+
+    SECURITY_ATTRIBUTES pipe_sa = {
+        .nLength = sizeof(SECURITY_ATTRIBUTES),
+        .lpSecurityDescriptor = NULL,
+        .bInheritHandle = FALSE
+    };
+
+    bool_rc = CreatePipe(&my_read_pipe, &my_write_pipe, &pipe_sa, 0);
+    if (!bool_rc)
+        return FALSE;
+
+    HANDLE dup_read_pipe;
+    bool_rc = plat_make_inheritable(my_read_pipe, &dup_read_pipe);
+    if (!bool_rc) {
+        CloseHandle(my_read_pipe);
+        CloseHandle(my_write_pipe);
+        return FALSE;
+    }
+
+    *out_read = dup_read_pipe;
+    *out_write = my_write_pipe;
+    return TRUE;
+}
+
+
+/**
+ * plat_relay_chunk
+ * 
+ * Moves the next chunk of a pipe on into another pipe, for a pipestat 
+ * relay: waits for the upstream pipe to have data, then for the downstream
+ * pipe to take it. On Linux the data is spliced from pipe to pipe in the
+ * kernel, without a trip through buf.
+ * 
+ * in, out: Upstream pipe's read end and downstream pipe's write end.
+ * buf, cap_buf: Scratch buffer the chunk can be copied through (at most 
+ *               cap_buf bytes are moved).
+ * out_bytes: Bytes moved are placed here - 0 once the upstream pipe is at
+ *            EOF.
+ * out_read_wait, out_write_wait: QueryPerformanceCounter ticks spent 
+ *                                waiting on each pipe are placed here.
+ * 
+ * Return Value: Returns TRUE on success (EOF included), FALSE on failure -
+ *               the downstream pipe's reader is gone, say. Bytes moved 
+ *               before a failure are still placed in out_bytes.
+ */
+BOOL plat_relay_chunk(plat_handle_t in, plat_handle_t out, BYTE *buf,
+                      DWORD cap_buf, DWORD *out_bytes, int64_t *out_read_wait,
+                      int64_t *out_write_wait) {
+
+    LARGE_INTEGER t0, t1, t2;
+    DWORD bytes_read, bytes_written;
+
+    *out_bytes = 0;
+    *out_write_wait = 0;
+    QueryPerformanceCounter(&t0);
+    BOOL read_ok = ReadFile(in, buf, cap_buf, &bytes_read, NULL);
+    QueryPerformanceCounter(&t1);
+    *out_read_wait = t1.QuadPart - t0.QuadPart;
+    if (!read_ok)
+        return GetLastError() == ERROR_BROKEN_PIPE; // upstream is done
+
+    while (*out_bytes < bytes_read) {
+        if (!WriteFile(out, buf + *out_bytes, bytes_read - *out_bytes,
+                       &bytes_written, NULL))
+            break; // ERROR_NO_DATA: downstream is gone
+        *out_bytes += bytes_written;
+    }
+    QueryPerformanceCounter(&t2);
+    *out_write_wait = t2.QuadPart - t1.QuadPart;
+    return *out_bytes == bytes_read;
+}
+
+
+
+/**
+ * plat_make_inheritable
+ * 
+ * Turns a private handle into one that can be passed to a child. h is 
+ * closed (or reused) - only use the returned one afterwards.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure (h is left open).
+ */
+BOOL plat_make_inheritable(plat_handle_t h, plat_handle_t *out_h) {
+    return DuplicateHandle(
+        GetCurrentProcess(),
+        h,
+        GetCurrentProcess(),
+        out_h,
+        0,
+        TRUE,
+        DUPLICATE_SAME_ACCESS | DUPLICATE_CLOSE_SOURCE // h will be closed
+    );
+}
+
+
+
+/**
+ * plat_spawn
+ * 
+ * Starts a process.
+ * 
+ * spec: What to start and with which standard streams.
+ * out_proc: Handle of the new process is placed here. It's waitable with
+ *           plat_wait_any.
+ * out_pid: pid of the new process is placed here.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_spawn(const plat_spawn_t *spec, plat_handle_t *out_proc, 
+                DWORD *out_pid) {
+
+    PROCESS_INFORMATION proc_info;
+    STARTUPINFO startup_info = {
+        .cb = sizeof(STARTUPINFO),
+        .dwFlags = STARTF_USESTDHANDLES,
+        .hStdInput = spec->std_in,
+        .hStdOutput = spec->std_out,
+        .hStdError = spec->std_err
+    };
+
+    DWORD dwCreationFlags = CREATE_UNICODE_ENVIRONMENT;
+    if (spec->new_group)
+        dwCreationFlags |= CREATE_NEW_PROCESS_GROUP;
+
+    BOOL bool_rc = CreateProcessW(
+        spec->application_name,
+        spec->cmd_line,
+        NULL,
+        NULL,
+        TRUE,
+        dwCreationFlags,
+        NULL, // envp,
+        spec->cwd,
+        &startup_info,
+        &proc_info
+    );
+    if (!bool_rc)
+        return FALSE;
+
+    CloseHandle(proc_info.hThread);
+    *out_proc = proc_info.hProcess;
+    *out_pid = proc_info.dwProcessId;
+    return TRUE;
+}
+
+
+
+/**
+ * plat_wait_any
+ * 
+ * Waits until any of the waitables (processes, threads, events, mutexes,
+ * timers or the console input) is signaled. A signaled auto-reset event is
+ * reset and a signaled mutex is taken by the wait that returns it.
+ * 
+ * waitables: Handles to wait on.
+ * n_waitables: Number of handles.
+ * timeout_ms: Longest time to wait, or PLAT_INFINITE.
+ * 
+ * Return Value: Returns the index of a signaled handle.
+ *               Returns PLAT_WAIT_TIMEOUT if none was signaled in time.
+ *               Returns PLAT_WAIT_FAILED on failure.
+ */
+int32_t plat_wait_any(const plat_handle_t *waitables, int32_t n_waitables,
+                      DWORD timeout_ms) {
+
+    DWORD dw_rc = WaitForMultipleObjects(
+        (DWORD)n_waitables,
+        waitables,
+        FALSE,
+        timeout_ms
+    );
+    if (dw_rc == WAIT_TIMEOUT)
+        return PLAT_WAIT_TIMEOUT;
+    if (dw_rc == WAIT_FAILED)
+        return PLAT_WAIT_FAILED;
+    if (dw_rc >= WAIT_ABANDONED_0)
+        return (int32_t)(dw_rc - WAIT_ABANDONED_0);
+    return (int32_t)(dw_rc - WAIT_OBJECT_0);
+}
+
+
+
+/**
+ * plat_interrupt
+ * 
+ * Asks a process to exit: Ctrl+Break to the process group it leads on Win32
+ * (only call it for a process spawned with new_group), SIGTERM on Linux.
+ * Doesn't wait for it to exit.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_interrupt(plat_handle_t proc) {
+    return GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, GetProcessId(proc));
+}
+
+
+
+/**
+ * plat_terminate
+ * 
+ * Forcibly terminates a process. Doesn't wait for it to exit.
+ * 
+ * exit_code: Exit code the process gets (where the platform allows it).
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_terminate(plat_handle_t proc, DWORD exit_code) {
+    return TerminateProcess(proc, exit_code);
+}
+
+
+
+/**
+ * plat_query_exit
+ * 
+ * Gets the exit code of a process that has exited. Should be called once per
+ * process, before it's closed (on Linux this collects the child).
+ * 
+ * out_exit_code: Exit code is placed here (128 + signal number for a Linux
+ *                process killed by a signal).
+ * 
+ * Return Value: Returns TRUE if the process has exited, FALSE if it's still
+ *               running or the query failed.
+ */
+BOOL plat_query_exit(plat_handle_t proc, DWORD *out_exit_code) {
+
+    DWORD exit_code;
+
+    if (WaitForSingleObject(proc, 0) != WAIT_OBJECT_0)
+        return FALSE;
+    if (!GetExitCodeProcess(proc, &exit_code))
+        return FALSE;
+    *out_exit_code = exit_code;
+    return TRUE;
+}
+
+
+
+/**
+ * plat_pid
+ * 
+ * Return Value: Returns the pid of a process, 0 on failure.
+ */
+DWORD plat_pid(plat_handle_t proc) {
+    return GetProcessId(proc);
+}
+
+
+
+/**
+ * filetime_to_u64
+ *
+ * Return Value: Returns a FILETIME as a number of 100ns units.
+ */
+static uint64_t filetime_to_u64(FILETIME ft) {
+    return ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+
+
+/**
+ * plat_proc_times
+ * 
+ * Gets the times of a process or thread that has exited, in 100ns units. On
+ * Linux process times are only known after plat_query_exit collected it.
+ * 
+ * out_wall: Time from creation to exit is placed here.
+ * out_user: User mode CPU time is placed here.
+ * out_sys: Kernel mode CPU time is placed here.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_proc_times(plat_handle_t proc, uint64_t *out_wall, 
+                     uint64_t *out_user, uint64_t *out_sys) {
+
+    FILETIME creation_ft, exit_ft, kernel_ft, user_ft;
+
+    // A thread HANDLE is an in-process stage
+    if (!GetProcessTimes(proc, &creation_ft, &exit_ft, &kernel_ft, &user_ft)
+         && !GetThreadTimes(proc, &creation_ft, &exit_ft, &kernel_ft, 
+                            &user_ft))
+        return FALSE;
+    *out_wall = filetime_to_u64(exit_ft) - filetime_to_u64(creation_ft);
+    *out_user = filetime_to_u64(user_ft);
+    *out_sys = filetime_to_u64(kernel_ft);
+    return TRUE;
+}
+
+
+
+/**
+ * plat_event_create
+ * 
+ * Creates an unsignaled event, waitable with plat_wait_any.
+ * 
+ * manual_reset: TRUE if the event stays signaled until it's reset, FALSE if
+ *               a wait that sees it signaled resets it.
+ * 
+ * Return Value: Returns the event, NULL on failure.
+ */
+plat_handle_t plat_event_create(BOOL manual_reset) {
+    return CreateEventW(NULL, manual_reset, FALSE, NULL);
+}
+
+
+
+/**
+ * plat_event_set
+ * 
+ * Signals an event.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_event_set(plat_handle_t event) {
+    return SetEvent(event);
+}
+
+
+
+/**
+ * plat_mutex_create
+ * 
+ * Creates an unowned mutex. Unlike a CRITICAL_SECTION it can be waited on
+ * together with other handles by plat_wait_any, which takes it.
+ * 
+ * Return Value: Returns the mutex, NULL on failure.
+ */
+plat_handle_t plat_mutex_create(void) {
+    return CreateMutexW(NULL, FALSE, NULL);
+}
+
+
+
+/**
+ * plat_mutex_lock
+ * 
+ * Waits until the mutex can be taken and takes it.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_mutex_lock(plat_handle_t mutex) {
+    return WaitForSingleObject(mutex, INFINITE) != WAIT_FAILED;
+}
+
+
+
+/**
+ * plat_mutex_unlock
+ * 
+ * Releases a mutex taken by plat_mutex_lock or plat_wait_any.
+ * 
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL plat_mutex_unlock(plat_handle_t mutex) {
+    return ReleaseMutex(mutex);
+}
+
+
+
+/**
+ * plat_close
+ * 
+ * Closes a process, pipe, file, event or mutex handle.
+ */
+void plat_close(plat_handle_t h) {
+    CloseHandle(h);
+}
+
+
+
+/**
+ * plat_is_command
+ * 
+ * Tells whether a file found in a directory can be run as a command: on
+ * Win32 by its extension (.exe, .com, .bat, .cmd), on Linux by whether it's
+ * a regular file the shell may execute.
+ * 
+ * dir: Directory the file is in.
+ * name: Name of the file.
+ * 
+ * Return Value: Returns TRUE if it's a command.
+ */
+BOOL plat_is_command(const WCHAR *dir, const WCHAR *name) {
+
+    static const WCHAR *exe_extensions[] = {
+        L".exe", L".com", L".bat", L".cmd"
+    };
+
+    (void)dir;
+    const WCHAR *dot_p = wcsrchr(name, L'.');
+    if (dot_p == NULL)
+        return FALSE;
+    for (int i = 0; i < sizeof(exe_extensions) / sizeof(*exe_extensions); i++) {
+        if (_wcsicmp(dot_p, exe_extensions[i]) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+
+// ifdef _WIN32
+#endif
@@ -6,32 +6,314 @@
 
 
 #include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "_winshell_private.h"
+
+
+
+/* ERR_CACHE_CAP: Number of slots in the error message cache. Must be a power 
+                  of two. */
+#define ERR_CACHE_CAP 64
+
+/* ERR_REPEAT_WINDOW_MS: An error identical to the previous one (same name and
+                         code) within this many milliseconds is counted 
+                         instead of printed. */
+#define ERR_REPEAT_WINDOW_MS 1000
+
+/* MAX_ERR_NAME: Longest err_name remembered for repeat detection. */
+#define MAX_ERR_NAME 128
 
 
 
 /**
- * print_err
+ * err_cache_entry_t
  * 
- * Prints err message to stderr based on GetLastError code.
+ * A FormatMessageW result for one error code.
  */
-void print_err(WCHAR *err_name) {
+typedef struct _err_cache_entry {
+    BOOL used;
+    DWORD code;
+    WCHAR *message; // LocalAlloc-ed by FormatMessageW, never freed
+    int32_t len_message;
+} err_cache_entry_t;
+
+
+
+/* print_err_jid: jid of the job this thread is spawning, printed with the 
+                  error. -1 when it isn't spawning one. Per thread: errors
+                  from the reader, capture, relay and stage threads must not
+                  pick up the shell thread's job. */
+THREAD_LOCAL int32_t print_err_jid = -1;
+
 
-    WCHAR *err_message;
-    HANDLE stderr_h = GetStdHandle(STD_ERROR_HANDLE);
 
-    size_t len_err_buf = FormatMessageW(
+/* err_lock: print_err can be called from the reader thread too. */
+static SRWLOCK err_lock = SRWLOCK_INIT;
+
+static err_cache_entry_t err_cache[ERR_CACHE_CAP];
+
+/* err_stream: Reused for every error so that its buffer is only allocated 
+               once. */
+static out_stream_t err_stream;
+static BOOL err_stream_ready = FALSE;
+
+/* Last error printed, for rate limiting. */
+static WCHAR last_name[MAX_ERR_NAME + 1];
+static DWORD last_code;
+static ULONGLONG last_tick;
+static int32_t n_repeats = 0;
+
+/* repeats_e: Set when repeats start being counted, to wake the flusher 
+              thread. Created with the thread, on the first repeat. */
+static HANDLE repeats_e = NULL;
+
+
+
+/**
+ * lookup_message
+ * 
+ * Finds the message for an error code in the cache, calling FormatMessageW 
+ * and caching the result on a miss. Trailing "\r\n" is stripped.
+ * 
+ * out_len_message: Length of the returned message is placed here.
+ * 
+ * Return Value: Returns the message. Returns a fixed string if FormatMessageW
+ *               fails.
+ */
+static const WCHAR *lookup_message(DWORD code, int32_t *out_len_message) {
+
+    uint32_t i = (code * 2654435761u) & (ERR_CACHE_CAP - 1);
+    uint32_t n_probes;
+
+    for (n_probes = 0; n_probes < ERR_CACHE_CAP; n_probes++) {
+        err_cache_entry_t *entry = &err_cache[i];
+        if (!entry->used)
+            break;
+        if (entry->code == code) {
+            *out_len_message = entry->len_message;
+            return entry->message;
+        }
+        i = (i + 1) & (ERR_CACHE_CAP - 1);
+    }
+
+    WCHAR *message;
+    DWORD len_message = FormatMessageW(
         FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM
          | FORMAT_MESSAGE_IGNORE_INSERTS,
         NULL,
-        GetLastError(),
+        code,
         MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-        (LPWSTR)&err_message,
+        (LPWSTR)&message,
         0,
         NULL
     );
+    if (len_message == 0) {
+        *out_len_message = (int32_t)wcslen(L"Unknown error");
+        return L"Unknown error";
+    }
+    while (len_message > 0 
+            && (message[len_message - 1] == L'\n' 
+                 || message[len_message - 1] == L'\r')) {
+        len_message--;
+    }
+
+    // Cache is full: leak nothing, just don't cache
+    if (n_probes == ERR_CACHE_CAP) {
+        static WCHAR uncached[512];
+        if (len_message > 511)
+            len_message = 511;
+        memcpy(uncached, message, len_message * sizeof(WCHAR));
+        LocalFree(message);
+        *out_len_message = (int32_t)len_message;
+        return uncached;
+    }
+
+    err_cache[i].used = TRUE;
+    err_cache[i].code = code;
+    err_cache[i].message = message;
+    err_cache[i].len_message = (int32_t)len_message;
+    *out_len_message = (int32_t)len_message;
+    return message;
+}
+
+
+
+/**
+ * write_repeats
+ * 
+ * Appends the "repeated N times" summary for the last error to err_stream 
+ * and resets the count.
+ */
+static void write_repeats() {
+
+    WCHAR summary[64];
+
+    if (n_repeats == 0)
+        return;
+    int len_summary = _snwprintf(
+        summary,
+        64,
+        L"  (last error repeated %d times)\n",
+        n_repeats
+    );
+    out_stream_write(&err_stream, summary, len_summary);
+    n_repeats = 0;
+}
+
+
+
+/**
+ * repeats_flusher_tproc
+ * 
+ * Writes the "repeated N times" summary once the repeat window of the last
+ * printed error closes, so that a failure storm that stops isn't left 
+ * unreported until the next error or exit.
+ */
+static DWORD WINAPI repeats_flusher_tproc(void *arg) {
+
+    while (TRUE) {
+        WaitForSingleObject(repeats_e, INFINITE);
+        AcquireSRWLockExclusive(&err_lock);
+        while (n_repeats > 0) {
+            ULONGLONG due = last_tick + ERR_REPEAT_WINDOW_MS;
+            ULONGLONG now = GetTickCount64();
+            if (now >= due) {
+                write_repeats();
+                out_stream_flush(&err_stream);
+                break;
+            }
+            ReleaseSRWLockExclusive(&err_lock);
+            Sleep((DWORD)(due - now));
+            AcquireSRWLockExclusive(&err_lock);
+        }
+        ReleaseSRWLockExclusive(&err_lock);
+    }
+    return 0;
+}
+
+
+
+/**
+ * count_repeat
+ * 
+ * Counts a repeat of the last error and makes sure the flusher thread will 
+ * report it. Called with err_lock held.
+ */
+static void count_repeat() {
+
+    if (n_repeats++ > 0)
+        return;
+    if (repeats_e == NULL) {
+        repeats_e = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (repeats_e == NULL)
+            return;
+        HANDLE flusher_h = CreateThread(NULL, 0, repeats_flusher_tproc, NULL,
+                                        0, NULL);
+        if (flusher_h == NULL) {
+            CloseHandle(repeats_e);
+            repeats_e = NULL;
+            return;
+        }
+        CloseHandle(flusher_h);
+    }
+    SetEvent(repeats_e);
+}
+
+
+
+/**
+ * print_err
+ * 
+ * Prints err message to stderr based on GetLastError code.
+ * Each error is a single write: "[hh:mm:ss.mmm] [jid N] err_name: message".
+ * Messages are cached per error code, and an error identical to the previous
+ * one within ERR_REPEAT_WINDOW_MS is only counted. The count is printed when
+ * the window closes.
+ * 
+ * err_name: Describes where the error happened.
+ */
+void print_err(const WCHAR *err_name) {
+
+    DWORD code = GetLastError();
+    ULONGLONG now = GetTickCount64();
+
+    AcquireSRWLockExclusive(&err_lock);
+
+    if (!err_stream_ready) {
+        out_stream_init(&err_stream, GetStdHandle(STD_ERROR_HANDLE));
+        err_stream_ready = TRUE;
+    }
+
+    // Same error again: just count it
+    if (code == last_code 
+         && now - last_tick < ERR_REPEAT_WINDOW_MS
+         && wcsncmp(err_name, last_name, MAX_ERR_NAME) == 0) {
+        count_repeat();
+        ReleaseSRWLockExclusive(&err_lock);
+        SetLastError(code);
+        return;
+    }
+    write_repeats();
+
+    // Timestamp and jid
+    SYSTEMTIME st;
+    WCHAR header[64];
+    GetLocalTime(&st);
+    int len_header;
+    if (print_err_jid >= 0) {
+        len_header = _snwprintf(
+            header, 
+            64, 
+            L"[%02u:%02u:%02u.%03u] [jid %d] ",
+            st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+            print_err_jid
+        );
+    }
+    else {
+        len_header = _snwprintf(
+            header, 
+            64, 
+            L"[%02u:%02u:%02u.%03u] ",
+            st.wHour, st.wMinute, st.wSecond, st.wMilliseconds
+        );
+    }
+
+    int32_t len_message;
+    const WCHAR *message = lookup_message(code, &len_message);
+
+    out_stream_write(&err_stream, header, len_header);
+    out_stream_puts(&err_stream, err_name);
+    out_stream_write(&err_stream, L": ", 2);
+    out_stream_write(&err_stream, message, len_message);
+    out_stream_write(&err_stream, L"\n", 1);
+    out_stream_flush(&err_stream);
+
+    wcsncpy(last_name, err_name, MAX_ERR_NAME);
+    last_code = code;
+    last_tick = now;
+
+    ReleaseSRWLockExclusive(&err_lock);
+
+    // Callers may still look at GetLastError
+    SetLastError(code);
+}
+
+
+
+/**
+ * print_err_summary
+ * 
+ * Prints the "repeated N times" summary for the last error if any repeats 
+ * were suppressed. Called before the shell exits.
+ */
+void print_err_summary() {
 
-    WriteFile(stderr_h, err_name, wcslen(err_name) * sizeof(WCHAR), NULL, NULL);
-    WriteFile(stderr_h, L": ", wcslen(L": ") * sizeof(WCHAR), NULL, NULL);
-    WriteFile(stderr_h, err_message, len_err_buf * sizeof(WCHAR), NULL, NULL);
-    LocalFree(err_message);
+    AcquireSRWLockExclusive(&err_lock);
+    if (err_stream_ready && n_repeats > 0) {
+        write_repeats();
+        out_stream_flush(&err_stream);
+    }
+    ReleaseSRWLockExclusive(&err_lock);
 }
@@ -6,6 +6,8 @@
 
 
 #include <windows.h>
+#include <string.h>
+#include <wchar.h>
 #include <iso646.h>
 #include "_winshell_private.h"
 
@@ -14,59 +16,34 @@
 /**
  * pwd_builtin
  * 
- * Prints the current working directory.
+ * Prints the working directory of the job it's part of.
  * 
  * parsed_proc: Contains information parsed from the command that called this
- *              builtin. Not used.
- * startup_info: Contains redirection info. Output is written to hStdOutput.
+ *              builtin. Its cwd is printed.
+ * stdio: Standard streams after redirection. Output is written to std_out.
  *
  * Return Value: Returns TRUE on success. Returns FALSE on failure.
  */
 BOOL pwd_builtin(parsed_process_t *parsed_proc, 
-                 STARTUPINFO *startup_info) {
+                 stdio_handles_t *stdio) {
 
     DWORD dw_rc;
     BOOL bool_rc;
     WCHAR pwd[MAX_PATH + 2]; // 1 for '\n', 1 for '\0'
     
-    dw_rc = GetCurrentDirectoryW(MAX_PATH + 1, pwd);
-    if (dw_rc == 0) {
-        print_err(L"pwd_builtin -> GetCurrentDirectory");
-        return FALSE;
-    }
+    dw_rc = (DWORD)wcslen(parsed_proc->cwd);
+    memcpy(pwd, parsed_proc->cwd, dw_rc * sizeof(WCHAR));
     pwd[dw_rc] = L'\n';
     pwd[dw_rc + 1] = L'\0'; 
 
-    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (stdout_h == INVALID_HANDLE_VALUE) {
-        print_err(L"pwd_builtin -> GetStdHandle");
+    out_stream_t out;
+    out_stream_init(&out, stdio->std_out);
+    out_stream_write(&out, pwd, (int32_t)(dw_rc + 1));
+    bool_rc = out_stream_close(&out);
+    if (not bool_rc) {
+        print_err(L"pwd_builtin -> out_stream_close");
         return FALSE;
     }
 
-    if (stdout_h == startup_info->hStdOutput) { // no redirection, output to stdout
-        bool_rc = WriteConsoleW(
-            stdout_h, 
-            pwd,
-            wcslen(pwd),
-            NULL,
-            NULL
-        );
-        if (not bool_rc) {
-            print_err(L"pwd_builtin -> WriteConsoleW");
-            return FALSE;
-        }
-    }
-    else {
-        bool_rc = WriteFile(
-            startup_info->hStdOutput,
-            pwd,
-            wcslen(pwd) * sizeof(WCHAR),
-            NULL,
-            NULL
-        );
-        if (not bool_rc) {
-            print_err(L"pwd_builtin -> WriteFile");
-            return FALSE;
-        }
-    }
-}
\ No newline at end of file
+    return TRUE;
+}
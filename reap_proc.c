@@ -15,7 +15,8 @@
  * 
  * Called when a process just terminates to remove it from the job management
  * structures.
- * Cleans up the job_t struct and its resources if this was its last process.
+ * Moves the job to the completion history (freeing its slot) if this was its
+ * last process.
  * 
  * proc_h: HANDLE of the process that just terminated.
  * 
@@ -25,35 +26,44 @@ BOOL reap_proc(HANDLE proc_h) {
 
     BOOL bool_rc;
 
-    CloseHandle(proc_h);
     bool_rc = handle_arr_remove(wait_handles, &n_wait_handles, proc_h);
-    if (!bool_rc)
+    if (!bool_rc) {
+        stage_close(proc_h);
         return FALSE;
+    }
 
-    job_t *job = NULL;
-    for (int jobs_i = 0; jobs_i < MAX_JOBS; jobs_i++) {
+    int32_t jid;
+    for (jid = live_jobs_head; jid >= 0; jid = jobs[jid].next_live) {
 
-        job_t *curr_job = &jobs[jobs_i];
-        if (curr_job->status != RUNNING)
+        if (job_status[jid] != RUNNING)
             continue;
 
-        if (handle_arr_remove(curr_job->proc_hs, 
-                              &curr_job->n_procs_alive, 
+        if (handle_arr_remove(jobs[jid].proc_hs, 
+                              &job_n_procs_alive[jid], 
                               proc_h)) {
-            job = curr_job;
             break;
         }
     }
 
-    if (job == NULL)
+    if (jid < 0) {
+        stage_close(proc_h);
         return FALSE;
+    }
 
-    if (job->n_procs_alive == 0) {
-        // Note: We still need cmdline for jobs call, we will free these in
-        //       jobs_builtin.
-        // free(job->proc_hs);
-        // free(job->cmdline);
-        job->status = TERMINATED;
+    DWORD exit_code;
+    if (stage_query_exit(proc_h, &exit_code) 
+         && proc_h == jobs[jid].last_proc_h) {
+        jobs[jid].exit_code = exit_code;
+    }
+    capture_stage_times(&jobs[jid], proc_h);
+    STAT_ADD(STAT_PROCS_REAPED, 1);
+    stage_close(proc_h);
+
+    if (job_n_procs_alive[jid] == 0) {
+        if (jobs[jid].stage_times != NULL) {
+            report_job_times(&jobs[jid]);
+        }
+        record_completion(jid);
     }
 
     return TRUE;
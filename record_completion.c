@@ -0,0 +1,44 @@
+
+/**
+ * record_completion.c
+ */
+
+
+
+#include <windows.h>
+#include "_winshell_private.h"
+
+
+
+/**
+ * record_completion
+ * 
+ * Moves a job whose processes have all exited (or that was killed) into the
+ * completion history (overwriting the oldest record once it's full) and
+ * frees its slot. The record takes over the job's arena.
+ * 
+ * jid: jid of the job.
+ */
+void record_completion(int32_t jid) {
+
+    job_t *job = &jobs[jid];
+    completion_t *record = &completions[n_completions % COMPLETIONS_CAP];
+
+    job_arena_release(record->arena);
+    release_pipe_relays(job);
+
+    record->jid = jid;
+    record->arena = job->arena;
+    record->cmdline = job->cmdline;
+    record->len_cmdline = job->len_cmdline;
+    record->exit_code = job->exit_code;
+    record->was_terminated = job_status[jid] == TERMINATED;
+    record->started_at = job->started_at;
+    record->finished_at = GetTickCount64();
+    n_completions++;
+
+    job->arena = NULL;
+    job->proc_hs = NULL;
+    job->cmdline = NULL;
+    release_job(jid);
+}
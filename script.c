@@ -0,0 +1,1880 @@
+
+/**
+ * script.c
+ *
+ * Control flow, variables, functions and aliases. Every top-level statement
+ * is compiled once, together with the lines of its blocks, into a chunk of
+ * ir_node_t that a small VM then runs. The VM stops whenever it starts a
+ * foreground job and carries on from the next node once the job is done, so
+ * the shell loop goes on reaping and reading while a script runs.
+ *
+ * Statements end at a newline or a non-quoted ';':
+ *   NAME=value
+ *   for NAME [in words...]; do ...; done
+ *   while cmd; do ...; done
+ *   if cmd; then ...; elif cmd; then ...; else ...; fi
+ *   function NAME { ... }          NAME() { ... }
+ *   break, continue, return [n]
+ *   alias [NAME=value], unalias NAME
+ *   (cd DIR; cmd)                  cmd runs in DIR, the shell stays put
+ * $NAME, ${NAME}, $1..$9, $#, $@ and $? are expanded in all of them - in a
+ * command line, quoted so that a value is only split into words. An
+ * assignment or for-loop runs its $(...) right away. Lines starting with 
+ * '#' are comments.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* SCRIPT_MAX_BLOCKS: Deepest nesting of blocks while compiling. */
+#define SCRIPT_MAX_BLOCKS 64
+
+/* SCRIPT_LOOP_SLOTS: Most for-loops nested inside one function. */
+#define SCRIPT_LOOP_SLOTS 16
+
+/* SCRIPT_MAX_CALLS: Deepest nesting of function calls. */
+#define SCRIPT_MAX_CALLS 128
+
+/* ALIAS_MAX_DEPTH: Most aliases expanded into each other for one command. */
+#define ALIAS_MAX_DEPTH 16
+
+/* VAR_NAME_CAP: Longest variable name looked up in the environment. */
+#define VAR_NAME_CAP 255
+
+
+
+/**
+ * name_table_t struct
+ *
+ * Open-addressing hash table from names to values (variables, aliases,
+ * functions). Names are never removed - an unset name keeps its slot with a
+ * NULL value.
+ */
+typedef struct _name_table {
+    WCHAR **names;
+    void **values;
+    int32_t n_names;
+    int32_t cap;
+} name_table_t;
+
+
+
+/**
+ * block_t struct
+ *
+ * A block that's being compiled.
+ */
+typedef enum _block_kind {
+    BLOCK_FOR,
+    BLOCK_WHILE,
+    BLOCK_IF,
+    BLOCK_FUNC
+} block_kind_t;
+
+typedef enum _block_part {
+    PART_HEAD,  // condition, for header, or function waiting for its '{'
+    PART_BODY,
+    PART_ELSE
+} block_part_t;
+
+typedef struct _block {
+
+    block_kind_t kind;
+    block_part_t part;
+
+    /* top: Where continue jumps to, or the IR_FUNC_DEF node. */
+    int32_t top;
+
+    /* branch: IR_BRANCH_FALSE or IR_FOR_NEXT waiting for its target. -1 if
+               there's none. */
+    int32_t branch;
+
+    /* exits: IR_JUMPs to the end of the block (break, end of an if branch),
+              chained through their target members. -1 if there are none. */
+    int32_t exits;
+
+    /* depth: for-loop slot. */
+    int32_t depth;
+
+} block_t;
+
+
+
+/**
+ * loop_slot_t struct
+ *
+ * Words a for-loop goes through.
+ */
+typedef struct _loop_slot {
+    WCHAR *words;   // NULL-terminated words back to back (heap-allocated)
+    WCHAR *next;    // next word
+    int32_t n_left;
+} loop_slot_t;
+
+
+
+/**
+ * frame_t struct
+ *
+ * A chunk or function that's running.
+ */
+typedef struct _frame {
+
+    /* chunk, pc, end: Nodes [pc, end) of chunk are left to run. */
+    script_chunk_t *chunk;
+    int32_t pc;
+    int32_t end;
+
+    /* args, n_args: $1, $2, ... back to back (heap-allocated). NULL if
+                     there are none. */
+    WCHAR *args;
+    int32_t n_args;
+
+    /* loops: for-loop slots. */
+    loop_slot_t loops[SCRIPT_LOOP_SLOTS];
+
+} frame_t;
+
+
+
+/* vars, aliases, funcs: Shell variables (WCHAR *), aliases (WCHAR *) and
+                         functions (script_func_t *). */
+static name_table_t vars, aliases, funcs;
+
+/* funcs_gen: Bumped whenever a function is defined, so that the function
+              cached in a command node is looked up again. */
+static uint32_t funcs_gen = 1;
+
+/* compiling: Chunk the lines are being compiled into. NULL between
+              statements. */
+static script_chunk_t *compiling = NULL;
+
+/* blocks, n_blocks: Blocks still open in the chunk being compiled. */
+static block_t blocks[SCRIPT_MAX_BLOCKS];
+static int32_t n_blocks = 0;
+
+/* frames, n_frames: Call stack of the VM. Empty when it's idle. */
+static frame_t frames[SCRIPT_MAX_CALLS];
+static int32_t n_frames = 0;
+
+/* last_status: Status of the last command ($?). 0 is success. */
+static DWORD last_status = 0;
+
+/* waiting_for_job: Is the VM stopped on a foreground job? */
+static BOOL waiting_for_job = FALSE;
+
+/* line_buf, expand_buf, words_buf, subst_buf: Scratch command lines. */
+static WCHAR line_buf[MAX_CMDLINE + 1];
+static WCHAR expand_buf[MAX_CMDLINE + 1];
+static WCHAR words_buf[MAX_CMDLINE + 1];
+static WCHAR subst_buf[MAX_CMDLINE + 1];
+
+
+
+/**
+ * script_err
+ *
+ * Writes "script: <message>\n" to stderr.
+ *
+ * Return Value: Returns FALSE, so that it can end a failing function.
+ */
+static BOOL script_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, L"script: ");
+    out_stream_puts(&err, message);
+    out_stream_puts(&err, L"\n");
+    out_stream_close(&err);
+    return FALSE;
+}
+
+
+
+/**
+ * dup_range
+ *
+ * Return Value: Returns a heap-allocated NULL-terminated copy of len_str
+ *               WCHARs of str. Returns NULL on failure.
+ */
+static WCHAR *dup_range(const WCHAR *str, int32_t len_str) {
+
+    WCHAR *copy = malloc((len_str + 1) * sizeof(WCHAR));
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, str, len_str * sizeof(WCHAR));
+    copy[len_str] = L'\0';
+    return copy;
+}
+
+
+
+/**
+ * is_name
+ *
+ * Return Value: Returns TRUE if the len_str WCHARs of str are a valid
+ *               variable or function name.
+ */
+static BOOL is_name(const WCHAR *str, int32_t len_str) {
+
+    if (len_str == 0 or not (iswalpha(str[0]) or str[0] == L'_'))
+        return FALSE;
+    for (int32_t i = 1; i < len_str; i++) {
+        if (not (iswalnum(str[i]) or str[i] == L'_'))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * unquote
+ *
+ * Return Value: Returns the length of the len_str WCHARs at str once a pair
+ *               of double quotes around all of them is dropped (*in_out_str
+ *               is moved past the opening quote).
+ */
+static int32_t unquote(const WCHAR **in_out_str, int32_t len_str) {
+
+    const WCHAR *str = *in_out_str;
+    if (len_str >= 2 and str[0] == L'"' and str[len_str - 1] == L'"') {
+        (*in_out_str)++;
+        return len_str - 2;
+    }
+    return len_str;
+}
+
+
+
+/**
+ * value_end
+ *
+ * Return Value: Returns a pointer to the end of an assignment's value (the
+ *               first whitespace that isn't quoted or inside a $(...)), 
+ *               NULL if a quote or parenthesis isn't closed.
+ */
+static const WCHAR *value_end(const WCHAR *value) {
+
+    BOOL in_quotes = FALSE;
+    int32_t paren_depth = 0;
+
+    const WCHAR *p = value;
+    for (; *p != L'\0'; p++) {
+        if (*p == L'\\' and p[1] == L'"') {
+            p++;
+        }
+        else if (*p == L'"') {
+            in_quotes = not in_quotes;
+        }
+        else if (in_quotes) {
+            continue;
+        }
+        else if (*p == L'(') {
+            paren_depth++;
+        }
+        else if (*p == L')' and paren_depth > 0) {
+            paren_depth--;
+        }
+        else if (iswspace(*p) and paren_depth == 0) {
+            break;
+        }
+    }
+    return in_quotes or paren_depth > 0 ? NULL : p;
+}
+
+
+
+/**
+ * hash_name
+ *
+ * Return Value: Returns the FNV-1a hash of a name.
+ */
+static uint32_t hash_name(const WCHAR *name, int32_t len_name) {
+
+    uint32_t hash = 2166136261u;
+    for (int32_t i = 0; i < len_name; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+
+/**
+ * table_slot
+ *
+ * Finds the value slot of a name in a name_table_t.
+ *
+ * table: Table to search.
+ * name, len_name: Name to look for (need not be NULL-terminated).
+ * create: Add the name (with a NULL value) if it isn't there yet?
+ *
+ * Return Value: Returns a pointer to the name's value. Returns NULL if the
+ *               name isn't there (and create is FALSE, or it couldn't be
+ *               added).
+ */
+static void **table_slot(name_table_t *table, const WCHAR *name,
+                         int32_t len_name, BOOL create) {
+
+    if (create and 2 * (table->n_names + 1) > table->cap) {
+        int32_t new_cap = table->cap ? 2 * table->cap : 16;
+        WCHAR **new_names = calloc(new_cap, sizeof(WCHAR *));
+        void **new_values = calloc(new_cap, sizeof(void *));
+        if (new_names == NULL or new_values == NULL) {
+            free(new_names);
+            free(new_values);
+            return NULL;
+        }
+        for (int32_t i = 0; i < table->cap; i++) {
+            if (table->names[i] == NULL)
+                continue;
+            uint32_t j = hash_name(table->names[i],
+                                   (int32_t)wcslen(table->names[i]));
+            j &= new_cap - 1;
+            while (new_names[j] != NULL)
+                j = (j + 1) & (new_cap - 1);
+            new_names[j] = table->names[i];
+            new_values[j] = table->values[i];
+        }
+        free(table->names);
+        free(table->values);
+        table->names = new_names;
+        table->values = new_values;
+        table->cap = new_cap;
+    }
+    if (table->cap == 0)
+        return NULL;
+
+    uint32_t i = hash_name(name, len_name) & (table->cap - 1);
+    while (table->names[i] != NULL) {
+        if (wcsncmp(table->names[i], name, len_name) == 0
+             and table->names[i][len_name] == L'\0')
+            return &table->values[i];
+        i = (i + 1) & (table->cap - 1);
+    }
+    if (not create)
+        return NULL;
+
+    table->names[i] = dup_range(name, len_name);
+    if (table->names[i] == NULL)
+        return NULL;
+    table->values[i] = NULL;
+    table->n_names++;
+    return &table->values[i];
+}
+
+
+
+/**
+ * release_chunk
+ *
+ * Drops a reference to a chunk and frees it once nobody holds one.
+ */
+static void release_chunk(script_chunk_t *chunk) {
+
+    if (--chunk->refs > 0)
+        return;
+    for (int32_t i = 0; i < chunk->n_nodes; i++) {
+        free(chunk->nodes[i].name);
+        free(chunk->nodes[i].text);
+        free(chunk->nodes[i].dir);
+        free(chunk->nodes[i].outer_redirs);
+        free(chunk->nodes[i].here_doc);
+    }
+    free(chunk->nodes);
+    free(chunk);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Compiler
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+/**
+ * emit
+ *
+ * Appends a node to the chunk being compiled.
+ *
+ * Return Value: Returns the index of the new node, -1 on failure.
+ */
+static int32_t emit(ir_op_t op) {
+
+    script_chunk_t *chunk = compiling;
+    if (chunk->n_nodes == chunk->cap_nodes) {
+        int32_t new_cap = chunk->cap_nodes ? 2 * chunk->cap_nodes : 8;
+        ir_node_t *new_nodes = realloc(chunk->nodes,
+                                       new_cap * sizeof(ir_node_t));
+        if (new_nodes == NULL) {
+            script_err(L"out of memory");
+            return -1;
+        }
+        chunk->nodes = new_nodes;
+        chunk->cap_nodes = new_cap;
+    }
+    ir_node_t *node = &chunk->nodes[chunk->n_nodes];
+    memset(node, 0, sizeof(ir_node_t));
+    node->op = op;
+    node->target = -1;
+    return chunk->n_nodes++;
+}
+
+
+
+/**
+ * emit_text
+ *
+ * Appends a node with a name and a text (either can be NULL) to the chunk
+ * being compiled.
+ *
+ * Return Value: Returns the index of the new node, -1 on failure.
+ */
+static int32_t emit_text(ir_op_t op, const WCHAR *name, int32_t len_name,
+                         const WCHAR *text, int32_t len_text) {
+
+    int32_t node_i = emit(op);
+    if (node_i < 0)
+        return -1;
+    ir_node_t *node = &compiling->nodes[node_i];
+    if (name != NULL)
+        node->name = dup_range(name, len_name);
+    if (text != NULL) {
+        node->text = dup_range(text, len_text);
+        node->has_vars = node->text != NULL
+                          and wcschr(node->text, L'$') != NULL;
+    }
+    if ((name != NULL and node->name == NULL)
+         or (text != NULL and node->text == NULL)) {
+        script_err(L"out of memory");
+        return -1;
+    }
+    return node_i;
+}
+
+
+
+/**
+ * patch_exits
+ *
+ * Points a chain of IR_JUMPs (linked through their targets) at target.
+ */
+static void patch_exits(int32_t exits, int32_t target) {
+
+    while (exits >= 0) {
+        int32_t next = compiling->nodes[exits].target;
+        compiling->nodes[exits].target = target;
+        exits = next;
+    }
+}
+
+
+
+/**
+ * push_block
+ *
+ * Return Value: Returns the new innermost block, NULL if too deep.
+ */
+static block_t *push_block(block_kind_t kind, int32_t top) {
+
+    if (n_blocks == SCRIPT_MAX_BLOCKS) {
+        script_err(L"blocks nested too deep");
+        return NULL;
+    }
+    block_t *block = &blocks[n_blocks++];
+    block->kind = kind;
+    block->part = PART_HEAD;
+    block->top = top;
+    block->branch = -1;
+    block->exits = -1;
+    block->depth = 0;
+    return block;
+}
+
+
+
+/**
+ * innermost_block
+ *
+ * Finds the innermost open block of one of two kinds, not looking past the
+ * function being compiled.
+ *
+ * Return Value: Returns the block, NULL if there's none.
+ */
+static block_t *innermost_block(block_kind_t kind1, block_kind_t kind2) {
+
+    for (int32_t i = n_blocks - 1; i >= 0; i--) {
+        if (blocks[i].kind == kind1 or blocks[i].kind == kind2)
+            return &blocks[i];
+        if (blocks[i].kind == BLOCK_FUNC)
+            break;
+    }
+    return NULL;
+}
+
+
+
+/**
+ * in_function
+ *
+ * Return Value: Returns TRUE if a function body is being compiled.
+ */
+static BOOL in_function() {
+
+    for (int32_t i = 0; i < n_blocks; i++) {
+        if (blocks[i].kind == BLOCK_FUNC)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+
+/**
+ * compile_command
+ *
+ * Compiles a command into an IR_CMD node, expanding aliases of its first
+ * word. If the line it's on had a here-document, the node gets a copy of 
+ * the body - the line after it is read before the node runs when it's in a
+ * block.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL compile_command(const WCHAR *cmd) {
+
+    // expanded: Aliases expanded so far - each is expanded once at most
+    const WCHAR *expanded[ALIAS_MAX_DEPTH];
+    int32_t n_expanded = 0;
+
+    while (n_expanded < ALIAS_MAX_DEPTH) {
+        const WCHAR *word_end = arg_end(cmd);
+        if (word_end == NULL)
+            break;
+        int32_t len_word = (int32_t)(word_end - cmd);
+        void **slot = table_slot(&aliases, cmd, len_word, FALSE);
+        if (slot == NULL or *slot == NULL)
+            break;
+        const WCHAR *name = aliases.names[slot - aliases.values];
+        BOOL is_expanded = FALSE;
+        for (int32_t i = 0; i < n_expanded; i++)
+            is_expanded = is_expanded or expanded[i] == name;
+        if (is_expanded)
+            break; // alias ls="ls -l" doesn't expand ls again
+        expanded[n_expanded++] = name;
+
+        const WCHAR *value = *slot;
+        WCHAR *buf = cmd == expand_buf ? words_buf : expand_buf;
+        int32_t len_value = (int32_t)wcslen(value);
+        int32_t len_rest = (int32_t)wcslen(word_end);
+        if (len_value + len_rest > MAX_CMDLINE)
+            return script_err(L"command too long after alias expansion");
+        memmove(buf + len_value, word_end, (len_rest + 1) * sizeof(WCHAR));
+        memcpy(buf, value, len_value * sizeof(WCHAR));
+        cmd = buf;
+    }
+
+    int32_t node_i = emit_text(IR_CMD, NULL, 0, cmd, (int32_t)wcslen(cmd));
+    if (node_i < 0)
+        return FALSE;
+
+    if (len_here_doc_body >= 0 and wcsstr(cmd, L"<<") != NULL) {
+        ir_node_t *node = &compiling->nodes[node_i];
+        node->here_doc = dup_range(here_doc_body != NULL ? here_doc_body 
+                                                         : L"",
+                                   len_here_doc_body);
+        if (node->here_doc == NULL)
+            return script_err(L"out of memory");
+        node->len_here_doc = len_here_doc_body;
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * compile_for
+ *
+ * Compiles "for NAME [in words...]" (rest is what follows "for").
+ */
+static BOOL compile_for(const WCHAR *rest) {
+
+    const WCHAR *name_end = arg_end(rest);
+    if (name_end == NULL or not is_name(rest, (int32_t)(name_end - rest)))
+        return script_err(L"for: bad variable name");
+
+    const WCHAR *words = skip_whitespace(name_end);
+    const WCHAR *in_end = arg_end(words);
+    if (*words == L'\0') {
+        words = L"$@";
+    }
+    else if (in_end - words == 2 and wcsncmp(words, L"in", 2) == 0) {
+        words = skip_whitespace(in_end);
+    }
+    else {
+        return script_err(L"for: expected \"in\"");
+    }
+
+    int32_t depth = 0;
+    for (int32_t i = n_blocks - 1; i >= 0 and blocks[i].kind != BLOCK_FUNC;
+          i--) {
+        if (blocks[i].kind == BLOCK_FOR)
+            depth++;
+    }
+    if (depth == SCRIPT_LOOP_SLOTS)
+        return script_err(L"for: loops nested too deep");
+
+    int32_t init_i = emit_text(IR_FOR_INIT, NULL, 0, words,
+                               (int32_t)wcslen(words));
+    if (init_i < 0)
+        return FALSE;
+    int32_t next_i = emit_text(IR_FOR_NEXT, rest, (int32_t)(name_end - rest),
+                               NULL, 0);
+    if (next_i < 0)
+        return FALSE;
+    compiling->nodes[init_i].depth = depth;
+    compiling->nodes[next_i].depth = depth;
+
+    block_t *block = push_block(BLOCK_FOR, next_i);
+    if (block == NULL)
+        return FALSE;
+    block->branch = next_i;
+    block->depth = depth;
+    return TRUE;
+}
+
+
+
+static BOOL compile_statement(const WCHAR *stmt);
+static WCHAR *split_statement(WCHAR *line);
+
+
+
+/**
+ * compile_function
+ *
+ * Compiles the head of a function definition, "NAME" followed by an
+ * optional "()" and '{'.
+ */
+static BOOL compile_function(const WCHAR *name, int32_t len_name,
+                             const WCHAR *rest) {
+
+    if (not is_name(name, len_name))
+        return script_err(L"function: bad function name");
+    if (in_function())
+        return script_err(L"function: functions can't be nested");
+
+    int32_t def_i = emit_text(IR_FUNC_DEF, name, len_name, NULL, 0);
+    if (def_i < 0)
+        return FALSE;
+    block_t *block = push_block(BLOCK_FUNC, def_i);
+    if (block == NULL)
+        return FALSE;
+
+    rest = skip_whitespace(rest);
+    if (wcsncmp(rest, L"()", 2) == 0)
+        rest = skip_whitespace(rest + 2);
+    if (*rest == L'{') {
+        block->part = PART_BODY;
+        return compile_statement(skip_whitespace(rest + 1));
+    }
+    if (*rest != L'\0')
+        return script_err(L"function: expected '{'");
+    return TRUE;
+}
+
+
+
+/**
+ * compile_alias
+ *
+ * Compiles "alias [NAME=value]" (rest is what follows "alias").
+ */
+static BOOL compile_alias(const WCHAR *rest) {
+
+    if (*rest == L'\0')
+        return emit(IR_ALIAS) >= 0;
+
+    const WCHAR *eq_p = wcschr(rest, L'=');
+    if (eq_p == NULL or eq_p == rest)
+        return script_err(L"alias: usage: alias [name=value]");
+    const WCHAR *value = eq_p + 1;
+    int32_t len_value = unquote(&value, (int32_t)wcslen(value));
+    return emit_text(IR_ALIAS, rest, (int32_t)(eq_p - rest),
+                     value, len_value) >= 0;
+}
+
+
+
+/**
+ * keyword_is
+ *
+ * Return Value: Returns TRUE if the len_word WCHARs of word are keyword.
+ */
+static BOOL keyword_is(const WCHAR *word, int32_t len_word,
+                       const WCHAR *keyword) {
+    return len_word == (int32_t)wcslen(keyword)
+            and wcsncmp(word, keyword, len_word) == 0;
+}
+
+
+
+/**
+ * compile_scope
+ *
+ * Compiles "(cd DIR; cmd) [&]" (stmt starts with the '(') into an IR_CMD
+ * whose job runs in DIR, leaving the shell's directory alone. "(cmd)" is
+ * just cmd. Text after the ')' goes on the end of cmd - for a scope with a
+ * DIR, when it runs, so that its redirections open files in the shell's 
+ * directory (a here-document or here-string goes on right away).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL compile_scope(const WCHAR *stmt) {
+
+    // Find the ')' closing the scope
+    const WCHAR *close_p = NULL;
+    BOOL in_quotes = FALSE;
+    int32_t depth = 0;
+    for (const WCHAR *p = stmt; *p != L'\0' and close_p == NULL; p++) {
+        if (*p == L'\\' and p[1] == L'"')
+            p++;
+        else if (*p == L'"')
+            in_quotes = not in_quotes;
+        else if (in_quotes)
+            continue;
+        else if (*p == L'(')
+            depth++;
+        else if (*p == L')' and --depth == 0)
+            close_p = p;
+    }
+    if (close_p == NULL)
+        return script_err(L"missing \")\"");
+
+    const WCHAR *inner = skip_whitespace(stmt + 1);
+    const WCHAR *tail = skip_whitespace(close_p + 1);
+    int32_t len_inner = (int32_t)(close_p - inner);
+    int32_t len_tail = (int32_t)wcslen(tail);
+    if (len_inner + 1 + len_tail > MAX_CMDLINE)
+        return script_err(L"command too long");
+    memcpy(words_buf, inner, len_inner * sizeof(WCHAR));
+    words_buf[len_inner] = L'\0';
+
+    // "cd DIR;" up front
+    const WCHAR *dir = NULL;
+    int32_t len_dir = 0;
+    WCHAR *cmd = words_buf;
+    const WCHAR *word_end = arg_end(cmd);
+    if (word_end != NULL
+         and keyword_is(cmd, (int32_t)(word_end - cmd), L"cd")) {
+        dir = skip_whitespace(word_end);
+        const WCHAR *dir_end = arg_end(dir);
+        if (dir_end == NULL or dir_end == dir)
+            return script_err(L"(cd): usage: (cd DIR; cmd)");
+        const WCHAR *semi_p = nonquoted_wcschr(dir, L';');
+        if (semi_p != NULL and semi_p < dir_end)
+            dir_end = semi_p; // "cd DIR;cmd"
+        if (dir_end == dir)
+            return script_err(L"(cd): usage: (cd DIR; cmd)");
+        len_dir = unquote(&dir, (int32_t)(dir_end - dir));
+        cmd = (WCHAR *)skip_whitespace(dir_end);
+        if (*cmd == L';')
+            cmd = (WCHAR *)skip_whitespace(cmd + 1);
+        else if (*cmd != L'\0')
+            return script_err(L"(cd): usage: (cd DIR; cmd)");
+    }
+    if (split_statement(cmd) != NULL)
+        return script_err(L"only \"(cd DIR; cmd)\" scopes are supported");
+    if (*cmd == L'\0')
+        return TRUE; // "(cd DIR)" runs nothing
+
+    // cmd, then whatever followed the ')'
+    BOOL is_outer_tail = dir != NULL and len_tail > 0
+                          and wcsstr(tail, L"<<") == NULL;
+    int32_t len_cmd = (int32_t)wcslen(cmd);
+    while (len_cmd > 0 and iswspace(cmd[len_cmd - 1]))
+        len_cmd--;
+    if (len_tail > 0 and not is_outer_tail) {
+        cmd[len_cmd++] = L' ';
+        memcpy(cmd + len_cmd, tail, len_tail * sizeof(WCHAR));
+        len_cmd += len_tail;
+    }
+    cmd[len_cmd] = L'\0';
+
+    if (not compile_command(cmd))
+        return FALSE;
+    if (dir != NULL) {
+        ir_node_t *node = &compiling->nodes[compiling->n_nodes - 1];
+        node->dir = dup_range(dir, len_dir);
+        if (node->dir == NULL)
+            return script_err(L"out of memory");
+        if (is_outer_tail) {
+            node->outer_redirs = dup_range(tail, len_tail);
+            if (node->outer_redirs == NULL)
+                return script_err(L"out of memory");
+        }
+    }
+    return TRUE;
+}
+
+
+
+/**
+ * compile_statement
+ *
+ * Compiles one statement into the chunk being compiled, opening and closing
+ * blocks as it goes.
+ *
+ * stmt: Statement, without leading whitespace or the ';' ending it.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (the error was
+ *               reported).
+ */
+static BOOL compile_statement(const WCHAR *stmt) {
+
+    if (*stmt == L'\0')
+        return TRUE;
+
+    const WCHAR *word_end = arg_end(stmt);
+    if (word_end == NULL)
+        return compile_command(stmt); // unclosed quotes: let the job fail
+    int32_t len_word = (int32_t)(word_end - stmt);
+    const WCHAR *rest = skip_whitespace(word_end);
+    block_t *top = n_blocks > 0 ? &blocks[n_blocks - 1] : NULL;
+
+    // ---------- Block keywords ----------
+
+    if (keyword_is(stmt, len_word, L"do")) {
+        if (top == NULL or top->part != PART_HEAD
+             or (top->kind != BLOCK_FOR and top->kind != BLOCK_WHILE))
+            return script_err(L"unexpected \"do\"");
+        if (top->kind == BLOCK_WHILE) {
+            if (compiling->n_nodes == top->top)
+                return script_err(L"while: missing condition");
+            top->branch = emit(IR_BRANCH_FALSE);
+            if (top->branch < 0)
+                return FALSE;
+        }
+        top->part = PART_BODY;
+        return compile_statement(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"then")) {
+        if (top == NULL or top->kind != BLOCK_IF or top->part != PART_HEAD)
+            return script_err(L"unexpected \"then\"");
+        if (compiling->n_nodes == top->top)
+            return script_err(L"if: missing condition");
+        top->branch = emit(IR_BRANCH_FALSE);
+        if (top->branch < 0)
+            return FALSE;
+        top->part = PART_BODY;
+        return compile_statement(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"done")) {
+        if (top == NULL or top->part != PART_BODY
+             or (top->kind != BLOCK_FOR and top->kind != BLOCK_WHILE))
+            return script_err(L"unexpected \"done\"");
+        if (*rest != L'\0')
+            return script_err(L"unexpected text after \"done\"");
+        int32_t jump_i = emit(IR_JUMP);
+        if (jump_i < 0)
+            return FALSE;
+        compiling->nodes[jump_i].target = top->top;
+        compiling->nodes[top->branch].target = compiling->n_nodes;
+        patch_exits(top->exits, compiling->n_nodes);
+        n_blocks--;
+        return TRUE;
+    }
+
+    if (keyword_is(stmt, len_word, L"elif")
+         or keyword_is(stmt, len_word, L"else")) {
+        if (top == NULL or top->kind != BLOCK_IF or top->part != PART_BODY)
+            return script_err(stmt[2] == L'i' ? L"unexpected \"elif\""
+                                              : L"unexpected \"else\"");
+        int32_t jump_i = emit(IR_JUMP);
+        if (jump_i < 0)
+            return FALSE;
+        compiling->nodes[jump_i].target = top->exits;
+        top->exits = jump_i;
+        compiling->nodes[top->branch].target = compiling->n_nodes;
+        top->branch = -1;
+        if (stmt[2] == L'i') {
+            top->part = PART_HEAD;
+            top->top = compiling->n_nodes;
+        }
+        else {
+            top->part = PART_ELSE;
+        }
+        return compile_statement(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"fi")) {
+        if (top == NULL or top->kind != BLOCK_IF or top->part == PART_HEAD)
+            return script_err(L"unexpected \"fi\"");
+        if (*rest != L'\0')
+            return script_err(L"unexpected text after \"fi\"");
+        if (top->branch >= 0)
+            compiling->nodes[top->branch].target = compiling->n_nodes;
+        patch_exits(top->exits, compiling->n_nodes);
+        n_blocks--;
+        return TRUE;
+    }
+
+    if (keyword_is(stmt, len_word, L"{")) {
+        if (top == NULL or top->kind != BLOCK_FUNC or top->part != PART_HEAD)
+            return script_err(L"unexpected '{'");
+        top->part = PART_BODY;
+        return compile_statement(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"}")) {
+        if (top == NULL or top->kind != BLOCK_FUNC or top->part != PART_BODY)
+            return script_err(L"unexpected '}'");
+        if (*rest != L'\0')
+            return script_err(L"unexpected text after '}'");
+        if (emit(IR_RETURN) < 0)
+            return FALSE;
+        compiling->nodes[top->top].target = compiling->n_nodes;
+        n_blocks--;
+        return TRUE;
+    }
+
+    if (top != NULL and top->kind == BLOCK_FUNC and top->part == PART_HEAD)
+        return script_err(L"function: expected '{'");
+    if (top != NULL and top->kind == BLOCK_FOR and top->part == PART_HEAD)
+        return script_err(L"for: expected \"do\"");
+
+    if (keyword_is(stmt, len_word, L"for")) {
+        return compile_for(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"while")
+         or keyword_is(stmt, len_word, L"if")) {
+        block_kind_t kind = stmt[0] == L'w' ? BLOCK_WHILE : BLOCK_IF;
+        if (push_block(kind, compiling->n_nodes) == NULL)
+            return FALSE;
+        return compile_statement(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"break")
+         or keyword_is(stmt, len_word, L"continue")) {
+        block_t *loop = innermost_block(BLOCK_FOR, BLOCK_WHILE);
+        if (loop == NULL or *rest != L'\0')
+            return script_err(stmt[0] == L'b' ? L"break: not in a loop"
+                                              : L"continue: not in a loop");
+        int32_t jump_i = emit(IR_JUMP);
+        if (jump_i < 0)
+            return FALSE;
+        if (stmt[0] == L'b') {
+            compiling->nodes[jump_i].target = loop->exits;
+            loop->exits = jump_i;
+        }
+        else {
+            compiling->nodes[jump_i].target = loop->top;
+        }
+        return TRUE;
+    }
+
+    if (keyword_is(stmt, len_word, L"return")) {
+        if (not in_function())
+            return script_err(L"return: not in a function");
+        if (*rest == L'\0')
+            return emit(IR_RETURN) >= 0;
+        return emit_text(IR_RETURN, NULL, 0, rest,
+                         (int32_t)wcslen(rest)) >= 0;
+    }
+
+    // ---------- Definitions ----------
+
+    if (keyword_is(stmt, len_word, L"function")) {
+        const WCHAR *name_end = arg_end(rest);
+        if (name_end == NULL)
+            return script_err(L"function: bad function name");
+        int32_t len_name = (int32_t)(name_end - rest);
+        if (len_name > 2 and wcsncmp(name_end - 2, L"()", 2) == 0)
+            len_name -= 2;
+        return compile_function(rest, len_name, name_end);
+    }
+
+    if (len_word > 2 and wcsncmp(word_end - 2, L"()", 2) == 0) {
+        return compile_function(stmt, len_word - 2, word_end);
+    }
+    if (wcsncmp(rest, L"()", 2) == 0 and is_name(stmt, len_word)) {
+        return compile_function(stmt, len_word, rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"alias")) {
+        return compile_alias(rest);
+    }
+
+    if (keyword_is(stmt, len_word, L"unalias")) {
+        const WCHAR *name_end = arg_end(rest);
+        if (name_end == NULL or name_end == rest)
+            return script_err(L"unalias: usage: unalias name");
+        return emit_text(IR_UNALIAS, rest, (int32_t)(name_end - rest),
+                         NULL, 0) >= 0;
+    }
+
+    const WCHAR *eq_p = wcschr(stmt, L'=');
+    if (eq_p != NULL and eq_p < word_end
+         and is_name(stmt, (int32_t)(eq_p - stmt))) {
+        const WCHAR *value = eq_p + 1;
+        const WCHAR *end_p = value_end(value);
+        if (end_p == NULL)
+            return script_err(L"missing '\"' or ')' in assignment");
+        if (*skip_whitespace(end_p) != L'\0')
+            return script_err(L"unexpected text after assignment");
+        int32_t len_value = unquote(&value, (int32_t)(end_p - value));
+        return emit_text(IR_ASSIGN, stmt, (int32_t)(eq_p - stmt),
+                         value, len_value) >= 0;
+    }
+
+    // ---------- Commands ----------
+
+    if (*stmt == L'(')
+        return compile_scope(stmt);
+    return compile_command(stmt);
+}
+
+
+
+/**
+ * split_statement
+ *
+ * Cuts the first statement off a line: puts a L'\0' over the first ';'
+ * that isn't quoted or inside a (...) or $(...).
+ *
+ * Return Value: Returns a pointer past the ';', NULL if there was none.
+ */
+static WCHAR *split_statement(WCHAR *line) {
+
+    BOOL in_quotes = FALSE;
+    int32_t paren_depth = 0;
+
+    for (WCHAR *p = line; *p != L'\0'; p++) {
+        if (*p == L'\\' and p[1] == L'"') {
+            p++;
+        }
+        else if (*p == L'"') {
+            in_quotes = not in_quotes;
+        }
+        else if (in_quotes) {
+            continue;
+        }
+        else if (*p == L'(') {
+            paren_depth++;
+        }
+        else if (*p == L')' and paren_depth > 0) {
+            paren_depth--;
+        }
+        else if (*p == L';' and paren_depth == 0) {
+            *p = L'\0';
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+
+
+/**
+ * discard_compiling
+ *
+ * Throws away the chunk being compiled (after an error).
+ */
+static void discard_compiling() {
+
+    if (compiling != NULL) {
+        compiling->refs = 1;
+        release_chunk(compiling);
+        compiling = NULL;
+    }
+    n_blocks = 0;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// VM
+//////////////////////////////////////////////////////////////////////////////
+
+
+
+/**
+ * lookup_var
+ *
+ * Looks up a shell variable, then an environment variable.
+ *
+ * Return Value: Returns the value, NULL if it's not set. An environment
+ *               variable's value is valid until the next call.
+ */
+static const WCHAR *lookup_var(const WCHAR *name, int32_t len_name) {
+
+    static WCHAR env_name[VAR_NAME_CAP + 1];
+    static WCHAR *env_value = NULL;
+    static DWORD cap_env_value = 0;
+
+    void **slot = table_slot(&vars, name, len_name, FALSE);
+    if (slot != NULL and *slot != NULL)
+        return *slot;
+
+    if (len_name > VAR_NAME_CAP)
+        return NULL;
+    memcpy(env_name, name, len_name * sizeof(WCHAR));
+    env_name[len_name] = L'\0';
+    DWORD len_value = GetEnvironmentVariableW(env_name, env_value,
+                                              cap_env_value);
+    if (len_value >= cap_env_value and len_value > 0) {
+        WCHAR *new_value = realloc(env_value, len_value * sizeof(WCHAR));
+        if (new_value == NULL)
+            return NULL;
+        env_value = new_value;
+        cap_env_value = len_value;
+        len_value = GetEnvironmentVariableW(env_name, env_value,
+                                            cap_env_value);
+    }
+    return len_value > 0 and len_value < cap_env_value ? env_value : NULL;
+}
+
+
+
+/**
+ * set_var
+ *
+ * Sets a shell variable.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL set_var(const WCHAR *name, const WCHAR *value) {
+
+    void **slot = table_slot(&vars, name, (int32_t)wcslen(name), TRUE);
+    WCHAR *copy = dup_range(value, (int32_t)wcslen(value));
+    if (slot == NULL or copy == NULL) {
+        free(copy);
+        return script_err(L"out of memory");
+    }
+    free(*slot);
+    *slot = copy;
+    return TRUE;
+}
+
+
+
+/**
+ * expand_vars
+ *
+ * Copies text into out with every $ reference replaced by its value. A '$'
+ * that doesn't start a reference ("$(", "C$") is copied as is. Values that
+ * go into a command line - text that is one, or the inside of a $(...) - 
+ * are quoted (see quote_words), so that they're only split into words.
+ *
+ * is_quoted: Is text a command line (or a for-loop's words)?
+ *
+ * Return Value: Returns TRUE on success, FALSE if out is too small.
+ */
+static BOOL expand_vars(const WCHAR *text, const frame_t *frame,
+                        BOOL is_quoted, WCHAR *out, int32_t cap_out) {
+
+    WCHAR number[16];
+    int32_t len_out = 0;
+
+    // in_quotes: Is p between double quotes? Saved (in outer_quotes) while
+    //            inside each level of parentheses.
+    BOOL in_quotes = FALSE;
+    uint64_t outer_quotes = 0;
+    int32_t paren_depth = 0;
+    int32_t n_backslashes = 0;
+
+    for (const WCHAR *p = text; *p != L'\0'; ) {
+
+        const WCHAR *value = NULL;
+        const WCHAR *ref_end = p + 2;
+        BOOL is_all_args = FALSE;
+        BOOL is_literal = FALSE;
+
+        if (*p != L'$') {
+            is_literal = TRUE;
+        }
+        else if (p[1] == L'?') {
+            _snwprintf(number, 16, L"%lu", (unsigned long)last_status);
+            value = number;
+        }
+        else if (p[1] == L'#') {
+            _snwprintf(number, 16, L"%d", frame->n_args);
+            value = number;
+        }
+        else if (p[1] == L'@' or p[1] == L'*') {
+            is_all_args = TRUE;
+        }
+        else if (p[1] >= L'1' and p[1] <= L'9') {
+            int32_t arg_i = p[1] - L'1';
+            value = L"";
+            if (arg_i < frame->n_args) {
+                value = frame->args;
+                while (arg_i-- > 0)
+                    value += wcslen(value) + 1;
+            }
+        }
+        else if (p[1] == L'{') {
+            const WCHAR *close_p = wcschr(p + 2, L'}');
+            if (close_p != NULL
+                 and is_name(p + 2, (int32_t)(close_p - p - 2))) {
+                value = lookup_var(p + 2, (int32_t)(close_p - p - 2));
+                ref_end = close_p + 1;
+            }
+            else {
+                is_literal = TRUE;
+            }
+        }
+        else if (iswalpha(p[1]) or p[1] == L'_') {
+            ref_end = p + 1;
+            while (iswalnum(*ref_end) or *ref_end == L'_')
+                ref_end++;
+            value = lookup_var(p + 1, (int32_t)(ref_end - p - 1));
+        }
+        else {
+            is_literal = TRUE; // "$(", "C$"
+        }
+
+        if (is_literal) {
+            if (len_out + 1 >= cap_out)
+                return FALSE;
+            if (*p == L'"' and n_backslashes % 2 == 0) {
+                in_quotes = not in_quotes;
+            }
+            else if (*p == L'(' and not in_quotes and paren_depth < 64) {
+                outer_quotes &= ~((uint64_t)1 << paren_depth);
+                paren_depth++;
+            }
+            else if (*p == L')' and not in_quotes and paren_depth > 0) {
+                paren_depth--;
+                in_quotes = (outer_quotes >> paren_depth) & 1;
+            }
+            n_backslashes = *p == L'\\' ? n_backslashes + 1 : 0;
+            out[len_out++] = *p++;
+            continue;
+        }
+        n_backslashes = 0;
+
+        BOOL is_before_quote = *ref_end == L'"';
+        BOOL is_cmdline = is_quoted or paren_depth > 0;
+        const WCHAR *arg = frame->args;
+        int32_t n_values = is_all_args ? frame->n_args : value != NULL;
+        for (int32_t i = 0; i < n_values; i++) {
+            if (is_all_args)
+                value = arg;
+            int32_t len_value = (int32_t)wcslen(value);
+            arg += len_value + 1;
+            if (i > 0) {
+                if (len_out + 1 >= cap_out)
+                    return FALSE;
+                out[len_out++] = L' ';
+            }
+            if (is_cmdline) {
+                len_value = quote_words(value, len_value, in_quotes,
+                                        is_before_quote and i == n_values - 1,
+                                        out + len_out, cap_out - len_out - 1);
+                if (len_value < 0)
+                    return FALSE;
+            }
+            else {
+                if (len_out + len_value >= cap_out)
+                    return FALSE;
+                memcpy(out + len_out, value, len_value * sizeof(WCHAR));
+            }
+            len_out += len_value;
+        }
+        p = ref_end;
+    }
+
+    out[len_out] = L'\0';
+    return TRUE;
+}
+
+
+
+/**
+ * split_words
+ *
+ * Splits text into words, expanding wildcards and dropping the quotes
+ * around each word.
+ *
+ * text: Words to split.
+ * out_words: Heap-allocated words, NULL-terminated and back to back, are
+ *            placed here (NULL if there are none).
+ * out_n_words: Number of words is placed here.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (reported).
+ */
+static BOOL split_words(const WCHAR *text, WCHAR **out_words,
+                        int32_t *out_n_words) {
+
+    // expand_globs leaves the first word alone: give it a dummy one
+    int32_t len_text = (int32_t)wcslen(text);
+    if (len_text + 2 > MAX_CMDLINE)
+        return script_err(L"word list too long");
+    words_buf[0] = L'_';
+    words_buf[1] = L' ';
+    memcpy(words_buf + 2, text, (len_text + 1) * sizeof(WCHAR));
+    if (not expand_globs(words_buf, MAX_CMDLINE + 1, shell_cwd))
+        return script_err(L"word list too long after wildcard expansion");
+
+    const WCHAR *p = skip_whitespace(words_buf + 2);
+    *out_words = NULL;
+    *out_n_words = 0;
+    if (*p == L'\0')
+        return TRUE;
+
+    WCHAR *words = malloc((wcslen(p) + 1) * sizeof(WCHAR));
+    if (words == NULL)
+        return script_err(L"out of memory");
+    WCHAR *words_p = words;
+    int32_t n_words = 0;
+    while (*p != L'\0') {
+        const WCHAR *word_end = arg_end(p);
+        if (word_end == NULL)
+            word_end = p + wcslen(p);
+        int32_t len_word = unquote(&p, (int32_t)(word_end - p));
+        memcpy(words_p, p, len_word * sizeof(WCHAR));
+        words_p[len_word] = L'\0';
+        words_p += len_word + 1;
+        n_words++;
+        p = skip_whitespace(word_end);
+    }
+    *out_words = words;
+    *out_n_words = n_words;
+    return TRUE;
+}
+
+
+
+/**
+ * push_frame
+ *
+ * Starts running nodes [start, end) of chunk. Takes over args.
+ *
+ * Return Value: Returns TRUE on success, FALSE if calls are nested too deep.
+ */
+static BOOL push_frame(script_chunk_t *chunk, int32_t start, int32_t end,
+                       WCHAR *args, int32_t n_args) {
+
+    if (n_frames == SCRIPT_MAX_CALLS) {
+        free(args);
+        return script_err(L"function calls nested too deep");
+    }
+    frame_t *frame = &frames[n_frames++];
+    memset(frame, 0, sizeof(frame_t));
+    frame->chunk = chunk;
+    frame->pc = start;
+    frame->end = end;
+    frame->args = args;
+    frame->n_args = n_args;
+    chunk->refs++;
+    return TRUE;
+}
+
+
+
+/**
+ * pop_frame
+ *
+ * Leaves the innermost running chunk or function.
+ */
+static void pop_frame() {
+
+    frame_t *frame = &frames[--n_frames];
+    for (int32_t i = 0; i < SCRIPT_LOOP_SLOTS; i++)
+        free(frame->loops[i].words);
+    free(frame->args);
+    release_chunk(frame->chunk);
+}
+
+
+
+/**
+ * find_func
+ *
+ * Finds the function named by the first word of a command line, using the
+ * node's cached lookup when the first word is the same every time.
+ *
+ * Return Value: Returns the function, NULL if the first word isn't one.
+ */
+static script_func_t *find_func(ir_node_t *node, const WCHAR *cmdline) {
+
+    const WCHAR *word_end = arg_end(cmdline);
+    if (word_end == NULL)
+        return NULL;
+    const WCHAR *text_end = arg_end(node->text);
+    BOOL is_fixed = text_end != NULL
+                     and wmemchr(node->text, L'$', text_end - node->text)
+                          == NULL;
+    if (is_fixed and node->func_gen == funcs_gen)
+        return node->func;
+
+    void **slot = table_slot(&funcs, cmdline, (int32_t)(word_end - cmdline),
+                             FALSE);
+    script_func_t *func = slot != NULL ? *slot : NULL;
+    if (is_fixed) {
+        node->func = func;
+        node->func_gen = funcs_gen;
+    }
+    return func;
+}
+
+
+
+/**
+ * add_outer_redirs
+ *
+ * Puts a "(cd DIR; cmd)" scope's command line into subst_buf followed by 
+ * what came after its ')', with the files of the redirections in that made
+ * absolute in the shell's directory (the job runs in DIR).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure (reported).
+ */
+static BOOL add_outer_redirs(const frame_t *frame, const WCHAR *cmdline,
+                             const WCHAR *redirs) {
+
+    WCHAR file[MAX_PATH + 1], path[MAX_PATH + 1];
+
+    if (wcschr(redirs, L'$') != NULL) {
+        if (not expand_vars(redirs, frame, TRUE, words_buf, 
+                            MAX_CMDLINE + 1))
+            return script_err(L"command too long after variable expansion");
+        redirs = words_buf;
+    }
+
+    int32_t len_out = (int32_t)wcslen(cmdline);
+    memcpy(subst_buf, cmdline, len_out * sizeof(WCHAR));
+
+    const WCHAR *p = skip_whitespace(redirs);
+    while (*p != L'\0') {
+        const WCHAR *end_p = arg_end(p);
+        if (end_p == NULL)
+            end_p = p + wcslen(p);
+
+        // "<", ">", ">>" or ">|", with the file name in it or after it
+        int32_t len_op = 0;
+        if (*p == L'<')
+            len_op = 1;
+        else if (*p == L'>')
+            len_op = p[1] == L'>' or p[1] == L'|' ? 2 : 1;
+        const WCHAR *file_p = p + len_op;
+        if (len_op > 0 and file_p == end_p) {
+            file_p = skip_whitespace(end_p);
+            end_p = arg_end(file_p);
+            if (end_p == NULL)
+                end_p = file_p + wcslen(file_p);
+        }
+
+        if (len_out + 1 + (end_p - p) > MAX_CMDLINE)
+            return script_err(L"command too long");
+        subst_buf[len_out++] = L' ';
+        if (len_op == 0 or end_p == file_p) {
+            memcpy(subst_buf + len_out, p, (end_p - p) * sizeof(WCHAR));
+            len_out += (int32_t)(end_p - p);
+            p = skip_whitespace(end_p);
+            continue;
+        }
+
+        const WCHAR *name = file_p;
+        int32_t len_name = unquote(&name, (int32_t)(end_p - file_p));
+        if (len_name > MAX_PATH)
+            return script_err(L"(cd): file name too long");
+        memcpy(file, name, len_name * sizeof(WCHAR));
+        file[len_name] = L'\0';
+        if (not make_abs_path(shell_cwd, file, path))
+            return script_err(L"(cd): file name too long");
+        int32_t len_path = (int32_t)wcslen(path);
+        int32_t len_quoted = quote_arg(path, len_path, FALSE, NULL);
+        if (len_out + len_op + len_quoted > MAX_CMDLINE)
+            return script_err(L"command too long");
+        memcpy(subst_buf + len_out, p, len_op * sizeof(WCHAR));
+        len_out += len_op;
+        quote_arg(path, len_path, FALSE, subst_buf + len_out);
+        len_out += len_quoted;
+        p = skip_whitespace(end_p);
+    }
+    subst_buf[len_out] = L'\0';
+    return TRUE;
+}
+
+
+
+/**
+ * exec_cmd
+ *
+ * Runs an IR_CMD node: calls the function it names or spawns it as a job.
+ *
+ * Return Value: Returns the jid of the foreground job that was started, -1
+ *               if there's none (last_status is then set, or a function
+ *               frame was pushed).
+ */
+static int32_t exec_cmd(frame_t *frame, ir_node_t *node) {
+
+    const WCHAR *cmdline = node->text;
+    if (node->has_vars) {
+        if (not expand_vars(node->text, frame, TRUE, expand_buf,
+                            MAX_CMDLINE + 1)) {
+            script_err(L"command too long after variable expansion");
+            last_status = 1;
+            return -1;
+        }
+        cmdline = expand_buf;
+    }
+
+    script_func_t *func = find_func(node, cmdline);
+    if (func != NULL) {
+        WCHAR *args;
+        int32_t n_args;
+        if (not split_words(skip_whitespace(arg_end(cmdline)), &args,
+                            &n_args)
+             or not push_frame(func->chunk, func->start, func->end, args,
+                               n_args))
+            last_status = 1;
+        return -1;
+    }
+
+    // "(cd DIR; cmd)": the job gets DIR, the shell keeps its directory
+    const WCHAR *cwd = shell_cwd;
+    WCHAR dir_buf[MAX_PATH + 1], scope_cwd[MAX_PATH + 1];
+    if (node->dir != NULL) {
+        const WCHAR *dir = node->dir;
+        if (wcschr(dir, L'$') != NULL) {
+            if (not expand_vars(dir, frame, FALSE, dir_buf, MAX_PATH + 1)) {
+                script_err(L"(cd): directory too long");
+                last_status = 1;
+                return -1;
+            }
+            dir = dir_buf;
+        }
+        if (not find_dir(shell_cwd, dir, scope_cwd)) {
+            last_status = 1;
+            return -1;
+        }
+        cwd = scope_cwd;
+    }
+    if (node->outer_redirs != NULL) {
+        if (not add_outer_redirs(frame, cmdline, node->outer_redirs)) {
+            last_status = 1;
+            return -1;
+        }
+        cmdline = subst_buf;
+    }
+
+    DWORD status;
+    here_doc_input = node->here_doc;
+    len_here_doc_input = node->len_here_doc;
+    int32_t fg_jid = run_job_cmdline(cmdline, cwd, &status);
+    here_doc_input = NULL;
+    len_here_doc_input = 0;
+    if (fg_jid >= 0) {
+        waiting_for_job = TRUE;
+        return fg_jid;
+    }
+    last_status = status;
+    return -1;
+}
+
+
+
+/**
+ * write_aliases
+ *
+ * Writes every alias to stdout as "alias name=value".
+ */
+static void write_aliases() {
+
+    out_stream_t out;
+    out_stream_init(&out, GetStdHandle(STD_OUTPUT_HANDLE));
+    for (int32_t i = 0; i < aliases.cap; i++) {
+        if (aliases.names[i] == NULL or aliases.values[i] == NULL)
+            continue;
+        out_stream_puts(&out, L"alias ");
+        out_stream_puts(&out, aliases.names[i]);
+        out_stream_puts(&out, L"=\"");
+        out_stream_puts(&out, aliases.values[i]);
+        out_stream_puts(&out, L"\"\n");
+    }
+    out_stream_close(&out);
+}
+
+
+
+/**
+ * exec_def
+ *
+ * Runs an IR_FUNC_DEF, IR_ALIAS or IR_UNALIAS node.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL exec_def(frame_t *frame, ir_node_t *node) {
+
+    int32_t len_name = node->name ? (int32_t)wcslen(node->name) : 0;
+
+    if (node->op == IR_FUNC_DEF) {
+        script_func_t *func = malloc(sizeof(script_func_t));
+        void **slot = table_slot(&funcs, node->name, len_name, TRUE);
+        if (func == NULL or slot == NULL) {
+            free(func);
+            return script_err(L"out of memory");
+        }
+        func->chunk = frame->chunk;
+        func->start = frame->pc;
+        func->end = node->target;
+        func->chunk->refs++;
+        if (*slot != NULL) {
+            release_chunk(((script_func_t *)*slot)->chunk);
+            free(*slot);
+        }
+        *slot = func;
+        funcs_gen++;
+        frame->pc = node->target;
+        return TRUE;
+    }
+
+    if (node->op == IR_ALIAS and node->name == NULL) {
+        write_aliases();
+        return TRUE;
+    }
+
+    void **slot = table_slot(&aliases, node->name, len_name,
+                             node->op == IR_ALIAS);
+    if (slot == NULL)
+        return node->op == IR_UNALIAS ? script_err(L"unalias: no such alias")
+                                      : script_err(L"out of memory");
+    WCHAR *value = NULL;
+    if (node->op == IR_ALIAS) {
+        value = dup_range(node->text, (int32_t)wcslen(node->text));
+        if (value == NULL)
+            return script_err(L"out of memory");
+    }
+    free(*slot);
+    *slot = value;
+    return TRUE;
+}
+
+
+
+/**
+ * run_vm
+ *
+ * Runs nodes until a foreground job is started or every frame is done.
+ *
+ * Return Value: Returns the jid of the foreground job that was started, -1
+ *               if the VM is idle again.
+ */
+static int32_t run_vm() {
+
+    while (n_frames > 0) {
+
+        frame_t *frame = &frames[n_frames - 1];
+        if (frame->pc >= frame->end) {
+            pop_frame();
+            continue;
+        }
+        ir_node_t *node = &frame->chunk->nodes[frame->pc++];
+
+        const WCHAR *text = node->text;
+        if (node->has_vars and node->op != IR_CMD) {
+            BOOL is_words = node->op == IR_FOR_INIT;
+            if (not expand_vars(text, frame, is_words, expand_buf,
+                                MAX_CMDLINE + 1)) {
+                script_err(L"text too long after variable expansion");
+                last_status = 1;
+                continue;
+            }
+            text = expand_buf;
+
+            // Commands are substituted when they're spawned, values now
+            if (node->op != IR_ALIAS and wcsstr(text, L"$(") != NULL) {
+                if (expand_substitutions(text, shell_cwd, is_words, 
+                                         subst_buf, MAX_CMDLINE + 1) < 0) {
+                    last_status = 1;
+                    continue;
+                }
+                text = subst_buf;
+            }
+        }
+
+        switch (node->op) {
+
+        case IR_CMD: {
+            int32_t fg_jid = exec_cmd(frame, node);
+            if (fg_jid >= 0)
+                return fg_jid;
+            break;
+        }
+
+        case IR_ASSIGN:
+            last_status = set_var(node->name, text) ? 0 : 1;
+            break;
+
+        case IR_FOR_INIT: {
+            loop_slot_t *slot = &frame->loops[node->depth];
+            free(slot->words);
+            slot->words = NULL;
+            slot->n_left = 0;
+            if (split_words(text, &slot->words, &slot->n_left))
+                slot->next = slot->words;
+            break;
+        }
+
+        case IR_FOR_NEXT: {
+            loop_slot_t *slot = &frame->loops[node->depth];
+            if (slot->n_left == 0) {
+                frame->pc = node->target;
+                break;
+            }
+            set_var(node->name, slot->next);
+            slot->next += wcslen(slot->next) + 1;
+            slot->n_left--;
+            break;
+        }
+
+        case IR_BRANCH_FALSE:
+            if (last_status != 0)
+                frame->pc = node->target;
+            break;
+
+        case IR_JUMP:
+            frame->pc = node->target;
+            break;
+
+        case IR_RETURN:
+            if (text != NULL)
+                last_status = (DWORD)wcstoul(text, NULL, 10);
+            pop_frame();
+            break;
+
+        case IR_FUNC_DEF:
+        case IR_ALIAS:
+        case IR_UNALIAS:
+            last_status = exec_def(frame, node) ? 0 : 1;
+            break;
+        }
+    }
+
+    return -1;
+}
+
+
+
+/**
+ * script_feed
+ *
+ * Compiles a line of input. Once the line completes a top-level statement
+ * (every block it opened is closed), the compiled chunk is run.
+ *
+ * line: Line of input.
+ *
+ * Return Value: Returns the jid of the foreground job the chunk started, -1
+ *               if it ran to the end (or the line didn't complete a
+ *               statement).
+ */
+int32_t script_feed(const WCHAR *line) {
+
+    line = skip_whitespace(line);
+    if (*line == L'#')
+        return -1;
+    wcsncpy(line_buf, line, MAX_CMDLINE);
+    line_buf[MAX_CMDLINE] = L'\0';
+
+    if (compiling == NULL) {
+        compiling = calloc(1, sizeof(script_chunk_t));
+        if (compiling == NULL) {
+            script_err(L"out of memory");
+            return -1;
+        }
+    }
+
+    WCHAR *stmt = line_buf;
+    while (stmt != NULL) {
+        WCHAR *next_stmt = split_statement(stmt);
+        stmt = skip_whitespace(stmt);
+        WCHAR *stmt_end = stmt + wcslen(stmt);
+        while (stmt_end > stmt and iswspace(stmt_end[-1]))
+            *--stmt_end = L'\0';
+        if (not compile_statement(stmt)) {
+            discard_compiling();
+            last_status = 1;
+            return -1;
+        }
+        stmt = next_stmt;
+    }
+
+    if (n_blocks > 0)
+        return -1;
+
+    script_chunk_t *chunk = compiling;
+    compiling = NULL;
+    if (chunk->n_nodes == 0
+         or not push_frame(chunk, 0, chunk->n_nodes, NULL, 0)) {
+        chunk->refs = 1;
+        release_chunk(chunk);
+        return -1;
+    }
+    return run_vm();
+}
+
+
+
+/**
+ * script_resume
+ *
+ * Carries on with the script once the foreground job it was stopped on is
+ * done.
+ *
+ * exit_code: Exit code of the job.
+ *
+ * Return Value: Returns the jid of the next foreground job started, -1 if
+ *               the script ran to the end (or wasn't stopped on a job).
+ */
+int32_t script_resume(DWORD exit_code) {
+
+    if (not waiting_for_job)
+        return -1;
+    waiting_for_job = FALSE;
+    last_status = exit_code;
+    return run_vm();
+}
+
+
+
+/**
+ * script_pending
+ *
+ * Return Value: Returns TRUE while a block is open (more lines are needed
+ *               before anything runs).
+ */
+BOOL script_pending() {
+    return n_blocks > 0;
+}
+
+
+
+/**
+ * script_end_input
+ *
+ * Called at the end of input: throws away a statement whose blocks were
+ * never closed.
+ */
+void script_end_input() {
+
+    if (n_blocks > 0) {
+        script_err(L"unexpected end of input (block not closed)");
+        discard_compiling();
+    }
+}
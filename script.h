@@ -0,0 +1,128 @@
+
+/**
+ * script.h
+ *
+ * ir_node_t and script_chunk_t structs defined here.
+ */
+
+
+
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/**
+ * ir_op_t
+ *
+ * What an ir_node_t does when it's executed.
+ */
+typedef enum _ir_op {
+    IR_CMD,          // run text as a job (or call the function it names)
+    IR_ASSIGN,       // name=text
+    IR_FOR_INIT,     // split text into the words of for-loop slot depth
+    IR_FOR_NEXT,     // name=next word of slot depth, or jump to target
+    IR_BRANCH_FALSE, // jump to target unless the last status was 0
+    IR_JUMP,         // jump to target
+    IR_FUNC_DEF,     // define function name as the nodes up to target
+    IR_RETURN,       // leave the function (status from text, if any)
+    IR_ALIAS,        // alias name=text, or list the aliases if name is NULL
+    IR_UNALIAS       // forget alias name
+} ir_op_t;
+
+
+
+/**
+ * ir_node_t struct
+ *
+ * One instruction of a compiled script. Control flow is flattened into
+ * jumps between node indexes of the same chunk.
+ */
+typedef struct _ir_node {
+
+    /* op: What the node does. */
+    ir_op_t op;
+
+    /* target: Node index to jump to (IR_FOR_NEXT, IR_BRANCH_FALSE,
+               IR_JUMP), or one past the end of the body (IR_FUNC_DEF). */
+    int32_t target;
+
+    /* depth: for-loop slot of IR_FOR_INIT and IR_FOR_NEXT. Nested loops of
+              the same function get different slots. */
+    int32_t depth;
+
+    /* name: Variable, function or alias name. NULL if the node has none. */
+    WCHAR *name;
+
+    /* text: Command line, value or word list, aliases already expanded.
+             NULL if the node has none. */
+    WCHAR *text;
+
+    /* has_vars: Does text contain $ references? If not, it's used as is. */
+    BOOL has_vars;
+
+    /* here_doc, len_here_doc: Body of the "<<TAG" here-document of an 
+                               IR_CMD. NULL if it has none. */
+    WCHAR *here_doc;
+    int32_t len_here_doc;
+
+    /* dir: Directory the job of a "(cd DIR; cmd)" IR_CMD runs in ($
+            references expanded when it runs). NULL for the shell's. */
+    WCHAR *dir;
+
+    /* outer_redirs: What followed the ')' of a "(cd DIR; cmd)" IR_CMD - 
+                     redirections, whose files are in the shell's directory
+                     rather than DIR. NULL if nothing did. */
+    WCHAR *outer_redirs;
+
+    /* func, func_gen: Function the command's first word named when it last
+                       ran, valid while func_gen matches the generation of
+                       the function table. NULL if it named none. */
+    struct _script_func *func;
+    uint32_t func_gen;
+
+} ir_node_t;
+
+
+
+/**
+ * script_chunk_t struct
+ *
+ * Nodes compiled from one top-level statement (with all the lines of its
+ * blocks). Functions defined by a chunk point into it, so it lives until
+ * the last of them is redefined.
+ */
+typedef struct _script_chunk {
+
+    /* refs: One while the chunk runs, plus one per function defined in it. */
+    int32_t refs;
+
+    /* nodes, n_nodes, cap_nodes: The instructions. */
+    ir_node_t *nodes;
+    int32_t n_nodes;
+    int32_t cap_nodes;
+
+} script_chunk_t;
+
+
+
+/**
+ * script_func_t struct
+ *
+ * A shell function: nodes [start, end) of chunk.
+ */
+typedef struct _script_func {
+    script_chunk_t *chunk;
+    int32_t start;
+    int32_t end;
+} script_func_t;
+
+
+
+// ifndef _SCRIPT_H
+#endif
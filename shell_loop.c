@@ -18,35 +18,180 @@
 
 
 
-static BOOL wait_cmdline_children(job_t *fg_job, DWORD *out_signaled_i) {
+static BOOL wait_cmdline_children(int32_t fg_jid, DWORD *out_signaled_i) {
 
-    DWORD dw_rc;
+    int32_t signaled_i;
 
-    if (fg_job == NULL) { // waiting at prompt: wait for cmdline and children
-        dw_rc = WaitForMultipleObjects(
-            (DWORD)n_wait_handles,
-            wait_handles,
-            FALSE,
-            INFINITE
-        );
-        *out_signaled_i = dw_rc - WAIT_OBJECT_0;
+    if (fg_jid < 0) { // waiting at prompt: wait for cmdline and children
+        signaled_i = plat_wait_any(wait_handles, n_wait_handles, PLAT_INFINITE);
     }
     else { // active fg job: ignore cmdline_available
-        dw_rc = WaitForMultipleObjects(
-            (DWORD)(n_wait_handles - 1),
-            wait_handles + 1,
-            FALSE,
-            INFINITE
+        signaled_i = plat_wait_any(
+            wait_handles + 1, 
+            n_wait_handles - 1, 
+            PLAT_INFINITE
         );
-        *out_signaled_i = dw_rc - WAIT_OBJECT_0 + 1;
+        if (signaled_i >= 0)
+            signaled_i++;
     }
-    if (dw_rc == WAIT_FAILED) {
+    if (signaled_i < 0) {
         print_err(
             L"shell_loop.c -> "
-            L"wait_for_event -> WaitForMultipleObjects"
+            L"wait_for_event -> plat_wait_any"
         );
         return FALSE;
     }
+    *out_signaled_i = (DWORD)signaled_i;
+    return TRUE;
+}
+
+
+
+/**
+ * run_job_cmdline
+ * 
+ * Spawns a job command line, and reports why if it couldn't be spawned.
+ * 
+ * cmdline: Job command line.
+ * cwd: Working directory of the job (shell_cwd unless it's scoped).
+ * out_status: Unless a foreground job was started, the command's status is
+ *             placed here: 0 if it was spawned (or was only builtins), 1 if
+ *             it failed.
+ * 
+ * Return Value: Returns the jid of the foreground job that was started, or 
+ *               -1 if none was.
+ */
+int32_t run_job_cmdline(const WCHAR *cmdline, const WCHAR *cwd,
+                        DWORD *out_status) {
+
+    STAT_TIMER_START(spawn_timer);
+    int32_t job_i = spawn_job(
+        cmdline, 
+        GetStdHandle(STD_OUTPUT_HANDLE), 
+        cwd
+    );
+    STAT_TIMER_RECORD(STAT_HIST_SPAWN, spawn_timer);
+    print_err_jid = -1;
+    *out_status = 0;
+    if (job_i >= 0)
+        STAT_ADD(STAT_JOBS_SPAWNED, 1);
+    else if (job_i == SPAWNJOB_EMPTY_PIPE 
+              || job_i == SPAWNJOB_SYSCALL_FAILURE 
+              || job_i == SPAWNJOB_BAD_SUBSTITUTION 
+              || job_i == SPAWNJOB_CMDLINE_TOO_LONG || job_i == -1) {
+        STAT_ADD(STAT_JOBS_FAILED, 1);
+        *out_status = 1;
+    }
+    
+    // Syscall failure
+    if (job_i == SPAWNJOB_SYSCALL_FAILURE) {
+        ExitProcess(1);
+    }
+
+    // Malformed command (empty pipe)
+    else if (job_i == SPAWNJOB_EMPTY_PIPE) {
+        out_stream_t err;
+        out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+        out_stream_puts(&err, L"Error: empty pipe\n");
+        out_stream_close(&err);
+    }
+
+    // Wildcards matched too much
+    else if (job_i == SPAWNJOB_CMDLINE_TOO_LONG) {
+        out_stream_t err;
+        out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+        out_stream_puts(
+            &err, 
+            L"Error: command line too long after wildcard expansion\n"
+        );
+        out_stream_close(&err);
+    }
+
+    // Just pressed enter
+    else if (job_i == SPAWNJOB_EMPTY_CMDLINE) {
+        // Do nothing...
+    }
+
+    else if (job_i == SPAWNJOB_EMPTY_JOB) {
+        // Do nothing...
+    }
+
+    // $(...) failed (already reported)
+    else if (job_i == SPAWNJOB_BAD_SUBSTITUTION) {
+        // Do nothing...
+    }
+
+    // Job was successfully spawned
+    else if (job_i >= 0) {
+        job_t *job = &jobs[job_i];
+        // Add job->proc_hs to wait_handles
+        append_to_wait_handles(job->proc_hs, job_n_procs_alive[job_i]);
+        // Is this a fg job?
+        if (job->is_foreground) {
+            // Note: We don't signal cmdline reader thread because we 
+            //       don't want it racing with child proc over stdin.
+            //       We'll signal it once the fg job finishes.
+            return job_i;
+        }
+        else {
+            // TODO: print job info
+        }
+    }
+
+    return -1;
+}
+
+
+
+/**
+ * spawn_pending_cmdlines
+ * 
+ * Feeds lines from the local copy of the cmdline batch to the script 
+ * compiler one after another (which runs every statement they complete)
+ * until a foreground job is started or there are no lines left.
+ * 
+ * Lines that belong to a here-document body are collected (see 
+ * here_doc_feed) rather than fed.
+ * 
+ * in_out_line_p: Points to the next line to spawn. Advanced past every line
+ *                that gets spawned.
+ * in_out_n_lines: Number of lines left. Decremented for every line spawned.
+ * at_eof: TRUE if no more lines will come after these. A here-document that
+ *         is still being collected is then spawned with what it has, and a
+ *         block that's still open is thrown away.
+ * 
+ * Return Value: Returns the jid of the foreground job that was started, or -1
+ *               if all the lines were spawned without starting a foreground 
+ *               job.
+ */
+static int32_t spawn_pending_cmdlines(WCHAR **in_out_line_p, 
+                                      int32_t *in_out_n_lines,
+                                      BOOL at_eof) {
+
+    int32_t fg_jid = -1;
+
+    while ((*in_out_n_lines > 0 || (at_eof && here_doc_pending())) 
+            && fg_jid < 0) {
+
+        WCHAR *line_p = NULL;
+        if (*in_out_n_lines > 0) {
+            line_p = *in_out_line_p;
+            *in_out_line_p = line_p + wcslen(line_p) + 1;
+            (*in_out_n_lines)--;
+        }
+
+        // Here-document body lines are held back until the body is complete
+        const WCHAR *cmdline;
+        if (!here_doc_feed(line_p, &cmdline))
+            continue;
+
+        fg_jid = script_feed(cmdline);
+    }
+
+    if (fg_jid < 0 && at_eof)
+        script_end_input();
+
+    return fg_jid;
 }
 
 
@@ -60,17 +205,19 @@ static BOOL wait_cmdline_children(job_t *fg_job, DWORD *out_signaled_i) {
  */
 void shell_loop() {
 
-    DWORD dw_rc;
     BOOL bool_rc;
-    int32_t rc;
-    WCHAR my_cmdline[MAX_CMDLINE + 1];
     HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
 
-    const WCHAR *prompt = L"winshell> ";
+    // my_batch: Local copy of the cmdline batch. Lines are spawned from here
+    //           while the reader thread is free to fill the next batch.
+    static WCHAR my_batch[CMDLINE_BATCH_CAP];
+    WCHAR *pending_line_p = my_batch;
+    int32_t n_pending_lines = 0;
+    BOOL my_eof = FALSE;
 
-    // Non-NULL when fg job is active, NULL when no fg job active (waiting 
+    // jid of the fg job when one is active, -1 when no fg job active (waiting 
     // at prompt)
-    job_t *fg_job = NULL;
+    int32_t fg_jid = -1;
 
     // Create the cmdline reader thread
     cmdline_reader_thread_h = CreateThread(
@@ -88,105 +235,61 @@ void shell_loop() {
 
     while (TRUE) {
 
-        // Print Prompt
-        if (fg_job == NULL) {
-            bool_rc = WriteFile(
-                stdout_h,
-                prompt,
-                wcslen(prompt) * sizeof(WCHAR),
-                NULL, 
-                NULL
+        // Print Prompt (only when a person is typing the commands)
+        if (fg_jid < 0 && stdin_is_console) {
+            out_stream_t out;
+            out_stream_init(&out, stdout_h);
+            out_stream_puts(
+                &out, 
+                here_doc_pending() || script_pending() 
+                 ? HERE_DOC_PROMPT : PROMPT
             );
+            bool_rc = out_stream_close(&out);
             if (!bool_rc) {
-                print_err(L"shell_loop -> WriteConsoleW prompt");
+                print_err(L"shell_loop -> out_stream_close prompt");
                 ExitProcess(1);
             }
         }
 
         // Wait for an event
         DWORD signaled_i;
-        bool_rc = wait_cmdline_children(fg_job, &signaled_i);
+        bool_rc = wait_cmdline_children(fg_jid, &signaled_i);
         if (!bool_rc)
             ExitProcess(1);
+        TRACE(TRACE_WAIT_WAKEUP, signaled_i);
         HANDLE signaled = wait_handles[signaled_i];
 
         // cmdline_available was signaled
         if (signaled_i == 0) {
 
-            // Consume cmdline
-            dw_rc = WaitForSingleObject(cmdline_lock, INFINITE);
-            if (dw_rc == WAIT_FAILED) {
-                print_err(L"shell_loop -> WaitForSingleObject");
-                ExitProcess(1);
-            }
-            memcpy(my_cmdline, cmdline, (wcslen(cmdline) + 1) * sizeof(WCHAR));
-            bool_rc = ReleaseMutex(cmdline_lock);
+            // Consume cmdline batch
+            bool_rc = plat_mutex_lock(cmdline_lock);
             if (!bool_rc) {
-                print_err(L"shell_loop -> ReleaseMutex");
+                print_err(L"shell_loop -> plat_mutex_lock");
                 ExitProcess(1);
             }
-            
-            int32_t job_i = spawn_job(my_cmdline);
-            
-            // Syscall failure
-            if (job_i == SPAWNJOB_SYSCALL_FAILURE) {
+            memcpy(my_batch, cmdline_batch, len_cmdline_batch * sizeof(WCHAR));
+            n_pending_lines = n_cmdline_batch;
+            pending_line_p = my_batch;
+            my_eof = cmdline_eof;
+            TRACE(TRACE_HANDOFF_RECV, n_pending_lines);
+            bool_rc = plat_mutex_unlock(cmdline_lock);
+            if (!bool_rc) {
+                print_err(L"shell_loop -> plat_mutex_unlock");
                 ExitProcess(1);
             }
-
-            // Malformed command (empty pipe)
-            else if (job_i == SPAWNJOB_EMPTY_PIPE) {
-                const WCHAR *message = L"Error: empty pipe\n";
-                WriteFile(
-                    GetStdHandle(STD_ERROR_HANDLE),
-                    message,
-                    wcslen(message) * sizeof(WCHAR),
-                    NULL, 
-                    NULL
-                );
-            }
-
-            // Just pressed enter
-            else if (job_i == SPAWNJOB_EMPTY_CMDLINE) {
-                // Do nothing...
-            }
-
-            else if (job_i == SPAWNJOB_EMPTY_JOB) {
-                // Do nothing...
-            }
-
-            // Job was successfully spawned
-            else {
-                job_t *job = &jobs[job_i];
-                // Add job->proc_hs to wait_handles
-                append_to_wait_handles(job->proc_hs, job->n_procs_alive);
-                // Is this a fg job?
-                if (job->is_foreground) {
-                    // Note: We don't signal cmdline reader thread because we 
-                    //       don't want it racing with child proc over stdin.
-                    //       We'll signal it once the fg_job finishes.
-                    fg_job = job;
-                }
-                else {
-                    // TODO: print job info
-                }
-            }
-            
-            // Signal cmdline reader thread to continue
-            if (fg_job == NULL) {
-                bool_rc = SetEvent(cmdline_consumed_e);
-                if (!bool_rc) {
-                    print_err(L"shell_loop -> SetEvent");
-                    ExitProcess(1);
-                }
-            }
         }
 
         // Process has terminated
         else {
             
-            DWORD signaled_pid = GetProcessId(signaled);
+            DWORD signaled_pid = plat_pid(signaled);
             
+            TRACE(TRACE_REAP_BEGIN, signaled_pid);
+            STAT_TIMER_START(reap_timer);
             bool_rc = reap_proc(signaled);
+            STAT_TIMER_RECORD(STAT_HIST_REAP, reap_timer);
+            TRACE(TRACE_REAP_END, signaled_pid);
 
             if (!bool_rc) {
                 fwprintf(
@@ -197,16 +300,41 @@ void shell_loop() {
                 fflush(stderr);
             }
             
-            // fg job finished
-            if (fg_job != NULL && fg_job->status != RUNNING) {
-                fg_job = NULL;
-                // Signal cmdline reader thread to continue
-                bool_rc = SetEvent(cmdline_consumed_e);
-                if (!bool_rc) {
-                    print_err(L"shell_loop -> SetEvent");
-                    ExitProcess(1);
-                }
+            // fg job finished: the script it came from carries on
+            if (fg_jid >= 0 && job_status[fg_jid] != RUNNING) {
+                const completion_t *record = 
+                    &completions[(n_completions - 1) % COMPLETIONS_CAP];
+                fg_jid = script_resume(
+                    record->jid == fg_jid ? record->exit_code : 0
+                );
+                if (fg_jid >= 0)
+                    continue;
             }
+            // Still waiting on the fg job (or nothing new to spawn)
+            else {
+                continue;
+            }
+        }
+
+        // Spawn lines until one of them is a fg job
+        fg_jid = spawn_pending_cmdlines(
+            &pending_line_p, 
+            &n_pending_lines, 
+            my_eof
+        );
+        if (fg_jid >= 0) 
+            continue;
+
+        // stdin is done: exit like the exit builtin would
+        if (my_eof) {
+            exit_builtin(NULL, NULL);
+        }
+
+        // Signal cmdline reader thread to continue
+        bool_rc = plat_event_set(cmdline_consumed_e);
+        if (!bool_rc) {
+            print_err(L"shell_loop -> plat_event_set");
+            ExitProcess(1);
         }
     }
 }
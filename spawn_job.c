@@ -24,113 +24,58 @@
 
 
 
-/**
- * dup_uninherit_to_inherit
- * 
- * Duplicates uninheritable HANDLE old_h to inheritable copy new_h.
- * old_h is closed.
- * 
- * old_h: Uninheritable HANDLE to be dup-ed.
- * new_h: New inheritable HANDLE will be placed here.
- * 
- * Return Value: Returns TRUE on success, FALSE on failure.
- */
-static BOOL dup_uninherit_to_inherit(HANDLE old_h, 
-                                     HANDLE *new_h) {
-    
-    BOOL bool_rc = DuplicateHandle(
-        GetCurrentProcess(),
-        old_h,
-        GetCurrentProcess(),
-        new_h,
-        0,
-        TRUE,
-        DUPLICATE_SAME_ACCESS | DUPLICATE_CLOSE_SOURCE // old_h will be closed
-    );
-    return bool_rc;
-}
-
-
-
-/**
- * create_my_pipe
- * 
- * When we spawn a process that pipes its output, we need to create a pipe 
- * with an uninheritable read end and an inheritable write end.
- * 
- * out_read_pipe: HANDLE to the new pipe's uninheritable read end will be 
- *                placed here.
- * out_write_pipe: HANDLE to the new pipe's inheritable write end will be 
- *                 placed here.
- * 
- * Return Value: Returns TRUE on success, FALSE on failure.
- */
-static BOOL create_my_pipe(HANDLE *out_read_pipe, 
-                            HANDLE *out_write_pipe) {
-    
-    BOOL bool_rc;
-
-    HANDLE my_read_pipe, my_write_pipe;
-
-    SECURITY_ATTRIBUTES pipe_sa = {
-        .nLength = sizeof(SECURITY_ATTRIBUTES),
-        .lpSecurityDescriptor = NULL,
-        .bInheritHandle = FALSE
-    };
-
-    bool_rc = CreatePipe(
-        &my_read_pipe,
-        &my_write_pipe,
-        &pipe_sa,
-        0
-    );
-    if (!bool_rc) { // Did CreatePipe fail?
-        return FALSE;
-    }
-
-    HANDLE dup_write_pipe;
-    bool_rc = dup_uninherit_to_inherit(my_write_pipe, &dup_write_pipe);
-    if (!bool_rc) { // DuplicateHandle failed
-        CloseHandle(my_read_pipe);
-        CloseHandle(my_write_pipe);
-        return FALSE;
-    }
-
-    // Return
-    *out_read_pipe = my_read_pipe;
-    *out_write_pipe = dup_write_pipe;
-    return TRUE;
-}
+/* spawn_lock: Held while the shell has inheritable handles meant for the 
+               children of one spawn, so that a process started by another
+               thread (xargs) can't inherit them and hold a pipe open. */
+CRITICAL_SECTION spawn_lock;
 
 
 
 /**
  * open_out_file
  * 
- * Opens out_file for output redirection.
+ * Opens out_file for output redirection. ">" truncates it (in place, so
+ * its attributes are kept). ">>" opens it with append-only access, so every
+ * write lands at its end even when several jobs append to it at once.
+ * Readers can share it either way, to follow the output.
  *
+ * cwd: Working directory of the job (a relative out_file is in it).
  * out_file: File name to open
+ * append: Append to the file (">>") rather than truncate it?
  * 
  * Return Value: Returns a HANDLE to the file on success.
  *               Returns INVALID_HANDLE_VALUE on failure.
  */
-static HANDLE open_out_file(const WCHAR *out_file) {
+static HANDLE open_out_file(const WCHAR *cwd, const WCHAR *out_file,
+                            BOOL append) {
+    WCHAR path[MAX_PATH + 1];
+    if (!make_abs_path(cwd, out_file, path)) {
+        print_err(L"open_out_file -> make_abs_path");
+        return INVALID_HANDLE_VALUE;
+    }
     SECURITY_ATTRIBUTES sa = {
         .nLength = sizeof(SECURITY_ATTRIBUTES),
         .lpSecurityDescriptor = NULL,
         .bInheritHandle = TRUE
     };
     HANDLE out_file_h = CreateFileW(
-        out_file, 
-        GENERIC_WRITE,
-        0,
+        path, 
+        append ? FILE_APPEND_DATA : GENERIC_WRITE,
+        append ? FILE_SHARE_READ | FILE_SHARE_WRITE : FILE_SHARE_READ,
         &sa,
         OPEN_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
         NULL
     );
     if (out_file_h == INVALID_HANDLE_VALUE) {
         print_err(L"CreateFileW opening output file");
+        return out_file_h;
+    }
+    // Drop the old contents - or a shorter output leaves their tail behind
+    if (!append && !SetEndOfFile(out_file_h)) {
+        print_err(L"open_out_file -> SetEndOfFile");
+        CloseHandle(out_file_h);
+        return INVALID_HANDLE_VALUE;
     }
     return out_file_h;
 }
@@ -140,26 +85,33 @@ static HANDLE open_out_file(const WCHAR *out_file) {
 /**
  * open_in_file
  * 
- * Opens in_file for input redirection.
+ * Opens in_file for input redirection, for a front-to-back read (the cache
+ * reads ahead). Writers can share it, so a growing file can be read.
  * 
+ * cwd: Working directory of the job (a relative in_file is in it).
  * in_file: File name to open
  * 
  * Return Value: Returns a HANDLE to the file on success.
  *               Returns INVALID_HANDLE_VALUE on failure.
  */
-static HANDLE open_in_file(const WCHAR *in_file) {
+static HANDLE open_in_file(const WCHAR *cwd, const WCHAR *in_file) {
+    WCHAR path[MAX_PATH + 1];
+    if (!make_abs_path(cwd, in_file, path)) {
+        print_err(L"open_in_file -> make_abs_path");
+        return INVALID_HANDLE_VALUE;
+    }
     SECURITY_ATTRIBUTES sa = {
         .nLength = sizeof(SECURITY_ATTRIBUTES),
         .lpSecurityDescriptor = NULL,
         .bInheritHandle = TRUE
     };
     HANDLE in_file_h = CreateFileW(
-        in_file,
+        path,
         GENERIC_READ,
-        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
         &sa,
         OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
         NULL
     );
     if (in_file_h == INVALID_HANDLE_VALUE) {
@@ -170,65 +122,27 @@ static HANDLE open_in_file(const WCHAR *in_file) {
 
 
 
-static void hexdump(const void *addr, DWORD n_bytes) {
-
-    const unsigned char *addr_c = (const unsigned char *)addr;
-    int i;
-
-    for (i = 0; i < n_bytes; i++) {
-        DWORD mod = i % 16;
-        switch (mod) {
-        case 15:
-            wprintf(L"%02x\n", addr_c[i]);
-            break;
-        case 7:
-            wprintf(L"%02x   ", addr_c[i]);
-            break;
-        case 0:
-            wprintf(L"%04d    %02x ", i, addr_c[i]);
-            break;
-        default:
-            wprintf(L"%02x ", addr_c[i]);
-            break;
-        }
-    }
-    if (i % 16 != 0) {
-        wprintf(L"\n");
-    }
-    fflush(stdout);
-}   
-
-
-
 /**
- * spawn_job
- *
- * Does all the work for spawning the job from the given job_cmdline. 
- * Cleans/parses the cmdline, sets up the pipes and I/O redirection, 
- * spawns the processes, and adds the job struct to the jobs array.
+ * spawn_expanded_job
  *
- * Return Value: Returns the jid of the new job on success. 
- *               Returns a negative number on failure:
- *                - SPAWNJOB_EMPTY_PIPE 
- *                - SPAWNJOB_EMPTY_CMDLINE
- *                - SPAWNJOB_SYSCALL_FAILURE
+ * spawn_job after command substitutions have been expanded.
  */
-int32_t spawn_job(const WCHAR *job_cmdline) {
+static int32_t spawn_expanded_job(const WCHAR *job_cmdline, 
+                                  HANDLE job_stdout_h, const WCHAR *cwd) {
     
     BOOL bool_rc;
 
-    STARTUPINFO startup_info = {
-        .cb = sizeof(STARTUPINFO),
-        .dwFlags = STARTF_USESTDHANDLES
-    };
+    STAT_TIMER_START(start_timer);
 
-    HANDLE my_prev_read_pipe, my_next_read_pipe, // no inherit
+    stdio_handles_t stdio = { .std_err = NULL };
+
+    HANDLE my_prev_read_pipe = NULL, my_next_read_pipe = NULL, // no inherit
            dup_prev_read_pipe, dup_write_pipe; // inherit
-    HANDLE in_file_h, out_file_h;
+    HANDLE in_file_h, out_file_h, here_read_h;
 
     // Get stdin and stdout
     HANDLE stdin_h = GetStdHandle(STD_INPUT_HANDLE);
-    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
+    HANDLE stdout_h = job_stdout_h;
 
     // Find jid
     int32_t jid = find_open_jid();
@@ -237,178 +151,395 @@ int32_t spawn_job(const WCHAR *job_cmdline) {
         return -1;
     }
     job_t *job = &jobs[jid];
+    print_err_jid = jid; // the caller resets this
+
+    // "time <pipeline>": the rest of the cmdline is the job, timed
+    const WCHAR *pipeline_cmdline = job_cmdline;
+    BOOL is_timed = FALSE;
+    const WCHAR *time_p = skip_whitespace(job_cmdline);
+    if (wcsncmp(time_p, L"time", 4) == 0 
+         && (time_p[4] == L'\0' || iswspace(time_p[4]))) {
+        is_timed = TRUE;
+        pipeline_cmdline = time_p + 4;
+    }
 
     // Parse the job cmdline
     int32_t n_procs;
+    TRACE(TRACE_PARSE_BEGIN, jid);
+    STAT_TIMER_START(parse_timer);
     parsed_process_t *parsed_procs = parse_job_cmdline(
-        job_cmdline, 
+        pipeline_cmdline, 
+        cwd,
         &n_procs, 
         &job->is_foreground
     );
+    STAT_TIMER_RECORD(STAT_HIST_PARSE, parse_timer);
+    TRACE(TRACE_PARSE_END, jid);
     if (parsed_procs == NULL) {
         return n_procs;
     }
 
-    // Allocate the job->proc_hs array
-    job->proc_hs = malloc(n_procs * sizeof(HANDLE));
-
-    // Allocate and initialize job->cmdline
-    size_t len_job_cmdline = wcslen(job_cmdline);
-    job->cmdline = malloc(sizeof(wchar_t) * (len_job_cmdline + 1));
-    memcpy(job->cmdline, job_cmdline, sizeof(wchar_t) * len_job_cmdline);
-    job->cmdline[len_job_cmdline] = L'\0';
-    job->n_procs_alive = 0;
+    // Get the job's arena, then carve job->proc_hs, job->cmdline and 
+    // job->cwd out of it
+    int32_t len_job_cmdline = (int32_t)wcslen(job_cmdline);
+    size_t len_cwd = wcslen(cwd);
+    size_t arena_size = JOB_ARENA_SIZE(n_procs, len_job_cmdline)
+                         + (len_cwd + 1) * sizeof(WCHAR) + JOB_ARENA_ALIGN;
+    if (is_timed)
+        arena_size += n_procs * sizeof(stage_time_t) + JOB_ARENA_ALIGN;
+    BOOL is_relayed = pipe_relay_enabled && n_procs > 1;
+    if (is_relayed)
+        arena_size += (n_procs - 1) * sizeof(pipe_relay_t *) + JOB_ARENA_ALIGN;
+    job->arena = job_arena_new(arena_size);
+    if (job->arena == NULL) {
+        print_err(L"spawn_job -> job_arena_new");
+        return SPAWNJOB_SYSCALL_FAILURE;
+    }
+    job->proc_hs = job_arena_alloc(job->arena, n_procs * sizeof(HANDLE));
+    job->cmdline = job_arena_intern_cmdline(
+        job->arena, 
+        job_cmdline, 
+        len_job_cmdline
+    );
+    job->len_cmdline = len_job_cmdline;
+    WCHAR *cwd_copy = job_arena_alloc(job->arena, 
+                                      (len_cwd + 1) * sizeof(WCHAR));
+    memcpy(cwd_copy, cwd, (len_cwd + 1) * sizeof(WCHAR));
+    job->cwd = cwd_copy;
+    job->last_proc_h = NULL;
+    job->exit_code = 0;
+    job->started_at = GetTickCount64();
+    job->stage_times = NULL;
+    job->n_stages = 0;
+    if (is_timed) {
+        job->stage_times = job_arena_alloc(
+            job->arena, 
+            n_procs * sizeof(stage_time_t)
+        );
+    }
+    job->group_pid = 0;
+    job->relays = NULL;
+    job->n_relays = 0;
+    if (is_relayed) {
+        job->relays = job_arena_alloc(
+            job->arena, 
+            (n_procs - 1) * sizeof(pipe_relay_t *)
+        );
+    }
+    job_n_procs_alive[jid] = 0;
 
     // Iterate through all processes
     for (int proc_i = 0; proc_i < n_procs; proc_i++) {
 
         parsed_process_t *curr_parsed_proc = &parsed_procs[proc_i];
+        in_file_h = out_file_h = INVALID_HANDLE_VALUE;
 
         // ---------- Output redirection ----------
 
         // Output is piped: create a pipe 
         if (curr_parsed_proc->pipe_output) {
-            bool_rc = create_my_pipe(&my_next_read_pipe, &dup_write_pipe);
+            TRACE(TRACE_PIPE_BEGIN, proc_i);
+            bool_rc = plat_pipe(&my_next_read_pipe, &dup_write_pipe);
+            TRACE(TRACE_PIPE_END, proc_i);
             if (!bool_rc) {
-                print_err(L"spawn_job -> create_my_pipe");
+                print_err(L"spawn_job -> plat_pipe");
                 terminate_job(job);
                 return SPAWNJOB_SYSCALL_FAILURE;
             }
-            startup_info.hStdOutput = dup_write_pipe;
+            stdio.std_out = dup_write_pipe;
         }
 
         // We need to redirect output to a file
         else if (curr_parsed_proc->out_file[0] != L'\0') {
-            out_file_h = open_out_file(curr_parsed_proc->out_file);
+            out_file_h = open_out_file(
+                job->cwd, 
+                curr_parsed_proc->out_file,
+                curr_parsed_proc->out_append
+            );
             if (out_file_h != INVALID_HANDLE_VALUE)
-                startup_info.hStdOutput = out_file_h;
+                stdio.std_out = out_file_h;
             else 
-                startup_info.hStdOutput = stdout_h;
+                stdio.std_out = stdout_h;
         }
 
         // Output just goes to stdout
         else {
-            startup_info.hStdOutput = stdout_h;
+            stdio.std_out = stdout_h;
         }
 
         // ---------- Input redirection ----------
 
+        // Input is piped through a relay (pipestat on)
+        if (curr_parsed_proc->pipe_input && job->relays != NULL) {
+            bool_rc = start_pipe_relay(
+                job,
+                my_prev_read_pipe,              // taken over by the relay
+                parsed_procs[proc_i - 1].application_name,
+                curr_parsed_proc->application_name,
+                &dup_prev_read_pipe
+            );
+            if (!bool_rc) {
+                CloseHandle(my_prev_read_pipe);
+                print_err(L"spawn_job -> start_pipe_relay");
+                terminate_job(job);
+                return SPAWNJOB_SYSCALL_FAILURE;
+            }
+            stdio.std_in = dup_prev_read_pipe;
+        }
+
         // Input is piped: Make previous pipe inheritable
-        if (curr_parsed_proc->pipe_input) {
-            bool_rc = dup_uninherit_to_inherit(
+        else if (curr_parsed_proc->pipe_input) {
+            bool_rc = plat_make_inheritable(
                 my_prev_read_pipe,              // my_prev_read_pipe now closed
                 &dup_prev_read_pipe
             );
             if (!bool_rc) {
                 CloseHandle(my_prev_read_pipe);
-                print_err(L"DuplicateHandle my_prev_read_pipe");
+                print_err(L"spawn_job -> plat_make_inheritable");
+                terminate_job(job);
+                return SPAWNJOB_SYSCALL_FAILURE;
+            }
+            stdio.std_in = dup_prev_read_pipe;
+        }
+
+        // Input is a here-string or here-document: a writer thread feeds it
+        else if (curr_parsed_proc->here_data != NULL) {
+            bool_rc = start_here_writer(
+                curr_parsed_proc->here_data,
+                curr_parsed_proc->len_here_data,
+                &here_read_h
+            );
+            if (!bool_rc) {
+                print_err(L"spawn_job -> start_here_writer");
                 terminate_job(job);
                 return SPAWNJOB_SYSCALL_FAILURE;
             }
-            startup_info.hStdInput = dup_prev_read_pipe;
+            stdio.std_in = here_read_h;
         }
 
         // Input is redirected to a file
         else if (curr_parsed_proc->in_file[0] != L'\0') {
-            in_file_h = open_in_file(curr_parsed_proc->in_file);
+            in_file_h = open_in_file(job->cwd, curr_parsed_proc->in_file);
             if (in_file_h != INVALID_HANDLE_VALUE)
-                startup_info.hStdInput = in_file_h;
+                stdio.std_in = in_file_h;
             else
-                startup_info.hStdInput = stdin_h;
+                stdio.std_in = stdin_h;
         }
 
         // Input just comes from stdin
         else {
-            startup_info.hStdInput = stdin_h;
+            stdio.std_in = stdin_h;
         }
 
         // ---------- Builtins ----------
 
+        // The stage a builtin pipes into is only started once it's done
+        spooled_out_h = curr_parsed_proc->pipe_output ? stdio.std_out : NULL;
+
         // exit
         if (wcscmp(curr_parsed_proc->application_name, L"exit") == 0) {
-            exit_builtin(curr_parsed_proc, &startup_info);
+            exit_builtin(curr_parsed_proc, &stdio);
         }
 
         // jobs
         else if (wcscmp(curr_parsed_proc->application_name, L"jobs") == 0) {
-            jobs_builtin(curr_parsed_proc, &startup_info);
+            jobs_builtin(curr_parsed_proc, &stdio);
         }
 
         // kill
         else if (wcscmp(curr_parsed_proc->application_name, L"kill") == 0) {
-            kill_builtin(curr_parsed_proc, &startup_info);
+            kill_builtin(curr_parsed_proc, &stdio);
         }
 
         // cd
         else if (wcscmp(curr_parsed_proc->application_name, L"cd") == 0) {
-            cd_builtin(curr_parsed_proc, &startup_info);
+            cd_builtin(curr_parsed_proc, &stdio);
         }
 
         // pwd
         else if (wcscmp(curr_parsed_proc->application_name, L"pwd") == 0) {
-            pwd_builtin(curr_parsed_proc, &startup_info);
+            pwd_builtin(curr_parsed_proc, &stdio);
+        }
+
+        // history
+        else if (wcscmp(curr_parsed_proc->application_name, L"history") == 0) {
+            history_builtin(curr_parsed_proc, &stdio);
+        }
+
+        // trace
+        else if (wcscmp(curr_parsed_proc->application_name, L"trace") == 0) {
+            trace_builtin(curr_parsed_proc, &stdio);
+        }
+
+        // stats
+        else if (wcscmp(curr_parsed_proc->application_name, L"stats") == 0) {
+            stats_builtin(curr_parsed_proc, &stdio);
+        }
+
+        // pipestat
+        else if (wcscmp(curr_parsed_proc->application_name, L"pipestat") == 0) {
+            pipestat_builtin(curr_parsed_proc, &stdio);
         }
 
         // ---------- Process spawning ----------
         else {
 
-            PROCESS_INFORMATION proc_info;
-
-            // Setup CreateProcessW creation flags
-            DWORD dwCreationFlags = CREATE_UNICODE_ENVIRONMENT;
-            if (job->n_procs_alive == 0) {
-                dwCreationFlags |= CREATE_NEW_PROCESS_GROUP;
+            HANDLE proc_h;
+
+            spooled_out_h = NULL; // not a builtin after all
+            DWORD pid = 0;
+
+            // In-process builtins (echo, cat, sleep, ...): no process, but
+            // a HANDLE that's waited on and reaped like one
+            if (is_inproc_builtin(curr_parsed_proc->application_name)) {
+                bool_rc = start_inproc_stage(
+                    curr_parsed_proc,
+                    stdio.std_in,
+                    stdio.std_out,
+                    &proc_h
+                );
+                if (!bool_rc) {
+                    print_err(L"spawn_job -> start_inproc_stage");
+                    terminate_job(job);
+                    return SPAWNJOB_SYSCALL_FAILURE;
+                }
             }
 
-            // TODO: resolve application_name to absolute path
+            else {
+
+                // Find the executable on PATH (remembered for the next time)
+                WCHAR app_path[MAX_PATH + 1];
+                const WCHAR *application_name = 
+                    curr_parsed_proc->application_name;
+                if (resolve_app_path(application_name, job->cwd, app_path))
+                    application_name = app_path;
+
+                plat_spawn_t spawn_spec = {
+                    .application_name = application_name,
+                    .cmd_line = curr_parsed_proc->cmd_line,
+                    .std_in = stdio.std_in,
+                    .std_out = stdio.std_out,
+                    .std_err = stdio.std_err,
+                    .cwd = job->cwd,
+                    .new_group = job->group_pid == 0
+                };
+
+                TRACE(TRACE_SPAWN_BEGIN, proc_i);
+                bool_rc = plat_spawn(&spawn_spec, &proc_h, &pid);
+                TRACE(TRACE_SPAWN_END, bool_rc ? pid : 0);
+                if (!bool_rc) { // plat_spawn failed
+                    print_err(L"spawn_job -> plat_spawn");
+                    terminate_job(job);
+                    return SPAWNJOB_SYSCALL_FAILURE;
+                }
+                if (job->group_pid == 0)
+                    job->group_pid = pid; // leads the job's process group
+            }
 
-            // Call CreateProcessW
-            bool_rc = CreateProcessW(
-                curr_parsed_proc->application_name,
-                curr_parsed_proc->cmd_line,
-                NULL,
-                NULL,
-                TRUE,
-                dwCreationFlags,
-                NULL, // envp,
-                NULL, // curr_dir,
-                &startup_info,
-                &proc_info
-            );
-            if (!bool_rc) { // CreateProcessW failed
-                print_err(L"spawn_job -> CreateProcessW");
-                terminate_job(job);
-                return SPAWNJOB_SYSCALL_FAILURE;
+            if (job_n_procs_alive[jid] == 0) {
+                activate_job(jid);
+                STAT_TIMER_RECORD(STAT_HIST_START, start_timer);
             }
-            else { // CreateProcessW successful
-                job->proc_hs[job->n_procs_alive++] = proc_info.hProcess;
-                job->status = RUNNING;
-                CloseHandle(proc_info.hThread);
+            job->proc_hs[job_n_procs_alive[jid]++] = proc_h;
+            job->last_proc_h = proc_h;
+            if (job->stage_times != NULL) {
+                stage_time_t *stage = &job->stage_times[job->n_stages++];
+                memset(stage, 0, sizeof(stage_time_t));
+                stage->proc_h = proc_h;
+                wcsncpy(
+                    stage->name, 
+                    curr_parsed_proc->application_name, 
+                    STAGE_NAME_CAP - 1
+                );
             }
         }
 
         // ---------- Clean up ----------
+        spooled_out_h = NULL;
         if (curr_parsed_proc->pipe_output
              && dup_write_pipe != INVALID_HANDLE_VALUE)
             CloseHandle(dup_write_pipe);
         if (curr_parsed_proc->pipe_input
              && dup_prev_read_pipe != INVALID_HANDLE_VALUE)
             CloseHandle(dup_prev_read_pipe);
-        if (curr_parsed_proc->in_file[0] != L'\0'
-             && in_file_h != INVALID_HANDLE_VALUE)
+        if (in_file_h != INVALID_HANDLE_VALUE)
             CloseHandle(in_file_h);
-        if (curr_parsed_proc->out_file[0] != L'\0'
-             && out_file_h != INVALID_HANDLE_VALUE)
+        if (!curr_parsed_proc->pipe_input
+             && curr_parsed_proc->here_data != NULL)
+            CloseHandle(here_read_h); // only the child holds the read end now
+        if (out_file_h != INVALID_HANDLE_VALUE)
             CloseHandle(out_file_h);
         my_prev_read_pipe = my_next_read_pipe;
     }
 
-    free(parsed_procs);
-
-    if (job->n_procs_alive == 0) {
+    if (job_n_procs_alive[jid] == 0) {
+        release_pipe_relays(job);
+        job_arena_release(job->arena);
+        job->arena = NULL;
         return SPAWNJOB_EMPTY_JOB;
     }
 
     // Return
     return jid;
 }
+
+
+
+/**
+ * spawn_job
+ *
+ * Does all the work for spawning the job from the given job_cmdline. 
+ * Expands $(...) substitutions, cleans/parses the cmdline, sets up the pipes
+ * and I/O redirection, spawns the processes, and adds the job struct to the
+ * jobs array.
+ *
+ * job_cmdline: Command line of the job.
+ * job_stdout_h: Where the job's output goes unless it's redirected (the 
+ *               shell's stdout, or a capture pipe for a substitution).
+ * cwd: Working directory of the job: shell_cwd, or the directory of a
+ *      "(cd DIR; cmd)" scope. The job keeps its own copy.
+ *
+ * Return Value: Returns the jid of the new job on success. 
+ *               Returns a negative number on failure:
+ *                - SPAWNJOB_EMPTY_PIPE 
+ *                - SPAWNJOB_EMPTY_CMDLINE
+ *                - SPAWNJOB_SYSCALL_FAILURE
+ *                - SPAWNJOB_EMPTY_JOB
+ *                - SPAWNJOB_BAD_SUBSTITUTION
+ *                - SPAWNJOB_CMDLINE_TOO_LONG
+ */
+int32_t spawn_job(const WCHAR *job_cmdline, HANDLE job_stdout_h,
+                  const WCHAR *cwd) {
+
+    int32_t rc;
+
+    if (wcsstr(job_cmdline, L"$(") == NULL) {
+        EnterCriticalSection(&spawn_lock);
+        rc = spawn_expanded_job(job_cmdline, job_stdout_h, cwd);
+        LeaveCriticalSection(&spawn_lock);
+        return rc;
+    }
+
+    WCHAR *expanded_cmdline = malloc((MAX_CMDLINE + 1) * sizeof(WCHAR));
+    if (expanded_cmdline == NULL) {
+        print_err(L"spawn_job -> malloc");
+        return SPAWNJOB_SYSCALL_FAILURE;
+    }
+    rc = expand_substitutions(
+        job_cmdline, 
+        cwd,
+        TRUE,
+        expanded_cmdline, 
+        MAX_CMDLINE + 1
+    );
+    if (rc >= 0) {
+        EnterCriticalSection(&spawn_lock);
+        rc = spawn_expanded_job(expanded_cmdline, job_stdout_h, cwd);
+        LeaveCriticalSection(&spawn_lock);
+    }
+    else {
+        rc = SPAWNJOB_BAD_SUBSTITUTION;
+    }
+    free(expanded_cmdline);
+    return rc;
+}
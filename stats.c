@@ -0,0 +1,255 @@
+
+/**
+ * stats.c
+ *
+ * Storage and reporting for the counters and histograms in stats.h.
+ */
+
+
+
+#include <windows.h>
+#include <string.h>
+#include <wchar.h>
+#include <stdio.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+#ifndef WINSHELL_NO_STATS
+
+
+
+/* stat_counters: Indexed by stat_counter_t. */
+volatile LONG64 stat_counters[N_STAT_COUNTERS];
+
+/* stat_hists: Indexed by stat_hist_t. */
+latency_hist_t stat_hists[N_STAT_HISTS];
+
+static const WCHAR *counter_names[N_STAT_COUNTERS] = {
+    [STAT_JOBS_SPAWNED] = L"jobs_spawned",
+    [STAT_JOBS_FAILED] = L"jobs_failed",
+    [STAT_PROCS_REAPED] = L"procs_reaped",
+    [STAT_CMDLINE_INTERN_HITS] = L"cmdline_intern_hits",
+    [STAT_OUT_BYTES] = L"builtin_bytes_written",
+    [STAT_XARGS_ITEMS] = L"xargs_items",
+    [STAT_XARGS_PROCS_SAVED] = L"xargs_procs_saved"
+};
+
+static const WCHAR *hist_names[N_STAT_HISTS] = {
+    [STAT_HIST_PARSE] = L"parse_us",
+    [STAT_HIST_SPAWN] = L"spawn_us",
+    [STAT_HIST_START] = L"start_us",
+    [STAT_HIST_REAP] = L"reap_us"
+};
+
+
+
+/**
+ * bucket_of
+ *
+ * Return Value: Returns the histogram bucket of a value: values below 
+ *               1 << HIST_SUB_BITS get a bucket each, above that every power
+ *               of two is split into 1 << HIST_SUB_BITS buckets.
+ */
+static int32_t bucket_of(uint64_t value) {
+
+    if (value < (1u << HIST_SUB_BITS))
+        return (int32_t)value;
+
+    int32_t msb = 63;
+    while (not (value >> msb & 1))
+        msb--;
+    int32_t sub = (int32_t)(value >> (msb - HIST_SUB_BITS)) 
+                   & ((1 << HIST_SUB_BITS) - 1);
+    int32_t bucket = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+
+
+/**
+ * bucket_high
+ *
+ * Return Value: Returns the highest value that falls in a bucket.
+ */
+static uint64_t bucket_high(int32_t bucket) {
+
+    if (bucket < (1 << HIST_SUB_BITS))
+        return bucket;
+
+    int32_t msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    uint64_t low = ((uint64_t)1 << msb) | (sub << (msb - HIST_SUB_BITS));
+    return low + ((uint64_t)1 << (msb - HIST_SUB_BITS)) - 1;
+}
+
+
+
+/**
+ * hist_percentile
+ *
+ * Return Value: Returns the value (bucket upper bound, capped at the max) 
+ *               below which pct percent of the recorded values fall.
+ */
+static int64_t hist_percentile(const latency_hist_t *hist, int32_t pct) {
+
+    if (hist->count == 0)
+        return 0;
+    int64_t rank = (hist->count * pct + 99) / 100;
+    int64_t seen = 0;
+    for (int32_t bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        seen += hist->buckets[bucket];
+        if (seen >= rank) {
+            int64_t high = (int64_t)bucket_high(bucket);
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+
+/**
+ * stats_percentile
+ *
+ * Return Value: Returns the value (bucket upper bound, capped at the max)
+ *               below which pct percent of a histogram's values fall.
+ */
+int64_t stats_percentile(stat_hist_t hist, int32_t pct) {
+    return hist_percentile(&stat_hists[hist], pct);
+}
+
+
+
+/**
+ * stats_record_since
+ *
+ * Records the microseconds elapsed since start in a histogram.
+ *
+ * hist: Histogram to record in.
+ * start: QueryPerformanceCounter value when the timed work started.
+ */
+void stats_record_since(stat_hist_t hist, const LARGE_INTEGER *start) {
+
+    static LARGE_INTEGER freq = { 0 };
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    int64_t ticks = now.QuadPart - start->QuadPart;
+    int64_t us = ticks / freq.QuadPart * 1000000 
+                  + ticks % freq.QuadPart * 1000000 / freq.QuadPart;
+
+    latency_hist_t *h = &stat_hists[hist];
+    h->buckets[bucket_of((uint64_t)us)]++;
+    h->count++;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+}
+
+
+
+/**
+ * stats_reset
+ *
+ * Zeroes every counter and histogram.
+ */
+void stats_reset() {
+
+    for (int32_t i = 0; i < N_STAT_COUNTERS; i++)
+        InterlockedExchange64(&stat_counters[i], 0);
+    memset(stat_hists, 0, sizeof(stat_hists));
+}
+
+
+
+/**
+ * stats_write
+ *
+ * Writes the counters, the gauges (wait set size and jid table occupancy)
+ * and a summary of each histogram to stream, as aligned text or as JSON.
+ * Write failures show up when the stream is flushed.
+ */
+void stats_write(out_stream_t *stream, BOOL as_json) {
+
+    WCHAR line[192];
+    int len;
+
+    int32_t n_live_jobs = 0;
+    for (int32_t jid = live_jobs_head; jid >= 0; jid = jobs[jid].next_live)
+        n_live_jobs++;
+
+    if (as_json)
+        out_stream_puts(stream, L"{\"counters\":{");
+    for (int32_t i = 0; i < N_STAT_COUNTERS; i++) {
+        len = _snwprintf(
+            line, 
+            192, 
+            as_json ? L"%ls\"%ls\":%lld" : L"%ls%-24ls %lld\n",
+            as_json and i > 0 ? L"," : L"",
+            counter_names[i], 
+            (long long)stat_counters[i]
+        );
+        if (len > 0)
+            out_stream_write(stream, line, len);
+    }
+
+    if (as_json) {
+        len = _snwprintf(
+            line,
+            192,
+            L"},\"gauges\":{\"wait_handles\":%d,\"live_jobs\":%d,"
+            L"\"jid_capacity\":%d},\"histograms\":{",
+            n_wait_handles,
+            n_live_jobs,
+            cap_jobs
+        );
+    }
+    else {
+        len = _snwprintf(
+            line,
+            192,
+            L"%-24ls %d\n%-24ls %d / %d\n",
+            L"wait_handles",
+            n_wait_handles,
+            L"live_jobs",
+            n_live_jobs,
+            cap_jobs
+        );
+    }
+    if (len > 0)
+        out_stream_write(stream, line, len);
+
+    for (int32_t i = 0; i < N_STAT_HISTS; i++) {
+        const latency_hist_t *h = &stat_hists[i];
+        len = _snwprintf(
+            line,
+            192,
+            as_json ? L"%ls\"%ls\":{\"count\":%lld,\"mean\":%lld,\"p50\":%lld,"
+                      L"\"p90\":%lld,\"p99\":%lld,\"max\":%lld}"
+                    : L"%ls%-24ls count %lld  mean %lld  p50 %lld  p90 %lld"
+                      L"  p99 %lld  max %lld\n",
+            as_json and i > 0 ? L"," : L"",
+            hist_names[i],
+            h->count,
+            h->count > 0 ? h->sum / h->count : 0,
+            hist_percentile(h, 50),
+            hist_percentile(h, 90),
+            hist_percentile(h, 99),
+            h->max
+        );
+        if (len > 0)
+            out_stream_write(stream, line, len);
+    }
+    if (as_json)
+        out_stream_puts(stream, L"}}\n");
+}
+
+
+
+// ifndef WINSHELL_NO_STATS
+#endif
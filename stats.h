@@ -0,0 +1,106 @@
+
+/**
+ * stats.h
+ *
+ * Shell counters and latency histograms, and the macros that record them.
+ * Defining WINSHELL_NO_STATS at build time turns every macro into nothing.
+ */
+
+
+
+#ifndef _STATS_H
+#define _STATS_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/**
+ * stat_counter_t
+ *
+ * Counters, indexes into stat_counters.
+ */
+typedef enum _stat_counter {
+    STAT_JOBS_SPAWNED,
+    STAT_JOBS_FAILED,
+    STAT_PROCS_REAPED,
+    STAT_CMDLINE_INTERN_HITS,
+    STAT_OUT_BYTES,
+    STAT_XARGS_ITEMS,
+    STAT_XARGS_PROCS_SAVED,
+    N_STAT_COUNTERS
+} stat_counter_t;
+
+
+
+/**
+ * stat_hist_t
+ *
+ * Latency histograms, indexes into stat_hists.
+ */
+typedef enum _stat_hist {
+    STAT_HIST_PARSE,
+    STAT_HIST_SPAWN,
+    STAT_HIST_START,    // cmdline expanded -> the job's first stage started
+    STAT_HIST_REAP,
+    N_STAT_HISTS
+} stat_hist_t;
+
+
+
+/* HIST_SUB_BITS: Each power of two range of a histogram is split into 
+                  1 << HIST_SUB_BITS linear buckets (so a bucket is at most 
+                  12.5% wide). */
+#define HIST_SUB_BITS 3
+
+/* HIST_BUCKETS: Number of buckets in a histogram, enough for any value 
+                 below 2^40 microseconds. */
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+
+
+/**
+ * latency_hist_t struct
+ *
+ * HDR-style log-linear histogram of latencies in microseconds.
+ */
+typedef struct _latency_hist {
+    int64_t buckets[HIST_BUCKETS];
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+} latency_hist_t;
+
+
+
+#ifndef WINSHELL_NO_STATS
+
+/* STAT_ADD: Adds n to a counter. Safe from any thread. */
+#define STAT_ADD(counter, n)                                                \
+    InterlockedExchangeAdd64(&stat_counters[(counter)], (int64_t)(n))
+
+/* STAT_TIMER_START: Declares a timer variable and starts it. */
+#define STAT_TIMER_START(timer)                                             \
+    LARGE_INTEGER timer;                                                    \
+    QueryPerformanceCounter(&timer)
+
+/* STAT_TIMER_RECORD: Records the time since STAT_TIMER_START(timer) in a 
+                      histogram. Only the job spawner thread records. */
+#define STAT_TIMER_RECORD(hist, timer)                                      \
+    stats_record_since((hist), &(timer))
+
+#else
+
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_TIMER_START(timer)
+#define STAT_TIMER_RECORD(hist, timer) ((void)0)
+
+#endif
+
+
+
+// ifndef _STATS_H
+#endif
@@ -0,0 +1,63 @@
+
+/**
+ * stats_builtin.c
+ */
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/**
+ * stats_builtin
+ * 
+ * Shows the shell's counters, gauges and latency histograms.
+ *  - stats          prints them as text
+ *  - stats --json   prints them as a JSON object
+ *  - stats --reset  zeroes them (after printing, if combined with --json)
+ * 
+ * parsed_proc: Contains parsed information about the command line that 
+ *              called this builtin.
+ * stdio: Standard streams after redirection - will output to std_out.
+ * 
+ * Return Value: Returns TRUE on success, returns FALSE on failure.
+ */
+BOOL stats_builtin(parsed_process_t *parsed_proc, 
+                   stdio_handles_t *stdio) {
+
+    out_stream_t out;
+
+    out_stream_init(&out, stdio->std_out);
+
+#ifndef WINSHELL_NO_STATS
+    BOOL as_json = FALSE, reset = FALSE;
+    const WCHAR *arg_p = skip_whitespace(arg_end(
+        skip_whitespace(parsed_proc->cmd_line)
+    ));
+    while (*arg_p != L'\0') {
+        const WCHAR *arg_end_p = arg_end(arg_p);
+        if (arg_end_p - arg_p == 6 and wcsncmp(arg_p, L"--json", 6) == 0)
+            as_json = TRUE;
+        else if (arg_end_p - arg_p == 7 and wcsncmp(arg_p, L"--reset", 7) == 0)
+            reset = TRUE;
+        arg_p = skip_whitespace(arg_end_p);
+    }
+
+    if (as_json or not reset)
+        stats_write(&out, as_json);
+    if (reset)
+        stats_reset();
+#else
+    out_stream_puts(&out, L"stats: disabled at build time\n");
+#endif
+
+    if (not out_stream_close(&out)) {
+        print_err(L"stats_builtin -> out_stream_close");
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -8,10 +8,19 @@
 
 
 #include <windows.h>
+#include <string.h>
+#include <wchar.h>
 #include <iso646.h>
 
 
 
+/* SHELL_SPECIALS: Characters that get a word quoted by quote_words, so that
+                   it isn't parsed as a pipe, redirection, background job, 
+                   scope or wildcard. */
+#define SHELL_SPECIALS L"<>|&;()*?["
+
+
+
 /**
  * first_nonescaped_dquote
  * 
@@ -201,3 +210,118 @@ BOOL readjust_quotes(WCHAR *str) {
 
     return TRUE;
 }
+
+
+
+/**
+ * quote_arg
+ *
+ * Quotes an argument so that it reaches the child as it is (CreateProcessW
+ * and CommandLineToArgvW rules): if it's empty or has whitespace or quotes
+ * (or force_quotes is set), it's put in quotes, quotes in it are escaped, 
+ * and backslashes before a quote are doubled.
+ *
+ * out: Quoted argument is written here (not NULL-terminated). NULL to only
+ *      get its length.
+ *
+ * Return Value: Returns the length of the quoted argument.
+ */
+int32_t quote_arg(const WCHAR *arg, int32_t len_arg, BOOL force_quotes,
+                  WCHAR *out) {
+
+    BOOL needs_quotes = force_quotes or len_arg == 0;
+    for (int32_t i = 0; i < len_arg and not needs_quotes; i++)
+        needs_quotes = arg[i] == L'"' or iswspace(arg[i]);
+    if (not needs_quotes) {
+        if (out != NULL)
+            memcpy(out, arg, len_arg * sizeof(WCHAR));
+        return len_arg;
+    }
+
+    int32_t len_out = 0;
+    if (out != NULL)
+        out[len_out] = L'"';
+    len_out++;
+    for (int32_t i = 0; i <= len_arg; i++) {
+        int32_t n_backslashes = 0;
+        while (i < len_arg and arg[i] == L'\\') {
+            n_backslashes++;
+            i++;
+        }
+        // Backslashes before a quote (or the closing one) are doubled
+        if (i == len_arg or arg[i] == L'"')
+            n_backslashes = 2 * n_backslashes + (i < len_arg);
+        for (int32_t j = 0; j < n_backslashes; j++) {
+            if (out != NULL)
+                out[len_out] = L'\\';
+            len_out++;
+        }
+        if (out != NULL)
+            out[len_out] = i < len_arg ? arg[i] : L'"';
+        len_out++;
+    }
+    return len_out;
+}
+
+
+
+/**
+ * quote_words
+ *
+ * Writes text into a command line so that it's only split into words (at
+ * whitespace): each word is quoted if it has quotes or SHELL_SPECIALS in 
+ * it, so a ">" or "|" in it is an argument rather than a redirection or a 
+ * pipe. Between double quotes, the text stays one argument instead: only 
+ * its quotes (and the backslashes before them) are escaped.
+ *
+ * is_in_quotes: Is the text going between double quotes?
+ * is_before_quote: Is it followed by one (so backslashes it ends with have
+ *                  to be doubled)?
+ *
+ * Return Value: Returns the number of WCHARs written to out, -1 if they 
+ *               don't fit in cap_out.
+ */
+int32_t quote_words(const WCHAR *text, int32_t len_text, BOOL is_in_quotes,
+                    BOOL is_before_quote, WCHAR *out, int32_t cap_out) {
+
+    if (is_in_quotes) {
+        int32_t len_quoted = quote_arg(text, len_text, TRUE, NULL);
+        if (len_quoted > cap_out)
+            return -1;
+        quote_arg(text, len_text, TRUE, out);
+        int32_t len_out = len_quoted - 2;
+        memmove(out, out + 1, len_out * sizeof(WCHAR));
+        // Trailing backslashes were doubled for a closing quote
+        for (int32_t i = len_text - 1; 
+             not is_before_quote and i >= 0 and text[i] == L'\\'; i--)
+            len_out--;
+        return len_out;
+    }
+
+    int32_t len_out = 0;
+    int32_t i = 0;
+    while (TRUE) {
+        while (i < len_text and iswspace(text[i]))
+            i++;
+        if (i == len_text)
+            break;
+
+        const WCHAR *word = text + i;
+        BOOL is_special = FALSE;
+        for (; i < len_text and not iswspace(text[i]); i++) {
+            is_special = is_special 
+                          or (text[i] != L'\0' 
+                               and wcschr(SHELL_SPECIALS, text[i]) != NULL);
+        }
+        int32_t len_word = (int32_t)(text + i - word);
+
+        int32_t len_quoted = quote_arg(word, len_word, is_special, NULL);
+        if (len_out + (len_out > 0) + len_quoted > cap_out)
+            return -1;
+        if (len_out > 0)
+            out[len_out++] = L' ';
+        quote_arg(word, len_word, is_special, out + len_out);
+        len_out += len_quoted;
+    }
+    return len_out;
+}
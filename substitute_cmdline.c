@@ -0,0 +1,412 @@
+
+/**
+ * substitute_cmdline.c
+ *
+ * $(pipeline) command substitution. The inner pipeline is spawned as a job
+ * with its stdout on a pipe, a reader thread drains the pipe into a capture
+ * buffer (so that builtins writing into the pipe can't block on it), and 
+ * the trimmed output replaces the $(...) in the command line. The output is
+ * quoted as it goes in, so it's only split into words - a ">" or "|" in it
+ * is an argument, not a redirection or a pipe. Script assignments take the
+ * output as it is.
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* CAPTURE_READ_CHUNK: Bytes requested by each ReadFile of the capture 
+                       pipe. */
+#define CAPTURE_READ_CHUNK (1 << 16)
+
+/* MAX_SUBST_DEPTH: How deep $(...) can be nested. */
+#define MAX_SUBST_DEPTH 8
+
+
+
+/**
+ * capture_t struct
+ *
+ * Output of a substitution, as read from its pipe by the capture thread.
+ */
+typedef struct _capture {
+
+    /* buf: The output. Reused (and grown) by every substitution at the same
+            depth - the result is always converted out of it before the 
+            next one at that depth starts. */
+    BYTE *buf;
+    DWORD len_buf, cap_buf;
+
+    /* failed: Set by the capture thread if buf couldn't grow. */
+    BOOL failed;
+
+    /* read_h: Read end of the pipe being captured. */
+    HANDLE read_h;
+
+} capture_t;
+
+
+
+/* captures: One capture per nesting depth - an inner substitution runs while
+             the outer one's capture is still being filled. */
+static capture_t captures[MAX_SUBST_DEPTH];
+
+/* subst_depth: Nesting depth of the substitution being expanded. */
+static int32_t subst_depth = 0;
+
+
+
+/**
+ * write_subst_err
+ *
+ * Writes a command substitution error message to stderr.
+ */
+static void write_subst_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, message);
+    out_stream_close(&err);
+}
+
+
+
+/**
+ * capture_tproc
+ *
+ * Reads a capture pipe into its capture until EOF.
+ *
+ * arg: capture_t to fill. Its read end of the pipe is in read_h.
+ */
+static DWORD WINAPI capture_tproc(void *arg) {
+
+    capture_t *capture = arg;
+    HANDLE read_h = capture->read_h;
+    DWORD bytes_read;
+
+    while (TRUE) {
+        if (capture->len_buf + CAPTURE_READ_CHUNK > capture->cap_buf) {
+            DWORD new_cap = capture->cap_buf ? capture->cap_buf * 2 
+                                             : CAPTURE_READ_CHUNK * 2;
+            BYTE *new_buf = realloc(capture->buf, new_cap);
+            if (new_buf == NULL) {
+                capture->failed = TRUE;
+                break;
+            }
+            capture->buf = new_buf;
+            capture->cap_buf = new_cap;
+        }
+        if (not ReadFile(read_h, capture->buf + capture->len_buf,
+                         CAPTURE_READ_CHUNK, &bytes_read, NULL)
+             or bytes_read == 0)
+            break; // EOF (ERROR_BROKEN_PIPE) or error
+        capture->len_buf += bytes_read;
+    }
+
+    // Keep draining so the writers never block
+    BYTE discard[4096];
+    while (capture->failed 
+            and ReadFile(read_h, discard, 4096, &bytes_read, NULL)
+            and bytes_read > 0);
+
+    return 0;
+}
+
+
+
+/**
+ * decode_capture
+ *
+ * Converts a capture to UTF-16: UTF-16LE if it has a BOM or looks like 
+ * UTF-16, else UTF-8, else the OEM code page. Line breaks become spaces and
+ * surrounding whitespace is trimmed.
+ *
+ * Return Value: Returns the number of WCHARs written to out, -1 if they 
+ *               don't fit in cap_out.
+ */
+static int32_t decode_capture(const capture_t *capture, WCHAR *out, 
+                              int32_t cap_out) {
+
+    const BYTE *bytes = capture->buf;
+    DWORD n_bytes = capture->len_buf;
+    int32_t n_wchars;
+
+    if (n_bytes >= 2 and bytes[0] == 0xFF and bytes[1] == 0xFE) {
+        bytes += 2;
+        n_bytes -= 2;
+        goto utf16;
+    }
+    if (n_bytes >= 2 and bytes[1] == 0 and bytes[0] != 0) {
+        goto utf16;
+    }
+    if (n_bytes >= 3 and bytes[0] == 0xEF and bytes[1] == 0xBB 
+         and bytes[2] == 0xBF) {
+        bytes += 3;
+        n_bytes -= 3;
+    }
+
+    if (n_bytes == 0) {
+        n_wchars = 0;
+    }
+    else {
+        n_wchars = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, 
+                                       (const char *)bytes, (int)n_bytes, 
+                                       out, cap_out);
+        if (n_wchars == 0 and GetLastError() == ERROR_NO_UNICODE_TRANSLATION)
+            n_wchars = MultiByteToWideChar(CP_OEMCP, 0, (const char *)bytes,
+                                           (int)n_bytes, out, cap_out);
+        if (n_wchars == 0)
+            return -1;
+    }
+    goto trim;
+
+utf16:
+    if ((int32_t)(n_bytes / 2) > cap_out)
+        return -1;
+    n_wchars = utf16le_to_wchar(bytes, (int32_t)(n_bytes / 2), out);
+
+trim:
+    for (int32_t i = 0; i < n_wchars; i++) {
+        if (out[i] == L'\r' or out[i] == L'\n' or out[i] == L'\t')
+            out[i] = L' ';
+    }
+    while (n_wchars > 0 and out[n_wchars - 1] == L' ')
+        n_wchars--;
+    int32_t start = 0;
+    while (start < n_wchars and out[start] == L' ')
+        start++;
+    memmove(out, out + start, (n_wchars - start) * sizeof(WCHAR));
+    return n_wchars - start;
+}
+
+
+
+/**
+ * run_capture
+ *
+ * Runs an inner pipeline with its stdout on a pipe and waits for it to 
+ * finish.
+ *
+ * capture: Where its output ends up.
+ * inner: NULL-terminated inner pipeline (altered by spawn_job).
+ * cwd: Working directory to run it in.
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+static BOOL run_capture(capture_t *capture, WCHAR *inner, const WCHAR *cwd) {
+
+    HANDLE read_h, write_h;
+
+    // write_h is inheritable until it's closed below
+    EnterCriticalSection(&spawn_lock);
+    if (not plat_pipe(&read_h, &write_h)) {
+        LeaveCriticalSection(&spawn_lock);
+        print_err(L"run_capture -> plat_pipe");
+        return FALSE;
+    }
+
+    capture->len_buf = 0;
+    capture->failed = FALSE;
+    capture->read_h = read_h;
+    HANDLE capture_thread_h = CreateThread(NULL, 0, capture_tproc, capture, 
+                                           0, NULL);
+    if (capture_thread_h == NULL) {
+        print_err(L"run_capture -> CreateThread");
+        plat_close(read_h);
+        plat_close(write_h);
+        LeaveCriticalSection(&spawn_lock);
+        return FALSE;
+    }
+
+    // The inner job's jid mustn't stick to the outer job's errors
+    int32_t outer_err_jid = print_err_jid;
+    int32_t jid = spawn_job(inner, write_h, cwd);
+    print_err_jid = outer_err_jid;
+    plat_close(write_h); // only the children hold the write end now
+    LeaveCriticalSection(&spawn_lock);
+
+    // Wait for the inner job and reap it like any other
+    if (jid >= 0) {
+        append_to_wait_handles(jobs[jid].proc_hs, job_n_procs_alive[jid]);
+        while (job_status[jid] == RUNNING and jobs[jid].proc_hs != NULL) {
+            int32_t i = plat_wait_any(
+                jobs[jid].proc_hs, 
+                job_n_procs_alive[jid], 
+                PLAT_INFINITE
+            );
+            if (i < 0) {
+                print_err(L"run_capture -> plat_wait_any");
+                break;
+            }
+            reap_proc(jobs[jid].proc_hs[i]);
+        }
+    }
+
+    WaitForSingleObject(capture_thread_h, INFINITE);
+    CloseHandle(capture_thread_h);
+    plat_close(read_h);
+
+    if (jid == SPAWNJOB_SYSCALL_FAILURE or capture->failed)
+        return FALSE;
+    return TRUE;
+}
+
+
+
+/**
+ * is_escaped
+ *
+ * Return Value: Returns TRUE if the character at p (in the string starting 
+ *               at str) is escaped by an odd number of backslashes.
+ */
+static BOOL is_escaped(const WCHAR *str, const WCHAR *p) {
+
+    int32_t n_backslashes = 0;
+    while (p - n_backslashes > str and p[-n_backslashes - 1] == L'\\')
+        n_backslashes++;
+    return n_backslashes % 2 == 1;
+}
+
+
+
+/**
+ * find_subst_end
+ *
+ * Return Value: Returns a pointer to the ')' closing the $( that ends just
+ *               before inner, or NULL if there isn't one. Parentheses inside
+ *               double quotes (not \" escaped ones) don't count.
+ */
+static const WCHAR *find_subst_end(const WCHAR *inner) {
+
+    int32_t depth = 1;
+    BOOL in_quotes = FALSE;
+
+    for (const WCHAR *p = inner; *p != L'\0'; p++) {
+        if (*p == L'"' and not is_escaped(inner, p))
+            in_quotes = not in_quotes;
+        else if (in_quotes)
+            continue;
+        else if (*p == L'(')
+            depth++;
+        else if (*p == L')' and --depth == 0)
+            return p;
+    }
+    return NULL;
+}
+
+
+
+/**
+ * expand_substitutions
+ * 
+ * Replaces every $(pipeline) in a command line with the trimmed output of 
+ * running pipeline (nested substitutions are expanded by the inner spawn).
+ * Errors are written to stderr.
+ * 
+ * cmdline: Command line to expand.
+ * cwd: Working directory the pipelines run in (the outer job's).
+ * is_quoted: Quote the output (see quote_words) so that it's only split 
+ *            into words, rather than paste it as it is (a variable's 
+ *            value).
+ * out: Expanded command line is written here (NULL-terminated).
+ * cap_out: Capacity of out in WCHARs.
+ * 
+ * Return Value: Returns the length of the expanded command line.
+ *               Returns -1 on failure.
+ */
+int32_t expand_substitutions(const WCHAR *cmdline, const WCHAR *cwd,
+                             BOOL is_quoted, WCHAR *out, int32_t cap_out) {
+
+    int32_t len_out = 0;
+    BOOL is_in_quotes = FALSE;
+
+    if (subst_depth >= MAX_SUBST_DEPTH) {
+        write_subst_err(L"Error: command substitution nested too deep\n");
+        return -1;
+    }
+
+    // Output is decoded here, then quoted into out
+    WCHAR *text = is_quoted ? malloc(cap_out * sizeof(WCHAR)) : NULL;
+    if (is_quoted and text == NULL) {
+        print_err(L"expand_substitutions -> malloc");
+        return -1;
+    }
+
+    const WCHAR *p = cmdline;
+    while (*p != L'\0') {
+
+        const WCHAR *dollar_p = wcsstr(p, L"$(");
+        size_t len_literal = dollar_p ? dollar_p - p : wcslen(p);
+        if (len_out + len_literal + 1 > (size_t)cap_out)
+            goto too_long;
+        for (size_t i = 0; i < len_literal; i++) {
+            if (p[i] == L'"' and not is_escaped(p, p + i))
+                is_in_quotes = not is_in_quotes;
+        }
+        memcpy(out + len_out, p, len_literal * sizeof(WCHAR));
+        len_out += (int32_t)len_literal;
+        if (dollar_p == NULL)
+            break;
+
+        const WCHAR *inner_p = dollar_p + 2;
+        const WCHAR *end_p = find_subst_end(inner_p);
+        if (end_p == NULL) {
+            write_subst_err(L"Error: unterminated $(\n");
+            goto failed;
+        }
+
+        // spawn_job needs its own NULL-terminated copy of the pipeline
+        size_t len_inner = end_p - inner_p;
+        WCHAR *my_inner = malloc((len_inner + 1) * sizeof(WCHAR));
+        if (my_inner == NULL) {
+            print_err(L"expand_substitutions -> malloc");
+            goto failed;
+        }
+        memcpy(my_inner, inner_p, len_inner * sizeof(WCHAR));
+        my_inner[len_inner] = L'\0';
+
+        capture_t *capture = &captures[subst_depth];
+        subst_depth++;
+        BOOL bool_rc = run_capture(capture, my_inner, cwd);
+        subst_depth--;
+        free(my_inner);
+        if (not bool_rc)
+            goto failed;
+
+        int32_t len_output;
+        if (is_quoted) {
+            int32_t len_text = decode_capture(capture, text, cap_out);
+            if (len_text < 0)
+                goto too_long;
+            len_output = quote_words(text, len_text, is_in_quotes,
+                                     end_p[1] == L'"', out + len_out,
+                                     cap_out - len_out - 1);
+        }
+        else {
+            len_output = decode_capture(capture, out + len_out, 
+                                        cap_out - len_out - 1);
+        }
+        if (len_output < 0)
+            goto too_long;
+        len_out += len_output;
+
+        p = end_p + 1;
+    }
+
+    free(text);
+    out[len_out] = L'\0';
+    return len_out;
+
+too_long:
+    write_subst_err(L"Error: command line too long after substitution\n");
+failed:
+    free(text);
+    return -1;
+}
@@ -10,12 +10,20 @@
 
 
 
+/* KILL_WAIT_MS: How long a killed process gets to go away before it's 
+                 given up on (instead of hanging the shell). */
+#define KILL_WAIT_MS 5000
+
+
+
 /**
  * terminate_job
  * 
  * Terminates a job, probably before it's finished.
  * Frees any resources for the job structs.
- * Terminates all active processes (with TerminateProcess).
+ * Terminates all active processes (with TerminateProcess) and in-process
+ * stages. A job marked TERMINATED (by kill) goes to the completion history;
+ * any other (one that failed while being spawned) is just freed.
  * 
  * job: Contains information on the job that failed - was in the process of 
  *      being built.
@@ -25,35 +33,45 @@
 BOOL terminate_job(job_t *job) {
 
     BOOL bool_rc;
-    DWORD dw_rc, exit_code;
+    DWORD exit_code;
 
-    // kill all processes
-    for (int i = 0; i < job->n_procs_alive; i++) {
-        HANDLE proc_h = job->proc_hs[i];
-        DWORD pid = GetProcessId(proc_h);
-        bool_rc = TerminateProcess(proc_h, 1);
+    // kill all processes first, so that they die in parallel
+    for (int i = 0; i < job_n_procs_alive[job->jid]; i++) {
+        bool_rc = stage_terminate(job->proc_hs[i], 1);
         if (!bool_rc) {
-            print_err(L"terminate_job -> TerminateProcess");
-            continue;
+            print_err(L"terminate_job -> stage_terminate");
+        }
+    }
+
+    // then collect them
+    for (int i = 0; i < job_n_procs_alive[job->jid]; i++) {
+        HANDLE proc_h = job->proc_hs[i];
+        int32_t wait_rc = plat_wait_any(&proc_h, 1, KILL_WAIT_MS);
+        if (wait_rc == PLAT_WAIT_FAILED) {
+            print_err(L"terminate_job -> plat_wait_any");
+        }
+        else if (wait_rc == PLAT_WAIT_TIMEOUT) {
+            print_err(L"terminate_job -> plat_wait_any timed out");
         }
-        do {
-            dw_rc = WaitForSingleObject(proc_h, INFINITE);
-            if (dw_rc == WAIT_FAILED) {
-                print_err(L"terminate_job -> WaitForSingleObject");
-                break;
-            }
-            bool_rc = GetExitCodeProcess(proc_h, &exit_code);
-        } while(bool_rc && exit_code == STILL_ACTIVE);
-
-        CloseHandle(proc_h);
+        if (stage_query_exit(proc_h, &exit_code) // collects it
+             && proc_h == job->last_proc_h)
+            job->exit_code = exit_code;
+
+        stage_close(proc_h);
         // Try to remove process HANDLE from wait_handles (may already be removed)
         handle_arr_remove(wait_handles, &n_wait_handles, proc_h);
     }
 
+    if (job_status[job->jid] == TERMINATED) {
+        record_completion(job->jid);
+        return TRUE;
+    }
+
     // Free job resources
-    free(job->proc_hs);
-    free(job->cmdline);
-    job->status = GARBAGE;
+    release_pipe_relays(job);
+    job_arena_release(job->arena);
+    job->arena = NULL;
+    release_job(job->jid);
 
     return TRUE;
 }
\ No newline at end of file
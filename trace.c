@@ -0,0 +1,293 @@
+
+/**
+ * trace.c
+ *
+ * Lifecycle tracing. Every thread that records an event gets its own ring
+ * buffer, so recording takes no lock: only the owning thread writes a ring,
+ * and it publishes its event count with an interlocked store. Dumps are 
+ * written in the Chrome trace event format (also read by Perfetto).
+ */
+
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* TRACE_RING_CAP: Events kept per thread (oldest are overwritten). Must be a
+                   power of two. */
+#define TRACE_RING_CAP (1 << 16)
+
+/* TRACE_MAX_THREADS: Most threads that can record events. */
+#define TRACE_MAX_THREADS 8
+
+
+
+/**
+ * trace_record_t
+ *
+ * A single recorded event.
+ */
+typedef struct _trace_record {
+    LONGLONG ticks;
+    int64_t arg;
+    trace_event_kind_t kind;
+} trace_record_t;
+
+
+
+/**
+ * trace_ring_t
+ *
+ * Ring of one thread's events.
+ */
+typedef struct _trace_ring {
+    DWORD tid;
+    volatile LONG64 n_records; // free-running, written by the owner only
+    trace_record_t records[TRACE_RING_CAP];
+} trace_ring_t;
+
+
+
+/**
+ * trace_kind_info_t
+ *
+ * How an event kind appears in the dump.
+ */
+typedef struct _trace_kind_info {
+    const char *name;
+    char phase; // 'B'egin, 'E'nd or 'i'nstant
+} trace_kind_info_t;
+
+static const trace_kind_info_t kind_infos[N_TRACE_EVENT_KINDS] = {
+    [TRACE_LINE_READ] = { "line_read", 'i' },
+    [TRACE_HANDOFF_SEND] = { "handoff_send", 'i' },
+    [TRACE_HANDOFF_RECV] = { "handoff_recv", 'i' },
+    [TRACE_WAIT_WAKEUP] = { "wait_wakeup", 'i' },
+    [TRACE_PARSE_BEGIN] = { "parse", 'B' },
+    [TRACE_PARSE_END] = { "parse", 'E' },
+    [TRACE_PIPE_BEGIN] = { "create_pipe", 'B' },
+    [TRACE_PIPE_END] = { "create_pipe", 'E' },
+    [TRACE_SPAWN_BEGIN] = { "CreateProcessW", 'B' },
+    [TRACE_SPAWN_END] = { "CreateProcessW", 'E' },
+    [TRACE_REAP_BEGIN] = { "reap_proc", 'B' },
+    [TRACE_REAP_END] = { "reap_proc", 'E' }
+};
+
+
+
+volatile LONG trace_enabled = 0;
+
+/* rings: Ring of each thread that has recorded an event. Slots are claimed
+          with an interlocked increment of n_rings and never given back. */
+static trace_ring_t *rings[TRACE_MAX_THREADS];
+static volatile LONG n_rings = 0;
+
+/* my_ring: The calling thread's ring, NULL until its first event. */
+static THREAD_LOCAL trace_ring_t *my_ring = NULL;
+
+/* my_ring_failed: Set if the calling thread couldn't get a ring. */
+static THREAD_LOCAL BOOL my_ring_failed = FALSE;
+
+
+
+/**
+ * claim_ring
+ *
+ * Gives the calling thread a ring.
+ *
+ * Return Value: Returns the ring, or NULL if every slot is taken or malloc
+ *               failed.
+ */
+static trace_ring_t *claim_ring() {
+
+    LONG slot = InterlockedIncrement(&n_rings) - 1;
+    if (slot >= TRACE_MAX_THREADS) {
+        InterlockedDecrement(&n_rings);
+        return NULL;
+    }
+
+    trace_ring_t *ring = malloc(sizeof(trace_ring_t));
+    if (ring == NULL) {
+        rings[slot] = NULL;
+        return NULL;
+    }
+    ring->tid = GetCurrentThreadId();
+    ring->n_records = 0;
+    InterlockedExchangePointer((PVOID volatile *)&rings[slot], ring);
+    return ring;
+}
+
+
+
+/**
+ * trace_event
+ *
+ * Records an event on the calling thread's ring. Use the TRACE macro instead
+ * so that nothing is done while tracing is off.
+ *
+ * kind: What happened.
+ * arg: Kind-specific number shown in the dump.
+ */
+void trace_event(trace_event_kind_t kind, int64_t arg) {
+
+    LARGE_INTEGER now;
+
+    if (my_ring == NULL) {
+        if (my_ring_failed)
+            return;
+        my_ring = claim_ring();
+        if (my_ring == NULL) {
+            my_ring_failed = TRUE;
+            return;
+        }
+    }
+
+    QueryPerformanceCounter(&now);
+    LONG64 n_records = my_ring->n_records;
+    trace_record_t *record = 
+        &my_ring->records[n_records & (TRACE_RING_CAP - 1)];
+    record->ticks = now.QuadPart;
+    record->arg = arg;
+    record->kind = kind;
+    InterlockedExchange64(&my_ring->n_records, n_records + 1);
+}
+
+
+
+/**
+ * trace_start
+ *
+ * Clears every ring and starts recording.
+ */
+void trace_start() {
+
+    LONG n = n_rings < TRACE_MAX_THREADS ? n_rings : TRACE_MAX_THREADS;
+    for (LONG i = 0; i < n; i++) {
+        if (rings[i] != NULL)
+            InterlockedExchange64(&rings[i]->n_records, 0);
+    }
+    InterlockedExchange(&trace_enabled, 1);
+}
+
+
+
+/**
+ * trace_stop
+ *
+ * Stops recording. Recorded events are kept for trace_dump.
+ */
+void trace_stop() {
+    InterlockedExchange(&trace_enabled, 0);
+}
+
+
+
+/**
+ * trace_dump
+ *
+ * Writes every recorded event to a file in the Chrome trace event format.
+ * Timestamps are microseconds since the earliest recorded event.
+ *
+ * Note: Events recorded while the dump runs may be cut off or torn - stop
+ *       tracing first for a clean dump.
+ *
+ * path: File to (over)write (relative to shell_cwd).
+ *
+ * Return Value: Returns TRUE on success, FALSE on failure.
+ */
+BOOL trace_dump(const WCHAR *path) {
+
+    LARGE_INTEGER freq;
+    out_stream_t out;
+    WCHAR line[160];
+    WCHAR full_path[MAX_PATH + 1];
+
+    if (not make_abs_path(shell_cwd, path, full_path)) {
+        print_err(L"trace_dump -> make_abs_path");
+        return FALSE;
+    }
+    HANDLE file_h = CreateFileW(
+        full_path,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL
+    );
+    if (file_h == INVALID_HANDLE_VALUE) {
+        print_err(L"trace_dump -> CreateFileW");
+        return FALSE;
+    }
+    out_stream_init(&out, file_h);
+    out.encoding = OUT_ENC_UTF8; // JSON
+
+    QueryPerformanceFrequency(&freq);
+
+    // Earliest timestamp, so that the dump starts at 0
+    LONG n = n_rings < TRACE_MAX_THREADS ? n_rings : TRACE_MAX_THREADS;
+    LONGLONG t0 = -1;
+    for (LONG i = 0; i < n; i++) {
+        trace_ring_t *ring = rings[i];
+        if (ring == NULL or ring->n_records == 0)
+            continue;
+        LONG64 n_records = ring->n_records;
+        LONG64 first = n_records > TRACE_RING_CAP 
+                        ? n_records - TRACE_RING_CAP 
+                        : 0;
+        LONGLONG ticks = ring->records[first & (TRACE_RING_CAP - 1)].ticks;
+        if (t0 < 0 or ticks < t0)
+            t0 = ticks;
+    }
+
+    out_stream_puts(&out, L"{\"traceEvents\":[\n");
+    BOOL is_first = TRUE;
+    for (LONG i = 0; i < n; i++) {
+        trace_ring_t *ring = rings[i];
+        if (ring == NULL)
+            continue;
+        LONG64 n_records = ring->n_records;
+        LONG64 first = n_records > TRACE_RING_CAP 
+                        ? n_records - TRACE_RING_CAP 
+                        : 0;
+        for (LONG64 j = first; j < n_records; j++) {
+            const trace_record_t *record = 
+                &ring->records[j & (TRACE_RING_CAP - 1)];
+            if ((uint32_t)record->kind >= N_TRACE_EVENT_KINDS)
+                continue;
+            const trace_kind_info_t *info = &kind_infos[record->kind];
+            LONGLONG delta = record->ticks - t0;
+            LONGLONG us = delta / freq.QuadPart * 1000000
+                           + delta % freq.QuadPart * 1000000 / freq.QuadPart;
+            int len_line = _snwprintf(
+                line,
+                160,
+                L"%ls{\"name\":\"%hs\",\"ph\":\"%hc\",%ls\"ts\":%lld,"
+                L"\"pid\":%lu,\"tid\":%lu,\"args\":{\"arg\":%lld}}",
+                is_first ? L"" : L",\n",
+                info->name,
+                info->phase,
+                info->phase == 'i' ? L"\"s\":\"t\"," : L"",
+                us,
+                GetCurrentProcessId(),
+                ring->tid,
+                record->arg
+            );
+            if (len_line > 0)
+                out_stream_write(&out, line, len_line);
+            is_first = FALSE;
+        }
+    }
+    out_stream_puts(&out, L"\n]}\n");
+
+    BOOL bool_rc = out_stream_close(&out);
+    if (not bool_rc)
+        print_err(L"trace_dump -> out_stream_close");
+    CloseHandle(file_h);
+    return bool_rc;
+}
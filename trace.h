@@ -0,0 +1,60 @@
+
+/**
+ * trace.h
+ *
+ * trace_event_kind_t enum and the TRACE macro defined here.
+ */
+
+
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+
+
+
+/**
+ * trace_event_kind_t
+ *
+ * Kinds of lifecycle events that can be traced. BEGIN/END pairs become
+ * duration slices in the dump, the rest are instants.
+ */
+typedef enum _trace_event_kind {
+    TRACE_LINE_READ,        // reader: line(s) read, arg = number of lines
+    TRACE_HANDOFF_SEND,     // reader: batch handed to the spawner
+    TRACE_HANDOFF_RECV,     // spawner: batch copied, arg = number of lines
+    TRACE_WAIT_WAKEUP,      // spawner: wait returned, arg = signaled index
+    TRACE_PARSE_BEGIN,
+    TRACE_PARSE_END,
+    TRACE_PIPE_BEGIN,       // arg = stage
+    TRACE_PIPE_END,
+    TRACE_SPAWN_BEGIN,      // arg = stage
+    TRACE_SPAWN_END,        // arg = pid
+    TRACE_REAP_BEGIN,       // arg = pid
+    TRACE_REAP_END,
+    N_TRACE_EVENT_KINDS
+} trace_event_kind_t;
+
+
+
+/* trace_enabled: Nonzero while "trace start" is in effect. */
+extern volatile LONG trace_enabled;
+
+
+
+/* TRACE: Records a trace event on the calling thread's ring. Costs one load
+          and a branch while tracing is off. */
+#define TRACE(kind, arg)                                                    \
+    do {                                                                    \
+        if (trace_enabled)                                                  \
+            trace_event((kind), (int64_t)(arg));                            \
+    } while (0)
+
+
+
+// ifndef _TRACE_H
+#endif
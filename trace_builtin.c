@@ -0,0 +1,100 @@
+
+/**
+ * trace_builtin.c
+ */
+
+
+
+#include <windows.h>
+#include <wchar.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/**
+ * trace_err
+ * 
+ * Writes a trace error message to stderr.
+ * 
+ * Return Value: Returns TRUE on success. Returns FALSE on failure.
+ */
+static BOOL trace_err(const WCHAR *message) {
+
+    out_stream_t err;
+    out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+    out_stream_puts(&err, message);
+    return out_stream_close(&err);
+}
+
+
+
+/**
+ * is_arg
+ * 
+ * Return Value: Returns TRUE if the argument [arg_p, arg_end_p) is word.
+ */
+static BOOL is_arg(const WCHAR *arg_p, const WCHAR *arg_end_p, 
+                   const WCHAR *word) {
+    size_t len_word = wcslen(word);
+    return (size_t)(arg_end_p - arg_p) == len_word 
+            and wcsncmp(arg_p, word, len_word) == 0;
+}
+
+
+
+/**
+ * trace_builtin
+ * 
+ * Controls lifecycle tracing.
+ *  - trace start           clears recorded events and starts recording
+ *  - trace stop            stops recording
+ *  - trace dump file.json  writes the recorded events to file.json in the
+ *                          Chrome trace event format
+ * 
+ * parsed_proc: Contains information about command line that called this 
+ *              builtin.
+ * stdio: Standard streams after I/O redirection. Not used.
+ * 
+ * Return Value: Returns TRUE on success. Returns FALSE on failure.
+ */
+BOOL trace_builtin(parsed_process_t *parsed_proc, 
+                   stdio_handles_t *stdio) {
+
+    WCHAR path[MAX_PATH + 1];
+
+    const WCHAR *trace_p = skip_whitespace(parsed_proc->cmd_line);
+    const WCHAR *cmd_p = skip_whitespace(arg_end(trace_p));
+    const WCHAR *cmd_end_p = arg_end(cmd_p);
+
+    if (is_arg(cmd_p, cmd_end_p, L"start")) {
+        trace_start();
+        return TRUE;
+    }
+
+    if (is_arg(cmd_p, cmd_end_p, L"stop")) {
+        trace_stop();
+        return TRUE;
+    }
+
+    if (is_arg(cmd_p, cmd_end_p, L"dump")) {
+        const WCHAR *path_p = skip_whitespace(cmd_end_p);
+        const WCHAR *path_end_p = arg_end(path_p);
+        size_t len_path = path_end_p - path_p;
+        if (len_path == 0 or len_path > MAX_PATH) {
+            trace_err(L"trace: usage: trace dump file.json\n");
+            return FALSE;
+        }
+        if (len_path >= 2 and path_p[0] == L'"' 
+             and path_p[len_path - 1] == L'"') { // drop the quotes
+            path_p++;
+            len_path -= 2;
+        }
+        memcpy(path, path_p, len_path * sizeof(WCHAR));
+        path[len_path] = L'\0';
+        return trace_dump(path);
+    }
+
+    trace_err(L"trace: usage: trace start|stop|dump file.json\n");
+    return FALSE;
+}
@@ -0,0 +1,148 @@
+
+/**
+ * utf16_to_utf8.c
+ */
+
+
+
+#include <windows.h>
+#include <inttypes.h>
+#include <string.h>
+#include <wchar.h>
+
+// The fast paths read WCHARs as 16-bit lanes (not so where WCHAR is 32 bits)
+#if (defined(_M_X64) || defined(__SSE2__)) && WCHAR_MAX <= 0xFFFF
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+#include "_winshell_private.h"
+
+
+
+/**
+ * utf16_to_utf8
+ * 
+ * Transcodes UTF-16 text to UTF-8. Runs of ASCII are converted 8 WCHARs at a
+ * time (SSE2 when available). Unpaired surrogates become U+FFFD. Where WCHAR
+ * is 32 bits (Linux), WCHARs past U+FFFF are code points of their own.
+ * 
+ * src: UTF-16 text to convert (doesn't need to be NULL-terminated).
+ * len_src: Number of WCHARs in src.
+ * dst: Output buffer. Must have room for UTF8_MAX_PER_WCHAR * len_src bytes.
+ * 
+ * Return Value: Returns the number of bytes written to dst.
+ */
+int32_t utf16_to_utf8(const WCHAR *src, int32_t len_src, char *dst) {
+
+    const WCHAR *src_p = src,
+                *src_end = src + len_src;
+    unsigned char *dst_p = (unsigned char *)dst;
+
+    while (src_p < src_end) {
+
+        // ASCII fast path: 8 WCHARs -> 8 bytes per step
+#ifdef HAVE_SSE2
+        const __m128i non_ascii_mask = _mm_set1_epi16((short)0xFF80);
+        const __m128i zero = _mm_setzero_si128();
+        while (src_end - src_p >= 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)src_p);
+            __m128i non_ascii = _mm_and_si128(v, non_ascii_mask);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii, zero)) != 0xFFFF)
+                break;
+            _mm_storel_epi64((__m128i *)dst_p, _mm_packus_epi16(v, v));
+            src_p += 8;
+            dst_p += 8;
+        }
+#elif WCHAR_MAX <= 0xFFFF
+        while (src_end - src_p >= 4) {
+            uint64_t v;
+            memcpy(&v, src_p, sizeof(v));
+            if (v & 0xFF80FF80FF80FF80ULL)
+                break;
+            dst_p[0] = (unsigned char)src_p[0];
+            dst_p[1] = (unsigned char)src_p[1];
+            dst_p[2] = (unsigned char)src_p[2];
+            dst_p[3] = (unsigned char)src_p[3];
+            src_p += 4;
+            dst_p += 4;
+        }
+#endif
+        if (src_p == src_end)
+            break;
+
+        uint32_t c = *src_p++;
+
+        if (c < 0x80) {
+            *dst_p++ = (unsigned char)c;
+            continue;
+        }
+        if (c < 0x800) {
+            *dst_p++ = (unsigned char)(0xC0 | (c >> 6));
+            *dst_p++ = (unsigned char)(0x80 | (c & 0x3F));
+            continue;
+        }
+
+        // Surrogates
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            if (c <= 0xDBFF && src_p < src_end
+                 && *src_p >= 0xDC00 && *src_p <= 0xDFFF)
+                c = 0x10000 + ((c - 0xD800) << 10) + (*src_p++ - 0xDC00);
+            else
+                c = 0xFFFD;
+        }
+
+        // A 32-bit WCHAR can hold a code point past U+FFFF, or garbage
+        if (c > 0x10FFFF)
+            c = 0xFFFD;
+        if (c > 0xFFFF) {
+            *dst_p++ = (unsigned char)(0xF0 | (c >> 18));
+            *dst_p++ = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+            *dst_p++ = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+            *dst_p++ = (unsigned char)(0x80 | (c & 0x3F));
+            continue;
+        }
+
+        *dst_p++ = (unsigned char)(0xE0 | (c >> 12));
+        *dst_p++ = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        *dst_p++ = (unsigned char)(0x80 | (c & 0x3F));
+    }
+
+    return (int32_t)(dst_p - (unsigned char *)dst);
+}
+
+
+
+/**
+ * utf16le_to_wchar
+ * 
+ * Copies UTF-16LE text into WCHARs. Where WCHAR is 16 bits that's a plain
+ * copy; where it's 32 bits (Linux) each surrogate pair becomes one WCHAR.
+ * 
+ * src: UTF-16LE text, 2 bytes per code unit (needn't be aligned).
+ * n_units: Number of code units in src.
+ * dst: Output buffer. Must have room for n_units WCHARs.
+ * 
+ * Return Value: Returns the number of WCHARs written to dst.
+ */
+int32_t utf16le_to_wchar(const BYTE *src, int32_t n_units, WCHAR *dst) {
+
+#if WCHAR_MAX <= 0xFFFF
+    memcpy(dst, src, n_units * sizeof(WCHAR));
+    return n_units;
+#else
+    WCHAR *dst_p = dst;
+    for (int32_t i = 0; i < n_units; i++) {
+        uint32_t c = src[2 * i] | (uint32_t)src[2 * i + 1] << 8;
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < n_units) {
+            uint32_t low = src[2 * i + 2] | (uint32_t)src[2 * i + 3] << 8;
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        *dst_p++ = (WCHAR)c;
+    }
+    return (int32_t)(dst_p - dst);
+#endif
+}
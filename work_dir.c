@@ -0,0 +1,129 @@
+
+/**
+ * work_dir.c
+ *
+ * The shell's working directory. It's plain shell state: cd changes it, and
+ * every job gets its own copy that its processes are started in. The
+ * process's current directory is never changed after startup, so relative
+ * paths the shell opens itself go through make_abs_path.
+ */
+
+
+
+#include <windows.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <iso646.h>
+#include "_winshell_private.h"
+
+
+
+/* shell_cwd: The shell's working directory (absolute). */
+WCHAR shell_cwd[MAX_PATH + 1];
+
+
+
+/**
+ * make_abs_path
+ *
+ * Makes a path absolute against a directory other than the process's current
+ * one, and normalizes it ("." and ".." are resolved).
+ *
+ * base_dir: Absolute directory relative paths are taken from.
+ * path: Path to make absolute.
+ * out_path: Absolute path is placed here (MAX_PATH + 1 WCHARs).
+ *
+ * Return Value: Returns TRUE on success. Returns FALSE if the path is too
+ *               long.
+ */
+BOOL make_abs_path(const WCHAR *base_dir, const WCHAR *path,
+                   WCHAR *out_path) {
+
+    WCHAR joined[2 * (MAX_PATH + 1)];
+    const WCHAR *full = joined;
+
+    size_t len_path = wcslen(path);
+    size_t len_base = wcslen(base_dir);
+    if (len_path > MAX_PATH or len_base > MAX_PATH)
+        return FALSE;
+
+    BOOL is_sep0 = path[0] == L'\\' or path[0] == L'/';
+    BOOL is_sep1 = is_sep0 and (path[1] == L'\\' or path[1] == L'/');
+    BOOL has_drive = iswalpha(path[0]) and path[1] == L':';
+    BOOL is_drive_rel = has_drive and path[2] != L'\\' and path[2] != L'/';
+    BOOL on_base_drive = has_drive and base_dir[1] == L':'
+                          and towupper(base_dir[0]) == towupper(path[0]);
+
+    // "C:\dir", "\\server\share" and "C:dir" on another drive don't depend
+    // on base_dir
+    if (is_sep1 or (has_drive and not (is_drive_rel and on_base_drive))) {
+        full = path;
+    }
+
+    // "\dir": root of base_dir's drive
+    else if (is_sep0) {
+        if (base_dir[1] != L':') {
+            full = path;
+        }
+        else {
+            joined[0] = base_dir[0];
+            joined[1] = L':';
+            memcpy(joined + 2, path, (len_path + 1) * sizeof(WCHAR));
+        }
+    }
+
+    // "dir", or "C:dir" on base_dir's drive: under base_dir
+    else {
+        if (is_drive_rel) {
+            path += 2;
+            len_path -= 2;
+        }
+        memcpy(joined, base_dir, len_base * sizeof(WCHAR));
+        if (len_base > 0 and joined[len_base - 1] != L'\\')
+            joined[len_base++] = L'\\';
+        memcpy(joined + len_base, path, (len_path + 1) * sizeof(WCHAR));
+    }
+
+    DWORD len_out = GetFullPathNameW(full, MAX_PATH + 1, out_path, NULL);
+    return len_out != 0 and len_out <= MAX_PATH;
+}
+
+
+
+/**
+ * find_dir
+ *
+ * Resolves the directory a cd names against base_dir and checks that it
+ * exists. Errors are written to stderr.
+ *
+ * base_dir: Absolute directory the cd is made from.
+ * dir: Directory named by the user.
+ * out_dir: Absolute directory is placed here (MAX_PATH + 1 WCHARs).
+ *
+ * Return Value: Returns TRUE if out_dir is an existing directory.
+ */
+BOOL find_dir(const WCHAR *base_dir, const WCHAR *dir, WCHAR *out_dir) {
+
+    const WCHAR *message = NULL;
+
+    if (not make_abs_path(base_dir, dir, out_dir)) {
+        message = L"directory too long\n";
+    }
+    else {
+        DWORD attrs = GetFileAttributesW(out_dir);
+        if (attrs == INVALID_FILE_ATTRIBUTES)
+            message = L"Directory not found\n";
+        else if (not (attrs & FILE_ATTRIBUTE_DIRECTORY))
+            message = L"Not a directory\n";
+    }
+
+    if (message != NULL) {
+        out_stream_t err;
+        out_stream_init(&err, GetStdHandle(STD_ERROR_HANDLE));
+        out_stream_puts(&err, message);
+        out_stream_close(&err);
+        return FALSE;
+    }
+    return TRUE;
+}